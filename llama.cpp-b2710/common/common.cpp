@@ -35,7 +35,9 @@
 #include <fcntl.h>
 #include <io.h>
 #else
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #endif
@@ -181,6 +183,36 @@ int get_math_cpu_count() {
     return get_num_physical_cores();
 }
 
+// parse a hex CPU mask like "0xff00", the lowest bit is CPU 0
+static bool parse_cpu_mask(const std::string & mask, bool (&boolmask)[GGML_MAX_N_CPUS]) {
+    size_t start_i = 0;
+    if (mask.length() >= 2 && mask.substr(0, 2) == "0x") {
+        start_i = 2;
+    }
+
+    size_t num_digits = mask.length() - start_i;
+    if (num_digits == 0 || num_digits > GGML_MAX_N_CPUS / 4) {
+        return false;
+    }
+
+    for (size_t i = 0; i < num_digits; i++) {
+        const char c = mask[mask.length() - 1 - i];
+        int8_t id;
+
+        /**/ if (c >= '0' && c <= '9') { id = c - '0'; }
+        else if (c >= 'a' && c <= 'f') { id = c - 'a' + 10; }
+        else if (c >= 'A' && c <= 'F') { id = c - 'A' + 10; }
+        else { return false; }
+
+        boolmask[i*4 + 0] = boolmask[i*4 + 0] || ((id & 1) != 0);
+        boolmask[i*4 + 1] = boolmask[i*4 + 1] || ((id & 2) != 0);
+        boolmask[i*4 + 2] = boolmask[i*4 + 2] || ((id & 4) != 0);
+        boolmask[i*4 + 3] = boolmask[i*4 + 3] || ((id & 8) != 0);
+    }
+
+    return true;
+}
+
 void process_escapes(std::string & input) {
     std::size_t input_len = input.length();
     std::size_t output_idx = 0;
@@ -289,6 +321,33 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         }
         return true;
     }
+    if (arg == "--poll") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.poll = std::stoi(argv[i]);
+        if (params.poll < 0 || params.poll > 100) {
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "-C" || arg == "--cpu-mask") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        if (!parse_cpu_mask(argv[i], params.cpumask)) {
+            invalid_param = true;
+            return true;
+        }
+        params.cpumask_set = true;
+        return true;
+    }
+    if (arg == "--cpu-strict") {
+        params.cpu_strict = true;
+        return true;
+    }
     if (arg == "-p" || arg == "--prompt") {
         if (++i >= argc) {
             invalid_param = true;
@@ -687,6 +746,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.n_draft = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "--draft-layers") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_layer_draft = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--chunks") {
         if (++i >= argc) {
             invalid_param = true;
@@ -735,6 +802,28 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.model_draft = argv[i];
         return true;
     }
+    if (arg == "--model-key") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.model_key = argv[i];
+        return true;
+    }
+    if (arg == "--model-key-file") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        std::ifstream file(argv[i]);
+        if (!file) {
+            fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
+            invalid_param = true;
+            return true;
+        }
+        file >> params.model_key;
+        return true;
+    }
     if (arg == "-a" || arg == "--alias") {
         if (++i >= argc) {
             invalid_param = true;
@@ -880,6 +969,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.no_kv_offload = true;
         return true;
     }
+    if (arg == "-fa" || arg == "--flash-attn") {
+        params.flash_attn = true;
+        return true;
+    }
     if (arg == "-ctk" || arg == "--cache-type-k") {
         params.cache_type_k = argv[++i];
         return true;
@@ -1393,6 +1486,9 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        number of threads to use during generation (default: same as --threads)\n");
     printf("  -tbd N, --threads-batch-draft N\n");
     printf("                        number of threads to use during batch and prompt processing (default: same as --threads-draft)\n");
+    printf("  --poll N              polling level of the compute threads, 0 - sleep right away, 100 - spin longest (default: %d)\n", params.poll);
+    printf("  -C M, --cpu-mask M    hex CPU affinity mask for the compute threads, e.g. 0xff (default: no affinity)\n");
+    printf("  --cpu-strict          pin each compute thread to a single CPU of --cpu-mask (default: %s)\n", params.cpu_strict ? "enabled" : "disabled");
     printf("  -p PROMPT, --prompt PROMPT\n");
     printf("                        prompt to start generation with (default: empty)\n");
     printf("  -e, --escape          process prompt escapes sequences (\\n, \\r, \\t, \\', \\\", \\\\)\n");
@@ -1473,6 +1569,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --kl-divergence       computes KL-divergence to logits provided via --kl-divergence-base\n");
     printf("  --keep N              number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
     printf("  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
+    printf("  --draft-layers N      number of layers of the model used to draft for self-speculative decoding (default: half)\n");
     printf("  --chunks N            max number of chunks to process (default: %d, -1 = all)\n", params.n_chunks);
     printf("  -np N, --parallel N   number of parallel sequences to decode (default: %d)\n", params.n_parallel);
     printf("  -ns N, --sequences N  number of sequences to decode (default: %d)\n", params.n_sequences);
@@ -1487,7 +1584,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
     printf("  --numa TYPE           attempt optimizations that help on some NUMA systems\n");
-    printf("                          - distribute: spread execution evenly over all nodes\n");
+    printf("                          - distribute: spread execution evenly over all nodes, and the rows of the\n");
+    printf("                            weights over the nodes whose threads process them\n");
     printf("                          - isolate: only spawn threads on CPUs on the node that execution started on\n");
     printf("                          - numactl: use the CPU map provided by numactl\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
@@ -1517,10 +1615,11 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        verbose print of the KV cache\n");
     printf("  -nkvo, --no-kv-offload\n");
     printf("                        disable KV offload\n");
+    printf("  -fa, --flash-attn     enable fused flash attention (default: %s)\n", params.flash_attn ? "enabled" : "disabled");
     printf("  -ctk TYPE, --cache-type-k TYPE\n");
     printf("                        KV cache data type for K (default: %s)\n", params.cache_type_k.c_str());
     printf("  -ctv TYPE, --cache-type-v TYPE\n");
-    printf("                        KV cache data type for V (default: %s)\n", params.cache_type_v.c_str());
+    printf("                        KV cache data type for V, quantized types require -fa (default: %s)\n", params.cache_type_v.c_str());
     printf("  --simple-io           use basic IO for better compatibility in subprocesses and limited consoles\n");
     printf("  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
     printf("  --lora-scaled FNAME S apply LoRA adapter with user defined scaling S (implies --no-mmap)\n");
@@ -1533,6 +1632,9 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        layer range to apply the control vector(s) to, start and end inclusive\n");
     printf("  -m FNAME, --model FNAME\n");
     printf("                        model path (default: %s)\n", params.model.c_str());
+    printf("  --model-key KEY       AES-256 key of an encrypted model, 64 hex digits (see examples/gguf-encrypt)\n");
+    printf("  --model-key-file FNAME\n");
+    printf("                        read the key of an encrypted model from a file\n");
     printf("  -md FNAME, --model-draft FNAME\n");
     printf("                        draft model for speculative decoding (default: unused)\n");
     printf("  -mu MODEL_URL, --model-url MODEL_URL\n");
@@ -1772,6 +1874,7 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.encryption_key  = params.model_key.empty() ? nullptr : params.model_key.c_str();
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -1820,6 +1923,9 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.n_ubatch          = params.n_ubatch;
     cparams.n_threads         = params.n_threads;
     cparams.n_threads_batch   = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+    cparams.poll              = params.poll;
+    cparams.cpumask           = params.cpumask_set ? params.cpumask : nullptr;
+    cparams.cpu_strict        = params.cpu_strict;
     cparams.seed              = params.seed;
     cparams.logits_all        = params.logits_all;
     cparams.embeddings        = params.embedding;
@@ -1836,6 +1942,7 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
+    cparams.flash_attn        = params.flash_attn;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
@@ -2326,6 +2433,46 @@ std::vector<llama_token> llama_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+        const struct llama_context * ctx,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special,
+                           int32_t   n_threads) {
+    const llama_model * model = llama_get_model(ctx);
+
+    std::vector<const char *> ptrs;
+    std::vector<int32_t>      lens;
+    ptrs.reserve(texts.size());
+    lens.reserve(texts.size());
+
+    // upper limit for the number of tokens
+    size_t n_tokens_max = 0;
+    for (const auto & text : texts) {
+        ptrs.push_back(text.data());
+        lens.push_back(text.length());
+        n_tokens_max += text.length() + 2 * add_special;
+    }
+
+    std::vector<llama_token> tokens(n_tokens_max);
+    std::vector<int32_t>     offsets(texts.size() + 1);
+
+    int n_tokens = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(),
+            offsets.data(), add_special, parse_special, n_threads);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        int check = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(),
+                offsets.data(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_tokens);
+    }
+
+    std::vector<std::vector<llama_token>> result(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        result[i].assign(tokens.begin() + offsets[i], tokens.begin() + offsets[i + 1]);
+    }
+    return result;
+}
+
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token) {
     std::vector<char> result(8, 0);
     const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size(), true);
@@ -2947,3 +3094,74 @@ llama_control_vector_data llama_control_vector_load(const std::vector<llama_cont
 
     return result;
 }
+
+//
+// File utils
+//
+
+llama_file_mapping::llama_file_mapping(const std::string & filename) {
+#ifdef _WIN32
+    HANDLE hfile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(hfile, &file_size) && file_size.QuadPart > 0) {
+        HANDLE hmapping = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hmapping != NULL) {
+            addr = MapViewOfFile(hmapping, FILE_MAP_READ, 0, 0, 0);
+            size = addr ? (size_t) file_size.QuadPart : 0;
+            CloseHandle(hmapping);
+        }
+    }
+    CloseHandle(hfile);
+#else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void * a = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (a != MAP_FAILED) {
+            addr = a;
+            size = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+llama_file_mapping::~llama_file_mapping() {
+    if (addr == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+}
+
+bool llama_file_save_atomic(const std::string & filename, const std::function<void(std::ofstream & file)> & write) {
+    const std::string filename_tmp = filename + ".tmp";
+    {
+        std::ofstream file(filename_tmp, std::ios::binary);
+        write(file);
+        file.close();
+        if (!file) {
+            std::remove(filename_tmp.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(filename_tmp.c_str(), filename.c_str()) != 0) {
+        // rename does not replace an existing file on Windows
+        std::remove(filename.c_str());
+        if (std::rename(filename_tmp.c_str(), filename.c_str()) != 0) {
+            std::remove(filename_tmp.c_str());
+            return false;
+        }
+    }
+    return true;
+}
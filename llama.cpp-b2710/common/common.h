@@ -10,6 +10,8 @@
 #include "log.h"
 
 #include <cmath>
+#include <fstream>
+#include <functional>
 #include <string>
 #include <vector>
 #include <random>
@@ -53,12 +55,17 @@ struct gpt_params {
     int32_t n_threads_draft       = -1;
     int32_t n_threads_batch       = -1;    // number of threads to use for batch processing (-1 = use n_threads)
     int32_t n_threads_batch_draft = -1;
+    int32_t poll                  = 50;    // threadpool polling level (0 - 100), how long idle compute threads spin before sleeping
+    bool    cpumask[GGML_MAX_N_CPUS] = {false}; // CPU affinity mask for the compute threads (all false = no affinity)
+    bool    cpumask_set           = false; // cpumask was given on the command line
+    bool    cpu_strict            = false; // pin each compute thread to a single CPU of cpumask
     int32_t n_predict             = -1;    // new tokens to predict
     int32_t n_ctx                 = 512;   // context size
     int32_t n_batch               = 2048;  // logical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_ubatch              = 512;   // physical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                = 0;     // number of tokens to keep from initial prompt
     int32_t n_draft               = 5;     // number of tokens to draft during speculative decoding
+    int32_t n_layer_draft         = 0;     // number of layers of the model used to draft in self-speculative decoding (0 = half)
     int32_t n_chunks              = -1;    // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            = 1;     // number of parallel sequences to decode
     int32_t n_sequences           = 1;     // number of sequences to decode
@@ -94,6 +101,7 @@ struct gpt_params {
 
     std::string model                = "models/7B/ggml-model-f16.gguf"; // model path
     std::string model_draft          = "";  // draft model for speculative decoding
+    std::string model_key            = "";  // AES-256 key of an encrypted model (hex)
     std::string model_alias          = "unknown"; // model alias
     std::string model_url            = "";  // model url to download
     std::string hf_repo              = "";  // HF repo
@@ -160,6 +168,7 @@ struct gpt_params {
     bool infill            = false; // use infill mode
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
     bool no_kv_offload     = false; // disable KV offloading
+    bool flash_attn        = false; // use the fused flash attention kernel
     bool warmup            = true;  // warmup run
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
@@ -237,6 +246,14 @@ std::vector<llama_token> llama_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenizes many strings in parallel, the tokens of texts[i] are in the i-th vector
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+        const struct llama_context * ctx,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special,
+                           int32_t   n_threads);
+
 // tokenizes a token into a piece
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string llama_token_to_piece(
@@ -316,6 +333,28 @@ struct llama_control_vector_load_info {
 // On error, returns {-1, empty}
 llama_control_vector_data llama_control_vector_load(const std::vector<llama_control_vector_load_info> & load_infos);
 
+//
+// File utils
+//
+
+// Read-only memory mapping of a whole file, addr is nullptr if the file cannot be opened or mapped or is empty.
+struct llama_file_mapping {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    llama_file_mapping(const std::string & filename);
+    ~llama_file_mapping();
+
+    llama_file_mapping(const llama_file_mapping &) = delete;
+    llama_file_mapping & operator=(const llama_file_mapping &) = delete;
+};
+
+// Write a file with write() under a temporary name and rename it to filename once it is complete,
+// which keeps filename intact if the write fails. On POSIX systems filename can be replaced while it is mapped,
+// on Windows an existing filename has to be removed first, which fails while it is mapped.
+// Returns false on error.
+bool llama_file_save_atomic(const std::string & filename, const std::function<void(std::ofstream & file)> & write);
+
 //
 // Split utils
 //
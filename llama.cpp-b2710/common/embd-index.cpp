@@ -0,0 +1,501 @@
+#include "embd-index.h"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <thread>
+
+void llama_embd_store::clear() {
+    n_rows = 0;
+    n_list = 0;
+
+    rows_mapped      = nullptr;
+    centroids_mapped = nullptr;
+    offsets_mapped   = nullptr;
+    ids_mapped       = nullptr;
+
+    rows_data.clear();
+    centroids_data.clear();
+    offsets_data.clear();
+    ids_data.clear();
+
+    mapping.reset();
+}
+
+static bool embd_store_has_ids(const llama_embd_store & store) {
+    return store.ids_mapped != nullptr || !store.ids_data.empty();
+}
+
+// copy the parts of the store that point into a file mapping, before modifying them
+static void embd_store_detach(llama_embd_store & store) {
+    if (!store.mapping) {
+        return;
+    }
+    if (store.rows_mapped) {
+        store.rows_data.assign(store.rows_mapped, store.rows_mapped + store.n_rows*store.row_size());
+    }
+    if (store.centroids_mapped) {
+        store.centroids_data.assign(store.centroids_mapped, store.centroids_mapped + (size_t) store.n_list*store.n_embd);
+    }
+    if (store.offsets_mapped) {
+        store.offsets_data.assign(store.offsets_mapped, store.offsets_mapped + store.n_list + 1);
+    }
+    if (store.ids_mapped) {
+        store.ids_data.assign(store.ids_mapped, store.ids_mapped + store.n_rows);
+    }
+    store.rows_mapped      = nullptr;
+    store.centroids_mapped = nullptr;
+    store.offsets_mapped   = nullptr;
+    store.ids_mapped       = nullptr;
+    store.mapping.reset();
+}
+
+static void embd_store_drop_index(llama_embd_store & store) {
+    store.n_list = 0;
+    store.centroids_data.clear();
+    store.offsets_data.clear();
+}
+
+static void embd_from_float(ggml_type type, const float * src, void * dst, int64_t n) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+    } else {
+        ggml_internal_get_type_traits(type).from_float(src, dst, n);
+    }
+}
+
+static void embd_to_float(ggml_type type, const void * src, float * dst, int64_t n) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+    } else {
+        ggml_internal_get_type_traits(type).to_float(src, dst, n);
+    }
+}
+
+static float embd_dot_f32(const float * x, const float * y, int n) {
+    float s;
+    ggml_internal_get_type_traits(GGML_TYPE_F32).vec_dot(n, &s, 0, x, 0, y, 0, 1);
+    return s;
+}
+
+static int32_t embd_argmax_centroid(const float * centroids, int32_t n_list, const float * x, int n_embd) {
+    int32_t best       = 0;
+    float   best_score = -INFINITY;
+    for (int32_t l = 0; l < n_list; ++l) {
+        const float score = embd_dot_f32(centroids + (size_t) l*n_embd, x, n_embd);
+        if (score > best_score) {
+            best       = l;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// run fn(i0, i1) on contiguous ranges of [0, n) with up to n_threads threads
+template <typename F>
+static void embd_parallel_for(int64_t n, int n_threads, const F & fn) {
+    n_threads = (int) std::max<int64_t>(1, std::min<int64_t>(n_threads, n));
+
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back([&, ith]() {
+            fn(n*ith/n_threads, n*(ith + 1)/n_threads);
+        });
+    }
+    fn(0, n/n_threads);
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+}
+
+bool llama_embd_store_init(llama_embd_store & store, int32_t n_embd, ggml_type type) {
+    if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0) {
+        return false;
+    }
+    if (n_embd <= 0 || n_embd % ggml_blck_size(type) != 0) {
+        return false;
+    }
+
+    store.clear();
+    store.n_embd = n_embd;
+    store.type   = type;
+    store.tag    = 0;
+
+    return true;
+}
+
+void llama_embd_store_add(llama_embd_store & store, const float * embd, int64_t n) {
+    GGML_ASSERT(store.n_embd > 0);
+
+    embd_store_detach(store);
+    embd_store_drop_index(store);
+
+    const size_t row_size = store.row_size();
+
+    store.rows_data.resize((store.n_rows + n)*row_size);
+    for (int64_t i = 0; i < n; ++i) {
+        embd_from_float(store.type, embd + i*store.n_embd, store.rows_data.data() + (store.n_rows + i)*row_size, store.n_embd);
+    }
+    if (embd_store_has_ids(store)) {
+        for (int64_t i = 0; i < n; ++i) {
+            store.ids_data.push_back(store.n_rows + i);
+        }
+    }
+    store.n_rows += n;
+}
+
+void llama_embd_store_build_ivf(llama_embd_store & store, int32_t n_list, int32_t n_iter, int n_threads, uint32_t seed) {
+    embd_store_detach(store);
+    embd_store_drop_index(store);
+
+    if (store.n_rows == 0 || n_list <= 0) {
+        return;
+    }
+
+    const int     n_embd   = store.n_embd;
+    const size_t  row_size = store.row_size();
+    const int64_t n_rows   = store.n_rows;
+
+    n_list = (int32_t) std::min<int64_t>(n_list, n_rows);
+
+    std::mt19937 rng(seed);
+
+    // train on a random sample of the rows, enough for a few hundred rows per centroid
+    std::vector<int64_t> sample(n_rows);
+    for (int64_t i = 0; i < n_rows; ++i) {
+        sample[i] = i;
+    }
+    const int64_t n_train = std::min<int64_t>(n_rows, (int64_t) n_list*256);
+    for (int64_t i = 0; i < n_train; ++i) {
+        std::swap(sample[i], sample[i + rng() % (n_rows - i)]);
+    }
+
+    std::vector<float> train(n_train*n_embd);
+    for (int64_t i = 0; i < n_train; ++i) {
+        embd_to_float(store.type, store.rows_data.data() + sample[i]*row_size, train.data() + i*n_embd, n_embd);
+    }
+
+    // spherical k-means: the centroids are the normalized means of their rows, the rows are assigned by dot product
+    std::vector<float> centroids(train.begin(), train.begin() + (size_t) n_list*n_embd);
+    std::vector<int32_t> assign(n_train);
+
+    for (int32_t iter = 0; iter < n_iter; ++iter) {
+        embd_parallel_for(n_train, n_threads, [&](int64_t i0, int64_t i1) {
+            for (int64_t i = i0; i < i1; ++i) {
+                assign[i] = embd_argmax_centroid(centroids.data(), n_list, train.data() + i*n_embd, n_embd);
+            }
+        });
+
+        std::fill(centroids.begin(), centroids.end(), 0.0f);
+        std::vector<int64_t> counts(n_list, 0);
+        for (int64_t i = 0; i < n_train; ++i) {
+            float * c = centroids.data() + (size_t) assign[i]*n_embd;
+            const float * x = train.data() + i*n_embd;
+            for (int j = 0; j < n_embd; ++j) {
+                c[j] += x[j];
+            }
+            counts[assign[i]]++;
+        }
+        for (int32_t l = 0; l < n_list; ++l) {
+            float * c = centroids.data() + (size_t) l*n_embd;
+            if (counts[l] == 0) {
+                // empty cluster, restart it from a random row
+                const float * x = train.data() + (rng() % n_train)*n_embd;
+                std::copy(x, x + n_embd, c);
+            }
+            llama_embd_normalize(c, c, n_embd);
+        }
+    }
+
+    // assign all rows and group them by list
+    std::vector<int32_t> list(n_rows);
+    embd_parallel_for(n_rows, n_threads, [&](int64_t i0, int64_t i1) {
+        std::vector<float> x(n_embd);
+        for (int64_t i = i0; i < i1; ++i) {
+            embd_to_float(store.type, store.rows_data.data() + i*row_size, x.data(), n_embd);
+            list[i] = embd_argmax_centroid(centroids.data(), n_list, x.data(), n_embd);
+        }
+    });
+
+    std::vector<int64_t> offsets(n_list + 1, 0);
+    for (int64_t i = 0; i < n_rows; ++i) {
+        offsets[list[i] + 1]++;
+    }
+    for (int32_t l = 0; l < n_list; ++l) {
+        offsets[l + 1] += offsets[l];
+    }
+
+    const bool has_ids = embd_store_has_ids(store);
+
+    std::vector<uint8_t> rows(n_rows*row_size);
+    std::vector<int32_t> ids(n_rows);
+    std::vector<int64_t> next(offsets.begin(), offsets.end() - 1);
+    for (int64_t i = 0; i < n_rows; ++i) {
+        const int64_t dst = next[list[i]]++;
+        memcpy(rows.data() + dst*row_size, store.rows_data.data() + i*row_size, row_size);
+        ids[dst] = has_ids ? store.ids_data[i] : (int32_t) i;
+    }
+
+    store.n_list         = n_list;
+    store.rows_data      = std::move(rows);
+    store.ids_data       = std::move(ids);
+    store.centroids_data = std::move(centroids);
+    store.offsets_data   = std::move(offsets);
+}
+
+// the best k matches, kept in a heap with the worst of them at the front
+struct embd_top_k {
+    int32_t k;
+    std::vector<llama_embd_match> heap;
+
+    static bool better(const llama_embd_match & a, const llama_embd_match & b) {
+        return a.score > b.score || (a.score == b.score && a.id < b.id);
+    }
+
+    void push(const llama_embd_match & match) {
+        if ((int32_t) heap.size() < k) {
+            heap.push_back(match);
+            std::push_heap(heap.begin(), heap.end(), better);
+        } else if (better(match, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = match;
+            std::push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+};
+
+// rows scanned by one task of a search
+static const int64_t embd_scan_block = 4096;
+
+std::vector<llama_embd_match> llama_embd_store_search(
+    const llama_embd_store & store, const float * query, int32_t k, int32_t n_probe, int n_threads) {
+    if (store.n_rows == 0 || k <= 0) {
+        return {};
+    }
+
+    const int     n_embd   = store.n_embd;
+    const size_t  row_size = store.row_size();
+    const uint8_t * rows   = store.rows();
+    const int32_t * ids    = embd_store_has_ids(store) ? store.ids() : nullptr;
+
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(store.type);
+
+    // the query in the type that the dot product expects
+    std::vector<uint8_t> q(ggml_row_size(traits.vec_dot_type, n_embd));
+    embd_from_float(traits.vec_dot_type, query, q.data(), n_embd);
+
+    // the ranges of rows to scan: everything, or the lists of the n_probe centroids closest to the query
+    std::vector<std::pair<int64_t, int64_t>> ranges;
+    if (store.n_list == 0 || n_probe <= 0 || n_probe >= store.n_list) {
+        ranges.emplace_back(0, store.n_rows);
+    } else {
+        std::vector<std::pair<float, int32_t>> lists(store.n_list);
+        for (int32_t l = 0; l < store.n_list; ++l) {
+            lists[l] = { embd_dot_f32(store.centroids() + (size_t) l*n_embd, query, n_embd), l };
+        }
+        std::partial_sort(lists.begin(), lists.begin() + n_probe, lists.end(),
+            [](const std::pair<float, int32_t> & a, const std::pair<float, int32_t> & b) { return a.first > b.first; });
+
+        const int64_t * offsets = store.offsets();
+        for (int32_t i = 0; i < n_probe; ++i) {
+            const int32_t l = lists[i].second;
+            if (offsets[l] < offsets[l + 1]) {
+                ranges.emplace_back(offsets[l], offsets[l + 1]);
+            }
+        }
+    }
+
+    // split the ranges into blocks that the threads take in turn
+    std::vector<std::pair<int64_t, int64_t>> blocks;
+    for (const std::pair<int64_t, int64_t> & range : ranges) {
+        for (int64_t r0 = range.first; r0 < range.second; r0 += embd_scan_block) {
+            blocks.emplace_back(r0, std::min(r0 + embd_scan_block, range.second));
+        }
+    }
+    n_threads = (int) std::max<size_t>(1, std::min<size_t>(n_threads, blocks.size()));
+
+    std::vector<embd_top_k> top(n_threads, embd_top_k { k, {} });
+    std::atomic<size_t> i_block(0);
+
+    auto scan = [&](const int ith) {
+        embd_top_k & top_k = top[ith];
+        for (size_t i = i_block++; i < blocks.size(); i = i_block++) {
+            for (int64_t r = blocks[i].first; r < blocks[i].second; ++r) {
+                float score;
+                traits.vec_dot(n_embd, &score, 0, rows + r*row_size, 0, q.data(), 0, 1);
+                top_k.push({ ids ? ids[r] : (int32_t) r, score });
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(scan, ith);
+    }
+    scan(0);
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+
+    for (int ith = 1; ith < n_threads; ++ith) {
+        for (const llama_embd_match & match : top[ith].heap) {
+            top[0].push(match);
+        }
+    }
+
+    std::vector<llama_embd_match> result = std::move(top[0].heap);
+    std::sort_heap(result.begin(), result.end(), embd_top_k::better);
+
+    return result;
+}
+
+// The file starts with a header, followed by the list offsets and the centroids of the IVF index if there is one,
+// the ids if the rows were reordered, and the rows, which start at a multiple of 32 bytes.
+// Like the ngram cache files it uses the native byte order.
+
+static const char     embd_store_magic[4] = { 'e', 'm', 'b', 's' };
+static const uint32_t embd_store_version  = 1;
+static const size_t   embd_store_align    = 32;
+
+struct llama_embd_store_file_header {
+    char     magic[4];
+    uint32_t version;
+    int32_t  n_embd;
+    int32_t  type;
+    int64_t  n_rows;
+    uint64_t tag;
+    int32_t  n_list;
+    int32_t  has_ids;
+    uint64_t row_size;
+};
+
+struct llama_embd_store_file_layout {
+    size_t offsets;
+    size_t centroids;
+    size_t ids;
+    size_t rows;
+    size_t end;
+
+    llama_embd_store_file_layout(int64_t n_rows, int32_t n_embd, int32_t n_list, bool has_ids, size_t row_size) {
+        offsets   = sizeof(llama_embd_store_file_header);
+        centroids = offsets   + (n_list > 0 ? (n_list + 1)*sizeof(int64_t) : 0);
+        ids       = centroids + (size_t) n_list*n_embd*sizeof(float);
+        rows      = GGML_PAD(ids + (has_ids ? n_rows*sizeof(int32_t) : 0), embd_store_align);
+        end       = rows + n_rows*row_size;
+    }
+};
+
+void llama_embd_store_save(const llama_embd_store & store, const std::string & filename) {
+    const bool has_ids = embd_store_has_ids(store);
+    const llama_embd_store_file_layout layout(store.n_rows, store.n_embd, store.n_list, has_ids, store.row_size());
+
+    // the file may be the one that the store is mapped from, which is only possible on POSIX systems
+    const bool ok = llama_file_save_atomic(filename, [&](std::ofstream & file_out) {
+        llama_embd_store_file_header header;
+        memcpy(header.magic, embd_store_magic, sizeof(header.magic));
+        header.version  = embd_store_version;
+        header.n_embd   = store.n_embd;
+        header.type     = store.type;
+        header.n_rows   = store.n_rows;
+        header.tag      = store.tag;
+        header.n_list   = store.n_list;
+        header.has_ids  = has_ids;
+        header.row_size = store.row_size();
+        file_out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        if (store.n_list > 0) {
+            file_out.write(reinterpret_cast<const char *>(store.offsets()),   (store.n_list + 1)*sizeof(int64_t));
+            file_out.write(reinterpret_cast<const char *>(store.centroids()), (size_t) store.n_list*store.n_embd*sizeof(float));
+        }
+        if (has_ids) {
+            file_out.write(reinterpret_cast<const char *>(store.ids()), store.n_rows*sizeof(int32_t));
+        }
+
+        const char padding[embd_store_align] = {};
+        file_out.write(padding, layout.rows - layout.ids - (has_ids ? store.n_rows*sizeof(int32_t) : 0));
+
+        file_out.write(reinterpret_cast<const char *>(store.rows()), store.n_rows*store.row_size());
+    });
+    GGML_ASSERT(ok);
+}
+
+llama_embd_store llama_embd_store_load(const std::string & filename) {
+    llama_embd_store store;
+    store.mapping = std::make_shared<llama_file_mapping>(filename);
+    const llama_file_mapping & mapping = *store.mapping;
+    if (mapping.addr == nullptr) {
+        throw std::ifstream::failure("Unable to open file " + filename);
+    }
+
+    const uint8_t * data = (const uint8_t *) mapping.addr;
+
+    llama_embd_store_file_header header;
+    if (mapping.size < sizeof(header)) {
+        throw std::ifstream::failure("Not an embedding store: " + filename);
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, embd_store_magic, sizeof(header.magic)) != 0 || header.version != embd_store_version) {
+        throw std::ifstream::failure("Not an embedding store: " + filename);
+    }
+
+    const ggml_type type = (ggml_type) header.type;
+    if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0) {
+        throw std::ifstream::failure("Unsupported embedding type in " + filename);
+    }
+    if (header.n_embd <= 0 || header.n_rows < 0 || header.n_list < 0 || header.row_size != ggml_row_size(type, header.n_embd)) {
+        throw std::ifstream::failure("Invalid embedding store: " + filename);
+    }
+
+    const llama_embd_store_file_layout layout(header.n_rows, header.n_embd, header.n_list, header.has_ids, header.row_size);
+    if (mapping.size != layout.end) {
+        throw std::ifstream::failure("Truncated embedding store: " + filename);
+    }
+
+    store.n_embd = header.n_embd;
+    store.type   = type;
+    store.n_rows = header.n_rows;
+    store.tag    = header.tag;
+    store.n_list = header.n_list;
+
+    if (store.n_list > 0) {
+        store.offsets_mapped   = (const int64_t *) (data + layout.offsets);
+        store.centroids_mapped = (const float   *) (data + layout.centroids);
+        // the searches index the rows by the offsets of the lists
+        if (store.offsets_mapped[0] != 0 || store.offsets_mapped[store.n_list] != store.n_rows) {
+            throw std::ifstream::failure("Invalid embedding store: " + filename);
+        }
+        for (int32_t l = 0; l < store.n_list; ++l) {
+            if (store.offsets_mapped[l] > store.offsets_mapped[l + 1]) {
+                throw std::ifstream::failure("Invalid embedding store: " + filename);
+            }
+        }
+    }
+    if (header.has_ids) {
+        store.ids_mapped = (const int32_t *) (data + layout.ids);
+        for (int64_t i = 0; i < store.n_rows; ++i) {
+            if (store.ids_mapped[i] < 0 || store.ids_mapped[i] >= store.n_rows) {
+                throw std::ifstream::failure("Invalid embedding store: " + filename);
+            }
+        }
+    }
+    store.rows_mapped = data + layout.rows;
+
+    return store;
+}
+
+size_t llama_embd_store_size_bytes(const llama_embd_store & store) {
+    size_t size = sizeof(llama_embd_store) + store.n_rows*store.row_size();
+    if (store.n_list > 0) {
+        size += (store.n_list + 1)*sizeof(int64_t) + (size_t) store.n_list*store.n_embd*sizeof(float);
+    }
+    if (embd_store_has_ids(store)) {
+        size += store.n_rows*sizeof(int32_t);
+    }
+    return size;
+}
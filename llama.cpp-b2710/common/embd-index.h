@@ -0,0 +1,87 @@
+#pragma once
+
+#include "llama.h"
+#include "ggml.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Store of normalized embeddings for nearest-neighbor search by cosine similarity.
+// The rows are kept in a ggml type (F32, F16 or Q8_0) and scored with the SIMD dot products of ggml,
+// the query is converted once to the type that the dot product of the row type expects.
+// A saved store is used directly from a read-only memory mapping of the file.
+//
+// The rows can optionally be grouped into an inverted file index (IVF): the rows are clustered with k-means,
+// the rows of each cluster are stored contiguously, and a query only scans the clusters of its n_probe closest centroids.
+//
+// The dot products use the f16 tables of ggml, llama_backend_init must be called first.
+
+struct llama_file_mapping;
+
+struct llama_embd_match {
+    int32_t id;    // index of the row when it was added
+    float   score; // dot product with the query, the cosine similarity for normalized embeddings
+};
+
+struct llama_embd_store {
+    int32_t   n_embd = 0;
+    ggml_type type   = GGML_TYPE_F16;
+    int64_t   n_rows = 0;
+
+    // set by the user, e.g. to recognize the corpus that a saved store was built from
+    uint64_t  tag    = 0;
+
+    // IVF index, n_list == 0 if the rows are not indexed
+    int32_t   n_list = 0;
+
+    // set if the store points into the memory mapping of a file, the vectors are empty until it is modified
+    const uint8_t * rows_mapped      = nullptr;
+    const float   * centroids_mapped = nullptr; // [n_list][n_embd]
+    const int64_t * offsets_mapped   = nullptr; // [n_list + 1], the rows of list i are offsets[i] .. offsets[i + 1] - 1
+    const int32_t * ids_mapped       = nullptr; // [n_rows], the id of each row, the rows are reordered by the index
+
+    std::vector<uint8_t> rows_data;
+    std::vector<float>   centroids_data;
+    std::vector<int64_t> offsets_data;
+    std::vector<int32_t> ids_data;
+
+    // keeps the file mapped while the store points into it
+    std::shared_ptr<llama_file_mapping> mapping;
+
+    const uint8_t * rows()      const { return rows_mapped      ? rows_mapped      : rows_data.data();      }
+    const float   * centroids() const { return centroids_mapped ? centroids_mapped : centroids_data.data(); }
+    const int64_t * offsets()   const { return offsets_mapped   ? offsets_mapped   : offsets_data.data();   }
+    const int32_t * ids()       const { return ids_mapped       ? ids_mapped       : ids_data.data();       }
+
+    size_t row_size() const { return ggml_row_size(type, n_embd); }
+
+    void clear();
+};
+
+// Create an empty store. Q8_0 needs n_embd to be a multiple of 32.
+// Returns false if the type is not supported.
+bool llama_embd_store_init(llama_embd_store & store, int32_t n_embd, ggml_type type);
+
+// Append n embeddings of n_embd floats each, they get the ids n_rows .. n_rows + n - 1.
+// The rows of a loaded store are copied out of the mapping, and an IVF index is dropped and has to be built again.
+void llama_embd_store_add(llama_embd_store & store, const float * embd, int64_t n);
+
+// Build an IVF index with n_list clusters, trained with n_iter iterations of spherical k-means on a sample of the rows.
+void llama_embd_store_build_ivf(llama_embd_store & store, int32_t n_list, int32_t n_iter = 10, int n_threads = 1, uint32_t seed = 42);
+
+// Find the k rows with the highest dot product with query, best first.
+// n_probe: number of IVF lists to scan, <= 0 or >= n_list scans all rows. Ignored if the store is not indexed.
+std::vector<llama_embd_match> llama_embd_store_search(
+    const llama_embd_store & store, const float * query, int32_t k, int32_t n_probe = 0, int n_threads = 1);
+
+// Save a store to a file, in a format that llama_embd_store_load maps into memory instead of parsing it.
+void llama_embd_store_save(const llama_embd_store & store, const std::string & filename);
+
+// Load a store saved with llama_embd_store_save, the store points into a read-only mapping of the file.
+// Throws std::ifstream::failure if the file cannot be opened or is not a valid store.
+llama_embd_store llama_embd_store_load(const std::string & filename);
+
+// Memory used by the rows and the index, including the parts that are mapped from a file.
+size_t llama_embd_store_size_bytes(const llama_embd_store & store);
@@ -2,11 +2,251 @@
 #include "common.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <thread>
+
+// The update and draft code is shared between llama_ngram_cache and llama_ngram_table, which it accesses through
+// ngram_add, ngram_find (a handle to the continuations of an n-gram, false if there is none), ngram_for_each and ngram_count.
+
+static void ngram_add(llama_ngram_cache & ngram_cache, const llama_ngram & ngram, const llama_token token, const int32_t count) {
+    llama_ngram_cache::iterator part_it = ngram_cache.find(ngram);
+    if (part_it == ngram_cache.end()) {
+        llama_ngram_cache_part part;
+        part.emplace(token, count);
+        ngram_cache.emplace(ngram, part);
+    } else {
+        llama_ngram_cache_part::iterator token_count_it = part_it->second.find(token);
+        if (token_count_it == part_it->second.end()) {
+            part_it->second.emplace(token, count);
+        } else {
+            token_count_it->second += count;
+        }
+    }
+}
 
-void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
-                              std::vector<llama_token> & inp, int nnew, bool print_progress) {
+static const llama_ngram_cache_part * ngram_find(const llama_ngram_cache & ngram_cache, const llama_ngram & ngram) {
+    llama_ngram_cache::const_iterator part_it = ngram_cache.find(ngram);
+    return part_it == ngram_cache.end() ? nullptr : &part_it->second;
+}
+
+template <typename F>
+static void ngram_for_each(const llama_ngram_cache & /*ngram_cache*/, const llama_ngram_cache_part * part, F && f) {
+    for (const std::pair<const llama_token, int32_t> & token_count : *part) {
+        f(token_count.first, token_count.second);
+    }
+}
+
+static int32_t ngram_count(const llama_ngram_cache & /*ngram_cache*/, const llama_ngram_cache_part * part, const llama_token token) {
+    if (part == nullptr) {
+        return 0;
+    }
+    llama_ngram_cache_part::const_iterator token_count_it = part->find(token);
+    return token_count_it == part->end() ? 0 : token_count_it->second;
+}
+
+// n-gram tables: the high bits of the hash select the shard, the low bits the first entry to probe in it
+
+static uint64_t ngram_table_hash(const llama_ngram & ngram) {
+    uint64_t hash = 0;
+    for (int i = 0; i < LLAMA_NGRAM_MAX; ++i) {
+        hash = (hash ^ (uint32_t) ngram.tokens[i]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static size_t ngram_table_shard_index(const uint64_t hash) {
+    return (hash >> 40) & (LLAMA_NGRAM_TABLE_SHARDS - 1);
+}
+
+static bool ngram_table_entry_empty(const llama_ngram_table_entry & entry) {
+    return entry.ngram.tokens[0] == -1;
+}
+
+static const llama_ngram_table_entry * ngram_table_shard_find(const llama_ngram_table_shard & shard, const llama_ngram & ngram, const uint64_t hash) {
+    if (shard.capacity == 0) {
+        return nullptr;
+    }
+    const llama_ngram_table_entry * entries = shard.entries();
+    const uint32_t mask = shard.capacity - 1;
+
+    // the load factor is kept below 1, the probing always ends at an empty entry
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        if (ngram_table_entry_empty(entries[i])) {
+            return nullptr;
+        }
+        if (entries[i].ngram == ngram) {
+            return &entries[i];
+        }
+    }
+}
+
+static llama_ngram_table_entry & ngram_table_shard_insert(std::vector<llama_ngram_table_entry> & entries, const llama_ngram & ngram, const uint64_t hash) {
+    const uint32_t mask = entries.size() - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        if (ngram_table_entry_empty(entries[i]) || entries[i].ngram == ngram) {
+            return entries[i];
+        }
+    }
+}
+
+// copy a shard that points into a file mapping so that it can be modified
+static void ngram_table_shard_detach(llama_ngram_table_shard & shard) {
+    if (shard.entries_mapped == nullptr) {
+        return;
+    }
+    shard.entries_data.assign(shard.entries_mapped, shard.entries_mapped + shard.capacity);
+    shard.chunks_data.assign(shard.chunks_mapped, shard.chunks_mapped + shard.n_chunks);
+    shard.entries_mapped = nullptr;
+    shard.chunks_mapped  = nullptr;
+}
+
+static void ngram_table_detach(llama_ngram_table & ngram_table) {
+    if (!ngram_table.mapping) {
+        return;
+    }
+    for (llama_ngram_table_shard & shard : ngram_table.shards) {
+        ngram_table_shard_detach(shard);
+    }
+    ngram_table.mapping.reset();
+}
+
+// find the entry of an n-gram in an owned shard, insert it if there is none
+static llama_ngram_table_entry & ngram_table_shard_emplace(llama_ngram_table_shard & shard, const llama_ngram & ngram, const uint64_t hash) {
+    GGML_ASSERT(shard.entries_mapped == nullptr);
+
+    if (4*(shard.size + 1) > 3*shard.capacity) {
+        std::vector<llama_ngram_table_entry> entries(std::max(16u, 2*shard.capacity));
+        for (uint32_t i = 0; i < shard.capacity; ++i) {
+            const llama_ngram_table_entry & entry = shard.entries_data[i];
+            if (!ngram_table_entry_empty(entry)) {
+                ngram_table_shard_insert(entries, entry.ngram, ngram_table_hash(entry.ngram)) = entry;
+            }
+        }
+        shard.entries_data.swap(entries);
+        shard.capacity = shard.entries_data.size();
+    }
+
+    llama_ngram_table_entry & entry = ngram_table_shard_insert(shard.entries_data, ngram, hash);
+    if (ngram_table_entry_empty(entry)) {
+        entry.ngram = ngram;
+        shard.size++;
+    }
+    return entry;
+}
+
+// add count to the continuation token of an entry in an owned shard
+static void ngram_table_entry_add(llama_ngram_table_shard & shard, llama_ngram_table_entry & entry, const llama_token token, const int32_t count) {
+    const int n_inline = std::min(entry.n_cont, LLAMA_NGRAM_TABLE_INLINE);
+    for (int i = 0; i < n_inline; ++i) {
+        if (entry.tokens[i] == token) {
+            entry.counts[i] += count;
+            return;
+        }
+    }
+    for (int32_t i_chunk = entry.i_chunk; i_chunk != -1; i_chunk = shard.chunks_data[i_chunk].i_next) {
+        llama_ngram_table_chunk & chunk = shard.chunks_data[i_chunk];
+        for (int i = 0; i < chunk.n; ++i) {
+            if (chunk.tokens[i] == token) {
+                chunk.counts[i] += count;
+                return;
+            }
+        }
+    }
+
+    if (entry.n_cont < LLAMA_NGRAM_TABLE_INLINE) {
+        entry.tokens[entry.n_cont] = token;
+        entry.counts[entry.n_cont] = count;
+    } else {
+        if (entry.i_chunk == -1 || shard.chunks_data[entry.i_chunk].n == LLAMA_NGRAM_TABLE_CHUNK) {
+            llama_ngram_table_chunk chunk;
+            chunk.i_next = entry.i_chunk;
+            entry.i_chunk = shard.chunks_data.size();
+            shard.chunks_data.push_back(chunk);
+            shard.n_chunks = shard.chunks_data.size();
+        }
+        llama_ngram_table_chunk & chunk = shard.chunks_data[entry.i_chunk];
+        chunk.tokens[chunk.n] = token;
+        chunk.counts[chunk.n] = count;
+        chunk.n++;
+    }
+    entry.n_cont++;
+}
+
+// the tables must have been detached from their file mappings
+static void ngram_add(llama_ngram_table & ngram_table, const llama_ngram & ngram, const llama_token token, const int32_t count) {
+    const uint64_t hash = ngram_table_hash(ngram);
+    llama_ngram_table_shard & shard = ngram_table.shards[ngram_table_shard_index(hash)];
+
+    ngram_table_entry_add(shard, ngram_table_shard_emplace(shard, ngram, hash), token, count);
+}
+
+struct llama_ngram_table_part {
+    const llama_ngram_table_shard * shard = nullptr;
+    const llama_ngram_table_entry * entry = nullptr;
+
+    explicit operator bool() const { return entry != nullptr; }
+};
+
+static llama_ngram_table_part ngram_find(const llama_ngram_table & ngram_table, const llama_ngram & ngram) {
+    const uint64_t hash = ngram_table_hash(ngram);
+
+    llama_ngram_table_part part;
+    part.shard = &ngram_table.shards[ngram_table_shard_index(hash)];
+    part.entry = ngram_table_shard_find(*part.shard, ngram, hash);
+    return part;
+}
+
+template <typename F>
+static void ngram_for_each(const llama_ngram_table_shard & shard, const llama_ngram_table_entry & entry, F && f) {
+    const int n_inline = std::min(entry.n_cont, LLAMA_NGRAM_TABLE_INLINE);
+    for (int i = 0; i < n_inline; ++i) {
+        f(entry.tokens[i], entry.counts[i]);
+    }
+    const llama_ngram_table_chunk * chunks = shard.chunks();
+    for (int32_t i_chunk = entry.i_chunk; i_chunk != -1; i_chunk = chunks[i_chunk].i_next) {
+        for (int i = 0; i < chunks[i_chunk].n; ++i) {
+            f(chunks[i_chunk].tokens[i], chunks[i_chunk].counts[i]);
+        }
+    }
+}
+
+template <typename F>
+static void ngram_for_each(const llama_ngram_table & /*ngram_table*/, const llama_ngram_table_part & part, F && f) {
+    ngram_for_each(*part.shard, *part.entry, f);
+}
+
+static int32_t ngram_count(const llama_ngram_table & /*ngram_table*/, const llama_ngram_table_part & part, const llama_token token) {
+    if (!part) {
+        return 0;
+    }
+    const llama_ngram_table_entry & entry = *part.entry;
+
+    const int n_inline = std::min(entry.n_cont, LLAMA_NGRAM_TABLE_INLINE);
+    for (int i = 0; i < n_inline; ++i) {
+        if (entry.tokens[i] == token) {
+            return entry.counts[i];
+        }
+    }
+    const llama_ngram_table_chunk * chunks = part.shard->chunks();
+    for (int32_t i_chunk = entry.i_chunk; i_chunk != -1; i_chunk = chunks[i_chunk].i_next) {
+        for (int i = 0; i < chunks[i_chunk].n; ++i) {
+            if (chunks[i_chunk].tokens[i] == token) {
+                return chunks[i_chunk].counts[i];
+            }
+        }
+    }
+    return 0;
+}
+
+template <typename cache_t>
+static void ngram_cache_update(cache_t & ngram_cache, int ngram_min, int ngram_max,
+                               std::vector<llama_token> & inp, int nnew, bool print_progress) {
     const int64_t t_start_ms = ggml_time_ms();
     const int64_t inp_size = inp.size();
 
@@ -20,19 +260,7 @@ void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, in
             llama_ngram ngram(&inp[ngram_start], ngram_size);
             const llama_token token = inp[i];
 
-            llama_ngram_cache::iterator part_it = ngram_cache.find(ngram);
-            if (part_it == ngram_cache.end()) {
-                llama_ngram_cache_part part;
-                part.emplace(token, 1);
-                ngram_cache.emplace(ngram, part);
-            } else {
-                llama_ngram_cache_part::iterator token_count_it = part_it->second.find(token);
-                if (token_count_it == part_it->second.end()) {
-                    part_it->second.emplace(token, 1);
-                } else {
-                    token_count_it->second++;
-                }
-            }
+            ngram_add(ngram_cache, ngram, token, 1);
             ++n_done;
 
             if (print_progress && n_done % 10000000 == 0) {
@@ -41,12 +269,17 @@ void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, in
                 const int64_t eta_min  = eta_ms / (60*1000);
                 const int64_t eta_s    = (eta_ms - 60*1000*eta_min) / 1000;
 
-                fprintf(stderr, "%s: %" PRId64 "/%" PRId64 " done, ETA: %02" PRId64 ":%02" PRId64 "\n", __func__, n_done, n_todo, eta_min, eta_s);
+                fprintf(stderr, "%s: %" PRId64 "/%" PRId64 " done, ETA: %02" PRId64 ":%02" PRId64 "\n", "llama_ngram_cache_update", n_done, n_todo, eta_min, eta_s);
             }
         }
     }
 }
 
+void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
+                              std::vector<llama_token> & inp, int nnew, bool print_progress) {
+    ngram_cache_update(ngram_cache, ngram_min, ngram_max, inp, nnew, print_progress);
+}
+
 // Helper function to get a token from the combined, speculative sequence of inp and draft.
 static llama_token get_token(const std::vector<llama_token> & inp, const std::vector<llama_token> & draft, const size_t i) {
     return i < inp.size() ? inp[i] : draft[1 + i - inp.size()];
@@ -59,27 +292,24 @@ constexpr int draft_min_sample_size_strict[LLAMA_NGRAM_MAX] = { 4,  3,  2,  2};
 constexpr int     draft_min_percent_strict[LLAMA_NGRAM_MAX] = {75, 66, 66, 66};
 
 // Helper function that tries to draft a token from only the static ngram cache:
-static llama_token try_draft(llama_ngram_cache & nc_static, const llama_ngram ngram_static) {
-    llama_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-    if (part_static_it == nc_static.end()) {
+template <typename cache_t>
+static llama_token try_draft(const cache_t & nc_static, const llama_ngram ngram_static) {
+    const auto part_static = ngram_find(nc_static, ngram_static);
+    if (!part_static) {
         return -1;
     }
-    const llama_ngram_cache_part part_static = part_static_it->second;
 
     int max_count_static  = 0;
     int sum_count_static  = 0;
     llama_token max_token = -1;
 
-    for (std::pair<llama_token, int> token_count_static : part_static) {
-        const llama_token token = token_count_static.first;
-        const int32_t count_static  = token_count_static.second;
-
+    ngram_for_each(nc_static, part_static, [&](const llama_token token, const int32_t count_static) {
         if (count_static > max_count_static) {
             max_token        = token;
             max_count_static = count_static;
         }
         sum_count_static += count_static;
-    }
+    });
 
     if (sum_count_static < draft_min_sample_size_lax[LLAMA_NGRAM_STATIC-1]) {
         return -1;
@@ -91,8 +321,9 @@ static llama_token try_draft(llama_ngram_cache & nc_static, const llama_ngram ng
 }
 
 // Try to draft a token from primary cache (context/dynamic), validate with static cache:
+template <typename cache_t, typename part_t>
 static llama_token try_draft(
-    llama_ngram_cache & nc_primary, const std::vector<llama_ngram> & ngrams_primary, llama_ngram_cache_part & part_static,
+    const cache_t & nc_primary, const std::vector<llama_ngram> & ngrams_primary, const cache_t & nc_static, const part_t & part_static,
     const int * min_sample_size, const int * min_percent) {
 
     llama_token drafted_token = -1;
@@ -100,24 +331,19 @@ static llama_token try_draft(
     for (int i = ngrams_primary.size()-1; i >= 0 && drafted_token == -1; --i) {
         const llama_ngram ngram_primary = ngrams_primary[i];
 
-        llama_ngram_cache::iterator part_primary_it = nc_primary.find(ngram_primary);
-        if (part_primary_it == nc_primary.end()) {
+        const auto part_primary = ngram_find(nc_primary, ngram_primary);
+        if (!part_primary) {
             continue;
         }
-        const llama_ngram_cache_part part_primary = part_primary_it->second;
 
         int max_count_primary = 0;
         int max_count_static  = 0;
         int sum_count_primary = 0;
         llama_token max_token = -1;
 
-        for (std::pair<llama_token, int> token_count_primary : part_primary) {
-            const llama_token token = token_count_primary.first;
-
-            llama_ngram_cache_part::iterator token_count_static_it = part_static.find(token);
-
-            const int32_t count_primary = token_count_primary.second;
-            const int32_t count_static  = token_count_static_it != part_static.end() ? 100*token_count_static_it->second : 1;
+        ngram_for_each(nc_primary, part_primary, [&](const llama_token token, const int32_t count_primary) {
+            const int32_t token_count_static = ngram_count(nc_static, part_static, token);
+            const int32_t count_static       = token_count_static > 0 ? 100*token_count_static : 1;
 
             if (count_primary*count_static > max_count_primary*max_count_static) {
                 max_token         = token;
@@ -125,7 +351,7 @@ static llama_token try_draft(
                 max_count_static  = count_static;
             }
             sum_count_primary += count_primary;
-        }
+        });
 
         if (sum_count_primary < min_sample_size[i]) {
             continue;
@@ -139,9 +365,10 @@ static llama_token try_draft(
     return drafted_token;
 }
 
-void llama_ngram_cache_draft(
+template <typename cache_t>
+static void ngram_cache_draft(
     std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
-    llama_ngram_cache & nc_context, llama_ngram_cache & nc_dynamic, llama_ngram_cache & nc_static
+    const cache_t & nc_context, const cache_t & nc_dynamic, const cache_t & nc_static
 ) {
     GGML_ASSERT(draft.size() == 1);
     const int inp_size = inp.size();
@@ -158,11 +385,7 @@ void llama_ngram_cache_draft(
         for (int j = ngram_start_static; j < ngram_start_static + LLAMA_NGRAM_STATIC; ++j) {
             ngram_static.tokens[j-ngram_start_static] = get_token(inp, draft, j);
         }
-        llama_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-        llama_ngram_cache_part part_static;
-        if (part_static_it != nc_static.end()) {
-            part_static = part_static_it->second;
-        }
+        const auto part_static = ngram_find(nc_static, ngram_static);
 
         // cd = context + dynamic
         std::vector<llama_ngram> ngrams_cd;
@@ -175,10 +398,10 @@ void llama_ngram_cache_draft(
             ngrams_cd.push_back(ngram_cd);
         }
         if (drafted_token == -1) {
-            drafted_token = try_draft(nc_context, ngrams_cd, part_static, draft_min_sample_size_lax, draft_min_percent_lax);
+            drafted_token = try_draft(nc_context, ngrams_cd, nc_static, part_static, draft_min_sample_size_lax, draft_min_percent_lax);
         }
         if (drafted_token == -1) {
-            drafted_token = try_draft(nc_dynamic, ngrams_cd, part_static, draft_min_sample_size_strict, draft_min_percent_strict);
+            drafted_token = try_draft(nc_dynamic, ngrams_cd, nc_static, part_static, draft_min_sample_size_strict, draft_min_percent_strict);
         }
         if (drafted_token == -1) {
             drafted_token = try_draft(nc_static, ngram_static);
@@ -193,6 +416,13 @@ void llama_ngram_cache_draft(
     }
 }
 
+void llama_ngram_cache_draft(
+    std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    llama_ngram_cache & nc_context, llama_ngram_cache & nc_dynamic, llama_ngram_cache & nc_static
+) {
+    ngram_cache_draft(inp, draft, n_draft, ngram_min, ngram_max, nc_context, nc_dynamic, nc_static);
+}
+
 void llama_ngram_cache_save(llama_ngram_cache & ngram_cache, std::string & filename) {
     std::ofstream file_out(filename, std::ios::binary);
     for (std::pair<llama_ngram, llama_ngram_cache_part> item : ngram_cache) {
@@ -280,3 +510,265 @@ void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram
         }
     }
 }
+
+// n-gram tables
+
+// The file starts with a header and a table with the sizes of the shards, followed by the entries and chunks of
+// each shard in order. Like the ngram cache files it uses the native byte order.
+
+static const char     ngram_table_magic[4] = { 'n', 'g', 't', 'b' };
+static const uint32_t ngram_table_version  = 1;
+
+struct llama_ngram_table_file_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t n_shards;
+    uint32_t ngram_max;
+    uint32_t n_inline;
+    uint32_t n_chunk;
+    uint32_t entry_size;
+    uint32_t chunk_size;
+};
+
+struct llama_ngram_table_file_shard {
+    uint32_t capacity;
+    uint32_t size;
+    uint32_t n_chunks;
+    uint32_t reserved;
+};
+
+size_t llama_ngram_table::size() const {
+    size_t n = 0;
+    for (const llama_ngram_table_shard & shard : shards) {
+        n += shard.size;
+    }
+    return n;
+}
+
+void llama_ngram_table::clear() {
+    for (llama_ngram_table_shard & shard : shards) {
+        shard = llama_ngram_table_shard();
+    }
+    mapping.reset();
+}
+
+void llama_ngram_cache_update(llama_ngram_table & ngram_table, int ngram_min, int ngram_max,
+                              std::vector<llama_token> & inp, int nnew, bool print_progress) {
+    ngram_table_detach(ngram_table);
+    ngram_cache_update(ngram_table, ngram_min, ngram_max, inp, nnew, print_progress);
+}
+
+void llama_ngram_cache_draft(
+    std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    llama_ngram_table & nc_context, llama_ngram_table & nc_dynamic, llama_ngram_table & nc_static
+) {
+    ngram_cache_draft(inp, draft, n_draft, ngram_min, ngram_max, nc_context, nc_dynamic, nc_static);
+}
+
+void llama_ngram_cache_merge(llama_ngram_table & ngram_table_target, const llama_ngram_table & ngram_table_add, int n_threads) {
+    ngram_table_detach(ngram_table_target);
+
+    // an n-gram is in the shard with the same index in both tables
+    auto merge_shards = [&](const int ith) {
+        for (int i_shard = ith; i_shard < LLAMA_NGRAM_TABLE_SHARDS; i_shard += n_threads) {
+            llama_ngram_table_shard       & shard_target = ngram_table_target.shards[i_shard];
+            const llama_ngram_table_shard & shard_add    = ngram_table_add.shards[i_shard];
+
+            const llama_ngram_table_entry * entries_add = shard_add.entries();
+            for (uint32_t i = 0; i < shard_add.capacity; ++i) {
+                const llama_ngram_table_entry & entry_add = entries_add[i];
+                if (ngram_table_entry_empty(entry_add)) {
+                    continue;
+                }
+                llama_ngram_table_entry & entry_target = ngram_table_shard_emplace(shard_target, entry_add.ngram, ngram_table_hash(entry_add.ngram));
+                ngram_for_each(shard_add, entry_add, [&](const llama_token token, const int32_t count) {
+                    GGML_ASSERT(count > 0);
+                    ngram_table_entry_add(shard_target, entry_target, token, count);
+                });
+            }
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, LLAMA_NGRAM_TABLE_SHARDS));
+
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(merge_shards, ith);
+    }
+    merge_shards(0);
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+}
+
+void llama_ngram_table_save(const llama_ngram_table & ngram_table, const std::string & filename) {
+    // the file may be the one that the table is mapped from, which is only possible on POSIX systems
+    const bool ok = llama_file_save_atomic(filename, [&](std::ofstream & file_out) {
+        llama_ngram_table_file_header header;
+        memcpy(header.magic, ngram_table_magic, sizeof(header.magic));
+        header.version    = ngram_table_version;
+        header.n_shards   = LLAMA_NGRAM_TABLE_SHARDS;
+        header.ngram_max  = LLAMA_NGRAM_MAX;
+        header.n_inline   = LLAMA_NGRAM_TABLE_INLINE;
+        header.n_chunk    = LLAMA_NGRAM_TABLE_CHUNK;
+        header.entry_size = sizeof(llama_ngram_table_entry);
+        header.chunk_size = sizeof(llama_ngram_table_chunk);
+        file_out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        for (const llama_ngram_table_shard & shard : ngram_table.shards) {
+            llama_ngram_table_file_shard shard_header;
+            shard_header.capacity = shard.capacity;
+            shard_header.size     = shard.size;
+            shard_header.n_chunks = shard.n_chunks;
+            shard_header.reserved = 0;
+            file_out.write(reinterpret_cast<const char *>(&shard_header), sizeof(shard_header));
+        }
+
+        for (const llama_ngram_table_shard & shard : ngram_table.shards) {
+            file_out.write(reinterpret_cast<const char *>(shard.entries()), shard.capacity*sizeof(llama_ngram_table_entry));
+            file_out.write(reinterpret_cast<const char *>(shard.chunks()),  shard.n_chunks*sizeof(llama_ngram_table_chunk));
+        }
+    });
+    GGML_ASSERT(ok);
+}
+
+llama_ngram_table llama_ngram_table_load(const std::string & filename) {
+    llama_ngram_table_file_header header;
+    {
+        std::ifstream file_in(filename, std::ios::binary);
+        if (!file_in) {
+            throw std::ifstream::failure("Unable to open file " + filename);
+        }
+        if (!file_in.read(reinterpret_cast<char *>(&header), sizeof(header)) || memcmp(header.magic, ngram_table_magic, sizeof(header.magic)) != 0) {
+            // not an n-gram table, convert the file written by llama_ngram_cache_save
+            std::string filename_cache = filename;
+            return llama_ngram_table_from_cache(llama_ngram_cache_load(filename_cache));
+        }
+    }
+
+    if (header.version    != ngram_table_version           ||
+        header.n_shards   != LLAMA_NGRAM_TABLE_SHARDS      ||
+        header.ngram_max  != LLAMA_NGRAM_MAX               ||
+        header.n_inline   != LLAMA_NGRAM_TABLE_INLINE      ||
+        header.n_chunk    != LLAMA_NGRAM_TABLE_CHUNK       ||
+        header.entry_size != sizeof(llama_ngram_table_entry) ||
+        header.chunk_size != sizeof(llama_ngram_table_chunk)) {
+        throw std::ifstream::failure("Incompatible n-gram table format in " + filename);
+    }
+
+    llama_ngram_table ngram_table;
+    ngram_table.mapping = std::make_shared<llama_file_mapping>(filename);
+    const llama_file_mapping & mapping = *ngram_table.mapping;
+    if (mapping.addr == nullptr) {
+        throw std::ifstream::failure("Unable to map file " + filename);
+    }
+
+    const auto corrupt = [&](const char * what) {
+        return std::ifstream::failure("Corrupt n-gram table " + filename + ": " + what);
+    };
+
+    const uint8_t * data = (const uint8_t *) mapping.addr;
+    size_t offset = sizeof(llama_ngram_table_file_header) + LLAMA_NGRAM_TABLE_SHARDS*sizeof(llama_ngram_table_file_shard);
+    if (mapping.size < offset) {
+        throw corrupt("truncated header");
+    }
+
+    const llama_ngram_table_file_shard * shard_headers = (const llama_ngram_table_file_shard *) (data + sizeof(llama_ngram_table_file_header));
+    for (int i_shard = 0; i_shard < LLAMA_NGRAM_TABLE_SHARDS; ++i_shard) {
+        const llama_ngram_table_file_shard & shard_header = shard_headers[i_shard];
+        llama_ngram_table_shard & shard = ngram_table.shards[i_shard];
+
+        if ((shard_header.capacity & (shard_header.capacity - 1)) != 0 ||
+            !(shard_header.size < shard_header.capacity || (shard_header.size == 0 && shard_header.n_chunks == 0)) ||
+            shard_header.n_chunks > (uint32_t) INT32_MAX) {
+            throw corrupt("invalid shard header");
+        }
+
+        const size_t size_entries = (size_t) shard_header.capacity*sizeof(llama_ngram_table_entry);
+        const size_t size_chunks  = (size_t) shard_header.n_chunks*sizeof(llama_ngram_table_chunk);
+        if (mapping.size - offset < size_entries + size_chunks) {
+            throw corrupt("truncated shard");
+        }
+
+        shard.capacity = shard_header.capacity;
+        shard.size     = shard_header.size;
+        shard.n_chunks = shard_header.n_chunks;
+        if (shard.capacity > 0) {
+            shard.entries_mapped = (const llama_ngram_table_entry *) (data + offset);
+            shard.chunks_mapped  = (const llama_ngram_table_chunk *) (data + offset + size_entries);
+        }
+        offset += size_entries + size_chunks;
+
+        // the chunks are appended, a chunk only links to an older one - this keeps the walks in ngram_for_each finite
+        const llama_ngram_table_chunk * chunks = shard.chunks();
+        for (uint32_t i = 0; i < shard.n_chunks; ++i) {
+            if (chunks[i].i_next < -1 || chunks[i].i_next >= (int32_t) i || chunks[i].n < 0 || chunks[i].n > LLAMA_NGRAM_TABLE_CHUNK) {
+                throw corrupt("invalid chunk");
+            }
+        }
+
+        const llama_ngram_table_entry * entries = shard.entries();
+        uint32_t n_used = 0;
+        for (uint32_t i = 0; i < shard.capacity; ++i) {
+            const llama_ngram_table_entry & entry = entries[i];
+            if (ngram_table_entry_empty(entry)) {
+                continue;
+            }
+            n_used++;
+            if (entry.n_cont < 0 || entry.i_chunk < -1 || entry.i_chunk >= (int32_t) shard.n_chunks) {
+                throw corrupt("invalid entry");
+            }
+            int64_t n_cont = std::min(entry.n_cont, LLAMA_NGRAM_TABLE_INLINE);
+            for (int32_t i_chunk = entry.i_chunk; i_chunk != -1; i_chunk = chunks[i_chunk].i_next) {
+                n_cont += chunks[i_chunk].n;
+            }
+            if (n_cont != entry.n_cont) {
+                throw corrupt("invalid entry");
+            }
+        }
+        // the probing in ngram_table_shard_find ends at an empty entry, so fewer entries than the capacity must be in use
+        if (n_used != shard.size) {
+            throw corrupt("invalid shard size");
+        }
+    }
+    if (mapping.size != offset) {
+        throw corrupt("unexpected size");
+    }
+
+    return ngram_table;
+}
+
+llama_ngram_table llama_ngram_table_from_cache(const llama_ngram_cache & ngram_cache) {
+    llama_ngram_table ngram_table;
+    for (const std::pair<const llama_ngram, llama_ngram_cache_part> & ngram_part : ngram_cache) {
+        for (const std::pair<const llama_token, int32_t> & token_count : ngram_part.second) {
+            ngram_add(ngram_table, ngram_part.first, token_count.first, token_count.second);
+        }
+    }
+    return ngram_table;
+}
+
+llama_ngram_cache llama_ngram_table_to_cache(const llama_ngram_table & ngram_table) {
+    llama_ngram_cache ngram_cache;
+    for (const llama_ngram_table_shard & shard : ngram_table.shards) {
+        const llama_ngram_table_entry * entries = shard.entries();
+        for (uint32_t i = 0; i < shard.capacity; ++i) {
+            if (ngram_table_entry_empty(entries[i])) {
+                continue;
+            }
+            llama_ngram_cache_part & part = ngram_cache[entries[i].ngram];
+            ngram_for_each(shard, entries[i], [&](const llama_token token, const int32_t count) {
+                part.emplace(token, count);
+            });
+        }
+    }
+    return ngram_cache;
+}
+
+size_t llama_ngram_table_size_bytes(const llama_ngram_table & ngram_table) {
+    size_t size = sizeof(llama_ngram_table);
+    for (const llama_ngram_table_shard & shard : ngram_table.shards) {
+        size += (size_t) shard.capacity*sizeof(llama_ngram_table_entry) + (size_t) shard.n_chunks*sizeof(llama_ngram_table_chunk);
+    }
+    return size;
+}
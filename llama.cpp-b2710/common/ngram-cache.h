@@ -2,6 +2,7 @@
 
 #include "llama.h"
 
+#include <memory>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -92,3 +93,87 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename);
 // ngram_cache_target: the ngram cache to which to add the information from ngram_cache_add.
 // ngram_cache_add:    the ngram cache to add to ngram_cache_target.
 void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add);
+
+
+// Compact alternative to llama_ngram_cache without an allocation per n-gram and per token:
+// an open-addressing hash table that is split into shards by the hash of the n-grams.
+// The first continuations of an n-gram are stored inline in its entry, further ones in fixed-size chunks chained from it.
+// The shards are independent of each other, which lets merges run in parallel,
+// and their arrays are written to disk as they are, which lets a saved table be used directly from a memory mapping.
+
+#define LLAMA_NGRAM_TABLE_SHARDS 64 // must be a power of 2
+#define LLAMA_NGRAM_TABLE_INLINE 4  // continuations stored in the entry of an n-gram
+#define LLAMA_NGRAM_TABLE_CHUNK  7  // continuations per overflow chunk
+
+struct llama_ngram_table_entry {
+    llama_ngram ngram;           // ngram.tokens[0] == -1 if the entry is empty
+    int32_t     n_cont  =  0;    // total number of continuations
+    int32_t     i_chunk = -1;    // index of the most recent overflow chunk, -1 if none
+    llama_token tokens[LLAMA_NGRAM_TABLE_INLINE] = {};
+    int32_t     counts[LLAMA_NGRAM_TABLE_INLINE] = {};
+};
+
+struct llama_ngram_table_chunk {
+    int32_t     i_next = -1;     // index of the previous chunk of the same n-gram, -1 if none
+    int32_t     n      =  0;     // number of continuations in this chunk
+    llama_token tokens[LLAMA_NGRAM_TABLE_CHUNK] = {};
+    int32_t     counts[LLAMA_NGRAM_TABLE_CHUNK] = {};
+};
+
+struct llama_file_mapping;
+
+struct llama_ngram_table_shard {
+    uint32_t capacity = 0; // number of entries, 0 or a power of 2
+    uint32_t size     = 0; // number of non-empty entries
+    uint32_t n_chunks = 0;
+
+    // set if the shard points into the memory mapping of a file, the vectors are empty until it is modified
+    const llama_ngram_table_entry * entries_mapped = nullptr;
+    const llama_ngram_table_chunk * chunks_mapped  = nullptr;
+
+    std::vector<llama_ngram_table_entry> entries_data;
+    std::vector<llama_ngram_table_chunk> chunks_data;
+
+    const llama_ngram_table_entry * entries() const { return entries_mapped ? entries_mapped : entries_data.data(); }
+    const llama_ngram_table_chunk * chunks()  const { return chunks_mapped  ? chunks_mapped  : chunks_data.data();  }
+};
+
+struct llama_ngram_table {
+    llama_ngram_table_shard shards[LLAMA_NGRAM_TABLE_SHARDS];
+
+    // keeps the file mapped while shards point into it
+    std::shared_ptr<llama_file_mapping> mapping;
+
+    // number of n-grams
+    size_t size() const;
+
+    bool empty() const { return size() == 0; }
+
+    void clear();
+};
+
+// Same as llama_ngram_cache_update/llama_ngram_cache_draft/llama_ngram_cache_merge for n-gram tables.
+// The merge processes the shards with n_threads threads.
+void llama_ngram_cache_update(
+    llama_ngram_table & ngram_table, int ngram_min, int ngram_max, std::vector<llama_token> & inp_data, int nnew, bool print_progress);
+
+void llama_ngram_cache_draft(
+    std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
+    llama_ngram_table & nc_context, llama_ngram_table & nc_dynamic, llama_ngram_table & nc_static);
+
+void llama_ngram_cache_merge(llama_ngram_table & ngram_table_target, const llama_ngram_table & ngram_table_add, int n_threads = 1);
+
+// Save an n-gram table to a file, in a format that llama_ngram_table_load maps into memory instead of parsing it.
+void llama_ngram_table_save(const llama_ngram_table & ngram_table, const std::string & filename);
+
+// Load an n-gram table saved with llama_ngram_table_save, or convert a cache saved with llama_ngram_cache_save.
+// The shards of a saved table point into a read-only mapping of the file and are only copied once they are modified.
+// Throws std::ifstream::failure if the file cannot be opened or is not a valid n-gram table.
+llama_ngram_table llama_ngram_table_load(const std::string & filename);
+
+// Convert between ngram caches and n-gram tables.
+llama_ngram_table llama_ngram_table_from_cache(const llama_ngram_cache & ngram_cache);
+llama_ngram_cache llama_ngram_table_to_cache(const llama_ngram_table & ngram_table);
+
+// Memory used by the entries and chunks of an n-gram table, including the parts that are mapped from a file.
+size_t llama_ngram_table_size_bytes(const llama_ngram_table & ngram_table);
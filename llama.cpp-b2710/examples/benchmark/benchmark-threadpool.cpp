@@ -0,0 +1,193 @@
+#include "common.h"
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// compares ggml_graph_compute() with threads created per call against a persistent ggml_threadpool
+// the graph mimics a single-token decode step: a long chain of small matrix-vector products,
+// so that the per-call thread setup is a noticeable part of the total time
+
+struct benchmark_params_struct {
+    int32_t n_threads    = 4;
+    int32_t n_iterations = 100;
+    int32_t n_layers     = 32;
+    int32_t n_embd       = 1024;
+    int32_t poll         = 50;
+};
+
+static void print_usage(int /*argc*/, char ** argv, struct benchmark_params_struct params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -i N, --iter N        number of graph evaluations per run (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "  -l N, --layers N      number of matrix-vector products in the graph (default: %d)\n", params.n_layers);
+    fprintf(stderr, "  -e N, --embd N        size of the square weight matrix (default: %d)\n", params.n_embd);
+    fprintf(stderr, "  --poll N              threadpool polling level 0 - 100 (default: %d)\n", params.poll);
+    fprintf(stderr, "\n");
+}
+
+static double run_graph(ggml_cgraph * gf, std::vector<uint8_t> & work_buffer, int n_threads, ggml_threadpool * threadpool, int n_iterations) {
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; i < n_iterations; i++) {
+        struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+        if (plan.work_size > 0) {
+            work_buffer.resize(plan.work_size);
+            plan.work_data = work_buffer.data();
+        }
+        plan.threadpool = threadpool;
+
+        ggml_graph_compute(gf, &plan);
+    }
+
+    return (double) (ggml_time_us() - t_start_us) / n_iterations;
+}
+
+int main(int argc, char ** argv) {
+    struct benchmark_params_struct benchmark_params;
+
+    bool invalid_param = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            benchmark_params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "-i" || arg == "--iter") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            benchmark_params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "-l" || arg == "--layers") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            benchmark_params.n_layers = std::stoi(argv[i]);
+        } else if (arg == "-e" || arg == "--embd") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            benchmark_params.n_embd = std::stoi(argv[i]);
+        } else if (arg == "--poll") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            benchmark_params.poll = std::stoi(argv[i]);
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv, benchmark_params);
+            exit(0);
+        } else {
+            invalid_param = true;
+            break;
+        }
+    }
+    if (invalid_param) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv, benchmark_params);
+        exit(1);
+    }
+
+    print_build_info();
+
+    const int n_embd   = benchmark_params.n_embd;
+    const int n_layers = benchmark_params.n_layers;
+
+    size_t ctx_size = 0;
+    ctx_size += ggml_row_size(GGML_TYPE_F32, (int64_t) n_embd*n_embd);
+    ctx_size += ggml_row_size(GGML_TYPE_F32, n_embd)*(2*n_layers + 1);
+    ctx_size += ggml_graph_overhead();
+    ctx_size += ggml_tensor_overhead()*(2*n_layers + 2);
+    ctx_size += 1024*1024;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ ctx_size,
+        /*.mem_buffer =*/ NULL,
+        /* no_alloc   =*/ 0
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+    if (!ctx) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return 1;
+    }
+
+    // small weights so that the values do not blow up along the chain
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd);
+    for (int64_t i = 0; i < ggml_nelements(w); i++) {
+        ((float *) w->data)[i] = 0.5f*std::sin((float) i)/n_embd;
+    }
+
+    struct ggml_tensor * x = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    ggml_set_f32(x, 1.0f);
+
+    struct ggml_tensor * cur = x;
+    for (int il = 0; il < n_layers; il++) {
+        cur = ggml_add(ctx, ggml_mul_mat(ctx, w, cur), cur);
+        cur = ggml_silu(ctx, cur);
+    }
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    printf("graph: %d nodes, n_embd = %d, n_threads = %d, iterations = %d\n\n",
+            gf->n_nodes, n_embd, benchmark_params.n_threads, benchmark_params.n_iterations);
+
+    std::vector<uint8_t> work_buffer;
+
+    // warm up and keep a reference result
+    run_graph(gf, work_buffer, benchmark_params.n_threads, nullptr, 1);
+    std::vector<float> ref((float *) cur->data, (float *) cur->data + n_embd);
+
+    printf("%-30s %14s %10s\n", "mode", "us/graph", "speedup");
+    printf("=========================================================\n");
+
+    const double t_spawn = run_graph(gf, work_buffer, benchmark_params.n_threads, nullptr, benchmark_params.n_iterations);
+    printf("%-30s %14.2f %10.2f\n", "per-call threads", t_spawn, 1.0);
+
+    const int polls[] = { 0, benchmark_params.poll, 100 };
+    for (int poll : polls) {
+        struct ggml_threadpool_params tpp = ggml_threadpool_params_default(benchmark_params.n_threads);
+        tpp.poll = poll;
+
+        struct ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+
+        run_graph(gf, work_buffer, benchmark_params.n_threads, threadpool, 1);
+        const double t_pool = run_graph(gf, work_buffer, benchmark_params.n_threads, threadpool, benchmark_params.n_iterations);
+
+        ggml_threadpool_free(threadpool);
+
+        const std::string mode = "threadpool (poll = " + std::to_string(poll) + ")";
+        printf("%-30s %14.2f %10.2f\n", mode.c_str(), t_pool, t_spawn/t_pool);
+
+        // the result must not depend on how the threads were started
+        if (memcmp(ref.data(), cur->data, n_embd*sizeof(float)) != 0) {
+            fprintf(stderr, "\nABORT - threadpool result differs from the reference\n");
+            ggml_free(ctx);
+            return 1;
+        }
+    }
+
+    printf("=========================================================\n");
+
+    ggml_free(ctx);
+
+    return 0;
+}
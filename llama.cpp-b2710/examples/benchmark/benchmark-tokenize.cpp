@@ -0,0 +1,120 @@
+#include "common.h"
+#include "llama.h"
+#include "unicode.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// measures the throughput of the tokenizer of a BPE vocab, the correctness checks are in test-tokenizer-1-bpe
+
+// tokenizes a text of about 1 MB a few times and reports the throughput. the text is read from a file, e.g. a
+// transcript, or made of random words of the vocabulary
+static void bench_tokenize(llama_context * ctx, const std::string & fname_text, int n_iter) {
+    std::string text;
+
+    if (!fname_text.empty()) {
+        std::ifstream f(fname_text);
+        std::stringstream ss;
+        ss << f.rdbuf();
+        text = ss.str();
+    } else {
+        const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+        std::mt19937 rng(1);
+        while (text.size() < 1024*1024) {
+            const std::string word = llama_detokenize_bpe(ctx, std::vector<int>(1, rng() % n_vocab));
+            try {
+                unicode_cpts_from_utf8(word);
+            } catch (const std::invalid_argument &) {
+                // a byte of a longer UTF-8 sequence
+                continue;
+            }
+            text += word;
+            text += rng() % 8 == 0 ? ".\n" : " ";
+        }
+    }
+
+    size_t n_tokens = 0;
+
+    const int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_iter; ++i) {
+        n_tokens = llama_tokenize(ctx, text, false).size();
+    }
+    const double t_sec = (ggml_time_us() - t_start)/1e6/n_iter;
+
+    fprintf(stderr, "%s : %zu bytes -> %zu tokens in %.3f s, %.2f MB/s, %.0f tokens/s\n", __func__,
+            text.size(), n_tokens, t_sec, text.size()/t_sec/1e6, n_tokens/t_sec);
+
+    // the same text as many short chunks, e.g. for embeddings, one by one and in parallel
+    std::vector<std::string> chunks;
+    for (size_t pos = 0; pos < text.size(); ) {
+        const size_t end = text.find('\n', pos);
+        const size_t len = end == std::string::npos ? text.size() - pos : end - pos + 1;
+        chunks.push_back(text.substr(pos, len));
+        pos += len;
+    }
+
+    const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    const int64_t t0 = ggml_time_us();
+    std::vector<std::vector<llama_token>> ref;
+    for (const auto & chunk : chunks) {
+        ref.push_back(llama_tokenize(ctx, chunk, true));
+    }
+    const int64_t t1 = ggml_time_us();
+    const auto res = llama_tokenize_batch(ctx, chunks, true, false, n_threads);
+    const int64_t t2 = ggml_time_us();
+
+    if (res != ref) {
+        fprintf(stderr, "%s : error: llama_tokenize_batch differs from llama_tokenize\n", __func__);
+        std::exit(4);
+    }
+
+    fprintf(stderr, "%s : %zu chunks, one by one %.2f MB/s, batch on %d threads %.2f MB/s\n", __func__,
+            chunks.size(), text.size()/((t1 - t0)/1e6)/1e6, n_threads, text.size()/((t2 - t1)/1e6)/1e6);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file> [text-file] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname      = argv[1];
+    const std::string fname_text = argc > 2 ? argv[2] : "";
+    const int         n_iter     = argc > 3 ? std::max(1, atoi(argv[3])) : 3;
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(fname.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    llama_context * ctx = llama_new_context_with_model(model, llama_context_default_params());
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        llama_free_model(model);
+        return 1;
+    }
+
+    bench_tokenize(ctx, fname_text, n_iter);
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return 0;
+}
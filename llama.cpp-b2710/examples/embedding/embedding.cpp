@@ -112,15 +112,13 @@ int main(int argc, char ** argv) {
     GGML_ASSERT(params.n_batch >= params.n_ctx);
 
     // tokenize the prompts and trim
-    std::vector<std::vector<int32_t>> inputs;
-    for (const auto & prompt : prompts) {
-        auto inp = ::llama_tokenize(ctx, prompt, true, false);
+    std::vector<std::vector<int32_t>> inputs = ::llama_tokenize_batch(ctx, prompts, true, false, params.n_threads);
+    for (const auto & inp : inputs) {
         if (inp.size() > n_batch) {
             fprintf(stderr, "%s: error: number of tokens in input line (%lld) exceeds batch size (%lld), increase batch size and re-run\n",
                     __func__, (long long int) inp.size(), (long long int) n_batch);
             return 1;
         }
-        inputs.push_back(inp);
     }
 
     // add SEP if not present
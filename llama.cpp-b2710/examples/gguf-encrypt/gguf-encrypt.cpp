@@ -0,0 +1,381 @@
+#include "llama.h"
+#include "ggml-backend.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// encrypts the tensor data of a GGUF file with AES-256-CTR
+// the header and metadata stay readable, so that the model can be inspected without the key;
+// llama.cpp decrypts the tensor data while loading when given the key with --model-key
+
+static const char * KV_ENCRYPTION     = "general.encryption";
+static const char * KV_ENCRYPTION_IV  = "general.encryption.iv";
+static const char * KV_ENCRYPTION_KCV = "general.encryption.kcv";
+
+enum encrypt_operation {
+    ENCRYPT_OP_ENCRYPT,
+    ENCRYPT_OP_DECRYPT,
+    ENCRYPT_OP_BENCH,
+};
+
+struct encrypt_params {
+    encrypt_operation operation = ENCRYPT_OP_ENCRYPT;
+    std::string key;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    int n_reps    = 3;
+    std::string input;
+    std::string output;
+};
+
+static void encrypt_print_usage(const char * executable) {
+    const encrypt_params default_params;
+    printf("\n");
+    printf("usage: %s [options] GGUF_IN GGUF_OUT\n", executable);
+    printf("       %s --bench --key KEY GGUF_PLAIN GGUF_ENCRYPTED\n", executable);
+    printf("\n");
+    printf("Encrypt the tensor data of GGUF_IN with AES-256-CTR and write it to GGUF_OUT.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help          show this help message and exit\n");
+    printf("  --key KEY           AES-256 key as 64 hex digits (default: generate a random key and print it)\n");
+    printf("  --decrypt           decrypt GGUF_IN instead, the output is a plain GGUF file\n");
+    printf("  --bench             compare the load throughput of a plain model and its encrypted copy (without mmap)\n");
+    printf("  -t N, --threads N   number of threads for the keystream generation (default: %d)\n", default_params.n_threads);
+    printf("  -r N, --repetitions N\n");
+    printf("                      number of loads per model in --bench (default: %d)\n", default_params.n_reps);
+    printf("\n");
+}
+
+static bool encrypt_params_parse(int argc, char ** argv, encrypt_params & params) {
+    bool invalid_param = false;
+    std::string arg;
+    int arg_idx = 1;
+    for (; arg_idx < argc && argv[arg_idx][0] == '-'; arg_idx++) {
+        arg = argv[arg_idx];
+        if (arg == "-h" || arg == "--help") {
+            encrypt_print_usage(argv[0]);
+            exit(0);
+        } else if (arg == "--key") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.key = argv[arg_idx];
+        } else if (arg == "--decrypt") {
+            params.operation = ENCRYPT_OP_DECRYPT;
+        } else if (arg == "--bench") {
+            params.operation = ENCRYPT_OP_BENCH;
+        } else if (arg == "-t" || arg == "--threads") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads = std::max(1, atoi(argv[arg_idx]));
+        } else if (arg == "-r" || arg == "--repetitions") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_reps = std::max(1, atoi(argv[arg_idx]));
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    if (invalid_param) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        return false;
+    }
+
+    if (argc - arg_idx < 2) {
+        fprintf(stderr, "error: bad arguments\n");
+        return false;
+    }
+
+    params.input  = argv[arg_idx++];
+    params.output = argv[arg_idx++];
+
+    return true;
+}
+
+static std::string bytes_to_hex(const uint8_t * data, size_t n) {
+    std::string hex;
+    char buf[3];
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(buf, sizeof(buf), "%02x", data[i]);
+        hex += buf;
+    }
+    return hex;
+}
+
+static bool hex_to_bytes(const std::string & hex, uint8_t * out, size_t n) {
+    if (hex.size() != 2*n) {
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        char * end = nullptr;
+        const std::string byte = hex.substr(2*i, 2);
+        out[i] = (uint8_t) strtoul(byte.c_str(), &end, 16);
+        if (*end != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void random_bytes(uint8_t * out, size_t n) {
+    std::random_device rd;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = (uint8_t) rd();
+    }
+}
+
+// key check value, see llama_aes256_ctr_kcv: the zero block encrypted with the key is the keystream for a zero counter
+static std::string key_check_value(const uint8_t * key) {
+    uint8_t block[16] = {0};
+    const uint8_t zero_iv[16] = {0};
+    llama_aes256_ctr_apply(key, zero_iv, 0, block, sizeof(block), 1);
+    return bytes_to_hex(block, 3);
+}
+
+static std::string gguf_get_str(const gguf_context * ctx, const char * key) {
+    const int kid = gguf_find_key(ctx, key);
+    return kid < 0 ? "" : gguf_get_val_str(ctx, kid);
+}
+
+static int encrypt_file(const encrypt_params & params, const uint8_t * key) {
+    struct ggml_context * ctx_meta = NULL;
+    struct gguf_init_params gguf_params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx_meta,
+    };
+    struct gguf_context * ctx_in = gguf_init_from_file(params.input.c_str(), gguf_params);
+    if (!ctx_in) {
+        fprintf(stderr, "%s: failed to load input GGUF from %s\n", __func__, params.input.c_str());
+        return 1;
+    }
+
+    const bool decrypt = params.operation == ENCRYPT_OP_DECRYPT;
+    const std::string cipher = gguf_get_str(ctx_in, KV_ENCRYPTION);
+
+    uint8_t iv[16];
+    if (decrypt) {
+        if (cipher != "aes-256-ctr" || !hex_to_bytes(gguf_get_str(ctx_in, KV_ENCRYPTION_IV), iv, sizeof(iv))) {
+            fprintf(stderr, "%s: %s is not an encrypted model\n", __func__, params.input.c_str());
+            return 1;
+        }
+        const std::string kcv = gguf_get_str(ctx_in, KV_ENCRYPTION_KCV);
+        if (!kcv.empty() && kcv != key_check_value(key)) {
+            fprintf(stderr, "%s: wrong key\n", __func__);
+            return 1;
+        }
+    } else {
+        if (!cipher.empty()) {
+            fprintf(stderr, "%s: %s is already encrypted\n", __func__, params.input.c_str());
+            return 1;
+        }
+        random_bytes(iv, sizeof(iv));
+    }
+
+    // same metadata and tensor layout, only the encryption keys change
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx_in);
+    if (decrypt) {
+        gguf_remove_key(ctx_out, KV_ENCRYPTION);
+        gguf_remove_key(ctx_out, KV_ENCRYPTION_IV);
+        gguf_remove_key(ctx_out, KV_ENCRYPTION_KCV);
+    } else {
+        gguf_set_val_str(ctx_out, KV_ENCRYPTION,     "aes-256-ctr");
+        gguf_set_val_str(ctx_out, KV_ENCRYPTION_IV,  bytes_to_hex(iv, sizeof(iv)).c_str());
+        gguf_set_val_str(ctx_out, KV_ENCRYPTION_KCV, key_check_value(key).c_str());
+    }
+    for (int i = 0; i < gguf_get_n_tensors(ctx_in); ++i) {
+        gguf_add_tensor(ctx_out, ggml_get_tensor(ctx_meta, gguf_get_tensor_name(ctx_in, i)));
+    }
+
+    std::ifstream f_in(params.input, std::ios::binary);
+    std::ofstream f_out(params.output, std::ios::binary);
+    if (!f_in || !f_out) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, !f_in ? params.input.c_str() : params.output.c_str());
+        return 1;
+    }
+
+    {
+        std::vector<uint8_t> meta(gguf_get_meta_size(ctx_out));
+        gguf_get_meta_data(ctx_out, meta.data());
+        f_out.write((const char *) meta.data(), meta.size());
+    }
+
+    // the data section has the same layout in both files, the keystream offset is relative to its start
+    f_in.seekg(0, std::ios::end);
+    const size_t data_offs = gguf_get_data_offset(ctx_in);
+    const size_t data_size = (size_t) f_in.tellg() - data_offs;
+    f_in.seekg(data_offs);
+
+    std::vector<uint8_t> buf(64*1024*1024);
+    for (size_t offs = 0; offs < data_size; offs += buf.size()) {
+        const size_t n = std::min(buf.size(), data_size - offs);
+        f_in.read((char *) buf.data(), n);
+        llama_aes256_ctr_apply(key, iv, offs, buf.data(), n, params.n_threads);
+        f_out.write((const char *) buf.data(), n);
+        printf("\r%s: %6.2f%%", decrypt ? "decrypting" : "encrypting", 100.0*(offs + n)/data_size);
+        fflush(stdout);
+    }
+    printf("\n");
+
+    if (!f_in || !f_out) {
+        fprintf(stderr, "%s: I/O error\n", __func__);
+        return 1;
+    }
+
+    printf("%s: wrote %s (%.2f MiB of tensor data)\n", __func__, params.output.c_str(), data_size/1024.0/1024.0);
+
+    gguf_free(ctx_out);
+    gguf_free(ctx_in);
+    ggml_free(ctx_meta);
+
+    return 0;
+}
+
+static bool bench_progress(float /*progress*/, void * /*user_data*/) {
+    return true;
+}
+
+static llama_model * bench_load(const std::string & fname, const char * key, double & t_ms) {
+    auto mparams = llama_model_default_params();
+    mparams.use_mmap          = false;
+    mparams.encryption_key    = key;
+    mparams.progress_callback = bench_progress;
+
+    const int64_t t_start_us = ggml_time_us();
+    llama_model * model = llama_load_model_from_file(fname.c_str(), mparams);
+    t_ms = (ggml_time_us() - t_start_us)/1e3;
+
+    return model;
+}
+
+static int bench(const encrypt_params & params, const uint8_t * key) {
+    llama_log_set([](ggml_log_level /*level*/, const char * /*text*/, void * /*user_data*/) {}, nullptr);
+
+    // raw keystream throughput, no I/O
+    {
+        std::vector<uint8_t> buf(256*1024*1024, 0);
+        const uint8_t iv[16] = {0};
+        printf("%-24s %10s %10s\n", "keystream", "threads", "GB/s");
+        for (int n_threads = 1; n_threads <= params.n_threads; n_threads *= 2) {
+            const int64_t t_start_us = ggml_time_us();
+            llama_aes256_ctr_apply(key, iv, 0, buf.data(), buf.size(), n_threads);
+            const double t_s = (ggml_time_us() - t_start_us)/1e6;
+            printf("%-24s %10d %10.2f\n", "", n_threads, buf.size()/t_s/1e9);
+        }
+        printf("\n");
+    }
+
+    const std::string key_hex = bytes_to_hex(key, 32);
+
+    printf("%-24s %10s %10s %10s\n", "model", "MiB", "ms", "GB/s");
+
+    double t_best[2] = { 1e30, 1e30 };
+    uint64_t size = 0;
+    for (int rep = 0; rep < params.n_reps; ++rep) {
+        for (int i = 0; i < 2; ++i) {
+            double t_ms = 0.0;
+            llama_model * model = bench_load(i == 0 ? params.input : params.output, i == 0 ? nullptr : key_hex.c_str(), t_ms);
+            if (!model) {
+                fprintf(stderr, "%s: failed to load %s\n", __func__, i == 0 ? params.input.c_str() : params.output.c_str());
+                return 1;
+            }
+            size = llama_model_size(model);
+            t_best[i] = std::min(t_best[i], t_ms);
+            llama_free_model(model);
+        }
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        printf("%-24s %10.2f %10.2f %10.2f\n", i == 0 ? "plain" : "encrypted", size/1024.0/1024.0, t_best[i], size/t_best[i]/1e6);
+    }
+
+    // the decrypted tensors must match the plain model
+    {
+        double t_ms = 0.0;
+        llama_model * model_plain = bench_load(params.input,  nullptr,         t_ms);
+        llama_model * model_enc   = bench_load(params.output, key_hex.c_str(), t_ms);
+
+        struct ggml_context * ctx_meta = NULL;
+        struct gguf_init_params gguf_params = {
+            /*.no_alloc = */ true,
+            /*.ctx      = */ &ctx_meta,
+        };
+        struct gguf_context * ctx_gguf = gguf_init_from_file(params.input.c_str(), gguf_params);
+
+        int n_diff = 0;
+        std::vector<uint8_t> a;
+        std::vector<uint8_t> b;
+        for (int i = 0; ctx_gguf && i < gguf_get_n_tensors(ctx_gguf); ++i) {
+            const char * name = gguf_get_tensor_name(ctx_gguf, i);
+            struct ggml_tensor * ta = llama_get_model_tensor(model_plain, name);
+            struct ggml_tensor * tb = llama_get_model_tensor(model_enc,   name);
+            if (!ta || !tb) {
+                continue;
+            }
+            a.resize(ggml_nbytes(ta));
+            b.resize(ggml_nbytes(tb));
+            ggml_backend_tensor_get(ta, a.data(), 0, a.size());
+            ggml_backend_tensor_get(tb, b.data(), 0, b.size());
+            if (a != b) {
+                fprintf(stderr, "%s: tensor %s differs\n", __func__, name);
+                n_diff++;
+            }
+        }
+
+        gguf_free(ctx_gguf);
+        ggml_free(ctx_meta);
+        llama_free_model(model_enc);
+        llama_free_model(model_plain);
+
+        if (!ctx_gguf || n_diff > 0) {
+            return 1;
+        }
+        printf("\ndecrypted tensors match the plain model\n");
+    }
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    encrypt_params params;
+    if (!encrypt_params_parse(argc, argv, params)) {
+        encrypt_print_usage(argv[0]);
+        return 1;
+    }
+
+    uint8_t key[32];
+    if (params.key.empty()) {
+        if (params.operation != ENCRYPT_OP_ENCRYPT) {
+            fprintf(stderr, "error: --key is required\n");
+            return 1;
+        }
+        random_bytes(key, sizeof(key));
+        printf("key: %s\n", bytes_to_hex(key, sizeof(key)).c_str());
+    } else if (!hex_to_bytes(params.key, key, sizeof(key))) {
+        fprintf(stderr, "error: invalid key, expected 64 hex digits\n");
+        return 1;
+    }
+
+    llama_backend_init();
+
+    const int ret = params.operation == ENCRYPT_OP_BENCH ? bench(params, key) : encrypt_file(params, key);
+
+    llama_backend_free();
+
+    return ret;
+}
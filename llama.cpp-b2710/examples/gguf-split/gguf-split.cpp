@@ -2,10 +2,16 @@
 #include "common.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <stdio.h>
@@ -19,11 +25,29 @@
         #define PATH_MAX MAX_PATH
     #endif
     #include <io.h>
+    #include <fcntl.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
 #endif
 
+#include <sys/stat.h>
+
+#if defined(__linux__)
+    #include <sys/sendfile.h>
+    #if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+        #define SPLIT_USE_COPY_FILE_RANGE
+    #endif
+#endif
+
+// CRC-32C of each tensor of a file, in the order of its tensor infos
+static const char * const KV_TENSOR_CRC32C = "general.tensor_crc32c";
+static const char * const KV_ENCRYPTION    = "general.encryption";
+
 enum split_operation : uint8_t {
     SPLIT_OP_SPLIT,
     SPLIT_OP_MERGE,
+    SPLIT_OP_VERIFY,
 };
 
 struct split_params {
@@ -33,12 +57,16 @@ struct split_params {
     std::string input;
     std::string output;
     bool dry_run = false;
+    bool checksums = false;
+    std::string model_key;
+    int n_threads = std::max(1, std::min(4, (int) std::thread::hardware_concurrency()));
 };
 
 static void split_print_usage(const char * executable) {
     const split_params default_params;
     printf("\n");
     printf("usage: %s [options] GGUF_IN GGUF_OUT\n", executable);
+    printf("       %s --verify [--model-key KEY] GGUF_IN\n", executable);
     printf("\n");
     printf("Apply a GGUF operation on IN to OUT.");
     printf("\n");
@@ -50,6 +78,10 @@ static void split_print_usage(const char * executable) {
     printf("  --split-max-tensors     max tensors in each split (default: %d)\n", default_params.n_split_tensors);
     printf("  --split-max-size N(M|G) max size per split\n");
     printf("  --dry-run               only print out a split plan and exit, without writing any new files\n");
+    printf("  --checksums             store the CRC-32C of each tensor in the output (the checksums of the input are kept otherwise)\n");
+    printf("  --verify                check the tensor data of GGUF_IN and its splits against the stored checksums\n");
+    printf("  --model-key KEY         key of an encrypted model for --verify\n");
+    printf("  --threads N             number of files written concurrently (default: %d)\n", default_params.n_threads);
     printf("\n");
 }
 
@@ -100,6 +132,26 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
             arg_found = true;
             params.dry_run = true;
         }
+        if (arg == "--checksums") {
+            arg_found = true;
+            params.checksums = true;
+        }
+        if (arg == "--model-key") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            params.model_key = argv[arg_idx];
+        }
+        if (arg == "--threads") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            params.n_threads = std::max(1, std::stoi(argv[arg_idx]));
+        }
 
         if (is_op_set) {
             throw std::invalid_argument("error: either --split or --merge can be specified, but not both");
@@ -114,6 +166,11 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
             is_op_set = true;
             params.operation = SPLIT_OP_SPLIT;
         }
+        if (arg == "--verify") {
+            arg_found = true;
+            is_op_set = true;
+            params.operation = SPLIT_OP_VERIFY;
+        }
 
         if (is_mode_set) {
             throw std::invalid_argument("error: either --split-max-tensors or --split-max-size can be specified, but not both");
@@ -146,6 +203,14 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
         throw std::invalid_argument("error: invalid parameter for argument: " + arg);
     }
 
+    if (params.operation == SPLIT_OP_VERIFY) {
+        if (argc - arg_idx < 1) {
+            throw std::invalid_argument("error: bad arguments");
+        }
+        params.input = argv[arg_idx++];
+        return;
+    }
+
     if (argc - arg_idx < 2) {
         throw std::invalid_argument("error: bad arguments");
     }
@@ -167,16 +232,349 @@ static bool split_params_parse(int argc, const char ** argv, split_params & para
     return result;
 }
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+// a file that is read or written with positional I/O, each thread opens its own
+struct split_file {
+    std::string path;
+    int fd = -1;
+
+    split_file(const std::string & path, bool write, bool truncate = false) : path(path) {
+#if defined(_WIN32)
+        const int flags = write ? (_O_WRONLY | _O_CREAT | (truncate ? _O_TRUNC : 0)) : _O_RDONLY;
+        fd = _open(path.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        const int flags = write ? (O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0)) : O_RDONLY;
+        fd = open(path.c_str(), flags, 0644);
+#endif
+        if (fd < 0) {
+            throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+        }
+    }
+
+    split_file(const split_file &) = delete;
+
+    ~split_file() {
+#if defined(_WIN32)
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+
+    void read_at(void * buf, size_t n, size_t offs) const {
+        char * dst = (char *) buf;
+        while (n > 0) {
+#if defined(_WIN32)
+            _lseeki64(fd, (__int64) offs, SEEK_SET);
+            const int ret = _read(fd, dst, (unsigned) std::min<size_t>(n, 1u << 30));
+#else
+            const ssize_t ret = pread(fd, dst, n, (off_t) offs);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (ret < 0) {
+                throw std::runtime_error("read error in " + path + ": " + strerror(errno));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of " + path);
+            }
+            dst  += ret;
+            offs += ret;
+            n    -= ret;
+        }
+    }
+
+    void write_at(const void * buf, size_t n, size_t offs) const {
+        const char * src = (const char *) buf;
+        while (n > 0) {
+#if defined(_WIN32)
+            _lseeki64(fd, (__int64) offs, SEEK_SET);
+            const int ret = _write(fd, src, (unsigned) std::min<size_t>(n, 1u << 30));
+#else
+            const ssize_t ret = pwrite(fd, src, n, (off_t) offs);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (ret <= 0) {
+                throw std::runtime_error("write error in " + path + ": " + strerror(errno));
+            }
+            src  += ret;
+            offs += ret;
+            n    -= ret;
+        }
+    }
+
+    void truncate(size_t size) const {
+#if defined(_WIN32)
+        const int ret = _chsize_s(fd, (__int64) size);
+#else
+        const int ret = ftruncate(fd, (off_t) size);
+#endif
+        if (ret != 0) {
+            throw std::runtime_error("failed to resize " + path + ": " + strerror(errno));
+        }
+    }
+
+    // the data must be on disk before the part is recorded as done in the manifest
+    void sync() const {
+#if defined(_WIN32)
+        const int ret = _commit(fd);
+#else
+        const int ret = fsync(fd);
+#endif
+        if (ret != 0) {
+            throw std::runtime_error("failed to sync " + path + ": " + strerror(errno));
+        }
+    }
+};
+
+static size_t split_file_size(const std::string & path, int64_t * mtime = nullptr) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    if (mtime) {
+        *mtime = (int64_t) st.st_mtime;
+    }
+    return (size_t) st.st_size;
+}
+
+// copies n bytes from one file to another, in the kernel with copy_file_range or sendfile where possible
+// the data goes through buf if its checksum is needed or if the kernel cannot copy between the files
+static void split_copy(const split_file & in, size_t in_offs, const split_file & out, size_t out_offs, size_t n,
+        std::vector<uint8_t> & buf, uint32_t * crc) {
+#if defined(__linux__)
+    if (crc == nullptr) {
+        loff_t off_in  = in_offs;
+        loff_t off_out = out_offs;
+#if defined(SPLIT_USE_COPY_FILE_RANGE)
+        while (n > 0) {
+            const ssize_t ret = copy_file_range(in.fd, &off_in, out.fd, &off_out, n, 0);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                // not supported between these files (e.g. EXDEV on old kernels), try the next method
+                break;
+            }
+            n -= ret;
+        }
+#endif
+        if (n > 0 && lseek(out.fd, off_out, SEEK_SET) == off_out) {
+            while (n > 0) {
+                const ssize_t ret = sendfile(out.fd, in.fd, &off_in, std::min<size_t>(n, 1u << 30));
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    break;
+                }
+                off_out += ret;
+                n       -= ret;
+            }
+        }
+        in_offs  = off_in;
+        out_offs = off_out;
+    }
+#endif
+    if (n > 0 && buf.empty()) {
+        buf.resize(8*1024*1024);
+    }
+    while (n > 0) {
+        const size_t size = std::min(n, buf.size());
+        in.read_at(buf.data(), size, in_offs);
+        if (crc) {
+            *crc = llama_crc32c(*crc, buf.data(), size);
+        }
+        out.write_at(buf.data(), size, out_offs);
+        in_offs  += size;
+        out_offs += size;
+        n        -= size;
+    }
+}
+
+static void split_write_padding(const split_file & out, size_t offs, size_t n_bytes) {
+    static const char zeros[GGUF_DEFAULT_ALIGNMENT] = {0};
+    const size_t n_pad = GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes;
+    if (n_pad > 0) {
+        out.write_at(zeros, n_pad, offs + n_bytes);
+    }
+}
+
+// runs part(i) for i in [0, n_parts) on up to n_threads threads, returns the first error or an empty string
+static std::string split_run_parallel(int n_parts, int n_threads, const std::function<void(int)> & part) {
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    std::string error;
+
+    auto worker = [&]() {
+        while (true) {
+            const int i = next++;
+            if (i >= n_parts) {
+                break;
+            }
+            try {
+                part(i);
+            } catch (const std::exception & err) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) {
+                    error = err.what();
+                }
+                next = n_parts;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < std::min(n_threads, n_parts); ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return error;
+}
+
+// records the parts of a split or merge that are written, so that an interrupted run can be resumed
+// the plan identifies the inputs and the layout of the outputs, the manifest of a different plan is discarded
+//
+//   gguf-split manifest 1
+//   plan <plan>
+//   done <part> [<crc32c of each tensor of the part> ...]
+//
+struct split_manifest {
+    std::string path;
+    std::string plan;
+    std::map<int, std::vector<uint32_t>> done;
+
+    FILE * fp = nullptr;
+    std::mutex mutex;
+
+    split_manifest(const std::string & path, const std::string & plan) : path(path), plan(plan) {
+        std::ifstream fin(path);
+        std::string line;
+        if (std::getline(fin, line) && line == "gguf-split manifest 1" && std::getline(fin, line) && line == "plan " + plan) {
+            while (std::getline(fin, line)) {
+                std::istringstream ss(line);
+                std::string tag;
+                int part;
+                if (!(ss >> tag >> part) || tag != "done") {
+                    break;
+                }
+                std::vector<uint32_t> crcs;
+                std::string crc;
+                while (ss >> crc) {
+                    crcs.push_back((uint32_t) std::stoul(crc, nullptr, 16));
+                }
+                done[part] = crcs;
+            }
+        }
+        fin.close();
+
+        // the parts that are done are written again, a partial line at the end is dropped
+        rewrite();
+    }
+
+    ~split_manifest() {
+        if (fp) {
+            fclose(fp);
+        }
+    }
+
+    void rewrite() {
+        if (fp) {
+            fclose(fp);
+        }
+        fp = fopen(path.c_str(), "w");
+        if (!fp) {
+            throw std::runtime_error("failed to create " + path + ": " + strerror(errno));
+        }
+        fprintf(fp, "gguf-split manifest 1\nplan %s\n", plan.c_str());
+        for (const auto & it : done) {
+            write_part(it.first, it.second);
+        }
+        fflush(fp);
+    }
+
+    // the outputs of the parts that are done are gone, start over
+    void clear() {
+        done.clear();
+        rewrite();
+    }
+
+    void write_part(int part, const std::vector<uint32_t> & crcs) {
+        fprintf(fp, "done %d", part);
+        for (uint32_t crc : crcs) {
+            fprintf(fp, " %08x", crc);
+        }
+        fprintf(fp, "\n");
+    }
+
+    void mark_done(int part, const std::vector<uint32_t> & crcs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        write_part(part, crcs);
+        fflush(fp);
+#if !defined(_WIN32)
+        fsync(fileno(fp));
+#endif
+    }
+
+    // the run is complete
+    void remove() {
+        fclose(fp);
+        fp = nullptr;
+        std::remove(path.c_str());
+    }
+};
+
+// identifies a run: the operation, the size and modification time of the inputs and the meta data of the outputs
+static std::string split_plan(const char * op, const std::vector<std::string> & inputs, const std::vector<struct gguf_context *> & ctx_outs, bool checksums) {
+    std::string desc = std::string(op) + (checksums ? " checksums" : "");
+    for (const auto & input : inputs) {
+        int64_t mtime = 0;
+        const size_t size = split_file_size(input, &mtime);
+        desc += " " + input + " " + std::to_string(size) + " " + std::to_string(mtime);
+    }
+
+    uint32_t crc = llama_crc32c(0, desc.data(), desc.size());
+    for (auto * ctx_out : ctx_outs) {
+        std::vector<uint8_t> meta(gguf_get_meta_size(ctx_out));
+        gguf_get_meta_data(ctx_out, meta.data());
+        crc = llama_crc32c(crc, meta.data(), meta.size());
+    }
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08x", crc);
+    return buf;
+}
+
+static double split_mib_per_s(size_t n_bytes, int64_t t_us) {
+    return n_bytes/1024.0/1024.0/std::max(1e-6, t_us/1e6);
+}
+
+// the stored checksums of the tensors of ctx_gguf, nullptr if the file has none
+static const uint32_t * split_get_checksums(const struct gguf_context * ctx_gguf) {
+    const int kid = gguf_find_key(ctx_gguf, KV_TENSOR_CRC32C);
+    if (kid < 0 || gguf_get_kv_type(ctx_gguf, kid) != GGUF_TYPE_ARRAY || gguf_get_arr_type(ctx_gguf, kid) != GGUF_TYPE_UINT32 ||
+        gguf_get_arr_n(ctx_gguf, kid) != gguf_get_n_tensors(ctx_gguf)) {
+        return nullptr;
+    }
+    return (const uint32_t *) gguf_get_arr_data(ctx_gguf, kid);
+}
+
+static void split_check_encryption(const split_params & params, const struct gguf_context * ctx_gguf) {
+    if (params.checksums && gguf_find_key(ctx_gguf, KV_ENCRYPTION) >= 0) {
+        // the checksums are of the decrypted data
+        fprintf(stderr, "error: cannot compute the checksums of an encrypted model, add them before encrypting it\n");
+        exit(EXIT_FAILURE);
     }
 }
 
 struct split_strategy {
     const split_params params;
-    std::ifstream & f_input;
     struct gguf_context * ctx_gguf;
     struct ggml_context * ctx_meta = NULL;
     const int n_tensors;
@@ -184,15 +582,10 @@ struct split_strategy {
     // one ctx_out per one output file
     std::vector<struct gguf_context *> ctx_outs;
 
-    // temporary buffer for reading in tensor data
-    std::vector<uint8_t> read_buf;
-
     split_strategy(const split_params & params,
-            std::ifstream & f_input,
             struct gguf_context * ctx_gguf,
             struct ggml_context * ctx_meta) :
         params(params),
-        f_input(f_input),
         ctx_gguf(ctx_gguf),
         ctx_meta(ctx_meta),
         n_tensors(gguf_get_n_tensors(ctx_gguf)) {
@@ -245,6 +638,20 @@ struct split_strategy {
         for (auto & ctx : ctx_outs) {
             gguf_set_val_u16(ctx, LLM_KV_SPLIT_COUNT, ctx_outs.size());
         }
+
+        // each split has the checksums of its own tensors, computed while writing or taken from the input
+        const uint32_t * crcs_in = split_get_checksums(ctx_gguf);
+        for (auto & ctx : ctx_outs) {
+            if (!params.checksums && !crcs_in) {
+                gguf_remove_key(ctx, KV_TENSOR_CRC32C);
+                continue;
+            }
+            std::vector<uint32_t> crcs(gguf_get_n_tensors(ctx), 0);
+            for (size_t i = 0; i < crcs.size() && crcs_in; ++i) {
+                crcs[i] = crcs_in[gguf_find_tensor(ctx_gguf, gguf_get_tensor_name(ctx, i))];
+            }
+            gguf_set_arr_data(ctx, KV_TENSOR_CRC32C, GGUF_TYPE_UINT32, crcs.data(), crcs.size());
+        }
     }
 
     ~split_strategy() {
@@ -279,57 +686,105 @@ struct split_strategy {
         }
     }
 
+    // the size of a split file: the metadata and the padded tensor data
+    size_t split_size(struct gguf_context * ctx_out) const {
+        size_t size = gguf_get_meta_size(ctx_out);
+        for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
+            struct ggml_tensor * t = ggml_get_tensor(ctx_meta, gguf_get_tensor_name(ctx_out, i));
+            size += GGML_PAD(ggml_nbytes(t), GGUF_DEFAULT_ALIGNMENT);
+        }
+        return size;
+    }
+
+    // writes one split file, returns the number of bytes of tensor data copied
+    size_t write_split(struct gguf_context * ctx_out, const char * split_path) {
+        split_file f_input(params.input, false);
+        split_file fout(split_path, true, /*truncate*/ true);
+
+        // write metadata
+        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+        gguf_get_meta_data(ctx_out, data.data());
+        fout.write_at(data.data(), data.size(), 0);
+
+        // write tensors
+        std::vector<uint8_t> buf;
+        std::vector<uint32_t> crcs(gguf_get_n_tensors(ctx_out), 0);
+        size_t offs     = data.size();
+        size_t n_copied = 0;
+        for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
+            // read tensor meta
+            const char * t_name = gguf_get_tensor_name(ctx_out, i);
+            struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
+            auto n_bytes = ggml_nbytes(t);
+
+            // calculate offset
+            auto i_tensor_in = gguf_find_tensor(ctx_gguf, t_name); // idx of tensor in the input file
+            auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
+
+            // copy tensor from input to output file
+            split_copy(f_input, offset, fout, offs, n_bytes, buf, params.checksums ? &crcs[i] : nullptr);
+            split_write_padding(fout, offs, n_bytes);
+
+            offs     += GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT);
+            n_copied += n_bytes;
+        }
+
+        if (params.checksums) {
+            // write the metadata again with the checksums
+            gguf_set_arr_data(ctx_out, KV_TENSOR_CRC32C, GGUF_TYPE_UINT32, crcs.data(), crcs.size());
+            gguf_get_meta_data(ctx_out, data.data());
+            fout.write_at(data.data(), data.size(), 0);
+        }
+
+        fout.sync();
+
+        return n_copied;
+    }
+
+    // writes the split files on params.n_threads threads, the files that were written by an interrupted run are kept
     void write() {
-        int i_split = 0;
-        int n_split = ctx_outs.size();
-        for (auto & ctx_out : ctx_outs) {
+        const int n_split = ctx_outs.size();
+
+        split_manifest manifest(params.output + ".manifest", split_plan("split", { params.input }, ctx_outs, params.checksums));
+
+        const int64_t t_start_us = llama_time_us();
+        std::atomic<size_t> n_written(0);
+        std::mutex mutex_print;
+
+        const std::string error = split_run_parallel(n_split, params.n_threads, [&](int i_split) {
             // construct file path
             char split_path[PATH_MAX] = {0};
             llama_split_path(split_path, sizeof(split_path), params.output.c_str(), i_split, n_split);
 
-            // open the output file
-            printf("Writing file %s ... ", split_path);
-            fflush(stdout);
-            std::ofstream fout = std::ofstream(split_path, std::ios::binary);
-            fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+            if (manifest.done.count(i_split) && split_file_size(split_path) == split_size(ctx_outs[i_split])) {
+                std::lock_guard<std::mutex> lock(mutex_print);
+                printf("Writing file %s ... done in a previous run\n", split_path);
+                return;
+            }
 
-            // write metadata
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-            gguf_get_meta_data(ctx_out, data.data());
-            fout.write((const char *)data.data(), data.size());
+            const int64_t t_split_us = llama_time_us();
+            const size_t n_bytes = write_split(ctx_outs[i_split], split_path);
+            manifest.mark_done(i_split, {});
+            n_written += n_bytes;
 
-            // write tensors
-            for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
-                // read tensor meta and prepare buffer
-                const char * t_name = gguf_get_tensor_name(ctx_out, i);
-                struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
-                auto n_bytes = ggml_nbytes(t);
-                read_buf.resize(n_bytes);
-
-                // calculate offset
-                auto i_tensor_in = gguf_find_tensor(ctx_gguf, t_name); // idx of tensor in the input file
-                auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
-
-                // copy tensor from input to output file
-                copy_file_to_file(f_input, fout, offset, n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
-            }
+            std::lock_guard<std::mutex> lock(mutex_print);
+            const int64_t t_us = llama_time_us() - t_split_us;
+            printf("Writing file %s ... done, %.2f MiB in %.2f s (%.2f MiB/s)\n", split_path,
+                    n_bytes/1024.0/1024.0, t_us/1e6, split_mib_per_s(n_bytes, t_us));
+            fflush(stdout);
+        });
 
-            printf("done\n");
-            // close the file
-            fout.close();
-            i_split++;
+        if (!error.empty()) {
+            fprintf(stderr, "error: %s\n", error.c_str());
+            fprintf(stderr, "run the same command again to resume from %s\n", manifest.path.c_str());
+            exit(EXIT_FAILURE);
         }
-    }
 
-    void copy_file_to_file(std::ifstream & f_in, std::ofstream & f_out, const size_t in_offset, const size_t len) {
-        // TODO: detect OS and use copy_file_range() here for better performance
-        if (read_buf.size() < len) {
-            read_buf.resize(len);
-        }
-        f_in.seekg(in_offset);
-        f_in.read((char *)read_buf.data(), len);
-        f_out.write((const char *)read_buf.data(), len);
+        manifest.remove();
+
+        const int64_t t_us = llama_time_us() - t_start_us;
+        printf("wrote %.2f MiB of tensor data in %.2f s (%.2f MiB/s) with %d threads\n",
+                n_written/1024.0/1024.0, t_us/1e6, split_mib_per_s(n_written, t_us), std::min(params.n_threads, n_split));
     }
 };
 
@@ -341,20 +796,16 @@ static void gguf_split(const split_params & split_params) {
         /*.ctx      = */ &ctx_meta,
     };
 
-    std::ifstream f_input(split_params.input.c_str(), std::ios::binary);
-    if (!f_input.is_open()) {
-        fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_params.input.c_str());
-        exit(EXIT_FAILURE);
-    }
-
     auto * ctx_gguf = gguf_init_from_file(split_params.input.c_str(), params);
     if (!ctx_gguf) {
         fprintf(stderr, "%s:  failed to load input GGUF from %s\n", __func__, split_params.input.c_str());
         exit(EXIT_FAILURE);
     }
 
+    split_check_encryption(split_params, ctx_gguf);
+
     // prepare the strategy
-    split_strategy strategy(split_params, f_input, ctx_gguf, ctx_meta);
+    split_strategy strategy(split_params, ctx_gguf, ctx_meta);
     int n_split = strategy.ctx_outs.size();
     strategy.print_info();
 
@@ -365,7 +816,6 @@ static void gguf_split(const split_params & split_params) {
 
     // done, clean up
     gguf_free(ctx_gguf);
-    f_input.close();
 
     fprintf(stderr, "%s: %d gguf split written with a total of %d tensors.\n",
             __func__, n_split, strategy.n_tensors);
@@ -379,13 +829,14 @@ static void gguf_merge(const split_params & split_params) {
     int total_tensors = 0;
 
     auto * ctx_out = gguf_init_empty();
-    std::ofstream fout(split_params.output.c_str(), std::ios::binary);
-    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
 
-    std::vector<uint8_t> read_data;
     std::vector<ggml_context *> ctx_metas;
     std::vector<gguf_context *> ctx_ggufs;
 
+    // the checksums of the merged tensors, the checksums of the splits are kept if all of them have some
+    std::vector<uint32_t> crcs;
+    bool has_crcs = true;
+
     char split_path[PATH_MAX] = {0};
     strncpy(split_path, split_params.input.c_str(), sizeof(split_path) - 1);
     char split_prefix[PATH_MAX] = {0};
@@ -422,7 +873,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -435,7 +885,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -448,7 +897,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -459,81 +907,178 @@ static void gguf_merge(const split_params & split_params) {
             gguf_set_kv(ctx_out, ctx_gguf);
         }
 
+        split_check_encryption(split_params, ctx_gguf);
+
+        const uint32_t * crcs_in = split_get_checksums(ctx_gguf);
+        has_crcs = has_crcs && crcs_in;
+
         auto n_tensors = gguf_get_n_tensors(ctx_gguf);
         for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
             const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
             struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
             gguf_add_tensor(ctx_out, t);
+            crcs.push_back(crcs_in ? crcs_in[i_tensor] : 0);
         }
         total_tensors += n_tensors;
 
         fprintf(stderr, "\033[3Ddone\n");
     }
 
-    // placeholder for the meta data
-    {
-        auto meta_size = gguf_get_meta_size(ctx_out);
-        ::zeros(fout, meta_size);
+    if (split_params.checksums || has_crcs) {
+        gguf_set_arr_data(ctx_out, KV_TENSOR_CRC32C, GGUF_TYPE_UINT32, crcs.data(), crcs.size());
+    } else {
+        gguf_remove_key(ctx_out, KV_TENSOR_CRC32C);
     }
 
-    // Write tensors data
-    for (int i_split = 0; i_split < n_split; i_split++) {
+    // the tensors of each split go to known offsets in the output, so the splits are copied concurrently
+    const size_t meta_size = gguf_get_meta_size(ctx_out);
+
+    std::vector<std::string> inputs;
+    std::vector<int> first_tensor_out; // index in the output of the first tensor of each split
+    std::vector<size_t> split_end;     // offset in the output of the end of the data of each split
+    size_t total_size = meta_size;
+    for (int i_split = 0, i_tensor_out = 0; i_split < n_split; i_split++) {
         llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
-        std::ifstream f_input(split_path, std::ios::binary);
-        if (!f_input.is_open()) {
-            fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_path);
-            for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
-                gguf_free(ctx_ggufs[i]);
-                ggml_free(ctx_metas[i]);
-            }
-            gguf_free(ctx_out);
-            fout.close();
-            exit(EXIT_FAILURE);
+        inputs.push_back(split_path);
+        first_tensor_out.push_back(i_tensor_out);
+        for (int i_tensor = 0; i_tensor < gguf_get_n_tensors(ctx_ggufs[i_split]); i_tensor++, i_tensor_out++) {
+            struct ggml_tensor * t = ggml_get_tensor(ctx_metas[i_split], gguf_get_tensor_name(ctx_ggufs[i_split], i_tensor));
+            total_size += GGML_PAD(ggml_nbytes(t), GGUF_DEFAULT_ALIGNMENT);
         }
-        fprintf(stderr, "%s: writing tensors %s ...", __func__, split_path);
+        split_end.push_back(total_size);
+    }
+
+    split_manifest manifest(split_params.output + ".manifest", split_plan("merge", inputs, { ctx_out }, split_params.checksums));
+
+    // the data of the splits that are done must still be in the output, a missing or shorter output
+    // (deleted or replaced since the interrupted run) would leave holes in the merged model
+    size_t done_end = 0;
+    for (const auto & it : manifest.done) {
+        if (it.first >= 0 && it.first < n_split) {
+            done_end = std::max(done_end, split_end[it.first]);
+        }
+    }
+    if (!manifest.done.empty() && split_file_size(split_params.output) < done_end) {
+        fprintf(stderr, "%s: %s is missing or shorter than in the interrupted run, merging all splits again\n", __func__, split_params.output.c_str());
+        manifest.clear();
+    }
+
+    if (manifest.done.empty()) {
+        // start from an empty file, a resumed run keeps the data of the splits that are done
+        split_file fout(split_params.output, true, /*truncate*/ true);
+    }
+
+    const int64_t t_start_us = llama_time_us();
+    std::atomic<size_t> n_written(0);
+    std::mutex mutex_print;
 
+    // Write tensors data
+    const std::string error = split_run_parallel(n_split, split_params.n_threads, [&](int i_split) {
         auto * ctx_gguf = ctx_ggufs[i_split];
         auto * ctx_meta = ctx_metas[i_split];
 
         auto n_tensors = gguf_get_n_tensors(ctx_gguf);
+
+        const auto it = manifest.done.find(i_split);
+        if (it != manifest.done.end() && (int) it->second.size() == n_tensors) {
+            std::copy(it->second.begin(), it->second.end(), crcs.begin() + first_tensor_out[i_split]);
+
+            std::lock_guard<std::mutex> lock(mutex_print);
+            fprintf(stderr, "gguf_merge: writing tensors %s ... done in a previous run\n", inputs[i_split].c_str());
+            return;
+        }
+
+        const int64_t t_split_us = llama_time_us();
+
+        split_file f_input(inputs[i_split], false);
+        split_file fout(split_params.output, true);
+
+        std::vector<uint8_t> buf;
+        size_t n_copied = 0;
         for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
             const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
             struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
 
             auto n_bytes = ggml_nbytes(t);
 
-            if (read_data.size() < n_bytes) {
-                read_data.resize(n_bytes);
-            }
-
-            auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
-            f_input.seekg(offset);
-            f_input.read((char *)read_data.data(), n_bytes);
+            const int  i_tensor_out = first_tensor_out[i_split] + i_tensor;
+            auto offset     = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
+            auto offset_out = meta_size + gguf_get_tensor_offset(ctx_out, i_tensor_out);
 
             // write tensor data + padding
-            fout.write((const char *)read_data.data(), n_bytes);
-            zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+            if (split_params.checksums) {
+                crcs[i_tensor_out] = 0;
+            }
+            split_copy(f_input, offset, fout, offset_out, n_bytes, buf, split_params.checksums ? &crcs[i_tensor_out] : nullptr);
+            split_write_padding(fout, offset_out, n_bytes);
+
+            n_copied += n_bytes;
         }
 
-        gguf_free(ctx_gguf);
-        ggml_free(ctx_meta);
-        f_input.close();
-        fprintf(stderr, "\033[3Ddone\n");
+        fout.sync();
+        manifest.mark_done(i_split, std::vector<uint32_t>(crcs.begin() + first_tensor_out[i_split], crcs.begin() + first_tensor_out[i_split] + n_tensors));
+        n_written += n_copied;
+
+        std::lock_guard<std::mutex> lock(mutex_print);
+        const int64_t t_us = llama_time_us() - t_split_us;
+        fprintf(stderr, "gguf_merge: writing tensors %s ... done, %.2f MiB in %.2f s (%.2f MiB/s)\n", inputs[i_split].c_str(),
+                n_copied/1024.0/1024.0, t_us/1e6, split_mib_per_s(n_copied, t_us));
+    });
+
+    for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
+        gguf_free(ctx_ggufs[i]);
+        ggml_free(ctx_metas[i]);
     }
 
-    {
-        // go back to beginning of file and write the updated metadata
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+    if (!error.empty()) {
+        fprintf(stderr, "%s: error: %s\n", __func__, error.c_str());
+        fprintf(stderr, "%s: run the same command again to resume from %s\n", __func__, manifest.path.c_str());
+        gguf_free(ctx_out);
+        exit(EXIT_FAILURE);
+    }
+
+    try {
+        // write the metadata, with the checksums of the tensors
+        if (split_params.checksums || has_crcs) {
+            gguf_set_arr_data(ctx_out, KV_TENSOR_CRC32C, GGUF_TYPE_UINT32, crcs.data(), crcs.size());
+        }
+        std::vector<uint8_t> data(meta_size);
         gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *)data.data(), data.size());
 
-        fout.close();
+        split_file fout(split_params.output, true);
+        fout.write_at(data.data(), data.size(), 0);
+        fout.truncate(total_size);
+        fout.sync();
+    } catch (const std::exception & err) {
+        fprintf(stderr, "%s: error: %s\n", __func__, err.what());
         gguf_free(ctx_out);
+        exit(EXIT_FAILURE);
+    }
+
+    manifest.remove();
+    gguf_free(ctx_out);
+
+    const int64_t t_us = llama_time_us() - t_start_us;
+    fprintf(stderr, "%s: %s merged from %d split with %d tensors, %.2f MiB of tensor data in %.2f s (%.2f MiB/s) with %d threads.\n",
+            __func__, split_params.output.c_str(), n_split, total_tensors,
+            n_written/1024.0/1024.0, t_us/1e6, split_mib_per_s(n_written, t_us), std::min(split_params.n_threads, n_split));
+}
+
+static void gguf_verify(const split_params & split_params) {
+    llama_model_params mparams = llama_model_default_params();
+    mparams.encryption_key = split_params.model_key.c_str();
+
+    const int32_t n_failed = llama_model_verify(split_params.input.c_str(), mparams);
+    if (n_failed < 0) {
+        fprintf(stderr, "%s: failed to verify %s\n", __func__, split_params.input.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (n_failed > 0) {
+        fprintf(stderr, "%s: %s has %d corrupted tensor(s)\n", __func__, split_params.input.c_str(), n_failed);
+        exit(EXIT_FAILURE);
     }
 
-    fprintf(stderr, "%s: %s merged from %d split with %d tensors.\n",
-            __func__, split_params.output.c_str(), n_split, total_tensors);
+    fprintf(stderr, "%s: %s: all tensor checksums match\n", __func__, split_params.input.c_str());
 }
 
 int main(int argc, const char ** argv) {
@@ -545,6 +1090,8 @@ int main(int argc, const char ** argv) {
             break;
         case SPLIT_OP_MERGE: gguf_merge(params);
             break;
+        case SPLIT_OP_VERIFY: gguf_verify(params);
+            break;
         default: split_print_usage(argv[0]);
             exit(EXIT_FAILURE);
     }
@@ -85,5 +85,17 @@ $MAIN --model $WORK_PATH/ggml-model-split-2G-00001-of-00002.gguf --random-prompt
 echo PASS
 echo
 
+# 7. Split with checksums
+$SPLIT --checksums --split-max-tensors 28 $WORK_PATH/ggml-model-merge.gguf $WORK_PATH/ggml-model-split-crc
+echo PASS
+echo
+
+# 7b. Verify the checksums of the sharded model, then merge it and verify the merged model
+$SPLIT --verify $WORK_PATH/ggml-model-split-crc-00001-of-00006.gguf
+$SPLIT --merge $WORK_PATH/ggml-model-split-crc-00001-of-00006.gguf $WORK_PATH/ggml-model-merge-crc.gguf
+$SPLIT --verify $WORK_PATH/ggml-model-merge-crc.gguf
+echo PASS
+echo
+
 # Clean up
 rm -f $WORK_PATH/ggml-model-split*.gguf $WORK_PATH/ggml-model-merge*.gguf
@@ -9,6 +9,7 @@
 #include <cstring>
 #include <ctime>
 #include <cstdlib>
+#include <fstream>
 #include <iterator>
 #include <map>
 #include <numeric>
@@ -152,6 +153,16 @@ static const char * output_format_str(output_formats format) {
     }
 }
 
+static const char * numa_str(ggml_numa_strategy numa) {
+    switch (numa) {
+        case GGML_NUMA_STRATEGY_DISABLED:   return "none";
+        case GGML_NUMA_STRATEGY_DISTRIBUTE: return "distribute";
+        case GGML_NUMA_STRATEGY_ISOLATE:    return "isolate";
+        case GGML_NUMA_STRATEGY_NUMACTL:    return "numactl";
+        default: GGML_ASSERT(!"invalid numa strategy");
+    }
+}
+
 static const char * split_mode_str(llama_split_mode mode) {
     switch (mode) {
         case LLAMA_SPLIT_MODE_NONE:  return "none";
@@ -174,9 +185,13 @@ struct cmd_params {
     std::vector<llama_split_mode> split_mode;
     std::vector<int> main_gpu;
     std::vector<bool> no_kv_offload;
+    std::vector<bool> flash_attn;
     std::vector<std::vector<float>> tensor_split;
     std::vector<bool> use_mmap;
     std::vector<bool> embeddings;
+    std::string ppl_file;
+    int ppl_chunks;
+    ggml_numa_strategy numa;
     int reps;
     bool verbose;
     output_formats output_format;
@@ -195,9 +210,13 @@ static const cmd_params cmd_params_defaults = {
     /* split_mode    */ {LLAMA_SPLIT_MODE_LAYER},
     /* main_gpu      */ {0},
     /* no_kv_offload */ {false},
+    /* flash_attn    */ {false},
     /* tensor_split  */ {std::vector<float>(llama_max_devices(), 0.0f)},
     /* use_mmap      */ {true},
     /* embeddings    */ {false},
+    /* ppl_file      */ "",
+    /* ppl_chunks    */ 4,
+    /* numa          */ GGML_NUMA_STRATEGY_DISABLED,
     /* reps          */ 5,
     /* verbose       */ false,
     /* output_format */ MARKDOWN
@@ -220,9 +239,13 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -sm, --split-mode <none|layer|row>  (default: %s)\n", join(transform_to_str(cmd_params_defaults.split_mode, split_mode_str), ",").c_str());
     printf("  -mg, --main-gpu <i>                 (default: %s)\n", join(cmd_params_defaults.main_gpu, ",").c_str());
     printf("  -nkvo, --no-kv-offload <0|1>        (default: %s)\n", join(cmd_params_defaults.no_kv_offload, ",").c_str());
+    printf("  -fa, --flash-attn <0|1>             (default: %s)\n", join(cmd_params_defaults.flash_attn, ",").c_str());
     printf("  -mmp, --mmap <0|1>                  (default: %s)\n", join(cmd_params_defaults.use_mmap, ",").c_str());
     printf("  -embd, --embeddings <0|1>           (default: %s)\n", join(cmd_params_defaults.embeddings, ",").c_str());
     printf("  -ts, --tensor-split <ts0/ts1/..>    (default: 0)\n");
+    printf("  -pf, --ppl-file <filename>          text file to also measure the perplexity of each test on (default: none)\n");
+    printf("  --ppl-chunks <n>                    number of chunks of the test context size to evaluate (default: %d)\n", cmd_params_defaults.ppl_chunks);
+    printf("  --numa <distribute|isolate|numactl> NUMA optimizations, see main (default: %s)\n", numa_str(cmd_params_defaults.numa));
     printf("  -r, --repetitions <n>               (default: %d)\n", cmd_params_defaults.reps);
     printf("  -o, --output <csv|json|md|sql>      (default: %s)\n", output_format_str(cmd_params_defaults.output_format));
     printf("  -v, --verbose                       (default: %s)\n", cmd_params_defaults.verbose ? "1" : "0");
@@ -267,6 +290,9 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.verbose = cmd_params_defaults.verbose;
     params.output_format = cmd_params_defaults.output_format;
     params.reps = cmd_params_defaults.reps;
+    params.ppl_file = cmd_params_defaults.ppl_file;
+    params.ppl_chunks = cmd_params_defaults.ppl_chunks;
+    params.numa = cmd_params_defaults.numa;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -393,6 +419,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
             auto p = split<bool>(argv[i], split_delim);
             params.no_kv_offload.insert(params.no_kv_offload.end(), p.begin(), p.end());
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split<bool>(argv[i], split_delim);
+            params.flash_attn.insert(params.flash_attn.end(), p.begin(), p.end());
         } else if (arg == "-mmp" || arg == "--mmap") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -435,6 +468,28 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 break;
             }
             params.reps = std::stoi(argv[i]);
+        } else if (arg == "-pf" || arg == "--ppl-file") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.ppl_file = argv[i];
+        } else if (arg == "--ppl-chunks") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.ppl_chunks = std::stoi(argv[i]);
+        } else if (arg == "--numa") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "distribute") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
+            else if (value == "isolate")    { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
+            else if (value == "numactl")    { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else { invalid_param = true; break; }
         } else if (arg == "-o" || arg == "--output") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -477,6 +532,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.split_mode.empty())   { params.split_mode = cmd_params_defaults.split_mode; }
     if (params.main_gpu.empty())     { params.main_gpu = cmd_params_defaults.main_gpu; }
     if (params.no_kv_offload.empty()){ params.no_kv_offload = cmd_params_defaults.no_kv_offload; }
+    if (params.flash_attn.empty())   { params.flash_attn = cmd_params_defaults.flash_attn; }
     if (params.tensor_split.empty()) { params.tensor_split = cmd_params_defaults.tensor_split; }
     if (params.use_mmap.empty())     { params.use_mmap = cmd_params_defaults.use_mmap; }
     if (params.embeddings.empty())   { params.embeddings = cmd_params_defaults.embeddings; }
@@ -498,9 +554,11 @@ struct cmd_params_instance {
     llama_split_mode split_mode;
     int main_gpu;
     bool no_kv_offload;
+    bool flash_attn;
     std::vector<float> tensor_split;
     bool use_mmap;
     bool embeddings;
+    ggml_numa_strategy numa;
 
     llama_model_params to_llama_mparams() const {
         llama_model_params mparams = llama_model_default_params();
@@ -532,6 +590,7 @@ struct cmd_params_instance {
         cparams.type_k = type_k;
         cparams.type_v = type_v;
         cparams.offload_kqv = !no_kv_offload;
+        cparams.flash_attn = flash_attn;
         cparams.embeddings = embeddings;
 
         return cparams;
@@ -554,6 +613,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
     for (const auto & tk : params.type_k)
     for (const auto & tv : params.type_v)
     for (const auto & nkvo : params.no_kv_offload)
+    for (const auto & fa : params.flash_attn)
     for (const auto & nt : params.n_threads) {
         for (const auto & n_prompt : params.n_prompt) {
             if (n_prompt == 0) {
@@ -572,9 +632,11 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .split_mode   = */ sm,
                 /* .main_gpu     = */ mg,
                 /* .no_kv_offload= */ nkvo,
+                /* .flash_attn   = */ fa,
                 /* .tensor_split = */ ts,
                 /* .use_mmap     = */ mmp,
                 /* .embeddings   = */ embd,
+                /* .numa         = */ params.numa,
             };
             instances.push_back(instance);
         }
@@ -596,9 +658,11 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .split_mode   = */ sm,
                 /* .main_gpu     = */ mg,
                 /* .no_kv_offload= */ nkvo,
+                /* .flash_attn   = */ fa,
                 /* .tensor_split = */ ts,
                 /* .use_mmap     = */ mmp,
                 /* .embeddings   = */ embd,
+                /* .numa         = */ params.numa,
             };
             instances.push_back(instance);
         }
@@ -633,13 +697,16 @@ struct test {
     llama_split_mode split_mode;
     int main_gpu;
     bool no_kv_offload;
+    bool flash_attn;
     std::vector<float> tensor_split;
     bool use_mmap;
     bool embeddings;
+    ggml_numa_strategy numa;
     int n_prompt;
     int n_gen;
     std::string test_time;
     std::vector<uint64_t> samples_ns;
+    double ppl = 0.0;
 
     test(const cmd_params_instance & inst, const llama_model * lmodel, const llama_context * ctx) {
         model_filename = inst.model;
@@ -657,9 +724,11 @@ struct test {
         split_mode = inst.split_mode;
         main_gpu = inst.main_gpu;
         no_kv_offload = inst.no_kv_offload;
+        flash_attn = inst.flash_attn;
         tensor_split = inst.tensor_split;
         use_mmap = inst.use_mmap;
         embeddings = inst.embeddings;
+        numa = inst.numa;
         n_prompt = inst.n_prompt;
         n_gen = inst.n_gen;
         // RFC 3339 date-time format
@@ -731,11 +800,12 @@ struct test {
             "n_batch", "n_ubatch",
             "n_threads", "type_k", "type_v",
             "n_gpu_layers", "split_mode",
-            "main_gpu", "no_kv_offload",
-            "tensor_split", "use_mmap", "embeddings",
+            "main_gpu", "no_kv_offload", "flash_attn",
+            "tensor_split", "use_mmap", "embeddings", "numa",
             "n_prompt", "n_gen", "test_time",
             "avg_ns", "stddev_ns",
-            "avg_ts", "stddev_ts"
+            "avg_ts", "stddev_ts",
+            "ppl"
         };
         return fields;
     }
@@ -753,10 +823,10 @@ struct test {
         }
         if (field == "cuda" || field == "opencl"  || field == "vulkan" || field == "kompute" || field == "metal" ||
             field == "gpu_blas" || field == "blas" || field == "sycl" ||field == "f16_kv" || field == "no_kv_offload" ||
-            field == "use_mmap" || field == "embeddings") {
+            field == "flash_attn" || field == "use_mmap" || field == "embeddings") {
             return BOOL;
         }
-        if (field == "avg_ts" || field == "stddev_ts") {
+        if (field == "avg_ts" || field == "stddev_ts" || field == "ppl") {
             return FLOAT;
         }
         return STRING;
@@ -787,11 +857,12 @@ struct test {
             std::to_string(n_batch), std::to_string(n_ubatch),
             std::to_string(n_threads), ggml_type_name(type_k), ggml_type_name(type_v),
             std::to_string(n_gpu_layers), split_mode_str(split_mode),
-            std::to_string(main_gpu), std::to_string(no_kv_offload),
-            tensor_split_str, std::to_string(use_mmap), std::to_string(embeddings),
+            std::to_string(main_gpu), std::to_string(no_kv_offload), std::to_string(flash_attn),
+            tensor_split_str, std::to_string(use_mmap), std::to_string(embeddings), numa_str(numa),
             std::to_string(n_prompt), std::to_string(n_gen), test_time,
             std::to_string(avg_ns()), std::to_string(stdev_ns()),
-            std::to_string(avg_ts()), std::to_string(stdev_ts())
+            std::to_string(avg_ts()), std::to_string(stdev_ts()),
+            std::to_string(ppl)
         };
         return values;
     }
@@ -955,6 +1026,9 @@ struct markdown_printer : public printer {
         if (field == "no_kv_offload") {
             return "nkvo";
         }
+        if (field == "flash_attn") {
+            return "fa";
+        }
         if (field == "use_mmap") {
             return "mmap";
         }
@@ -1001,6 +1075,9 @@ struct markdown_printer : public printer {
         if (params.no_kv_offload.size() > 1 || params.no_kv_offload != cmd_params_defaults.no_kv_offload) {
             fields.emplace_back("no_kv_offload");
         }
+        if (params.flash_attn.size() > 1 || params.flash_attn != cmd_params_defaults.flash_attn) {
+            fields.emplace_back("flash_attn");
+        }
         if (params.tensor_split.size() > 1 || params.tensor_split != cmd_params_defaults.tensor_split) {
             fields.emplace_back("tensor_split");
         }
@@ -1010,8 +1087,14 @@ struct markdown_printer : public printer {
         if (params.embeddings.size() > 1 || params.embeddings != cmd_params_defaults.embeddings) {
             fields.emplace_back("embeddings");
         }
+        if (params.numa != cmd_params_defaults.numa) {
+            fields.emplace_back("numa");
+        }
         fields.emplace_back("test");
         fields.emplace_back("t/s");
+        if (!params.ppl_file.empty()) {
+            fields.emplace_back("ppl");
+        }
 
         fprintf(fout, "|");
         for (const auto & field : fields) {
@@ -1064,6 +1147,9 @@ struct markdown_printer : public printer {
             } else if (field == "t/s") {
                 snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ts(), t.stdev_ts());
                 value = buf;
+            } else if (field == "ppl") {
+                snprintf(buf, sizeof(buf), "%.4f", t.ppl);
+                value = buf;
             } else if (vmap.find(field) != vmap.end()) {
                 value = vmap.at(field);
             } else {
@@ -1162,6 +1248,75 @@ static void test_gen(llama_context * ctx, int n_gen, int n_past, int n_threads)
     }
 }
 
+// perplexity over the second half of up to n_chunks chunks of the context size, so that the KV cache types can be compared for quality as well
+static double test_ppl(llama_context * ctx, const std::vector<llama_token> & tokens, int n_chunks, int n_batch, int n_threads) {
+    llama_set_n_threads(ctx, n_threads, n_threads);
+
+    const llama_model * model = llama_get_model(ctx);
+    const int n_vocab = llama_n_vocab(model);
+    const int n_ctx   = llama_n_ctx(ctx);
+    const int first   = n_ctx/2;
+
+    n_batch = std::min(n_batch, n_ctx);
+    n_chunks = std::min(n_chunks, (int) tokens.size() / n_ctx);
+
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    double nll   = 0.0;
+    int    count = 0;
+
+    for (int i = 0; i < n_chunks; ++i) {
+        const int start = i*n_ctx;
+
+        llama_kv_cache_clear(ctx);
+
+        std::vector<float> logits;
+        logits.reserve((size_t) n_ctx*n_vocab);
+
+        for (int j = 0; j < n_ctx; j += n_batch) {
+            const int n_tokens = std::min(n_batch, n_ctx - j);
+
+            llama_batch_clear(batch);
+            for (int k = 0; k < n_tokens; ++k) {
+                llama_token token = tokens[start + j + k];
+                if (j + k == 0 && llama_add_bos_token(model)) {
+                    token = llama_token_bos(model);
+                }
+                llama_batch_add(batch, token, j + k, { 0 }, true);
+            }
+
+            if (llama_decode(ctx, batch)) {
+                fprintf(stderr, "%s: llama_decode() failed\n", __func__);
+                llama_batch_free(batch);
+                return 0.0;
+            }
+
+            const float * batch_logits = llama_get_logits(ctx);
+            logits.insert(logits.end(), batch_logits, batch_logits + (size_t) n_tokens*n_vocab);
+        }
+
+        for (int j = first; j < n_ctx - 1; ++j) {
+            const float * row = logits.data() + (size_t) j*n_vocab;
+
+            float max_logit = row[0];
+            for (int k = 1; k < n_vocab; ++k) {
+                max_logit = std::max(max_logit, row[k]);
+            }
+            double sum_exp = 0.0;
+            for (int k = 0; k < n_vocab; ++k) {
+                sum_exp += expf(row[k] - max_logit);
+            }
+
+            nll += std::log(sum_exp) - (row[tokens[start + j + 1]] - max_logit);
+            count++;
+        }
+    }
+
+    llama_batch_free(batch);
+
+    return count > 0 ? std::exp(nll/count) : 0.0;
+}
+
 static void llama_null_log_callback(enum ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) text;
@@ -1191,6 +1346,7 @@ int main(int argc, char ** argv) {
         llama_log_set(llama_null_log_callback, NULL);
     }
     llama_backend_init();
+    llama_numa_init(params.numa);
 
     // initialize printer
     std::unique_ptr<printer> p;
@@ -1216,6 +1372,16 @@ int main(int argc, char ** argv) {
 
     std::vector<cmd_params_instance> params_instances = get_cmd_params_instances(params);
 
+    std::string ppl_text;
+    if (!params.ppl_file.empty()) {
+        std::ifstream file(params.ppl_file);
+        if (!file) {
+            fprintf(stderr, "%s: error: failed to open file '%s'\n", __func__, params.ppl_file.c_str());
+            return 1;
+        }
+        std::copy(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), back_inserter(ppl_text));
+    }
+
     llama_model * lmodel = nullptr;
     const cmd_params_instance * prev_inst = nullptr;
 
@@ -1269,6 +1435,16 @@ int main(int argc, char ** argv) {
             t.samples_ns.push_back(t_ns);
         }
 
+        if (!ppl_text.empty()) {
+            const std::vector<llama_token> ppl_tokens = ::llama_tokenize(ctx, ppl_text, true);
+            if ((int) ppl_tokens.size() < (int) llama_n_ctx(ctx)) {
+                fprintf(stderr, "%s: warning: %s is too short for a context of %u tokens, skipping perplexity\n",
+                        __func__, params.ppl_file.c_str(), llama_n_ctx(ctx));
+            } else {
+                t.ppl = test_ppl(ctx, ppl_tokens, params.ppl_chunks, t.n_batch, t.n_threads);
+            }
+        }
+
         p->print_test(t);
 
         llama_print_timings(ctx);
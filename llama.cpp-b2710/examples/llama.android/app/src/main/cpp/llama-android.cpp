@@ -583,18 +583,9 @@ Java_com_example_llama_Llm_completion_1loop(
     static bool skip_next_token = false;
 
     // 先にトークン生成のロジックを実行
-    auto n_vocab = llama_n_vocab(model);
     auto *logits = llama_get_logits_ith(context, batch->n_tokens - 1);
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
-
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-
-    llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
-    const auto new_token_id = llama_sample_token_greedy(context, &candidates_p);
-    float token_score = candidates[new_token_id].logit;
+    const auto new_token_id = llama_sample_token_fused(context, logits, 0, 1.0f, 0.0f, 0.0f, 1);
+    float token_score = logits[new_token_id];
     const auto n_cur = env->CallIntMethod(intvar_ncur, la_int_var_value);
     const auto start_pos = n_cur - g_input_token_count;
 
@@ -691,13 +682,7 @@ Java_com_example_llama_Llm_completion_1loop(
         if (llama_decode(context, *batch) == 0) {
             auto *next_logits = llama_get_logits_ith(context, 0);
             if (next_logits != nullptr) {
-                std::vector<llama_token_data> next_candidates;
-                next_candidates.reserve(n_vocab);
-                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                    next_candidates.emplace_back(llama_token_data{token_id, next_logits[token_id], 0.0f});
-                }
-                llama_token_data_array next_candidates_p = {next_candidates.data(), next_candidates.size(), false};
-                const auto next_token_id = llama_sample_token_greedy(context, &next_candidates_p);
+                const auto next_token_id = llama_sample_token_fused(context, next_logits, 0, 1.0f, 0.0f, 0.0f, 1);
 
                 char next_piece[64] = {0};
                 int next_length = llama_token_to_piece(model, next_token_id, next_piece, sizeof(next_piece), true);
@@ -751,6 +736,65 @@ Java_com_example_llama_Llm_completion_1loop(
     return new_token;
 }
 
+// llama_tree_verifyのコールバック: completion_loopと同じ貪欲サンプリングで次のトークンを選ぶ
+static llama_token pick_greedy(llama_context *context, int32_t i, void * /*user_data*/) {
+    return llama_sample_token_fused(context, llama_get_logits_ith(context, i), 0, 1.0f, 0.0f, 0.0f, 1);
+}
+
+/**
+ * ドラフトトークンのツリーを1回のバッチで検証する (ツリー型投機的デコーディング)
+ *
+ * @param env JNI環境
+ * @param context_pointer LLAMAコンテキストのポインタ
+ * @param jtokens ツリーのトークン (先頭はルート = 最後に生成されKVキャッシュにまだないトークン)
+ * @param jparents 各トークンの親のインデックス (parents[i] < i、ルートの値は無視)
+ * @param n_past ルートの位置
+ * @return 受理されたパスの各トークンの次に選ばれたトークン (失敗時はnull)
+ *
+ * @note 受理されなかった分岐はKVキャッシュから一括で削除される
+ * @note 返り値の最後のトークンはKVキャッシュにまだなく、次のツリーのルートになる
+ */
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_example_llama_Llm_decode_1tree(
+        JNIEnv *env,
+        jobject /*unused*/,
+        jlong context_pointer,
+        jintArray jtokens,
+        jintArray jparents,
+        jint n_past
+) {
+    auto *const context = reinterpret_cast<llama_context *>(context_pointer);
+
+    const jsize n_tokens = env->GetArrayLength(jtokens);
+    if (n_tokens == 0 || env->GetArrayLength(jparents) != n_tokens) {
+        LOGe("decode_tree: tokens and parents must have the same non-zero length");
+        return nullptr;
+    }
+
+    std::vector<llama_token> tokens(n_tokens);
+    std::vector<int32_t> parents(n_tokens);
+    env->GetIntArrayRegion(jtokens, 0, n_tokens, reinterpret_cast<jint *>(tokens.data()));
+    env->GetIntArrayRegion(jparents, 0, n_tokens, reinterpret_cast<jint *>(parents.data()));
+
+    if (llama_decode_tree(context, tokens.data(), parents.data(), n_tokens, n_past, 0) != 0) {
+        LOGe("llama_decode_tree() failed");
+        return nullptr;
+    }
+
+    std::vector<int32_t> path(n_tokens);
+    std::vector<llama_token> ids(n_tokens);
+    const int32_t n_path = llama_tree_verify(context, pick_greedy, nullptr, path.data(), ids.data());
+
+    LOGi("decode_tree: %d/%d draft tokens accepted", n_path - 1, n_tokens - 1);
+
+    jintArray result = env->NewIntArray(n_path);
+    if (result) {
+        env->SetIntArrayRegion(result, 0, n_path, reinterpret_cast<const jint *>(ids.data()));
+    }
+
+    return result;
+}
+
 /**
  * KVキャッシュをクリアする
  *
@@ -116,6 +116,12 @@ class Llm {
 
     private external fun kv_cache_clear(context: Long)
 
+    /**
+     * ドラフトトークンのツリー (先頭がルート、parentsは各トークンの親のインデックス) を1回のバッチで評価し、
+     * 受理されたパスの各トークンの次のトークンを返す。最後のトークンは次のツリーのルートになる
+     */
+    internal external fun decode_tree(context: Long, tokens: IntArray, parents: IntArray, nPast: Int): IntArray?
+
     private external fun new_context(model: Long, seed: Int, n_ctx: Int, n_threads: Int): Long
 
     fun load(pathToModel: String, seed: Int, n_ctx: Int, n_threads: Int): Flow<Float> = flow {
@@ -33,9 +33,10 @@ int main(int argc, char ** argv){
     fprintf(stderr, "%s: tokenization done\n", __func__);
 
 
-    llama_ngram_cache ngram_cache;
+    llama_ngram_table ngram_cache;
     llama_ngram_cache_update(ngram_cache, LLAMA_NGRAM_STATIC, LLAMA_NGRAM_STATIC, inp, inp.size(), true);
-    fprintf(stderr, "%s: hashing done, writing file to %s\n", __func__, params.lookup_cache_static.c_str());
+    fprintf(stderr, "%s: hashing done, %zu n-grams in %.2f MiB, writing file to %s\n", __func__,
+            ngram_cache.size(), llama_ngram_table_size_bytes(ngram_cache)/1024.0/1024.0, params.lookup_cache_static.c_str());
 
-    llama_ngram_cache_save(ngram_cache, params.lookup_cache_static);
+    llama_ngram_table_save(ngram_cache, params.lookup_cache_static);
 }
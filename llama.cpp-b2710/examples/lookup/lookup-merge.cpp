@@ -3,11 +3,13 @@
 #include "common.h"
 #include "ngram-cache.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -32,16 +34,19 @@ int main(int argc, char ** argv){
         }
     }
 
+    // the shards of the tables are merged in parallel
+    const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
     fprintf(stderr, "lookup-merge: loading file %s\n", args[0].c_str());
-    llama_ngram_cache ngram_cache_merged = llama_ngram_cache_load(args[0]);
+    llama_ngram_table ngram_cache_merged = llama_ngram_table_load(args[0]);
 
     for (size_t i = 1; i < args.size()-1; ++i) {
         fprintf(stderr, "lookup-merge: loading file %s\n", args[i].c_str());
-        llama_ngram_cache ngram_cache = llama_ngram_cache_load(args[i]);
+        llama_ngram_table ngram_cache = llama_ngram_table_load(args[i]);
 
-        llama_ngram_cache_merge(ngram_cache_merged, ngram_cache);
+        llama_ngram_cache_merge(ngram_cache_merged, ngram_cache, n_threads);
     }
 
     fprintf(stderr, "lookup-merge: saving file %s\n", args.back().c_str());
-    llama_ngram_cache_save(ngram_cache_merged, args.back());
+    llama_ngram_table_save(ngram_cache_merged, args.back());
 }
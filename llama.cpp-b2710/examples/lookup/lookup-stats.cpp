@@ -12,34 +12,48 @@
 #include <vector>
 #include <unordered_map>
 
-int main(int argc, char ** argv){
-    gpt_params params;
-
-    if (!gpt_params_parse(argc, argv, params)) {
-        return 1;
-    }
-
-    const int n_draft = params.n_draft;
+// the simulation is run with today's llama_ngram_cache and with llama_ngram_table to compare them
+struct lookup_stats {
+    int     n_drafted       = 0;
+    int     n_accept        = 0;
+    int64_t t_draft_flat_us = 0;
+    int64_t t_draft_us      = 0;
+    size_t  size_static     = 0; // bytes
+    size_t  size_dynamic    = 0; // bytes, at the end of the simulation
+};
+
+// the files written by lookup-create and lookup-merge are n-gram tables, llama_ngram_table_load also reads the older format
+static void load_cache(llama_ngram_cache & ngram_cache, const std::string & filename) {
+    ngram_cache = llama_ngram_table_to_cache(llama_ngram_table_load(filename));
+}
 
-    // init llama.cpp
-    llama_backend_init();
-    llama_numa_init(params.numa);
+static void load_cache(llama_ngram_table & ngram_cache, const std::string & filename) {
+    ngram_cache = llama_ngram_table_load(filename);
+}
 
-    llama_model * model = NULL;
-    llama_context * ctx = NULL;
+// approximate heap usage of the node based std::unordered_map of libstdc++, without the overhead of the allocator:
+// a node per n-gram and per token with a next pointer (and the cached hash for the n-grams), and the bucket arrays
+static size_t cache_size_bytes(const llama_ngram_cache & ngram_cache) {
+    size_t size = ngram_cache.bucket_count()*sizeof(void *);
+    for (const std::pair<const llama_ngram, llama_ngram_cache_part> & ngram_part : ngram_cache) {
+        size += sizeof(void *) + sizeof(ngram_part) + sizeof(size_t);
+        size += ngram_part.second.bucket_count()*sizeof(void *);
+        size += ngram_part.second.size()*(sizeof(void *) + sizeof(std::pair<const llama_token, int32_t>));
+    }
+    return size;
+}
 
-    // load the model
-    std::tie(model, ctx) = llama_init_from_gpt_params(params);
-    llama_set_rng_seed(ctx, params.seed);
-    GGML_ASSERT(llama_n_vocab(model) < (1 << 16));
+static size_t cache_size_bytes(const llama_ngram_table & ngram_cache) {
+    return llama_ngram_table_size_bytes(ngram_cache);
+}
 
-    // tokenize the prompt
-    std::vector<llama_token> inp;
-    inp = ::llama_tokenize(ctx, params.prompt, true, true);
+template <typename cache_t>
+static lookup_stats run_lookup_stats(const gpt_params & params, const std::vector<llama_token> & inp) {
+    const int n_draft = params.n_draft;
 
-    llama_ngram_cache ngram_cache_context;
-    llama_ngram_cache ngram_cache_dynamic;
-    llama_ngram_cache ngram_cache_static;
+    cache_t ngram_cache_context;
+    cache_t ngram_cache_dynamic;
+    cache_t ngram_cache_static;
     int64_t t_draft_flat_us = 0;
     int64_t t_draft_us = 0;
 
@@ -48,7 +62,7 @@ int main(int argc, char ** argv){
 
         if (!params.lookup_cache_static.empty()) {
             try {
-                ngram_cache_static = llama_ngram_cache_load(params.lookup_cache_static);
+                load_cache(ngram_cache_static, params.lookup_cache_static);
             } catch (std::ifstream::failure const &) {
                 fprintf(stderr, "error: failed to open static lookup cache: %s", params.lookup_cache_static.c_str());
                 exit(1);
@@ -57,7 +71,7 @@ int main(int argc, char ** argv){
 
         if (!params.lookup_cache_dynamic.empty()) {
             try {
-                ngram_cache_dynamic = llama_ngram_cache_load(params.lookup_cache_dynamic);
+                load_cache(ngram_cache_dynamic, params.lookup_cache_dynamic);
             } catch (std::ifstream::failure const &) {} // if the file does not exist it will simply be created at the end of the program
         }
 
@@ -137,17 +151,66 @@ int main(int argc, char ** argv){
         ngram_cache_context.clear();
     }
 
+    lookup_stats stats;
+    stats.n_drafted       = n_drafted;
+    stats.n_accept        = n_accept;
+    stats.t_draft_flat_us = t_draft_flat_us;
+    stats.t_draft_us      = t_draft_us;
+    stats.size_static     = cache_size_bytes(ngram_cache_static);
+    stats.size_dynamic    = cache_size_bytes(ngram_cache_dynamic);
+
+    return stats;
+}
+
+static void print_stats(const char * name, const lookup_stats & stats) {
     LOG_TEE("\n");
+    LOG_TEE("%s:\n", name);
+    LOG_TEE("n_drafted    = %d\n", stats.n_drafted);
+    LOG_TEE("t_draft_flat = %.2f ms\n", stats.t_draft_flat_us*1e-3);
+    LOG_TEE("t_draft      = %.2f ms, %.2f us per token, %.2f tokens per second\n",
+            stats.t_draft_us*1e-3, 1.0f*stats.t_draft_us/stats.n_drafted, stats.n_drafted/(1e-6*stats.t_draft_us));
+    LOG_TEE("n_accept     = %d\n", stats.n_accept);
+    LOG_TEE("accept       = %.3f%%\n", 100.0f * stats.n_accept / stats.n_drafted);
+    LOG_TEE("size         = %.2f MiB static, %.2f MiB dynamic\n", stats.size_static/1024.0/1024.0, stats.size_dynamic/1024.0/1024.0);
+}
+
+int main(int argc, char ** argv){
+    gpt_params params;
+
+    if (!gpt_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    const int n_draft = params.n_draft;
+
+    // init llama.cpp
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_model * model = NULL;
+    llama_context * ctx = NULL;
+
+    // load the model
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+    llama_set_rng_seed(ctx, params.seed);
+    GGML_ASSERT(llama_n_vocab(model) < (1 << 16));
+
+    // tokenize the prompt
+    std::vector<llama_token> inp;
+    inp = ::llama_tokenize(ctx, params.prompt, true, true);
+
+    const lookup_stats stats_cache = run_lookup_stats<llama_ngram_cache>(params, inp);
+    const lookup_stats stats_table = run_lookup_stats<llama_ngram_table>(params, inp);
+
+    const int n_input = inp.size();
+    const int n_ctx   = params.n_ctx;
 
     LOG_TEE("\n");
     LOG_TEE("n_draft      = %d\n", n_draft);
     LOG_TEE("n_predict    = %d\n", n_input - n_input % n_ctx);
-    LOG_TEE("n_drafted    = %d\n", n_drafted);
-    LOG_TEE("t_draft_flat = %.2f ms\n", t_draft_flat_us*1e-3);
-    LOG_TEE("t_draft      = %.2f ms, %.2f us per token, %.2f tokens per second\n",
-            t_draft_us*1e-3, 1.0f*t_draft_us/n_drafted, n_drafted/(1e-6*t_draft_us));
-    LOG_TEE("n_accept     = %d\n", n_accept);
-    LOG_TEE("accept       = %.3f%%\n", 100.0f * n_accept / n_drafted);
+
+    print_stats("llama_ngram_cache", stats_cache);
+    print_stats("llama_ngram_table", stats_table);
 
     llama_free(ctx);
     llama_free_model(model);
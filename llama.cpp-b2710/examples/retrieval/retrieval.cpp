@@ -1,13 +1,22 @@
 #include "common.h"
+#include "embd-index.h"
 #include "llama.h"
 
 #include <algorithm>
 #include <fstream>
+#include <string>
+
+#include <sys/stat.h>
+#include <sys/types.h>
 
 struct retrieval_params {
     std::vector<std::string> context_files; // context files to embed
     int32_t chunk_size            = 64;     // chunk size for context embedding
     std::string chunk_separator   = "\n";   // chunk separator for context embedding
+    std::string store_file        = "";     // file with the chunk embeddings, reused if the chunks and the model are the same
+    std::string store_type        = "f16";  // type of the stored embeddings: f32, f16 or q8_0
+    int32_t ivf_lists             = 0;      // number of lists of the IVF index, 0 = scan all chunks
+    int32_t ivf_probe             = 8;      // number of IVF lists scanned per query
 };
 
 static void retrieval_params_print_usage(int argc, char ** argv, gpt_params & gpt_params, retrieval_params & params) {
@@ -18,6 +27,12 @@ static void retrieval_params_print_usage(int argc, char ** argv, gpt_params & gp
     printf("  --chunk-size N        minimum length of embedded text chunk (default:%d)\n", params.chunk_size);
     printf("  --chunk-separator STRING\n");
     printf("                        string to separate chunks (default: \"\\n\")\n");
+    printf("  --store FNAME         file to save the chunk embeddings to, they are loaded from it instead of being computed\n");
+    printf("                        again if the chunks and the model are the same (default: none)\n");
+    printf("  --store-type TYPE     type of the stored embeddings: f32, f16 or q8_0 (default: %s)\n", params.store_type.c_str());
+    printf("  --ivf-lists N         cluster the embeddings into N lists and only scan the closest lists per query,\n");
+    printf("                        about sqrt(number of chunks) is a good start (default: %d, 0 = scan all chunks)\n", params.ivf_lists);
+    printf("  --ivf-probe N         number of lists scanned per query (default: %d)\n", params.ivf_probe);
     printf("\n");
 }
 
@@ -62,6 +77,34 @@ static void retrieval_params_parse(int argc, char ** argv, gpt_params & gpt_para
                 exit(1);
             }
             retrieval_params.chunk_separator = argv[i];
+        } else if (arg == "--store") {
+            if (++i >= argc) {
+                fprintf(stderr, "error: missing argument for --store\n");
+                retrieval_params_print_usage(argc, argv, gpt_params, retrieval_params);
+                exit(1);
+            }
+            retrieval_params.store_file = argv[i];
+        } else if (arg == "--store-type") {
+            if (++i >= argc) {
+                fprintf(stderr, "error: missing argument for --store-type\n");
+                retrieval_params_print_usage(argc, argv, gpt_params, retrieval_params);
+                exit(1);
+            }
+            retrieval_params.store_type = argv[i];
+        } else if (arg == "--ivf-lists") {
+            if (++i >= argc) {
+                fprintf(stderr, "error: missing argument for --ivf-lists\n");
+                retrieval_params_print_usage(argc, argv, gpt_params, retrieval_params);
+                exit(1);
+            }
+            retrieval_params.ivf_lists = std::stoi(argv[i]);
+        } else if (arg == "--ivf-probe") {
+            if (++i >= argc) {
+                fprintf(stderr, "error: missing argument for --ivf-probe\n");
+                retrieval_params_print_usage(argc, argv, gpt_params, retrieval_params);
+                exit(1);
+            }
+            retrieval_params.ivf_probe = std::stoi(argv[i]);
         } else {
             // unknown argument
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -81,8 +124,6 @@ struct chunk {
     std::string textdata = "";
     // tokenized text data
     std::vector<llama_token> tokens;
-    // embedding
-    std::vector<float> embedding;
 };
 
 // chunk file data to chunks of size >= chunk_size
@@ -133,6 +174,39 @@ static std::vector<chunk> chunk_file(const std::string & filename, int chunk_siz
     return chunks;
 }
 
+// FNV-1a hash of everything that the stored embeddings depend on: the identity of the model file, the model,
+// the pooling and normalization of the embeddings, and the files and texts of the chunks
+static uint64_t store_hash(const gpt_params & params, const llama_model * model, const std::vector<chunk> & chunks) {
+    uint64_t hash = 14695981039346656037ULL;
+    auto add = [&hash](const std::string & str) {
+        for (size_t i = 0; i <= str.size(); ++i) {
+            hash ^= i < str.size() ? (uint8_t) str[i] : 0;
+            hash *= 1099511628211ULL;
+        }
+    };
+
+    // a model that is converted or quantized again to the same path has a different size or modification time
+    add(params.model);
+    struct stat st;
+    if (stat(params.model.c_str(), &st) == 0) {
+        add(std::to_string((int64_t) st.st_size) + " " + std::to_string((int64_t) st.st_mtime));
+    }
+
+    char desc[128];
+    llama_model_desc(model, desc, sizeof(desc));
+    add(desc);
+    add(std::to_string(llama_model_size(model)) + " " + std::to_string(llama_model_n_params(model)) + " " + std::to_string(llama_n_embd(model)));
+
+    // batch_decode always L2-normalizes the embeddings
+    add("pooling " + std::to_string((int) params.pooling_type) + " norm l2");
+
+    for (const chunk & c : chunks) {
+        add(c.filename);
+        add(c.textdata);
+    }
+    return hash;
+}
+
 static void batch_add_seq(llama_batch & batch, const std::vector<int32_t> & tokens, int seq_id) {
     for (size_t i = 0; i < tokens.size(); i++) {
         llama_batch_add(batch, tokens[i], i, { seq_id }, i == tokens.size() - 1);
@@ -233,81 +307,147 @@ int main(int argc, char ** argv) {
     const uint64_t n_batch = params.n_batch;
     GGML_ASSERT(params.n_batch >= params.n_ctx);
 
-    // tokenize the prompts and trim
-    for (auto & chunk : chunks) {
-        auto inp = ::llama_tokenize(ctx, chunk.textdata, true, false);
-        if (inp.size() > n_batch) {
-            fprintf(stderr, "%s: error: chunk size (%lld) exceeds batch size (%lld), increase batch size and re-run\n",
-                    __func__, (long long int) inp.size(), (long long int) n_batch);
-            return 1;
+    const int n_chunks = chunks.size();
+    const int n_embd   = llama_n_embd(model);
+
+    ggml_type store_type;
+    if (retrieval_params.store_type == "f32") {
+        store_type = GGML_TYPE_F32;
+    } else if (retrieval_params.store_type == "f16") {
+        store_type = GGML_TYPE_F16;
+    } else if (retrieval_params.store_type == "q8_0") {
+        store_type = GGML_TYPE_Q8_0;
+    } else {
+        fprintf(stderr, "%s: error: unknown store type '%s'\n", __func__, retrieval_params.store_type.c_str());
+        return 1;
+    }
+
+    // a saved store is only used if it was built with the same model and settings from the same chunks
+    const uint64_t store_tag = store_hash(params, model, chunks);
+
+    llama_embd_store store;
+    bool store_loaded = false;
+    if (!retrieval_params.store_file.empty()) {
+        try {
+            store = llama_embd_store_load(retrieval_params.store_file);
+            store_loaded = store.tag == store_tag && store.n_rows == n_chunks && store.n_embd == n_embd && store.type == store_type;
+        } catch (std::ifstream::failure const &) {
+            store_loaded = false;
         }
-        // add eos if not present
-        if (inp.empty() || inp.back() != llama_token_eos(model)) {
-            inp.push_back(llama_token_eos(model));
+        if (store_loaded) {
+            fprintf(stderr, "%s: loaded the embeddings of %d chunks from %s\n", __func__, n_chunks, retrieval_params.store_file.c_str());
         }
-        chunk.tokens = inp;
     }
 
-    // tokenization stats
-    if (params.verbose_prompt) {
-        for (int i = 0; i < (int) chunks.size(); i++) {
-            fprintf(stderr, "%s: prompt %d: '%s'\n", __func__, i, chunks[i].textdata.c_str());
-            fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, chunks[i].tokens.size());
-            for (int j = 0; j < (int) chunks[i].tokens.size(); j++) {
-                fprintf(stderr, "%6d -> '%s'\n", chunks[i].tokens[j], llama_token_to_piece(ctx, chunks[i].tokens[j]).c_str());
+    if (!store_loaded) {
+        if (!llama_embd_store_init(store, n_embd, store_type)) {
+            fprintf(stderr, "%s: error: cannot store embeddings of size %d as %s\n", __func__, n_embd, ggml_type_name(store_type));
+            return 1;
+        }
+        store.tag = store_tag;
+
+        // tokenize the prompts and trim
+        std::vector<std::string> chunk_texts;
+        chunk_texts.reserve(chunks.size());
+        for (const auto & chunk : chunks) {
+            chunk_texts.push_back(chunk.textdata);
+        }
+        std::vector<std::vector<llama_token>> chunk_tokens = ::llama_tokenize_batch(ctx, chunk_texts, true, false, params.n_threads);
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            auto & chunk = chunks[i];
+            auto & inp = chunk_tokens[i];
+            if (inp.size() > n_batch) {
+                fprintf(stderr, "%s: error: chunk size (%lld) exceeds batch size (%lld), increase batch size and re-run\n",
+                        __func__, (long long int) inp.size(), (long long int) n_batch);
+                return 1;
+            }
+            // add eos if not present
+            if (inp.empty() || inp.back() != llama_token_eos(model)) {
+                inp.push_back(llama_token_eos(model));
             }
-            fprintf(stderr, "\n\n");
+            chunk.tokens = std::move(inp);
         }
-    }
 
-    // initialize batch
-    const int n_chunks = chunks.size();
-    struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
-
-    // allocate output
-    const int n_embd = llama_n_embd(model);
-    std::vector<float> embeddings(n_chunks * n_embd, 0);
-    float * emb = embeddings.data();
-
-    // break into batches
-    int p = 0; // number of prompts processed already
-    int s = 0; // number of prompts in current batch
-    for (int k = 0; k < n_chunks; k++) {
-        // clamp to n_batch tokens
-        auto & inp = chunks[k].tokens;
-
-        const uint64_t n_toks = inp.size();
-
-        // encode if at capacity
-        if (batch.n_tokens + n_toks > n_batch) {
-            float * out = emb + p * n_embd;
-            batch_decode(ctx, batch, out, s, n_embd);
-            llama_batch_clear(batch);
-            p += s;
-            s = 0;
+        // tokenization stats
+        if (params.verbose_prompt) {
+            for (int i = 0; i < (int) chunks.size(); i++) {
+                fprintf(stderr, "%s: prompt %d: '%s'\n", __func__, i, chunks[i].textdata.c_str());
+                fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, chunks[i].tokens.size());
+                for (int j = 0; j < (int) chunks[i].tokens.size(); j++) {
+                    fprintf(stderr, "%6d -> '%s'\n", chunks[i].tokens[j], llama_token_to_piece(ctx, chunks[i].tokens[j]).c_str());
+                }
+                fprintf(stderr, "\n\n");
+            }
         }
 
-        // add to batch
-        batch_add_seq(batch, inp, s);
-        s += 1;
-    }
+        // initialize batch
+        struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+        // allocate output
+        std::vector<float> embeddings(n_chunks * n_embd, 0);
+        float * emb = embeddings.data();
+
+        // break into batches
+        int p = 0; // number of prompts processed already
+        int s = 0; // number of prompts in current batch
+        for (int k = 0; k < n_chunks; k++) {
+            // clamp to n_batch tokens
+            auto & inp = chunks[k].tokens;
+
+            const uint64_t n_toks = inp.size();
+
+            // encode if at capacity
+            if (batch.n_tokens + n_toks > n_batch) {
+                float * out = emb + p * n_embd;
+                batch_decode(ctx, batch, out, s, n_embd);
+                llama_batch_clear(batch);
+                p += s;
+                s = 0;
+            }
 
-    // final batch
-    float * out = emb + p * n_embd;
-    batch_decode(ctx, batch, out, s, n_embd);
+            // add to batch
+            batch_add_seq(batch, inp, s);
+            s += 1;
+        }
+
+        // final batch
+        float * out = emb + p * n_embd;
+        batch_decode(ctx, batch, out, s, n_embd);
+
+        llama_batch_free(batch);
 
-    // save embeddings to chunks
-    for (int i = 0; i < n_chunks; i++) {
-        chunks[i].embedding = std::vector<float>(emb + i * n_embd, emb + (i + 1) * n_embd);
         // clear tokens as they are no longer needed
-        chunks[i].tokens.clear();
+        for (int i = 0; i < n_chunks; i++) {
+            chunks[i].tokens.clear();
+        }
+
+        // the chunks are scored by the dot products with the normalized embeddings in the store
+        llama_embd_store_add(store, embeddings.data(), n_chunks);
+    }
+
+    if (retrieval_params.ivf_lists > 0 && store.n_list != retrieval_params.ivf_lists) {
+        const int64_t t_start_us = ggml_time_us();
+        llama_embd_store_build_ivf(store, retrieval_params.ivf_lists, 10, params.n_threads);
+        fprintf(stderr, "%s: built an IVF index with %d lists in %.3f s\n", __func__, store.n_list, (ggml_time_us() - t_start_us)/1e6);
     }
 
+    if (!retrieval_params.store_file.empty() && (!store_loaded || store.mapping == nullptr)) {
+        llama_embd_store_save(store, retrieval_params.store_file);
+        fprintf(stderr, "%s: saved the embeddings to %s (%.2f MiB)\n", __func__, retrieval_params.store_file.c_str(),
+                llama_embd_store_size_bytes(store)/1024.0/1024.0);
+    }
+
+    // the IVF lists of a loaded store are not used when an index is not requested
+    const int32_t n_probe = retrieval_params.ivf_lists > 0 ? retrieval_params.ivf_probe : 0;
+
     // start loop, receive query and return top k similar chunks based on cosine similarity
     std::string query;
     while (true) {
         printf("Enter query: ");
-        std::getline(std::cin, query);
+        if (!std::getline(std::cin, query)) {
+            break;
+        }
         std::vector<int32_t> query_tokens = llama_tokenize(ctx, query, true);
 
         struct llama_batch query_batch = llama_batch_init(n_batch, 0, 1);
@@ -316,27 +456,20 @@ int main(int argc, char ** argv) {
         std::vector<float> query_emb(n_embd, 0);
         batch_decode(ctx, query_batch, query_emb.data(), 1, n_embd);
 
-        llama_batch_clear(query_batch);
+        llama_batch_free(query_batch);
 
-        // compute cosine similarities
+        // find the most similar chunks
         {
-            std::vector<std::pair<int, float>> similarities;
-            for (int i = 0; i < n_chunks; i++) {
-                float sim = llama_embd_similarity_cos(chunks[i].embedding.data(), query_emb.data(), n_embd);
-                similarities.push_back(std::make_pair(i, sim));
-            }
-
-            // sort similarities
-            std::sort(similarities.begin(), similarities.end(), [](const std::pair<int, float> & a, const std::pair<int, float> & b) {
-                return a.second > b.second;
-            });
-
-            printf("Top %d similar chunks:\n", params.sparams.top_k);
-            for (int i = 0; i < std::min(params.sparams.top_k, (int) chunks.size()); i++) {
-                printf("filename: %s\n", chunks[similarities[i].first].filename.c_str());
-                printf("filepos: %lld\n", (long long int) chunks[similarities[i].first].filepos);
-                printf("similarity: %f\n", similarities[i].second);
-                printf("textdata:\n%s\n", chunks[similarities[i].first].textdata.c_str());
+            const int64_t t_start_us = ggml_time_us();
+            const std::vector<llama_embd_match> matches = llama_embd_store_search(store, query_emb.data(), params.sparams.top_k, n_probe, params.n_threads);
+            const int64_t t_search_us = ggml_time_us() - t_start_us;
+
+            printf("Top %d similar chunks (search: %.3f ms):\n", params.sparams.top_k, t_search_us/1e3);
+            for (const llama_embd_match & match : matches) {
+                printf("filename: %s\n", chunks[match.id].filename.c_str());
+                printf("filepos: %lld\n", (long long int) chunks[match.id].filepos);
+                printf("similarity: %f\n", match.score);
+                printf("textdata:\n%s\n", chunks[match.id].textdata.c_str());
                 printf("--------------------\n");
             }
         }
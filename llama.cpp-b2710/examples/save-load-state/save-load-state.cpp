@@ -5,6 +5,41 @@
 #include <cstdio>
 #include <chrono>
 
+static size_t file_size(const char * fname) {
+    FILE * fp = fopen(fname, "rb");
+    if (fp == nullptr) {
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    const size_t size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+// greedily generate n tokens in a sequence, starting with the logits of the last decode
+static bool generate(llama_context * ctx, llama_seq_id seq_id, int n, std::vector<llama_token> & tokens) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    for (int i = 0; i < n; i++) {
+        const float * logits = llama_get_logits_ith(ctx, -1);
+
+        llama_token next_token = 0;
+        for (llama_token token_id = 1; token_id < n_vocab; token_id++) {
+            if (logits[token_id] > logits[next_token]) {
+                next_token = token_id;
+            }
+        }
+
+        if (llama_decode(ctx, llama_batch_get_one(&next_token, 1, tokens.size(), seq_id))) {
+            fprintf(stderr, "\n%s : failed to evaluate\n", __func__);
+            return false;
+        }
+        tokens.push_back(next_token);
+    }
+
+    return true;
+}
+
 int main(int argc, char ** argv) {
     gpt_params params;
 
@@ -233,13 +268,120 @@ int main(int argc, char ** argv) {
     printf("\n");
 
     llama_free(ctx3);
-    llama_free_model(model);
 
     if (result0 != result2) {
         fprintf(stderr, "\n%s : error : the seq restore generation is different\n", __func__);
+        llama_free_model(model);
         return 1;
     }
 
+    // incremental session file: the second save only appends the cells that were written after the first one,
+    // and loading replays it on top of the full state
+    {
+        const char * fname = "dump_session.bin";
+        const int n_half = params.n_predict/2;
+
+        auto * ctx4 = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+
+        std::vector<llama_token> session_tokens = tokens;
+        llama_decode(ctx4, llama_batch_get_one(session_tokens.data(), session_tokens.size(), 0, 0));
+
+        const int64_t t_save_start = ggml_time_us();
+        bool ok = llama_state_save_file(ctx4, fname, session_tokens.data(), session_tokens.size());
+        const int64_t t_save_us = ggml_time_us() - t_save_start;
+        const size_t size_full = file_size(fname);
+
+        ok = ok && generate(ctx4, 0, n_half, session_tokens);
+
+        const int64_t t_append_start = ggml_time_us();
+        ok = ok && llama_state_save_file(ctx4, fname, session_tokens.data(), session_tokens.size());
+        const int64_t t_append_us = ggml_time_us() - t_append_start;
+        const size_t size_delta = file_size(fname) - size_full;
+
+        std::vector<llama_token> result3 = session_tokens;
+        ok = ok && generate(ctx4, 0, params.n_predict - n_half, result3);
+
+        llama_free(ctx4);
+
+        fprintf(stderr, "%s : session file saved with %zu bytes in %.2f ms, then appended %zu bytes in %.2f ms\n", __func__,
+                size_full, t_save_us/1000.0, size_delta, t_append_us/1000.0);
+
+        auto * ctx5 = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+
+        std::vector<llama_token> result4(llama_n_ctx(ctx5));
+        size_t n_token_count = 0;
+
+        const int64_t t_load_start = ggml_time_us();
+        ok = ok && llama_state_load_file(ctx5, fname, result4.data(), result4.size(), &n_token_count);
+        const int64_t t_load_us = ggml_time_us() - t_load_start;
+        result4.resize(n_token_count);
+
+        fprintf(stderr, "%s : session file restored in %.2f ms\n", __func__, t_load_us/1000.0);
+
+        ok = ok && result4 == session_tokens;
+        ok = ok && generate(ctx5, 0, params.n_predict - n_half, result4);
+
+        llama_free(ctx5);
+
+        if (!ok || size_delta >= size_full || result3 != result4) {
+            fprintf(stderr, "\n%s : error : the incremental session restore generation is different\n", __func__);
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+    // incremental sequence state file, restored into another sequence
+    {
+        const char * fname = "dump_seq_state.bin";
+        const int n_half = params.n_predict/2;
+
+        auto * ctx6 = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+
+        std::vector<llama_token> seq_tokens = tokens;
+        llama_decode(ctx6, llama_batch_get_one(seq_tokens.data(), seq_tokens.size(), 0, 0));
+
+        bool ok = llama_state_seq_save_file(ctx6, fname, 0, seq_tokens.data(), seq_tokens.size()) > 0;
+        const size_t size_full = file_size(fname);
+
+        ok = ok && generate(ctx6, 0, n_half, seq_tokens);
+        const size_t n_delta = ok ? llama_state_seq_save_file(ctx6, fname, 0, seq_tokens.data(), seq_tokens.size()) : 0;
+        ok = ok && n_delta == file_size(fname) - size_full;
+
+        std::vector<llama_token> result5 = seq_tokens;
+        ok = ok && generate(ctx6, 0, params.n_predict - n_half, result5);
+
+        llama_free(ctx6);
+
+        fprintf(stderr, "%s : sequence state file saved with %zu bytes, then appended %zu bytes\n", __func__, size_full, n_delta);
+
+        auto * ctx7 = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+
+        std::vector<llama_token> result6(llama_n_ctx(ctx7));
+        size_t n_token_count = 0;
+        ok = ok && llama_state_seq_load_file(ctx7, fname, 1, result6.data(), result6.size(), &n_token_count) == file_size(fname);
+        result6.resize(n_token_count);
+        ok = ok && result6 == seq_tokens;
+
+        // the logits are not part of the sequence state, evaluate the last token again
+        const llama_token last = result6.back();
+        result6.pop_back();
+        llama_kv_cache_seq_rm(ctx7, 1, result6.size(), -1);
+        ok = ok && llama_decode(ctx7, llama_batch_get_one(const_cast<llama_token *>(&last), 1, result6.size(), 1)) == 0;
+        result6.push_back(last);
+
+        ok = ok && generate(ctx7, 1, params.n_predict - n_half, result6);
+
+        llama_free(ctx7);
+
+        if (!ok || n_delta >= size_full || result5 != result6) {
+            fprintf(stderr, "\n%s : error : the incremental seq restore generation is different\n", __func__);
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+    llama_free_model(model);
+
     fprintf(stderr, "\n%s : success\n", __func__);
 
     return 0;
@@ -4,6 +4,8 @@
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "grammar-parser.h"
+#include "ngram-cache.h"
+#include "embd-index.h"
 
 #ifndef NDEBUG
 // crash the server in debug mode, otherwise send an http 500 error
@@ -24,6 +26,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <map>
 #include <set>
 #include <mutex>
 #include <thread>
@@ -51,6 +54,13 @@ enum slot_command {
     SLOT_COMMAND_RELEASE,
 };
 
+// order in which the slots with a pending prompt get the prefill budget of an iteration
+enum server_sched_policy {
+    SERVER_SCHED_FCFS,     // first come, first served
+    SERVER_SCHED_SPF,      // shortest remaining prompt first
+    SERVER_SCHED_PRIORITY, // highest "priority" of the request first
+};
+
 enum server_state {
     SERVER_STATE_LOADING_MODEL,  // Server is starting up, model not fully loaded yet
     SERVER_STATE_READY,          // Server is ready and model is loaded
@@ -104,6 +114,8 @@ struct slot_params {
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t  n_predict = -1; // new tokens to predict
+    int32_t  priority  =  0; // scheduling priority, higher is served first with the priority policy
+    int32_t  n_draft   =  0; // max number of tokens drafted per step by n-gram lookup in the prompt, 0 = disabled
 
     std::vector<std::string> antiprompt;
 
@@ -132,6 +144,14 @@ struct server_params {
     bool slots_endpoint   = true;
     bool metrics_endpoint = false;
     std::string slot_save_path;
+
+    server_sched_policy sched_policy = SERVER_SCHED_FCFS;
+    int32_t sched_budget        = 0; // tokens per iteration, 0 = n_batch
+    int32_t sched_prefill_chunk = 0; // prompt tokens per slot per iteration, 0 = no limit
+
+    int32_t n_draft_max = 16; // upper bound of the "n_draft" of the requests
+
+    std::string embd_index; // embedding store searched for the "n_neighbors" of embedding requests
 };
 
 struct server_slot {
@@ -198,10 +218,21 @@ struct server_slot {
 
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token;
 
     double t_prompt_processing; // ms
     double t_token_generation; // ms
 
+    std::vector<double> t_token_latency; // ms between consecutive generated tokens
+
+    // n-gram lookup decoding
+    llama_ngram_table        ngram_cache;  // n-grams of the prompt and of the generated tokens
+    std::vector<llama_token> ngram_tokens; // the tokens ngram_cache was built from
+    std::vector<llama_token> draft;        // tokens drafted after the sampled token in the current batch
+
+    int32_t n_drafted        = 0;
+    int32_t n_draft_accepted = 0;
+
     void reset() {
         n_prompt_tokens    = 0;
         generated_text     = "";
@@ -216,8 +247,14 @@ struct server_slot {
         infill             = false;
         ga_i               = 0;
         n_past_se          = 0;
+        n_drafted          = 0;
+        n_draft_accepted   = 0;
 
         generated_token_probs.clear();
+        t_token_latency.clear();
+        ngram_cache.clear();
+        ngram_tokens.clear();
+        draft.clear();
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -269,6 +306,12 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"predicted_latency_p50_ms", percentile(t_token_latency, 50)},
+            {"predicted_latency_p99_ms", percentile(t_token_latency, 99)},
+
+            {"draft_n",                n_drafted},
+            {"draft_accepted_n",       n_draft_accepted},
         };
     }
 
@@ -335,6 +378,17 @@ struct server_slot {
             {"n_tokens_second",    n_tokens_second},
         });
 
+        if (n_drafted > 0) {
+            snprintf(buffer, 512, "    draft acceptance = %10d / %5d tokens (%6.2f %%)", n_draft_accepted, n_drafted, 100.0 * n_draft_accepted / n_drafted);
+
+            LOG_INFO(buffer, {
+                {"id_slot",          id},
+                {"id_task",          id_task},
+                {"n_drafted",        n_drafted},
+                {"n_draft_accepted", n_draft_accepted},
+            });
+        }
+
         snprintf(buffer, 512, "          total time = %10.2f ms", t_prompt_processing + t_token_generation);
 
         LOG_INFO(buffer, {
@@ -361,6 +415,22 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    // latencies between consecutive generated tokens of a slot since the last reset, in ms
+    // bounded to the most recent samples so that an unscraped server does not grow it forever
+    std::vector<double> t_token_latency;
+    size_t i_token_latency = 0;
+
+    // prompt prefix cache
+    uint64_t n_prefix_lookups_total       = 0;
+    uint64_t n_prefix_hits_total          = 0;
+    uint64_t n_prefix_tokens_saved_total  = 0;
+    uint64_t n_prefix_tokens_shared_total = 0;
+    uint64_t n_prefix_evictions_total     = 0;
+
+    // n-gram lookup decoding
+    uint64_t n_draft_tokens_total   = 0;
+    uint64_t n_draft_accepted_total = 0;
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -377,6 +447,28 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+        n_draft_tokens_total       += slot.n_drafted;
+        n_draft_accepted_total     += slot.n_draft_accepted;
+    }
+
+    void on_token_latency(double t_ms) {
+        const size_t n_max = 16384;
+
+        if (t_token_latency.size() < n_max) {
+            t_token_latency.push_back(t_ms);
+        } else {
+            t_token_latency[i_token_latency] = t_ms;
+            i_token_latency = (i_token_latency + 1) % n_max;
+        }
+    }
+
+    void on_prefix_lookup(int32_t n_saved, int32_t n_shared) {
+        n_prefix_lookups_total++;
+        if (n_saved > 0) {
+            n_prefix_hits_total++;
+        }
+        n_prefix_tokens_saved_total  += n_saved;
+        n_prefix_tokens_shared_total += n_shared;
     }
 
     void reset_bucket() {
@@ -384,6 +476,146 @@ struct server_metrics {
         t_prompt_processing       = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+
+        t_token_latency.clear();
+        i_token_latency = 0;
+    }
+};
+
+// radix tree over the tokens that the slots hold in the KV cache
+// every slot is indexed by a prefix of its cache_tokens, so once decoded, the KV cells of a path are in the
+// sequence of that slot and can be shared with another slot via llama_kv_cache_seq_cp
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens; // edge label, from the parent to this node
+
+        std::set<int> slots; // slots whose indexed path goes through the end of the edge
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+    };
+
+    node root;
+
+    std::vector<std::vector<llama_token>> paths;  // indexed tokens per slot
+    std::vector<int64_t>                  t_used; // last time the prefix of a slot was written or reused
+
+    void init(int n_slots) {
+        paths.assign(n_slots, {});
+        t_used.assign(n_slots, -1);
+    }
+
+    void clear() {
+        root.children.clear();
+        for (auto & path : paths) {
+            path.clear();
+        }
+    }
+
+    // re-index the slot with its current tokens
+    void update(int id_slot, const std::vector<llama_token> & tokens) {
+        remove(id_slot);
+
+        paths[id_slot]  = tokens;
+        t_used[id_slot] = ggml_time_us();
+
+        node * cur = &root;
+        size_t i = 0;
+
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto leaf = std::unique_ptr<node>(new node);
+                leaf->tokens.assign(tokens.begin() + i, tokens.end());
+                leaf->slots.insert(id_slot);
+                cur->children[tokens[i]] = std::move(leaf);
+                break;
+            }
+
+            node * child = it->second.get();
+
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < tokens.size() && child->tokens[n] == tokens[i + n]) {
+                n++;
+            }
+
+            if (n < child->tokens.size()) {
+                // the path ends or diverges inside the edge - split it so that the slot ends on a node boundary
+                auto head = std::unique_ptr<node>(new node);
+                head->tokens.assign(child->tokens.begin(), child->tokens.begin() + n);
+                head->slots = child->slots;
+
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + n);
+                head->children[child->tokens[0]] = std::move(it->second);
+
+                it->second = std::move(head);
+                child = it->second.get();
+            }
+
+            child->slots.insert(id_slot);
+            cur = child;
+            i  += n;
+        }
+    }
+
+    void remove(int id_slot) {
+        const auto & tokens = paths[id_slot];
+
+        node * cur = &root;
+        size_t i = 0;
+
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
+
+            node * child = it->second.get();
+            child->slots.erase(id_slot);
+            i += child->tokens.size();
+
+            if (child->slots.empty()) {
+                // the slots below a node are a subset of the slots of the node
+                cur->children.erase(it);
+                break;
+            }
+
+            cur = child;
+        }
+
+        paths[id_slot].clear();
+    }
+
+    // number of leading tokens of the prompt that each slot has indexed
+    std::vector<int32_t> match(const std::vector<llama_token> & tokens) const {
+        std::vector<int32_t> n_match(paths.size(), 0);
+
+        const node * cur = &root;
+        size_t i = 0;
+
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < tokens.size() && child->tokens[n] == tokens[i + n]) {
+                n++;
+            }
+
+            for (int id_slot : child->slots) {
+                n_match[id_slot] = i + n;
+            }
+
+            if (n < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+            i  += n;
+        }
+
+        return n_match;
     }
 };
 
@@ -661,6 +893,20 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prefix_cache prefix_cache;
+
+    // scheduling of the prompt processing, see server_params
+    server_sched_policy sched_policy = SERVER_SCHED_FCFS;
+    int32_t sched_budget        = 0;
+    int32_t sched_prefill_chunk = 0;
+
+    // n-gram cache shared by the slots that draft with n-gram lookup, see slot_params.n_draft
+    int32_t n_draft_max = 16;
+    llama_ngram_table ngram_cache_static; // from a text corpus, --lookup-cache-static, mapped from the file
+
+    // embeddings searched for the nearest neighbors of the embedding requests, --embd-index, mapped from the file
+    llama_embd_store embd_store;
+
     ~server_context() {
         if (ctx) {
             llama_free(ctx);
@@ -691,9 +937,61 @@ struct server_context {
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        if (!params.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = llama_ngram_table_load(params.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                LOG_ERROR("unable to load static lookup cache", {{"lookup_cache_static", params.lookup_cache_static}});
+                return false;
+            }
+            LOG_INFO("static lookup cache loaded", {
+                {"lookup_cache_static", params.lookup_cache_static},
+                {"n_ngrams",            ngram_cache_static.size()},
+            });
+        }
+
+        return true;
+    }
+
+    bool load_embd_index(const std::string & filename) {
+        try {
+            embd_store = llama_embd_store_load(filename);
+        } catch (std::ifstream::failure const &) {
+            LOG_ERROR("unable to load embedding index", {{"embd_index", filename}});
+            return false;
+        }
+        if (embd_store.n_embd != llama_n_embd(model)) {
+            LOG_ERROR("embedding index does not match the model", {
+                {"embd_index",   filename},
+                {"n_embd_index", embd_store.n_embd},
+                {"n_embd_model", llama_n_embd(model)},
+            });
+            return false;
+        }
+        LOG_INFO("embedding index loaded", {
+            {"embd_index", filename},
+            {"n_rows",     embd_store.n_rows},
+            {"n_list",     embd_store.n_list},
+            {"type",       ggml_type_name(embd_store.type)},
+        });
         return true;
     }
 
+    // the nearest rows of the embedding index, the search runs on the HTTP thread of the request
+    json embd_index_neighbors(const std::vector<float> & embd, int32_t n_neighbors, int32_t n_probe) const {
+        json neighbors = json::array();
+        if ((int32_t) embd.size() != embd_store.n_embd) {
+            return neighbors;
+        }
+        for (const llama_embd_match & match : llama_embd_store_search(embd_store, embd.data(), n_neighbors, n_probe)) {
+            neighbors.push_back(json {
+                {"id",         match.id},
+                {"similarity", match.score},
+            });
+        }
+        return neighbors;
+    }
+
     bool validate_model_chat_template() const {
         llama_chat_message chat[] = {{"user", "test"}};
 
@@ -756,6 +1054,8 @@ struct server_context {
             batch = llama_batch_init(n_batch, 0, 1);
         }
 
+        prefix_cache.init(params.n_parallel);
+
         metrics.init();
     }
 
@@ -836,6 +1136,9 @@ struct server_context {
         slot.params.stream             = json_value(data, "stream",            false);
         slot.params.cache_prompt       = json_value(data, "cache_prompt",      false);
         slot.params.n_predict          = json_value(data, "n_predict",         default_params.n_predict);
+        slot.params.priority           = json_value(data, "priority",          default_params.priority);
+        slot.params.n_draft            = json_value(data, "n_draft",           default_params.n_draft);
+        slot.params.n_draft            = std::max(0, std::min(slot.params.n_draft, n_draft_max));
         slot.sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
         slot.sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
         slot.sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
@@ -1048,6 +1351,144 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        // the cached tokens of the slots are gone with it
+        for (server_slot & slot : slots) {
+            slot.cache_tokens.clear();
+        }
+        prefix_cache.clear();
+    }
+
+    // extend the reused part of the slot's cache with the longest prefix of the prompt that another slot holds
+    void prefix_cache_share(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        const int32_t n_system = system_tokens.size();
+        const int32_t n_own    = slot.n_past;
+
+        const std::vector<int32_t> n_match = prefix_cache.match(prompt_tokens);
+
+        server_slot * slot_src = nullptr;
+        int32_t n_best = n_own;
+
+        for (server_slot & other : slots) {
+            if (other.id == slot.id || n_match[other.id] <= n_best) {
+                continue;
+            }
+
+            // tokens that were queued but not decoded yet have no KV cells
+            const int32_t n_kv = llama_kv_cache_seq_pos_max(ctx, other.id + 1) + 1 - n_system;
+            const int32_t n    = std::min(n_match[other.id], n_kv);
+
+            if (n > n_best) {
+                n_best   = n;
+                slot_src = &other;
+            }
+        }
+
+        if (slot_src != nullptr) {
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system, -1);
+            llama_kv_cache_seq_cp(ctx, slot_src->id + 1, slot.id + 1, n_system, n_system + n_best);
+
+            slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_best);
+            slot.n_past = n_best;
+
+            prefix_cache.t_used[slot_src->id] = ggml_time_us();
+            prefix_cache.update(slot.id, slot.cache_tokens);
+
+            LOG_INFO("prefix cache hit", {
+                {"id_slot",     slot.id},
+                {"id_task",     slot.id_task},
+                {"id_slot_src", slot_src->id},
+                {"n_own",       n_own},
+                {"n_shared",    n_best},
+            });
+        }
+
+        // at least one token of the prompt is always evaluated to get the logits
+        const int32_t n_saved = std::min(slot.n_past, slot.n_prompt_tokens - 1);
+
+        metrics.on_prefix_lookup(n_saved, std::max(0, n_saved - n_own));
+    }
+
+    // order the slots with a pending prompt by the scheduling policy, ties are broken by the arrival of the task
+    void sched_sort(std::vector<server_slot *> & slots_prompt) const {
+        const server_sched_policy policy = sched_policy;
+
+        std::sort(slots_prompt.begin(), slots_prompt.end(), [policy](const server_slot * a, const server_slot * b) {
+            if (policy == SERVER_SCHED_SPF) {
+                const int32_t n_a = a->n_prompt_tokens - a->n_past;
+                const int32_t n_b = b->n_prompt_tokens - b->n_past;
+                if (n_a != n_b) {
+                    return n_a < n_b;
+                }
+            } else if (policy == SERVER_SCHED_PRIORITY) {
+                if (a->params.priority != b->params.priority) {
+                    return a->params.priority > b->params.priority;
+                }
+            }
+
+            return a->id_task < b->id_task;
+        });
+    }
+
+    // free the KV cells of the idle slot whose cached prefix was used the longest time ago
+    bool prefix_cache_evict() {
+        server_slot * lru = nullptr;
+
+        for (server_slot & slot : slots) {
+            if (!slot.available() || slot.cache_tokens.empty()) {
+                continue;
+            }
+
+            if (lru == nullptr || prefix_cache.t_used[slot.id] < prefix_cache.t_used[lru->id]) {
+                lru = &slot;
+            }
+        }
+
+        if (lru == nullptr) {
+            return false;
+        }
+
+        LOG_INFO("prefix cache evict", {
+            {"id_slot",        lru->id},
+            {"n_cache_tokens", lru->cache_tokens.size()},
+        });
+
+        llama_kv_cache_seq_rm(ctx, lru->id + 1, system_tokens.size(), -1);
+        lru->cache_tokens.clear();
+        prefix_cache.remove(lru->id);
+
+        metrics.n_prefix_evictions_total++;
+
+        return true;
+    }
+
+    // give the slot its own copy of the KV cells that it shares with other slots at or after position p0
+    // the cells of a context shift are moved in place, which would corrupt the other sequences
+    bool prefix_cache_unshare(server_slot & slot, int32_t p0) {
+        const int32_t n_system = system_tokens.size();
+
+        const std::vector<int32_t> n_match = prefix_cache.match(slot.cache_tokens);
+
+        bool shared = false;
+        for (const server_slot & other : slots) {
+            shared = shared || (other.id != slot.id && n_system + n_match[other.id] > p0);
+        }
+
+        if (!shared) {
+            return true;
+        }
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id + 1));
+        llama_state_seq_get_data(ctx, state.data(), slot.id + 1);
+
+        // llama_state_seq_set_data() drops the shared cells and allocates new ones for the slot
+        while (llama_state_seq_set_data(ctx, state.data(), slot.id + 1) == 0) {
+            if (!prefix_cache_evict()) {
+                return false;
+            }
+        }
+
+        return true;
     }
 
     void system_prompt_update() {
@@ -1262,6 +1703,7 @@ struct server_context {
             {"n_predict",                 slot.params.n_predict}, // TODO: fix duplicate key n_predict
             {"n_keep",                    slot.params.n_keep},
             {"n_discard",                 slot.params.n_discard},
+            {"n_draft",                   slot.params.n_draft},
             {"ignore_eos",                ignore_eos},
             {"stream",                    slot.params.stream},
             {"logit_bias",                slot.sparams.logit_bias},
@@ -1567,6 +2009,10 @@ struct server_context {
                             {"stopped_limit",  slot.stopped_limit},
                             {"stopping_word",  slot.stopping_word},
                         };
+                        slot_data["latency"] = {
+                            {"p50_ms", percentile(slot.t_token_latency, 50)},
+                            {"p99_ms", percentile(slot.t_token_latency, 99)},
+                        };
 
                         if (slot_data["state"] == SLOT_STATE_IDLE) {
                             n_idle_slots++;
@@ -1610,9 +2056,21 @@ struct server_context {
                         { "n_tokens_predicted",              metrics.n_tokens_predicted},
                         { "t_tokens_generation",             metrics.t_tokens_generation},
 
+                        { "t_token_latency_p50",             percentile(metrics.t_token_latency, 50)},
+                        { "t_token_latency_p99",             percentile(metrics.t_token_latency, 99)},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
+                        { "n_prefix_lookups_total",          metrics.n_prefix_lookups_total},
+                        { "n_prefix_hits_total",             metrics.n_prefix_hits_total},
+                        { "n_prefix_tokens_saved_total",     metrics.n_prefix_tokens_saved_total},
+                        { "n_prefix_tokens_shared_total",    metrics.n_prefix_tokens_shared_total},
+                        { "n_prefix_evictions_total",        metrics.n_prefix_evictions_total},
+
+                        { "n_draft_tokens_total",            metrics.n_draft_tokens_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
+
                         { "slots",                           slots_data },
                     };
 
@@ -1675,10 +2133,12 @@ struct server_context {
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
                     if (nread == 0) {
                         slot->cache_tokens.resize(0);
+                        prefix_cache.remove(slot->id);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    prefix_cache.update(slot->id, slot->cache_tokens);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -1711,6 +2171,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
+                    prefix_cache.remove(slot->id);
 
                     server_task_result result;
                     result.id = task.id;
@@ -1757,6 +2218,9 @@ struct server_context {
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                // the generated tokens can be reused by the next turn of the conversation
+                prefix_cache.update(slot.id, slot.cache_tokens);
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -1824,6 +2288,17 @@ struct server_context {
                         {"n_cache_tokens",  slot.cache_tokens.size()}
                     });
 
+                    if (!prefix_cache_unshare(slot, n_keep + n_discard)) {
+                        slot.cache_tokens.clear();
+                        prefix_cache.remove(slot.id);
+
+                        slot.state = SLOT_STATE_PROCESSING;
+                        slot.command = SLOT_COMMAND_NONE;
+                        slot.release();
+                        send_error(slot, "Unable to shift the context, no available space in KV cache. Please try increasing KV size.");
+                        continue;
+                    }
+
                     llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
@@ -1835,6 +2310,8 @@ struct server_context {
                         slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
                     }
 
+                    prefix_cache.update(slot.id, slot.cache_tokens);
+
                     slot.n_past -= n_discard;
 
                     slot.truncated = true;
@@ -1845,6 +2322,14 @@ struct server_context {
         // start populating the batch for this iteration
         llama_batch_clear(batch);
 
+        // the sampled tokens of the slots not added yet, the drafts only get the room left by them
+        int32_t n_sampled_pending = 0;
+        for (const auto & slot : slots) {
+            if (slot.state != SLOT_STATE_IDLE) {
+                n_sampled_pending += 1;
+            }
+        }
+
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state == SLOT_STATE_IDLE) {
@@ -1855,16 +2340,50 @@ struct server_context {
 
             const int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
+            if (!slot.draft.empty()) {
+                // drafted tokens of the previous batch that did not fit in the evaluated part of it
+                llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot_npast, -1);
+                slot.draft.clear();
+            }
+
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
             llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
 
             slot.n_past += 1;
+            n_sampled_pending -= 1;
 
             if (slot.params.cache_prompt) {
                 slot.cache_tokens.push_back(slot.sampled);
             }
 
+            // draft the next tokens from the n-grams of the prompt and the generated text, they are verified
+            // with the sampled token in this batch
+            if (slot.params.n_draft > 0 && slot.ga_n == 1 && !slot.ngram_tokens.empty()) {
+                int32_t n_draft = std::min(slot.params.n_draft, (int32_t) llama_n_batch(ctx) - batch.n_tokens - n_sampled_pending);
+                n_draft = std::min(n_draft, slot.n_ctx - 2 - (int32_t) system_tokens.size() - slot.n_past);
+                if (slot.params.n_predict != -1 || params.n_predict != -1) {
+                    // the sampled token and the accepted drafts must fit in n_predict
+                    slot.has_budget(params);
+                    n_draft = std::min(n_draft, slot.n_remaining - 1);
+                }
+
+                if (n_draft > 0) {
+                    // the generations of previous requests are not kept, the dynamic cache is always empty
+                    llama_ngram_table ngram_cache_dynamic;
+
+                    std::vector<llama_token> draft = { slot.sampled };
+                    llama_ngram_cache_draft(slot.ngram_tokens, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                            slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+                    slot.draft.assign(draft.begin() + 1, draft.end());
+                    for (size_t j = 0; j < slot.draft.size(); ++j) {
+                        llama_batch_add(batch, slot.draft[j], system_tokens.size() + slot.n_past + j, { slot.id + 1 }, true);
+                    }
+                    slot.n_drafted += slot.draft.size();
+                }
+            }
+
             LOG_VERBOSE("slot decode token", {
                 {"id_slot",         slot.id},
                 {"id_task",         slot.id_task},
@@ -2010,6 +2529,9 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                // a longer prefix may already be in the KV cache of another slot
+                                prefix_cache_share(slot, prompt_tokens);
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
@@ -2032,101 +2554,149 @@ struct server_context {
 
                         slot.n_prompt_tokens_processed = 0;
                     }
+                }
+            }
 
-                    if (slot.embedding) {
-                        // cannot fit the prompt in the current batch - will try next iter
-                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
-                            continue;
-                        }
-                    }
+            // the sampled tokens of the ongoing sequences are always decoded, the rest of the budget goes to
+            // the pending prompts in the order of the scheduling policy - at least one prompt token is evaluated
+            // per iteration so that new requests cannot starve
+            const int32_t n_budget = std::min(n_batch, std::max(batch.n_tokens + 1, sched_budget > 0 ? sched_budget : n_batch));
 
-                    // keep only the common part
-                    int p0 = (int) system_tokens.size() + slot.n_past;
-                    if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1)) {
-                        // could not partially delete (likely using a non-Transformer model)
-                        llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            std::vector<server_slot *> slots_prompt;
+            for (auto & slot : slots) {
+                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
+                    slots_prompt.push_back(&slot);
+                }
+            }
 
-                        p0 = (int) system_tokens.size();
-                        if (p0 != 0) {
-                            // copy over the system prompt when there is one
-                            llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
-                        }
+            sched_sort(slots_prompt);
 
-                        // there is no common part left (except for the system prompt)
-                        slot.n_past = 0;
-                        slot.n_past_se = 0;
-                        slot.ga_i = 0;
-                        // TODO: is the system prompt ever in the sampling context?
-                        llama_sampling_reset(slot.ctx_sampling);
+            for (server_slot * slot_prompt : slots_prompt) {
+                server_slot & slot = *slot_prompt;
+
+                auto & prompt_tokens = slot.prompt_tokens;
+
+                if (slot.embedding) {
+                    // cannot fit the prompt in the current batch - will try next iter
+                    if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
+                        continue;
                     }
+                }
 
-                    // remove the non-common part from the cache
-                    slot.cache_tokens.resize(slot.n_past);
+                // keep only the common part
+                int p0 = (int) system_tokens.size() + slot.n_past;
+                if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1)) {
+                    // could not partially delete (likely using a non-Transformer model)
+                    llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
 
-                    LOG_INFO("kv cache rm [p0, end)", {
-                        { "id_slot", slot.id },
-                        { "id_task", slot.id_task },
-                        { "p0",      p0 }
-                    });
+                    p0 = (int) system_tokens.size();
+                    if (p0 != 0) {
+                        // copy over the system prompt when there is one
+                        llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+                    }
 
-                    int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
+                    // there is no common part left (except for the system prompt)
+                    slot.n_past = 0;
+                    slot.n_past_se = 0;
+                    slot.ga_i = 0;
+                    // TODO: is the system prompt ever in the sampling context?
+                    llama_sampling_reset(slot.ctx_sampling);
+                }
 
-                    int32_t ga_i = slot.ga_i;
-                    int32_t ga_n = slot.ga_n;
-                    int32_t ga_w = slot.ga_w;
+                // remove the non-common part from the cache, a slot without prompt caching keeps no tokens and
+                // must not be indexed, its KV cells are overwritten by the next request
+                if (slot.params.cache_prompt) {
+                    slot.cache_tokens.resize(slot.n_past);
+                    prefix_cache.update(slot.id, slot.cache_tokens);
+                } else {
+                    slot.cache_tokens.clear();
+                    prefix_cache.remove(slot.id);
+                }
 
-                    // add prompt tokens for processing in the current batch
-                    // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
-                        if (slot.ga_n != 1) {
-                            while (slot_npast >= ga_i + ga_w) {
-                                const int bd = (ga_w/ga_n)*(ga_n - 1);
-                                slot_npast -= bd;
-                                ga_i += ga_w/ga_n;
-                            }
-                        }
+                LOG_INFO("kv cache rm [p0, end)", {
+                    { "id_slot", slot.id },
+                    { "id_task", slot.id_task },
+                    { "p0",      p0 }
+                });
+
+                int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
-                        llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
+                int32_t ga_i = slot.ga_i;
+                int32_t ga_n = slot.ga_n;
+                int32_t ga_w = slot.ga_w;
 
-                        if (slot.params.cache_prompt) {
-                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
+                // a chunk of the prompt is evaluated per iteration, an embedding needs the whole prompt in one batch
+                int32_t n_past_end   = slot.n_prompt_tokens;
+                int32_t n_tokens_end = n_batch;
+                if (!slot.embedding) {
+                    if (sched_prefill_chunk > 0) {
+                        n_past_end = std::min(n_past_end, slot.n_past + sched_prefill_chunk);
+                    }
+                    n_tokens_end = n_budget;
+                }
+
+                // add prompt tokens for processing in the current batch
+                // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
+                for (; slot.n_past < n_past_end && batch.n_tokens < n_tokens_end; ++slot.n_past) {
+                    if (slot.ga_n != 1) {
+                        while (slot_npast >= ga_i + ga_w) {
+                            const int bd = (ga_w/ga_n)*(ga_n - 1);
+                            slot_npast -= bd;
+                            ga_i += ga_w/ga_n;
                         }
+                    }
+
+                    llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
 
-                        slot.n_prompt_tokens_processed++;
-                        slot_npast++;
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
                     }
 
-                    LOG_VERBOSE("prompt processing progress", {
-                        {"id_slot",  slot.id},
-                        {"n_past",   slot.n_past},
-                        {"n_ctx",    n_ctx},
-                        {"n_tokens", batch.n_tokens},
-                        {"progress", (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens},
-                    });
+                    slot.n_prompt_tokens_processed++;
+                    slot_npast++;
+                }
 
-                    // entire prompt has been processed - start decoding new tokens
-                    if (slot.n_past == slot.n_prompt_tokens) {
-                        slot.state   = SLOT_STATE_PROCESSING;
-                        slot.command = SLOT_COMMAND_NONE;
+                LOG_VERBOSE("prompt processing progress", {
+                    {"id_slot",  slot.id},
+                    {"n_past",   slot.n_past},
+                    {"n_ctx",    n_ctx},
+                    {"n_tokens", batch.n_tokens},
+                    {"progress", (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens},
+                });
 
-                        GGML_ASSERT(batch.n_tokens > 0);
+                // entire prompt has been processed - start decoding new tokens
+                if (slot.n_past == slot.n_prompt_tokens) {
+                    slot.state   = SLOT_STATE_PROCESSING;
+                    slot.command = SLOT_COMMAND_NONE;
 
-                        // extract the logits only for the last token
-                        batch.logits[batch.n_tokens - 1] = true;
+                    GGML_ASSERT(batch.n_tokens > 0);
 
-                        slot.n_decoded = 0;
-                        slot.i_batch   = batch.n_tokens - 1;
+                    // extract the logits only for the last token
+                    batch.logits[batch.n_tokens - 1] = true;
 
-                        LOG_VERBOSE("prompt done", {
-                            {"id_slot",  slot.id},
-                            {"n_past",   slot.n_past},
-                            {"n_ctx",    n_ctx},
-                            {"n_tokens", batch.n_tokens},
-                        });
+                    slot.n_decoded = 0;
+                    slot.i_batch   = batch.n_tokens - 1;
+
+                    if (slot.params.cache_prompt) {
+                        prefix_cache.update(slot.id, slot.cache_tokens);
+                    }
+
+                    if (slot.params.n_draft > 0) {
+                        // the prompt is the main source of drafts, e.g. summaries copy spans of it
+                        slot.ngram_tokens = prompt_tokens;
+                        slot.ngram_cache.clear();
+                        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_tokens, slot.ngram_tokens.size(), false);
                     }
+
+                    LOG_VERBOSE("prompt done", {
+                        {"id_slot",  slot.id},
+                        {"n_past",   slot.n_past},
+                        {"n_ctx",    n_ctx},
+                        {"n_tokens", batch.n_tokens},
+                    });
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_budget) {
                     break;
                 }
             }
@@ -2188,6 +2758,13 @@ struct server_context {
             const int ret = llama_decode(ctx, batch_view);
 
             if (ret != 0) {
+                // make room by dropping the least recently used prefix of an idle slot
+                if (ret > 0 && prefix_cache_evict()) {
+                    i -= n_batch;
+
+                    continue; // continue loop of n_batch
+                }
+
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     LOG_ERROR("failed to decode the batch: KV cache is full - try increasing it via the context size", {
@@ -2230,39 +2807,77 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                // the sampled token is followed by the drafted tokens, a drafted token is accepted when it is the token
+                // sampled from the logits of the previous one
+                const int32_t n_draft_view = std::min((int32_t) slot.draft.size(), i + n_tokens - 1 - slot.i_batch);
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+                for (int32_t j = 0; j <= n_draft_view; ++j) {
+                    completion_token_output result;
+                    const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch + j - i);
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+                    llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = ggml_time_us();
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        slot.t_last_token = slot.t_start_generation;
+                        metrics.on_prompt_eval(slot);
+                    } else {
+                        const int64_t t_token = ggml_time_us();
+                        slot.t_token_latency.push_back((t_token - slot.t_last_token) / 1e3);
+                        slot.t_last_token = t_token;
+                        metrics.on_token_latency(slot.t_token_latency.back());
+                    }
 
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0) {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
-                }
+                    llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+                    result.tok = id;
 
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t) n_probs); ++i) {
-                    result.probs.push_back({
-                        cur_p.data[i].id,
-                        cur_p.data[i].p
-                    });
+                    const int32_t n_probs = slot.sparams.n_probs;
+                    if (slot.sparams.temp <= 0 && n_probs > 0) {
+                        // for llama_sample_token_greedy we need to sort candidates
+                        llama_sample_softmax(ctx, &cur_p);
+                    }
+
+                    for (size_t i = 0; i < std::min(cur_p.size, (size_t) n_probs); ++i) {
+                        result.probs.push_back({
+                            cur_p.data[i].id,
+                            cur_p.data[i].p
+                        });
+                    }
+
+                    if (slot.params.n_draft > 0) {
+                        slot.ngram_tokens.push_back(id);
+                        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_tokens, 1, false);
+                    }
+
+                    if (!process_token(result, slot)) {
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
+                    }
+
+                    if (j == n_draft_view || id != slot.draft[j]) {
+                        break;
+                    }
+
+                    // the drafted token is accepted, it is already in the KV cache and its logits are the next ones
+                    slot.n_draft_accepted += 1;
+                    slot.n_past += 1;
+
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.push_back(id);
+                    }
                 }
 
-                if (!process_token(result, slot)) {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                if (n_draft_view == (int32_t) slot.draft.size()) {
+                    // remove the rejected drafts, the ones in the next part of the batch are removed with the next batch
+                    if (!slot.draft.empty()) {
+                        llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
+                    }
+                    slot.draft.clear();
                 }
 
                 slot.i_batch = -1;
@@ -2363,11 +2978,25 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
     printf("                            KV cache data type for K (default: f16)\n");
     printf("  -ctv TYPE, --cache-type-v TYPE\n");
     printf("                            KV cache data type for V (default: f16)\n");
+    printf("  -fa, --flash-attn         enable fused flash attention (default: %s)\n", params.flash_attn ? "enabled" : "disabled");
     printf("  --log-format              log output format: json or text (default: json)\n");
     printf("  --log-disable             disables logging to a file.\n");
     printf("  --slots-endpoint-disable  disables slots monitoring endpoint.\n");
     printf("  --metrics                 enable prometheus compatible metrics endpoint (default: %s).\n", sparams.metrics_endpoint ? "enabled" : "disabled");
     printf("  --slot-save-path PATH     path to save slot kv cache (default: disabled)\n");
+    printf("  --sched-policy POLICY     order in which pending prompts are processed: fcfs, spf (shortest prompt first)\n");
+    printf("                            or priority (\"priority\" field of the request) (default: fcfs)\n");
+    printf("  --sched-budget N          maximum number of tokens decoded per iteration, shared by the generated tokens of\n");
+    printf("                            all slots and the prompts being processed (default: %d, 0 = batch size)\n", sparams.sched_budget);
+    printf("  --sched-prefill-chunk N   maximum number of prompt tokens of one slot per iteration, so that long prompts do\n");
+    printf("                            not stall the generation of the other slots (default: %d, 0 = no limit)\n", sparams.sched_prefill_chunk);
+    printf("  --draft-max N             maximum number of tokens drafted per step by n-gram lookup, the \"n_draft\" of the\n");
+    printf("                            requests is clamped to it (default: %d)\n", sparams.n_draft_max);
+    printf("  -lcs, --lookup-cache-static FNAME\n");
+    printf("                            n-gram cache of a text corpus used with the prompt to draft tokens for the requests\n");
+    printf("                            with \"n_draft\" > 0, see lookup-create (default: none)\n");
+    printf("  --embd-index FNAME        embeddings searched for the \"n_neighbors\" nearest ones of the embedding requests,\n");
+    printf("                            e.g. saved by retrieval --store (default: none)\n");
     printf("\n");
     printf("  -n, --n-predict           maximum tokens to predict (default: %d)\n", params.n_predict);
     printf("  --override-kv KEY=TYPE:VALUE\n");
@@ -2619,6 +3248,8 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
             }
         } else if (arg == "-nkvo" || arg == "--no-kv-offload") {
             params.no_kv_offload = true;
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            params.flash_attn = true;
         } else if (arg == "--split-mode" || arg == "-sm") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -2776,6 +3407,46 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
             sparams.slots_endpoint = false;
         } else if (arg == "--metrics") {
             sparams.metrics_endpoint = true;
+        } else if (arg == "-lcs" || arg == "--lookup-cache-static") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.lookup_cache_static = argv[i];
+        } else if (arg == "--embd-index") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.embd_index = argv[i];
+        } else if (arg == "--sched-policy") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "fcfs")     { sparams.sched_policy = SERVER_SCHED_FCFS; }
+            else if (value == "spf")      { sparams.sched_policy = SERVER_SCHED_SPF; }
+            else if (value == "priority") { sparams.sched_policy = SERVER_SCHED_PRIORITY; }
+            else { invalid_param = true; break; }
+        } else if (arg == "--sched-budget") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.sched_budget = std::stoi(argv[i]);
+        } else if (arg == "--sched-prefill-chunk") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.sched_prefill_chunk = std::stoi(argv[i]);
+        } else if (arg == "--draft-max") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_draft_max = std::stoi(argv[i]);
         } else if (arg == "--slot-save-path") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -3010,10 +3681,15 @@ int main(int argc, char ** argv) {
     }
 
     // load the model
-    if (!ctx_server.load_model(params)) {
+    if (!ctx_server.load_model(params) || (!sparams.embd_index.empty() && !ctx_server.load_embd_index(sparams.embd_index))) {
         state.store(SERVER_STATE_ERROR);
         return 1;
     } else {
+        ctx_server.sched_policy        = sparams.sched_policy;
+        ctx_server.sched_budget        = sparams.sched_budget;
+        ctx_server.sched_prefill_chunk = sparams.sched_prefill_chunk;
+        ctx_server.n_draft_max         = sparams.n_draft_max;
+
         ctx_server.init();
         state.store(SERVER_STATE_READY);
     }
@@ -3218,6 +3894,9 @@ int main(int argc, char ** argv) {
 
         const int32_t kv_cache_used_cells = data["kv_cache_used_cells"];
 
+        const uint64_t n_prefix_lookups = data["n_prefix_lookups_total"];
+        const uint64_t n_prefix_hits    = data["n_prefix_hits_total"];
+
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
         json all_metrics_def = json {
             {"counter", {{
@@ -3236,6 +3915,34 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data["t_tokens_generation_total"] / 1.e3}
+            }, {
+                    {"name",  "prefix_cache_lookups_total"},
+                    {"help",  "Number of prompts looked up in the prompt prefix cache."},
+                    {"value",  n_prefix_lookups}
+            }, {
+                    {"name",  "prefix_cache_hits_total"},
+                    {"help",  "Number of prompts that reused a cached prefix."},
+                    {"value",  n_prefix_hits}
+            }, {
+                    {"name",  "prefix_cache_tokens_saved_total"},
+                    {"help",  "Number of prompt tokens reused from the KV cache instead of being processed."},
+                    {"value",  (uint64_t) data["n_prefix_tokens_saved_total"]}
+            }, {
+                    {"name",  "prefix_cache_tokens_shared_total"},
+                    {"help",  "Number of prompt tokens reused from the KV cache of another slot."},
+                    {"value",  (uint64_t) data["n_prefix_tokens_shared_total"]}
+            }, {
+                    {"name",  "prefix_cache_evictions_total"},
+                    {"help",  "Number of cached prefixes evicted to free KV cache cells."},
+                    {"value",  (uint64_t) data["n_prefix_evictions_total"]}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of tokens drafted by n-gram lookup."},
+                    {"value",  (uint64_t) data["n_draft_tokens_total"]}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of drafted tokens accepted by the model."},
+                    {"value",  (uint64_t) data["n_draft_accepted_total"]}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3245,10 +3952,22 @@ int main(int argc, char ** argv) {
                     {"name",  "predicted_tokens_seconds"},
                     {"help",  "Average generation throughput in tokens/s."},
                     {"value",  n_tokens_predicted ? 1.e3 / t_tokens_generation * n_tokens_predicted : 0.}
+            },{
+                    {"name",  "token_latency_p50_seconds"},
+                    {"help",  "Median latency between consecutive generated tokens of a request."},
+                    {"value",  (double) data["t_token_latency_p50"] / 1.e3}
+            },{
+                    {"name",  "token_latency_p99_seconds"},
+                    {"help",  "99th percentile latency between consecutive generated tokens of a request."},
+                    {"value",  (double) data["t_token_latency_p99"] / 1.e3}
             },{
                     {"name",  "kv_cache_usage_ratio"},
                     {"help",  "KV-cache usage. 1 means 100 percent usage."},
                     {"value",  1. * kv_cache_used_cells / params.n_ctx}
+            },{
+                    {"name",  "prefix_cache_hit_ratio"},
+                    {"help",  "Fraction of prompts that reused a cached prefix."},
+                    {"value",  n_prefix_lookups ? 1. * n_prefix_hits / n_prefix_lookups : 0.}
             },{
                     {"name",  "kv_cache_tokens"},
                     {"help",  "KV-cache tokens."},
@@ -3708,6 +4427,15 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // nearest neighbors in the embedding index
+        const int32_t n_neighbors = json_value(body, "n_neighbors", 0);
+        if (n_neighbors > 0 && ctx_server.embd_store.n_rows > 0) {
+            const int32_t n_probe = json_value(body, "n_probe", 0);
+            for (json & elem : responses) {
+                elem["neighbors"] = ctx_server.embd_index_neighbors(json_value(elem, "embedding", std::vector<float>()), n_neighbors, n_probe);
+            }
+        }
+
         // write JSON response
         json root = is_openai
             ? format_embeddings_response_oaicompat(body, responses)
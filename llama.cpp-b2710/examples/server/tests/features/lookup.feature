@@ -0,0 +1,58 @@
+@llama.cpp
+@lookup
+Feature: llama.cpp server n-gram lookup decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   42 as server seed
+    And   1024 KV cache size
+    And   2 slots
+    And   continuous batching
+    And   16 as batch size
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario Outline: Same completion with and without drafts from the prompt
+    Given a prompt:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside. Once upon a time, there was a little
+      """
+    And   32 max tokens to predict
+    And   a sampling temperature of <temperature>
+    And   a completion request with no api error
+    Then  32 tokens are predicted matching (Lily|girl)
+    And   the completion is stored
+    Given a prompt:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside. Once upon a time, there was a little
+      """
+    And   8 tokens drafted by n-gram lookup
+    And   a completion request with no api error
+    Then  32 tokens are predicted matching (Lily|girl)
+    And   the completion is the same as the stored one
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:draft_tokens_total is greater than 0
+
+    Examples: Sampling temperatures
+      | temperature |
+      | 0.0         |
+      | 0.8         |
+
+  Scenario: Multi users drafting more tokens than the batch can hold
+    Given a prompt:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside. Once upon a time, there was a little
+      """
+    And a prompt:
+      """
+      Once upon a time, there was a little boy named Tom. He loved to play outside. Once upon a time, there was a little
+      """
+    And 64 max tokens to predict
+    And 64 tokens drafted by n-gram lookup
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 64 tokens
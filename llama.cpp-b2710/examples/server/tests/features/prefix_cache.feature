@@ -0,0 +1,33 @@
+@llama.cpp
+@prefix_cache
+Feature: llama.cpp server prompt prefix cache shared across slots
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   prompt caching is enabled
+    And   2 slots
+    And   2048 KV cache size
+    And   42 as server seed
+    And   24 max tokens to predict
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Reuse the prompt of another slot
+    # First prompt in slot 0 should be fully processed
+    Given a user prompt "What is the capital of France?"
+    And   using slot id 0
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   22 prompt tokens are processed
+    # The same prompt in slot 1 reuses the KV cache of slot 0 and gives the same output
+    Given a user prompt "What is the capital of France?"
+    And   using slot id 1
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   1 prompt tokens are processed
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:prefix_cache_lookups_total is 2
+    And   metric llamacpp:prefix_cache_hits_total is 1
+    And   metric llamacpp:prefix_cache_tokens_shared_total is 21
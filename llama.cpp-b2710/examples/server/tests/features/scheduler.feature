@@ -0,0 +1,59 @@
+@llama.cpp
+@scheduler
+Feature: llama.cpp server scheduling of prompt processing
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   42 as server seed
+    And   1024 KV cache size
+    And   3 slots
+    And   continuous batching
+    And   spf scheduling policy
+    And   32 tokens as scheduling budget
+    And   8 tokens as prefill chunk
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Multi users completion with chunked prefill
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Once upon a time, in a small village at the edge of a large forest, there lived a little girl who loved to read books about dragons.
+      """
+    And a prompt:
+      """
+      Hello
+      """
+    And 64 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 64 tokens
+    Then prometheus metrics are exposed
+
+  Scenario: Chunked prefill without prompt caching
+    # the prompt is processed in chunks of 8 tokens, none of them is kept for other requests
+    Given a user prompt "What is the capital of France?"
+    And   prompt caching is disabled
+    And   using slot id 0
+    And   64 max tokens to predict
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    And   22 prompt tokens are processed
+    And   the completion is stored
+    # the same prompt in another slot cannot reuse the KV cache of slot 0
+    Given a user prompt "What is the capital of France?"
+    And   prompt caching is enabled
+    And   using slot id 1
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    And   22 prompt tokens are processed
+    And   the completion is the same as the stored one
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:prefix_cache_hits_total is 0
@@ -52,7 +52,12 @@ def step_server_config(context, server_fqdn, server_port):
     context.slot_save_path = None
     context.id_slot = None
     context.cache_prompt = None
+    context.n_draft = None
+    context.temperature = None
     context.n_slots = None
+    context.sched_policy = None
+    context.sched_budget = None
+    context.sched_prefill_chunk = None
     context.prompt_prefix = None
     context.prompt_suffix = None
     context.server_api_key = None
@@ -122,6 +127,31 @@ def step_server_n_predict(context, n_predict):
     context.n_server_predict = n_predict
 
 
+@step('{n_draft:d} tokens drafted by n-gram lookup')
+def step_n_draft(context, n_draft):
+    context.n_draft = n_draft
+
+
+@step('a sampling temperature of {temperature:f}')
+def step_temperature(context, temperature):
+    context.temperature = temperature
+
+
+@step('{sched_policy} scheduling policy')
+def step_sched_policy(context, sched_policy):
+    context.sched_policy = sched_policy
+
+
+@step('{sched_budget:d} tokens as scheduling budget')
+def step_sched_budget(context, sched_budget):
+    context.sched_budget = sched_budget
+
+
+@step('{sched_prefill_chunk:d} tokens as prefill chunk')
+def step_sched_prefill_chunk(context, sched_prefill_chunk):
+    context.sched_prefill_chunk = sched_prefill_chunk
+
+
 @step('{slot_save_path} as slot save path')
 def step_slot_save_path(context, slot_save_path):
     context.slot_save_path = slot_save_path
@@ -137,6 +167,11 @@ def step_enable_prompt_cache(context):
     context.cache_prompt = True
 
 
+@step('prompt caching is disabled')
+def step_disable_prompt_cache(context):
+    context.cache_prompt = False
+
+
 @step('continuous batching')
 def step_server_continuous_batching(context):
     context.server_continuous_batching = True
@@ -232,6 +267,8 @@ async def step_request_completion(context, api_error):
                                           n_predict=context.n_predict,
                                           cache_prompt=context.cache_prompt,
                                           id_slot=context.id_slot,
+                                          n_draft=context.n_draft,
+                                          temperature=context.temperature,
                                           seed=await completions_seed(context),
                                           expect_api_error=expect_api_error,
                                           user_api_key=context.user_api_key)
@@ -254,6 +291,17 @@ def step_n_tokens_predicted(context, predicted_n):
     assert_n_tokens_predicted(context.completion, predicted_n)
 
 
+@step('the completion is stored')
+def step_store_completion(context):
+    context.completion_stored = context.completion['content']
+
+
+@step('the completion is the same as the stored one')
+def step_assert_completion_same_as_stored(context):
+    assert context.completion['content'] == context.completion_stored, \
+        f"completion differs:\n{context.completion['content']}\n---\n{context.completion_stored}"
+
+
 @step('the completion is  truncated')
 def step_assert_completion_truncated(context):
     step_assert_completion_truncated(context, '')
@@ -453,6 +501,8 @@ async def step_concurrent_completion_requests(context):
                               prompt_prefix=context.prompt_prefix,
                               prompt_suffix=context.prompt_suffix,
                               n_predict=context.n_predict if hasattr(context, 'n_predict') else None,
+                              cache_prompt=context.cache_prompt,
+                              n_draft=context.n_draft,
                               seed=await completions_seed(context),
                               user_api_key=context.user_api_key if hasattr(context,
                                                                            'user_api_key') else None)
@@ -689,6 +739,13 @@ def step_assert_metric_value(context, metric_name, metric_value):
     assert context.metrics[metric_name].samples[0].value == metric_value, f"metric: {context.metrics[metric_name]}"
 
 
+@step('metric {metric_name} is greater than {metric_value:d}')
+def step_assert_metric_value_greater(context, metric_name, metric_value):
+    if metric_name not in context.metrics:
+        assert False, f"no metric {metric_name} in {context.metrics.keys()}"
+    assert context.metrics[metric_name].samples[0].value > metric_value, f"metric: {context.metrics[metric_name]}"
+
+
 @step('available models')
 def step_available_models(context):
     # openai client always expects an api_key
@@ -773,6 +830,8 @@ async def request_completion(prompt,
                              n_predict=None,
                              cache_prompt=False,
                              id_slot=None,
+                             n_draft=None,
+                             temperature=None,
                              seed=None,
                              expect_api_error=None,
                              user_api_key=None):
@@ -787,17 +846,22 @@ async def request_completion(prompt,
             print(f"Set user_api_key: {user_api_key}")
         headers['Authorization'] = f'Bearer {user_api_key}'
 
+    payload = {
+        "input_prefix": prompt_prefix,
+        "prompt": prompt,
+        "input_suffix": prompt_suffix,
+        "n_predict": n_predict if n_predict is not None else -1,
+        "cache_prompt": cache_prompt,
+        "id_slot": id_slot,
+        "n_draft": n_draft if n_draft is not None else 0,
+        "seed": seed if seed is not None else 42
+    }
+    if temperature is not None:
+        payload["temperature"] = temperature
+
     async with aiohttp.ClientSession() as session:
         async with session.post(f'{base_url}/completion',
-                                json={
-                                    "input_prefix": prompt_prefix,
-                                    "prompt": prompt,
-                                    "input_suffix": prompt_suffix,
-                                    "n_predict": n_predict if n_predict is not None else -1,
-                                    "cache_prompt": cache_prompt,
-                                    "id_slot": id_slot,
-                                    "seed": seed if seed is not None else 42
-                                },
+                                json=payload,
                                 headers=headers,
                                 timeout=3600) as response:
             if expect_api_error is None or not expect_api_error:
@@ -1164,6 +1228,12 @@ def start_server_background(context):
         server_args.extend(['--n-predict', context.n_server_predict])
     if context.slot_save_path:
         server_args.extend(['--slot-save-path', context.slot_save_path])
+    if context.sched_policy:
+        server_args.extend(['--sched-policy', context.sched_policy])
+    if context.sched_budget:
+        server_args.extend(['--sched-budget', context.sched_budget])
+    if context.sched_prefill_chunk:
+        server_args.extend(['--sched-prefill-chunk', context.sched_prefill_chunk])
     if context.server_api_key:
         server_args.extend(['--api-key', context.server_api_key])
     if context.n_ga:
@@ -9,6 +9,8 @@
 #include <vector>
 #include <sstream>
 #include <random>
+#include <algorithm>
+#include <cmath>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
 
@@ -258,6 +260,20 @@ static size_t common_part(const std::vector<llama_token> & a, const std::vector<
     return i;
 }
 
+// nearest-rank percentile p (0 - 100) of the samples, 0 if there are none
+static double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+
+    const double rank = std::ceil(p / 100.0 * samples.size());
+    const size_t k    = (size_t) std::max(0.0, std::min((double) samples.size(), rank) - 1);
+
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+
+    return samples[k];
+}
+
 static bool ends_with(const std::string & str, const std::string & suffix) {
     return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
 }
@@ -580,11 +596,15 @@ static json format_embeddings_response_oaicompat(const json & request, const jso
     json data = json::array();
     int i = 0;
     for (auto & elem : embeddings) {
-        data.push_back(json{
+        json item = json{
             {"embedding", json_value(elem, "embedding", json::array())},
             {"index",     i++},
             {"object",    "embedding"}
-        });
+        };
+        if (elem.contains("neighbors")) {
+            item["neighbors"] = elem.at("neighbors");
+        }
+        data.push_back(item);
     }
 
     json res = json {
@@ -0,0 +1,246 @@
+#include "common.h"
+#include "llama.h"
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// self-speculative decoding: the draft tokens are generated by the first layers of the target model itself,
+// which reuses its weights and its KV cache, and then verified in a single batch with all layers
+int main(int argc, char ** argv) {
+    gpt_params params;
+
+    if (gpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.seed == LLAMA_DEFAULT_SEED) {
+        params.seed = time(NULL);
+    }
+
+#ifndef LOG_DISABLE_LOGS
+    log_set_target(log_filename_generator("self-speculative", "log"));
+    LOG_TEE("Log start\n");
+    log_dump_cmdline(argc, argv);
+#endif // LOG_DISABLE_LOGS
+
+    // init llama.cpp
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_model * model = NULL;
+    llama_context * ctx = NULL;
+
+    // load the target model
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+    llama_set_rng_seed(ctx, params.seed);
+
+    const int n_layer = llama_n_layer(model);
+
+    // number of layers used to draft
+    const int n_layer_draft = params.n_layer_draft > 0 ? std::min(params.n_layer_draft, n_layer) : std::max(1, n_layer/2);
+
+    LOG_TEE("%s: drafting with %d of %d layers\n", __func__, n_layer_draft, n_layer);
+
+    // Tokenize the prompt
+    std::vector<llama_token> inp;
+    inp = ::llama_tokenize(ctx, params.prompt, true, true);
+
+    const int max_context_size     = llama_n_ctx(ctx);
+    const int max_tokens_list_size = max_context_size - 4;
+
+    if ((int) inp.size() > max_tokens_list_size) {
+        fprintf(stderr, "%s: error: prompt too long (%d tokens, max %d)\n", __func__, (int) inp.size(), max_tokens_list_size);
+        return 1;
+    }
+
+    fprintf(stderr, "\n\n");
+
+    for (auto id : inp) {
+        fprintf(stderr, "%s", llama_token_to_piece(ctx, id).c_str());
+    }
+
+    fflush(stderr);
+
+    const int n_input = inp.size();
+
+    const auto t_enc_start = ggml_time_us();
+
+    // eval the prompt with all layers, the first layers of its KV cache are shared with the draft
+    llama_decode(ctx, llama_batch_get_one( inp.data(), n_input - 1, 0,           0));
+    llama_decode(ctx, llama_batch_get_one(&inp.back(),           1, n_input - 1, 0));
+
+    const auto t_enc_end = ggml_time_us();
+
+    // how many tokens to draft each time
+    const int n_draft = params.n_draft;
+
+    int n_predict = 0;
+    int n_drafted = 0;
+    int n_accept  = 0;
+
+    int n_past = inp.size();
+
+    // used to determine end of generation
+    bool has_eos = false;
+
+    int64_t t_draft_us = 0;
+
+    // target model sampling context
+    struct llama_sampling_context * ctx_sampling = llama_sampling_init(params.sparams);
+
+    // draft sampling context
+    params.sparams.grammar.clear(); // the draft sampler copies the target sampler's grammar
+    if (params.sparams.temp == 0) {
+        params.sparams.temp = -1.0f; // force greedy sampling with probs for the draft
+    }
+    struct llama_sampling_context * ctx_sampling_dft = llama_sampling_init(params.sparams);
+
+    std::vector<llama_token> draft;
+
+    llama_batch batch_dft = llama_batch_init(1, 0, 1);
+    llama_batch batch_tgt = llama_batch_init(std::max(n_draft + 1, 1), 0, 1);
+
+    const auto t_dec_start = ggml_time_us();
+
+    while (true) {
+        LOG("drafted %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, draft).c_str());
+
+        int i_dft = 0;
+        llama_token id;
+
+        // loop until we fail to accept a drafted token or we run out of drafted tokens
+        while (true) {
+            // sample from the target model
+            id = llama_sampling_sample(ctx_sampling, ctx, NULL, i_dft);
+
+            llama_sampling_accept(ctx_sampling, ctx, id, true);
+
+            const std::string token_str = llama_token_to_piece(ctx, id);
+
+            if (llama_token_is_eog(model, id)) {
+                has_eos = true;
+            }
+            ++n_predict;
+
+            // check if the target token matches the draft
+            if (i_dft < (int) draft.size() && id == draft[i_dft]) {
+                LOG("the sampled target token matches the %dth drafted token (%d, '%s') - accepted\n", i_dft, id, token_str.c_str());
+                ++n_accept;
+                ++n_past;
+                ++i_dft;
+
+                if (params.use_color) {
+                    // color accepted draft token
+                    printf("\033[34m%s\033[0m", token_str.c_str());
+                } else {
+                    printf("%s", token_str.c_str());
+                }
+                fflush(stdout);
+
+                if (has_eos || (params.n_predict > 0 && n_predict > params.n_predict)) {
+                    break;
+                }
+                continue;
+            }
+
+            printf("%s", token_str.c_str());
+            fflush(stdout);
+
+            LOG("the sampled target token (%d, '%s') did not match, or we ran out of drafted tokens\n", id, token_str.c_str());
+            break;
+        }
+
+        if ((params.n_predict > 0 && n_predict > params.n_predict) || has_eos) {
+            break;
+        }
+
+        // clean the cache of draft tokens that weren't accepted
+        llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+
+        draft.clear();
+
+        // draft with the first layers of the model
+        // the drafted tokens attend to the KV cache of these layers, which the full model has already filled for the accepted tokens
+        {
+            const int64_t t_start_draft_us = ggml_time_us();
+
+            llama_set_n_layer_exit(ctx, n_layer_draft);
+            llama_sampling_cp(ctx_sampling, ctx_sampling_dft);
+
+            llama_token id_dft = id;
+            for (int i = 0; i < n_draft; ++i) {
+                llama_batch_clear(batch_dft);
+                llama_batch_add  (batch_dft, id_dft, n_past + i, { 0 }, true);
+
+                if (llama_decode(ctx, batch_dft) != 0) {
+                    break;
+                }
+
+                id_dft = llama_sampling_sample(ctx_sampling_dft, ctx, NULL, 0);
+                llama_sampling_accept(ctx_sampling_dft, ctx, id_dft, true);
+
+                LOG(" - draft candidate %3d: %6d (%8.3f) '%s'\n", i, id_dft, ctx_sampling_dft->cur[0].p, llama_token_to_piece(ctx, id_dft).c_str());
+
+                draft.push_back(id_dft);
+
+                if (llama_token_is_eog(model, id_dft)) {
+                    break;
+                }
+            }
+
+            llama_set_n_layer_exit(ctx, 0);
+
+            t_draft_us += ggml_time_us() - t_start_draft_us;
+            n_drafted  += draft.size();
+        }
+
+        // the KV cells of the drafted tokens only have the first layers, the verification writes all of them again
+        llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+
+        // evaluate the sampled token and the drafted tokens with all layers in a single batch
+        llama_batch_clear(batch_tgt);
+        llama_batch_add  (batch_tgt, id, n_past, { 0 }, true);
+        for (size_t i = 0; i < draft.size(); ++i) {
+            llama_batch_add(batch_tgt, draft[i], n_past + i + 1, { 0 }, true);
+        }
+
+        llama_decode(ctx, batch_tgt);
+        ++n_past;
+    }
+
+    auto t_dec_end = ggml_time_us();
+
+    LOG_TEE("\n\n");
+
+    LOG_TEE("encoded %4d tokens in %8.3f seconds, speed: %8.3f t/s\n", n_input,   (t_enc_end - t_enc_start) / 1e6f, inp.size() / ((t_enc_end - t_enc_start) / 1e6f));
+    LOG_TEE("decoded %4d tokens in %8.3f seconds, speed: %8.3f t/s\n", n_predict, (t_dec_end - t_dec_start) / 1e6f, n_predict  / ((t_dec_end - t_dec_start) / 1e6f));
+
+    LOG_TEE("\n");
+    LOG_TEE("n_layer   = %d of %d\n", n_layer_draft, n_layer);
+    LOG_TEE("n_draft   = %d\n", n_draft);
+    LOG_TEE("n_predict = %d\n", n_predict);
+    LOG_TEE("n_drafted = %d\n", n_drafted);
+    LOG_TEE("t_draft   = %.2f ms, %.2f ms per token\n", t_draft_us*1e-3, t_draft_us*1e-3/std::max(n_drafted, 1));
+    LOG_TEE("n_accept  = %d\n", n_accept);
+    LOG_TEE("accept    = %.3f%%\n", 100.0f * n_accept / n_drafted);
+
+    LOG_TEE("\ntarget and draft:\n");
+    llama_print_timings(ctx);
+
+    llama_sampling_free(ctx_sampling);
+    llama_sampling_free(ctx_sampling_dft);
+
+    llama_batch_free(batch_dft);
+    llama_batch_free(batch_tgt);
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    fprintf(stderr, "\n\n");
+
+    return 0;
+}
@@ -189,7 +189,11 @@ int main(int argc, char ** argv) {
     }
 
     llama_batch batch_dft = llama_batch_init(params.n_ctx, 0, 1);
-    llama_batch batch_tgt = llama_batch_init(params.n_ctx, 0, n_seq_dft);
+
+    // the drafted tokens of all sequences form a tree, which the target model evaluates in a single batch
+    // i_batch_tgt of a sequence holds the indices of its tokens in the tree
+    std::vector<llama_token> tokens_tgt;
+    std::vector<int32_t>     parents_tgt;
 
     const auto t_dec_start = ggml_time_us();
 
@@ -397,10 +401,8 @@ int main(int argc, char ** argv) {
                 llama_kv_cache_seq_cp  (ctx_dft, s_keep, 0, -1, -1);
                 llama_kv_cache_seq_keep(ctx_dft, 0);
 
-                llama_kv_cache_seq_rm  (ctx_tgt, s_keep, n_past_tgt, -1);
-                llama_kv_cache_seq_keep(ctx_tgt, s_keep);
-                llama_kv_cache_seq_cp  (ctx_tgt, s_keep, 0, -1, -1);
-                llama_kv_cache_seq_keep(ctx_tgt, 0);
+                // keep the root and the accepted tokens of the tree, drop the other branches
+                llama_tree_accept(ctx_tgt, drafts[s_keep].i_batch_tgt.data(), i_dft + 1);
             }
 
             for (int s = 0; s < n_seq_dft; ++s) {
@@ -441,8 +443,8 @@ int main(int argc, char ** argv) {
         drafts[0].drafting    = true;
         drafts[0].i_batch_dft = 0;
 
-        llama_batch_clear(batch_tgt);
-        llama_batch_add  (batch_tgt, drafts[0].tokens[0], n_past_tgt, { 0 }, true);
+        tokens_tgt.assign(1, drafts[0].tokens[0]);
+        parents_tgt.assign(1, -1);
 
         // sample n_draft tokens from the draft model using tree-based sampling
         for (int i = 0; i < n_draft; ++i) {
@@ -476,17 +478,6 @@ int main(int argc, char ** argv) {
                         llama_kv_cache_seq_rm(ctx_dft,    n_seq_cur, -1, -1);
                         llama_kv_cache_seq_cp(ctx_dft, s, n_seq_cur, -1, -1);
 
-                        // all previous tokens from this branch are now also part of the new branch
-                        for (int t = 0; t < batch_tgt.n_tokens; ++t) {
-                            for (int p = 0; p < batch_tgt.n_seq_id[t]; ++p) {
-                                if (batch_tgt.seq_id[t][p] == s) {
-                                    batch_tgt.seq_id[t][batch_tgt.n_seq_id[t]] = n_seq_cur;
-                                    batch_tgt.n_seq_id[t]++;
-                                    break;
-                                }
-                            }
-                        }
-
                         // copy the draft state
                         drafts[n_seq_cur].active   = true;
                         drafts[n_seq_cur].drafting = true;
@@ -519,17 +510,18 @@ int main(int argc, char ** argv) {
                     // save cur_p.data into drafts[s].dists
                     drafts[s].dists.push_back(cur_p);
 
-                    // add unique drafted tokens to the target batch
-                    drafts[s].i_batch_tgt.push_back(batch_tgt.n_tokens);
+                    // add unique drafted tokens to the target tree, as children of the previous token of the sequence
+                    parents_tgt.push_back(drafts[s].i_batch_tgt.back());
+                    drafts[s].i_batch_tgt.push_back(tokens_tgt.size());
 
-                    llama_batch_add(batch_tgt, id, n_past_tgt + i + 1, { s }, true);
+                    tokens_tgt.push_back(id);
 
                     // add the token to the batch for batched decoding with the draft model
                     drafts[s].i_batch_dft = batch_dft.n_tokens;
 
                     llama_batch_add(batch_dft, id, n_past_cur, { s }, true);
 
-                    if (batch_tgt.n_tokens > n_draft) {
+                    if ((int) tokens_tgt.size() > n_draft) {
                         drafts[s].drafting = false;
                     }
                 }
@@ -545,20 +537,14 @@ int main(int argc, char ** argv) {
             ++n_past_cur;
             ++n_drafted;
 
-            if (batch_tgt.n_tokens > n_draft) {
+            if ((int) tokens_tgt.size() > n_draft) {
                 break;
             }
         }
 
         // evaluate the target model on the drafted tokens
         {
-            llama_kv_cache_seq_keep(ctx_tgt, 0);
-            for (int s = 1; s < n_seq_dft; ++s) {
-                llama_kv_cache_seq_cp(ctx_tgt, 0, s, -1, -1);
-            }
-
-            // LOG("target batch: %s\n", LOG_BATCH_TOSTR_PRETTY(ctx_tgt, batch_tgt).c_str());
-            llama_decode(ctx_tgt, batch_tgt);
+            llama_decode_tree(ctx_tgt, tokens_tgt.data(), parents_tgt.data(), tokens_tgt.size(), n_past_tgt, 0);
             ++n_past_tgt;
         }
 
@@ -2012,6 +2012,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "LEAKY_RELU",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "SSM_CONV",
@@ -2038,7 +2039,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 76, "GGML_OP_COUNT != 76");
+static_assert(GGML_OP_COUNT == 77, "GGML_OP_COUNT != 77");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -2102,6 +2103,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "leaky_relu(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "ssm_conv(x)",
@@ -2128,7 +2130,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 76, "GGML_OP_COUNT != 76");
+static_assert(GGML_OP_COUNT == 77, "GGML_OP_COUNT != 77");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -2379,6 +2381,41 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// with GGML_NUMA_STRATEGY_DISTRIBUTE, thread ith runs on node ith % n_nodes (see set_numa_thread_affinity)
+// mul_mat gives each node a fixed slice of the src0 rows, which depends neither on the number of threads nor on src1,
+// and ggml_numa_place_tensor moves the pages of each slice of the weights to the node that processes it
+static int ggml_numa_split_n_nodes(void) {
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_DISTRIBUTE || g_state.numa.n_nodes < 2) {
+        return 1;
+    }
+    return g_state.numa.n_nodes;
+}
+
+// the rows [*ir0, *ir1) of a matrix with nr rows that belong to node
+static void ggml_numa_node_rows(int64_t nr, int node, int n_nodes, int64_t * ir0, int64_t * ir1) {
+    const int64_t dr = (nr + n_nodes - 1)/n_nodes;
+
+    *ir0 = MIN(dr*node, nr);
+    *ir1 = MIN(*ir0 + dr, nr);
+}
+
+// the rows of the node of thread ith, and the index and number of threads on that node
+// returns false if the rows are not split by node
+static bool ggml_numa_mul_mat_split(int64_t nr, int ith, int nth, int64_t * ir0, int64_t * ir1, int * ith_node, int * nth_node) {
+    const int n_nodes = ggml_numa_split_n_nodes();
+    if (n_nodes < 2 || nth < n_nodes) {
+        return false;
+    }
+
+    const int node = ith % n_nodes;
+    ggml_numa_node_rows(nr, node, n_nodes, ir0, ir1);
+
+    *ith_node = ith / n_nodes;
+    *nth_node = (nth - node + n_nodes - 1)/n_nodes;
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6228,6 +6265,65 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        struct ggml_tensor  * pos,
+        float                 scale,
+        float                 max_bias) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    // TODO: check if vT can be multiplied by (k*qT)
+    GGML_ASSERT(k->ne[1] == v->ne[1]);
+    GGML_ASSERT(k->ne[2] == v->ne[2]);
+    GGML_ASSERT(q->ne[3] == k->ne[3] && q->ne[3] == v->ne[3]);
+
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_is_contiguous(mask));
+        GGML_ASSERT(mask->ne[0] == k->ne[1]);
+        GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+        GGML_ASSERT(mask->ne[2] == 1 && mask->ne[3] == 1);
+    }
+
+    if (max_bias > 0.0f) {
+        GGML_ASSERT(pos);
+    }
+
+    if (pos) {
+        GGML_ASSERT(ggml_is_vector(pos));
+        GGML_ASSERT(pos->type == GGML_TYPE_F32);
+        GGML_ASSERT(pos->ne[0] == k->ne[1]);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        is_node = true;
+    }
+
+    // permute(0, 2, 1, 3)
+    int64_t ne[4] = { v->ne[0], q->ne[2], q->ne[1], q->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    float params[] = { scale, max_bias };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+    result->src[4] = pos;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -7092,8 +7188,8 @@ static void ggml_compute_forward_dup_same_cont(
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
+    // parallelize by elements (blocks for quantized types)
+    const int ne = ggml_nelements(dst)/ggml_blck_size(dst->type);
     const int dr = (ne + nth - 1) / nth;
     const int ie0 = dr * ith;
     const int ie1 = MIN(ie0 + dr, ne);
@@ -7427,6 +7523,24 @@ static void ggml_compute_forward_dup_f32(
         return;
     }
 
+    if (ggml_is_quantized(dst->type) && type_traits[dst->type].from_float &&
+        ggml_are_same_shape(src0, dst) && nb00 == sizeof(float) && !ggml_is_contiguous(dst)) {
+        // quantize by rows into a strided destination (e.g. a view of a quantized KV cache)
+        ggml_from_float_t const quantize_row_q = type_traits[dst->type].from_float;
+
+        for (int64_t i03 = 0; i03 < ne03; i03++) {
+            for (int64_t i02 = 0; i02 < ne02; i02++) {
+                for (int64_t i01 = ir0; i01 < ir1; i01++) {
+                    quantize_row_q(
+                        (const float *) ((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03),
+                                        ((char *)        dst->data + i01*nb1  + i02*nb2  + i03*nb3),
+                        ne00);
+                }
+            }
+        }
+        return;
+    }
+
     if (ggml_is_contiguous(dst)) {
         // TODO: simplify
         if (nb00 == sizeof(float)) {
@@ -7668,7 +7782,7 @@ static void ggml_compute_forward_dup_bytes(
         ne00 == ne0 &&
         nb00 == type_size && nb0 == type_size) {
         // copy by rows
-        const size_t rs = ne00 * type_size;
+        const size_t rs = ggml_row_size(src0->type, ne00);
         for (int64_t i03 = 0; i03 < ne03; i03++) {
             for (int64_t i02 = 0; i02 < ne02; i02++) {
                 for (int64_t i01 = ir0; i01 < ir1; i01++) {
@@ -7782,6 +7896,50 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+
+    if (params->type == GGML_TASK_TYPE_INIT || params->type == GGML_TASK_TYPE_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    // the rows of both tensors must be contiguous, they are dequantized one at a time
+    GGML_ASSERT(nb00 == ggml_type_size(src0->type));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    ggml_to_float_t const dequantize_row_q = type_traits[src0->type].to_float;
+    GGML_ASSERT(dequantize_row_q != NULL);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // parallelize by rows
+    const int64_t nr = ne01*ne02*ne03;
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        dequantize_row_q(
+                (const void *) ((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03),
+                (float *)      ((char *)        dst->data + i01*nb1  + i02*nb2  + i03*nb3),
+                ne00);
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -7804,6 +7962,10 @@ static void ggml_compute_forward_dup(
             } break;
         default:
             {
+                if (ggml_is_quantized(src0->type)) {
+                    ggml_compute_forward_dup_q(params, dst);
+                    break;
+                }
                 GGML_ASSERT(false);
             } break;
     }
@@ -10824,18 +10986,25 @@ static void ggml_compute_forward_mul_mat(
     }
 #endif
 
+    // range of src0 rows split among the threads, all rows unless they are split by NUMA node
+    int64_t ir0_first = 0;
+    int64_t ir0_last  = ne01;
+    int     ith_split = ith;
+    int     nth_split = nth;
+    const bool numa_split = ggml_numa_mul_mat_split(ne01, ith, nth, &ir0_first, &ir0_last, &ith_split, &nth_split);
+
 #if GGML_USE_LLAMAFILE
     if (nb10 == ggml_type_size(src1->type)) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(ir0_last - ir0_first, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + ir0_first*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + ir0_first*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     ith_split, nth_split,
                                      params->type,
                                      src0->type,
                                      src1->type,
@@ -10881,16 +11050,16 @@ UseGgmlGemm1:;
     if (nb10 == ggml_type_size(src1->type) || src1->type != vec_dot_type) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(ir0_last - ir0_first, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + ir0_first*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + ggml_row_size(vec_dot_type,
                                          nb12/ggml_type_size(src1->type)*i12 +
                                          nb13/ggml_type_size(src1->type)*i13),
                                      row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + ir0_first*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     ith_split, nth_split,
                                      params->type,
                                      src0->type,
                                      vec_dot_type,
@@ -10907,18 +11076,19 @@ UseGgmlGemm2:;
     //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
     // distribute the thread work across the inner or outer loop based on which one is larger
+    // with the NUMA split, always by src0 rows, so that each node only reads its own slice of src0
 
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    const int64_t nth0 = numa_split || nr0 > nr1 ? nth_split : 1; // parallelize by src0 rows
+    const int64_t nth1 = numa_split || nr0 > nr1 ? 1 : nth;       // parallelize by src1 rows
 
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
+    const int64_t ith0 = ith_split % nth0;
+    const int64_t ith1 = ith_split / nth0;
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
+    const int64_t dr0 = (ir0_last - ir0_first + nth0 - 1)/nth0;
     const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
 
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+    const int64_t ir010 = ir0_first + dr0*ith0;
+    const int64_t ir011 = MIN(ir010 + dr0, ir0_last);
 
     const int64_t ir110 = dr1*ith1;
     const int64_t ir111 = MIN(ir110 + dr1, nr1);
@@ -14583,6 +14753,207 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_ext
+
+// number of consecutive query rows of the same head that share one pass over K and V
+#define GGML_FA_TILE_Q 8
+
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * q    = dst->src[0];
+    const struct ggml_tensor * k    = dst->src[1];
+    const struct ggml_tensor * v    = dst->src[2];
+    const struct ggml_tensor * mask = dst->src[3];
+    const struct ggml_tensor * pos  = dst->src[4];
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    if (params->type == GGML_TASK_TYPE_INIT || params->type == GGML_TASK_TYPE_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne1 == neq2);
+    GGML_ASSERT(ne2 == N);
+
+    GGML_ASSERT(neq0 == DK);
+    GGML_ASSERT(nek1 == nev1);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    // K and V can be F16 or block-quantized, Q is converted to the vec_dot type of K
+    enum ggml_type    const k_vec_dot_type = type_traits[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
+
+    GGML_ASSERT(q_to_vec_dot && kq_vec_dot && v_to_float);
+    GGML_ASSERT(DK % ggml_blck_size(k_vec_dot_type) == 0);
+
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, DK);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors (GQA)
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rv2 = neq2/nev2;
+
+    float scale    = 1.0f;
+    float max_bias = 0.0f;
+
+    memcpy(&scale,    (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias, (float *) dst->op_params + 1, sizeof(float));
+
+    // same ALiBi slopes as ggml_compute_forward_soft_max_f32
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    const float * pp = pos ? (const float *) pos->data : NULL;
+
+    // work is split in tiles of GGML_FA_TILE_Q queries, so every K/V row that is loaded is used for the whole tile
+    const int64_t n_tiles = (N + GGML_FA_TILE_Q - 1)/GGML_FA_TILE_Q;
+    const int64_t nt      = n_tiles*neq2*neq3;
+
+    // tiles per thread
+    const int64_t dt = (nt + nth - 1)/nth;
+
+    // tile range for this thread
+    const int64_t it0 = dt*ith;
+    const int64_t it1 = MIN(it0 + dt, nt);
+
+    float * VKQ = (float *) params->wdata + (GGML_FA_TILE_Q*(DV + DK) + DV + CACHE_LINE_SIZE_F32)*ith; // [GGML_FA_TILE_Q][DV]
+    char  * QC  = (char *) (VKQ + GGML_FA_TILE_Q*DV);                                                  // [GGML_FA_TILE_Q][q_row_size]
+    float * V32 = VKQ + GGML_FA_TILE_Q*(DV + DK);                                                      // [DV]
+
+    float S[GGML_FA_TILE_Q]; // running sum of exp(s - M)
+    float M[GGML_FA_TILE_Q]; // running maximum of s
+
+    for (int64_t it = it0; it < it1; ++it) {
+        const int64_t iq3 = it/(n_tiles*neq2);
+        const int64_t iq2 = (it - iq3*n_tiles*neq2)/n_tiles;
+        const int64_t iq1 = (it - iq3*n_tiles*neq2 - iq2*n_tiles)*GGML_FA_TILE_Q;
+
+        const int64_t nq = MIN(GGML_FA_TILE_Q, N - iq1);
+
+        const uint32_t h = iq2; // head
+        const float slope = max_bias > 0.0f ? (h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1)) : 0.0f;
+
+        const int64_t ik2 = iq2/rk2;
+        const int64_t iv2 = iq2/rv2;
+
+        for (int64_t j = 0; j < nq; ++j) {
+            S[j] = 0.0f;
+            M[j] = -INFINITY;
+
+            memset(VKQ + j*DV, 0, DV*sizeof(float));
+
+            const float * pq = (const float *) ((const char *) q->data + (iq1 + j)*nbq1 + iq2*nbq2 + iq3*nbq3);
+            q_to_vec_dot(pq, QC + j*q_row_size, DK);
+        }
+
+        // online softmax over the KV cells
+        for (int64_t ic = 0; ic < nek1; ++ic) {
+            const char * pk = (const char *) k->data + ic*nbk1 + ik2*nbk2 + iq3*nbk3;
+            const char * pv = (const char *) v->data + ic*nbv1 + iv2*nbv2 + iq3*nbv3;
+
+            const float bias = pp ? slope*pp[ic] : 0.0f;
+
+            bool v_loaded = false;
+
+            for (int64_t j = 0; j < nq; ++j) {
+                const float mv = mask ? ((const float *) ((const char *) mask->data + (iq1 + j)*mask->nb[1]))[ic] : 0.0f;
+                if (mv == -INFINITY) {
+                    continue;
+                }
+
+                float s;
+                kq_vec_dot(DK, &s, 0, pk, 0, QC + j*q_row_size, 0, 1);
+
+                s = s*scale + mv + bias;
+
+                if (!v_loaded) {
+                    v_to_float(pv, V32, DV);
+                    v_loaded = true;
+                }
+
+                float ms = 1.0f; // rescale factor of the previous accumulator
+                float vs = 1.0f; // weight of the current V row
+
+                if (s > M[j]) {
+                    ms = expf(M[j] - s);
+                    M[j] = s;
+
+                    ggml_vec_scale_f32(DV, VKQ + j*DV, ms);
+                } else {
+                    vs = expf(s - M[j]);
+                }
+
+                ggml_vec_mad_f32(DV, VKQ + j*DV, V32, vs);
+
+                S[j] = S[j]*ms + vs;
+            }
+        }
+
+        for (int64_t j = 0; j < nq; ++j) {
+            // a fully masked row produces zeros
+            const float S_inv = S[j] == 0.0f ? 0.0f : 1.0f/S[j];
+            ggml_vec_scale_f32(DV, VKQ + j*DV, S_inv);
+
+            // dst is permuted: [DV, n_head, N, ne3]
+            memcpy((char *) dst->data + (iq1 + j)*nb2 + iq2*nb1 + iq3*nb3, VKQ + j*DV, DV*sizeof(float));
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * q = dst->src[0];
+    const struct ggml_tensor * k = dst->src[1];
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+
+    switch (k->type) {
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q4_0:
+            {
+                ggml_compute_forward_flash_attn_ext_f16(params, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -16390,6 +16761,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor);
@@ -17455,6 +17830,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             zero_table);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -17902,6 +18281,46 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
+// mutex and condition variable used by the threadpool to park idle workers
+
+#if defined(_WIN32)
+
+typedef SRWLOCK            ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(m)      InitializeSRWLock(m)
+#define ggml_mutex_destroy(m)   UNUSED(m)
+#define ggml_mutex_lock(m)      AcquireSRWLockExclusive(m)
+#define ggml_mutex_unlock(m)    ReleaseSRWLockExclusive(m)
+#define ggml_cond_init(c)       InitializeConditionVariable(c)
+#define ggml_cond_destroy(c)    UNUSED(c)
+#define ggml_cond_wait(c, m)    SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ggml_cond_broadcast(c)  WakeAllConditionVariable(c)
+
+#else
+
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(m)      pthread_mutex_init(m, NULL)
+#define ggml_mutex_destroy(m)   pthread_mutex_destroy(m)
+#define ggml_mutex_lock(m)      pthread_mutex_lock(m)
+#define ggml_mutex_unlock(m)    pthread_mutex_unlock(m)
+#define ggml_cond_init(c)       pthread_cond_init(c, NULL)
+#define ggml_cond_destroy(c)    pthread_cond_destroy(c)
+#define ggml_cond_wait(c, m)    pthread_cond_wait(c, m)
+#define ggml_cond_broadcast(c)  pthread_cond_broadcast(c)
+
+#endif
+
+static inline void ggml_cpu_relax(void) {
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+    _mm_pause();
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__gnu_linux__)
 static void set_numa_thread_affinity(int thread_n) {
@@ -17969,11 +18388,128 @@ static void clear_numa_thread_affinity(void) {
 
     CPU_FREE(cpus);
 }
+
+// pin the calling thread to the CPUs in the threadpool mask
+// with strict_cpu, thread ith gets only the ith CPU of the mask (wrapping around)
+static bool set_cpumask_thread_affinity(const struct ggml_threadpool_params * tpp, int ith) {
+    int n_set = 0;
+    for (int i = 0; i < GGML_MAX_N_CPUS; ++i) {
+        n_set += tpp->cpumask[i];
+    }
+    if (n_set == 0) {
+        return false;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+
+    for (int i = 0, k = 0; i < GGML_MAX_N_CPUS && i < CPU_SETSIZE; ++i) {
+        if (!tpp->cpumask[i]) {
+            continue;
+        }
+        if (!tpp->strict_cpu || k == ith % n_set) {
+            CPU_SET(i, &cpus);
+        }
+        k++;
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+
+    return true;
+}
+
+struct ggml_numa_place_state {
+    const struct ggml_tensor * tensor;
+    int node;
+    int n_nodes;
+    int n_failed;
+    int err;
+};
+
+static thread_ret_t ggml_numa_place_thread(void * data) {
+    struct ggml_numa_place_state * state = (struct ggml_numa_place_state *) data;
+    const struct ggml_tensor * t = state->tensor;
+
+    // run on the node, so that pages that are not resident yet are allocated there on first touch
+    set_numa_thread_affinity(state->node);
+
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    int64_t ir0;
+    int64_t ir1;
+    ggml_numa_node_rows(t->ne[1], state->node, state->n_nodes, &ir0, &ir1);
+
+    for (int64_t i3 = 0; i3 < t->ne[3]; i3++) {
+        for (int64_t i2 = 0; i2 < t->ne[2]; i2++) {
+            const uintptr_t base  = (uintptr_t) t->data + i2*t->nb[2] + i3*t->nb[3];
+            // only whole pages, the pages at the boundaries are shared with the neighbouring slices
+            const uintptr_t first = (base + ir0*t->nb[1] + page_size - 1) & ~(page_size - 1);
+            const uintptr_t last  = (base + ir1*t->nb[1]) & ~(page_size - 1);
+            if (last <= first) {
+                continue;
+            }
+
+            volatile uint8_t sum = 0;
+            for (uintptr_t p = first; p < last; p += page_size) {
+                sum += *(const volatile uint8_t *) p;
+            }
+            UNUSED(sum);
+
+            // move the pages that were already resident on another node
+            unsigned long nodemask = 1ul << state->node;
+            const long rv = syscall(SYS_mbind, (void *) first, last - first, 1 /* MPOL_PREFERRED */,
+                                    &nodemask, sizeof(nodemask)*8, 1 << 1 /* MPOL_MF_MOVE */);
+            if (rv != 0) {
+                state->n_failed++;
+                state->err = errno;
+            }
+        }
+    }
+
+    clear_numa_thread_affinity();
+
+    return 0;
+}
+
+void ggml_numa_place_tensor(const struct ggml_tensor * tensor) {
+    const int n_nodes = ggml_numa_split_n_nodes();
+    if (n_nodes < 2 || tensor->data == NULL || tensor->ne[1] < n_nodes) {
+        return;
+    }
+
+    struct ggml_numa_place_state states[GGML_NUMA_MAX_NODES];
+    pthread_t threads[GGML_NUMA_MAX_NODES];
+
+    for (int node = 0; node < n_nodes; ++node) {
+        states[node] = (struct ggml_numa_place_state) { tensor, node, n_nodes, 0, 0 };
+        const int rc = pthread_create(&threads[node], NULL, ggml_numa_place_thread, &states[node]);
+        GGML_ASSERT(rc == 0);
+    }
+
+    int err = 0;
+    for (int node = 0; node < n_nodes; ++node) {
+        pthread_join(threads[node], NULL);
+        if (states[node].n_failed > 0) {
+            err = states[node].err;
+        }
+    }
+
+    static bool warned = false;
+    if (err != 0 && !warned) {
+        fprintf(stderr, "warning: mbind() failed for tensor %s: %s, some pages may be on the wrong NUMA node\n", tensor->name, strerror(err));
+        warned = true;
+    }
+}
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
+void ggml_numa_place_tensor(const struct ggml_tensor * tensor) { UNUSED(tensor); }
 static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
+static bool set_cpumask_thread_affinity(const struct ggml_threadpool_params * tpp, int ith) { UNUSED(tpp); UNUSED(ith); return false; }
 #endif
 
 struct ggml_compute_state_shared {
@@ -17999,6 +18535,24 @@ struct ggml_compute_state {
     int ith;
     struct ggml_compute_state_shared * shared;
     enum ggml_status ec;
+    bool pinned; // affinity was already set by the owning threadpool worker
+    struct ggml_threadpool * threadpool;
+};
+
+struct ggml_threadpool {
+    struct ggml_threadpool_params params;
+
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;
+
+    // workers[0] is a placeholder for the thread calling ggml_graph_compute()
+    struct ggml_compute_state * workers;
+
+    struct ggml_compute_state_shared * shared; // state of the graph being computed
+
+    atomic_int n_graph;   // incremented each time a new graph is submitted
+    atomic_int n_pending; // number of workers that have not finished the current graph yet
+    atomic_int stop;
 };
 
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
@@ -18174,6 +18728,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads, int n_cur_
                 n_tasks = n_threads;
             } break;
         case GGML_OP_FLASH_ATTN:
+        case GGML_OP_FLASH_ATTN_EXT:
             {
                 n_tasks = n_threads;
             } break;
@@ -18300,7 +18855,9 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith);
+    if (!state->pinned) {
+        set_numa_thread_affinity(state->ith);
+    }
 
     int node_n     = -1;
     int task_phase = GGML_TASK_TYPE_FINALIZE;
@@ -18577,6 +19134,14 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                         cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
                     }
                 } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    const int64_t DK = node->src[1]->ne[0];
+                    const int64_t DV = node->src[2]->ne[0];
+
+                    // per thread: F32 accumulators + converted Q rows for a tile of queries, one V row in F32
+                    cur = sizeof(float)*(GGML_FA_TILE_Q*(DV + DK) + DV + CACHE_LINE_SIZE_F32)*n_tasks;
+                } break;
             case GGML_OP_FLASH_FF:
                 {
                     if (node->src[1]->type == GGML_TYPE_F32) {
@@ -18627,6 +19192,176 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
+//
+// threadpool
+//
+
+struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads) {
+    struct ggml_threadpool_params params;
+    memset(&params, 0, sizeof(params));
+
+    params.n_threads  = n_threads > 0 ? n_threads : GGML_DEFAULT_N_THREADS;
+    params.poll       = 50;
+    params.strict_cpu = false;
+
+    return params;
+}
+
+// wait until a graph newer than last_graph is submitted or the pool is stopped
+// spin first (proportionally to the polling level) and then sleep on the condition variable
+static int ggml_threadpool_wait(struct ggml_threadpool * threadpool, int last_graph) {
+    const uint64_t n_rounds = (uint64_t) threadpool->params.poll * 1024;
+
+    for (uint64_t i = 0; i < n_rounds; ++i) {
+        const int n_graph = atomic_load(&threadpool->n_graph);
+        if (n_graph != last_graph || atomic_load(&threadpool->stop)) {
+            return n_graph;
+        }
+        ggml_cpu_relax();
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    while (atomic_load(&threadpool->n_graph) == last_graph && !atomic_load(&threadpool->stop)) {
+        ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
+    }
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    return atomic_load(&threadpool->n_graph);
+}
+
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    if (set_cpumask_thread_affinity(&threadpool->params, state->ith)) {
+        state->pinned = true;
+    } else if (ggml_is_numa()) {
+        set_numa_thread_affinity(state->ith);
+        state->pinned = true;
+    }
+
+    int last_graph = 0;
+
+    while (true) {
+        last_graph = ggml_threadpool_wait(threadpool, last_graph);
+
+        if (atomic_load(&threadpool->stop)) {
+            break;
+        }
+
+        // workers beyond the number of threads planned for this graph sit it out
+        state->shared = threadpool->shared;
+        if (state->ith < state->shared->n_threads) {
+            ggml_graph_compute_thread(state);
+        }
+
+        atomic_fetch_sub(&threadpool->n_pending, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(const struct ggml_threadpool_params * params) {
+    GGML_ASSERT(params->n_threads > 0);
+
+    struct ggml_threadpool * threadpool = GGML_MALLOC(sizeof(struct ggml_threadpool));
+
+    threadpool->params = *params;
+    threadpool->shared = NULL;
+    threadpool->workers = GGML_MALLOC(sizeof(struct ggml_compute_state)*params->n_threads);
+
+    ggml_mutex_init(&threadpool->mutex);
+    ggml_cond_init(&threadpool->cond);
+
+    atomic_store(&threadpool->n_graph,   0);
+    atomic_store(&threadpool->n_pending, 0);
+    atomic_store(&threadpool->stop,      0);
+
+    for (int j = 0; j < params->n_threads; ++j) {
+        threadpool->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = NULL,
+            .ec         = GGML_STATUS_SUCCESS,
+            .pinned     = false,
+            .threadpool = threadpool,
+        };
+    }
+
+    for (int j = 1; j < params->n_threads; ++j) {
+        const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_worker, &threadpool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return threadpool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (threadpool == NULL) {
+        return;
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    atomic_store(&threadpool->stop, 1);
+    ggml_cond_broadcast(&threadpool->cond);
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    for (int j = 1; j < threadpool->params.n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_mutex_destroy(&threadpool->mutex);
+    ggml_cond_destroy(&threadpool->cond);
+
+    GGML_FREE(threadpool->workers);
+    GGML_FREE(threadpool);
+}
+
+int ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->params.n_threads;
+}
+
+// hand the graph to the parked workers and run the share of thread 0 on the calling thread
+static enum ggml_status ggml_threadpool_compute(struct ggml_threadpool * threadpool, struct ggml_compute_state_shared * state_shared) {
+    struct ggml_compute_state * workers = threadpool->workers;
+
+    for (int j = 0; j < threadpool->params.n_threads; ++j) {
+        workers[j].ec = GGML_STATUS_SUCCESS;
+    }
+    workers[0].shared = state_shared;
+
+    threadpool->shared = state_shared;
+    atomic_store(&threadpool->n_pending, threadpool->params.n_threads - 1);
+
+    ggml_mutex_lock(&threadpool->mutex);
+    atomic_fetch_add(&threadpool->n_graph, 1);
+    ggml_cond_broadcast(&threadpool->cond);
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    // this is a work thread too
+    ggml_graph_compute_thread(&workers[0]);
+
+    // don't leave affinity set on the main thread
+    clear_numa_thread_affinity();
+
+    // the shared state lives on the caller's stack - wait until every worker is done with it
+    while (atomic_load(&threadpool->n_pending) > 0) {
+        ggml_cpu_relax();
+    }
+
+    enum ggml_status compute_status = GGML_STATUS_SUCCESS;
+    for (int j = 0; j < state_shared->n_threads; ++j) {
+        if (workers[j].ec != GGML_STATUS_SUCCESS) {
+            compute_status = workers[j].ec;
+        }
+    }
+
+    return compute_status;
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -18637,7 +19372,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         }
     }
 
-    const int n_threads = cplan->n_threads;
+    struct ggml_threadpool * threadpool = cplan->n_threads > 1 ? cplan->threadpool : NULL;
+
+    // the work buffer was planned for cplan->n_threads, so running on fewer threads is always safe
+    const int n_threads = threadpool ? MIN(cplan->n_threads, threadpool->params.n_threads) : cplan->n_threads;
 
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
@@ -18651,45 +19389,56 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
-
-    // create thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; ++j) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
-                .ec = GGML_STATUS_SUCCESS,
-            };
-
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
-    }
-
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
-    workers[0].ec = GGML_STATUS_SUCCESS;
 
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    // this is a work thread too
-    ggml_graph_compute_thread(&workers[0]);
-    enum ggml_status compute_status = workers[0].ec;
+    enum ggml_status compute_status;
 
-    // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+    if (threadpool) {
+        compute_status = ggml_threadpool_compute(threadpool, &state_shared);
+    } else {
+        struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+        // create thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; ++j) {
+                workers[j] = (struct ggml_compute_state) {
+                    .thrd       = 0,
+                    .ith        = j,
+                    .shared     = &state_shared,
+                    .ec         = GGML_STATUS_SUCCESS,
+                    .pinned     = false,
+                    .threadpool = NULL,
+                };
 
-    // join or kill thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-            if (workers[j].ec != GGML_STATUS_SUCCESS)
-                compute_status = workers[j].ec;
+                const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
+        }
+
+        workers[0].ith        = 0;
+        workers[0].shared     = &state_shared;
+        workers[0].ec         = GGML_STATUS_SUCCESS;
+        workers[0].pinned     = false;
+        workers[0].threadpool = NULL;
+
+        // this is a work thread too
+        ggml_graph_compute_thread(&workers[0]);
+        compute_status = workers[0].ec;
+
+        // don't leave affinity set on the main thread
+        clear_numa_thread_affinity();
+
+        // join or kill thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; j++) {
+                const int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+                if (workers[j].ec != GGML_STATUS_SUCCESS)
+                    compute_status = workers[j].ec;
+            }
         }
     }
 
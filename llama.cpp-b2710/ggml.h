@@ -233,6 +233,7 @@
 #define GGML_MAX_NAME           64
 #endif
 #define GGML_MAX_OP_PARAMS      64
+#define GGML_MAX_N_CPUS         512
 #define GGML_DEFAULT_N_THREADS  4
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 #if UINTPTR_MAX == 0xFFFFFFFF
@@ -475,6 +476,7 @@ extern "C" {
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_SSM_CONV,
@@ -601,6 +603,16 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent pool of compute threads that can be reused across ggml_graph_compute() calls
+    struct ggml_threadpool;
+
+    struct ggml_threadpool_params {
+        int      n_threads;                  // total number of threads, including the calling thread
+        uint32_t poll;                       // polling level (0 - 100): how long idle workers spin before sleeping
+        bool     strict_cpu;                 // pin each worker to a single CPU from cpumask instead of the whole mask
+        bool     cpumask[GGML_MAX_N_CPUS];   // CPUs the workers may run on (all false = no affinity)
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -609,6 +621,9 @@ extern "C" {
 
         int n_threads;
 
+        // optional persistent worker threads, if NULL the threads are created and joined on every call
+        struct ggml_threadpool * threadpool;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -717,6 +732,10 @@ extern "C" {
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // with GGML_NUMA_STRATEGY_DISTRIBUTE, move the pages of each slice of rows of a weight matrix to the NUMA node
+    // whose threads process these rows in ggml_mul_mat; does nothing with other strategies
+    GGML_API void    ggml_numa_place_tensor(const struct ggml_tensor * tensor);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1720,6 +1739,23 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // fused KQ -> soft_max_ext -> KQV with online softmax, the KQ matrix is never materialized
+    // q:    [n_embd_k, n_batch, n_head,    ne3]
+    // k:    [n_embd_k, n_kv,    n_head_kv, ne3]
+    // v:    [n_embd_v, n_kv,    n_head_kv, ne3] !! not transposed !!
+    // mask: [n_kv,     n_batch, 1,         1]   (optional)
+    // pos:  [n_kv]                              (optional, ALiBi positions as in ggml_soft_max_ext)
+    // res:  [n_embd_v, n_head,  n_batch,   ne3] !! permuted !!
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            struct ggml_tensor  * pos,
+            float                 scale,
+            float                 max_bias);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1981,6 +2017,14 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // threadpool
+    // the workers are started once and park between graphs: they spin for a while (see poll) and then sleep until new work arrives
+    // a threadpool can be used by only one ggml_graph_compute() call at a time
+    GGML_API struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads);
+    GGML_API struct ggml_threadpool *      ggml_threadpool_new (const struct ggml_threadpool_params * params);
+    GGML_API void                          ggml_threadpool_free(struct ggml_threadpool * threadpool);
+    GGML_API int                           ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
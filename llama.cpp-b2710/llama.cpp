@@ -36,6 +36,7 @@
 #ifdef __has_include
     #if __has_include(<unistd.h>)
         #include <unistd.h>
+        #include <sys/uio.h>
         #if defined(_POSIX_MAPPED_FILES)
             #include <sys/mman.h>
             #include <fcntl.h>
@@ -58,20 +59,33 @@
     #include <io.h>
 #endif
 
+#if defined(__AES__)
+#include <wmmintrin.h>
+#endif
+
+#if defined(__SSE4_2__) && (defined(__x86_64__) || defined(_M_X64))
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <exception>
 #include <forward_list>
 #include <fstream>
 #include <functional>
@@ -273,6 +287,10 @@ enum llm_kv {
     LLM_KV_GENERAL_LICENSE,
     LLM_KV_GENERAL_SOURCE_URL,
     LLM_KV_GENERAL_SOURCE_HF_REPO,
+    LLM_KV_GENERAL_ENCRYPTION,
+    LLM_KV_GENERAL_ENCRYPTION_IV,
+    LLM_KV_GENERAL_ENCRYPTION_KCV,
+    LLM_KV_GENERAL_TENSOR_CRC32C,
 
     LLM_KV_VOCAB_SIZE,
     LLM_KV_CONTEXT_LENGTH,
@@ -349,6 +367,10 @@ static const std::map<llm_kv, const char *> LLM_KV_NAMES = {
     { LLM_KV_GENERAL_LICENSE,               "general.license"                       },
     { LLM_KV_GENERAL_SOURCE_URL,            "general.source.url"                    },
     { LLM_KV_GENERAL_SOURCE_HF_REPO,        "general.source.huggingface.repository" },
+    { LLM_KV_GENERAL_ENCRYPTION,            "general.encryption"                    },
+    { LLM_KV_GENERAL_ENCRYPTION_IV,         "general.encryption.iv"                 },
+    { LLM_KV_GENERAL_ENCRYPTION_KCV,        "general.encryption.kcv"                },
+    { LLM_KV_GENERAL_TENSOR_CRC32C,         "general.tensor_crc32c"                 },
 
     { LLM_KV_VOCAB_SIZE,                    "%s.vocab_size"            },
     { LLM_KV_CONTEXT_LENGTH,                "%s.context_length"        },
@@ -1167,6 +1189,409 @@ static std::string llama_format_win_err(DWORD err) {
 }
 #endif
 
+//
+// AES-256-CTR
+//
+
+// used to decrypt the tensor data of encrypted models while it is being read from the file
+// the counter block for the byte at offset `offs` of the encrypted data is `iv + offs/16` (128-bit big-endian),
+// so that any range of the data can be decrypted independently, e.g. starting at a tensor offset
+
+struct llama_aes_tables {
+    uint8_t  sbox[256];
+    uint32_t te[4][256];
+
+    llama_aes_tables() {
+        // generate the S-box from the multiplicative inverse in GF(2^8) instead of hardcoding it
+        uint8_t p = 1;
+        uint8_t q = 1;
+        do {
+            // multiply p by 3
+            p = p ^ (uint8_t) (p << 1) ^ (p & 0x80 ? 0x1B : 0);
+
+            // divide q by 3
+            q ^= q << 1;
+            q ^= q << 2;
+            q ^= q << 4;
+            q ^= q & 0x80 ? 0x09 : 0;
+
+            // affine transformation
+            const uint8_t x = q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4);
+            sbox[p] = x ^ 0x63;
+        } while (p != 1);
+        sbox[0] = 0x63;
+
+        for (int i = 0; i < 256; ++i) {
+            const uint32_t s  = sbox[i];
+            const uint32_t s2 = (uint8_t) ((s << 1) ^ (s & 0x80 ? 0x1B : 0));
+            const uint32_t s3 = s2 ^ s;
+
+            te[0][i] = (s2 << 24) | (s << 16) | (s << 8) | s3;
+            te[1][i] = (te[0][i] >>  8) | (te[0][i] << 24);
+            te[2][i] = (te[0][i] >> 16) | (te[0][i] << 16);
+            te[3][i] = (te[0][i] >> 24) | (te[0][i] <<  8);
+        }
+    }
+
+    static uint8_t rotl8(uint8_t x, int n) {
+        return (uint8_t) ((x << n) | (x >> (8 - n)));
+    }
+
+    static const llama_aes_tables & get() {
+        static const llama_aes_tables tables;
+        return tables;
+    }
+};
+
+struct llama_aes256_ctr {
+    static constexpr int    N_ROUNDS   = 14;
+    static constexpr size_t BLOCK_SIZE = 16;
+    static constexpr int    N_BATCH    = 8; // number of keystream blocks generated at once
+
+    uint32_t rk[4*(N_ROUNDS + 1)];          // expanded key, big-endian words
+    uint8_t  rk_bytes[4*4*(N_ROUNDS + 1)];  // expanded key, in byte order (AES-NI)
+    uint64_t iv_hi;
+    uint64_t iv_lo;
+
+    size_t base      = 0; // file offset of the first encrypted byte, the data before it is not touched
+    int    n_threads = 1;
+
+    llama_aes256_ctr(const uint8_t * key, const uint8_t * iv) {
+        const auto & T = llama_aes_tables::get();
+
+        for (int i = 0; i < 8; ++i) {
+            rk[i] = load_be32(key + 4*i);
+        }
+
+        uint32_t rcon = 0x01;
+        for (int i = 8; i < 4*(N_ROUNDS + 1); ++i) {
+            uint32_t t = rk[i - 1];
+            if (i % 8 == 0) {
+                t = (t << 8) | (t >> 24);
+                t = sub_word(T, t) ^ (rcon << 24);
+                rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x1B : 0);
+            } else if (i % 8 == 4) {
+                t = sub_word(T, t);
+            }
+            rk[i] = rk[i - 8] ^ t;
+        }
+
+        for (int i = 0; i < 4*(N_ROUNDS + 1); ++i) {
+            store_be32(rk_bytes + 4*i, rk[i]);
+        }
+
+        iv_hi = load_be64(iv);
+        iv_lo = load_be64(iv + 8);
+    }
+
+    static uint32_t load_be32(const uint8_t * p) {
+        return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+    }
+
+    static uint64_t load_be64(const uint8_t * p) {
+        return ((uint64_t) load_be32(p) << 32) | load_be32(p + 4);
+    }
+
+    static void store_be32(uint8_t * p, uint32_t x) {
+        p[0] = (uint8_t) (x >> 24);
+        p[1] = (uint8_t) (x >> 16);
+        p[2] = (uint8_t) (x >>  8);
+        p[3] = (uint8_t) (x);
+    }
+
+    static void store_be64(uint8_t * p, uint64_t x) {
+        store_be32(p,     (uint32_t) (x >> 32));
+        store_be32(p + 4, (uint32_t) (x));
+    }
+
+    static uint32_t sub_word(const llama_aes_tables & T, uint32_t x) {
+        return ((uint32_t) T.sbox[(x >> 24)       ] << 24) |
+               ((uint32_t) T.sbox[(x >> 16) & 0xFF] << 16) |
+               ((uint32_t) T.sbox[(x >>  8) & 0xFF] <<  8) |
+               ((uint32_t) T.sbox[(x      ) & 0xFF]);
+    }
+
+    void encrypt_block(const uint8_t * in, uint8_t * out) const {
+        const auto & T = llama_aes_tables::get();
+
+        uint32_t s0 = load_be32(in +  0) ^ rk[0];
+        uint32_t s1 = load_be32(in +  4) ^ rk[1];
+        uint32_t s2 = load_be32(in +  8) ^ rk[2];
+        uint32_t s3 = load_be32(in + 12) ^ rk[3];
+
+        for (int r = 1; r < N_ROUNDS; ++r) {
+            const uint32_t * k = rk + 4*r;
+            const uint32_t t0 = T.te[0][s0 >> 24] ^ T.te[1][(s1 >> 16) & 0xFF] ^ T.te[2][(s2 >> 8) & 0xFF] ^ T.te[3][s3 & 0xFF] ^ k[0];
+            const uint32_t t1 = T.te[0][s1 >> 24] ^ T.te[1][(s2 >> 16) & 0xFF] ^ T.te[2][(s3 >> 8) & 0xFF] ^ T.te[3][s0 & 0xFF] ^ k[1];
+            const uint32_t t2 = T.te[0][s2 >> 24] ^ T.te[1][(s3 >> 16) & 0xFF] ^ T.te[2][(s0 >> 8) & 0xFF] ^ T.te[3][s1 & 0xFF] ^ k[2];
+            const uint32_t t3 = T.te[0][s3 >> 24] ^ T.te[1][(s0 >> 16) & 0xFF] ^ T.te[2][(s1 >> 8) & 0xFF] ^ T.te[3][s2 & 0xFF] ^ k[3];
+            s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+        }
+
+        // last round: no MixColumns
+        const uint32_t * k = rk + 4*N_ROUNDS;
+        const auto last = [&](uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+            return ((uint32_t) T.sbox[a >> 24] << 24) | ((uint32_t) T.sbox[(b >> 16) & 0xFF] << 16) |
+                   ((uint32_t) T.sbox[(c >> 8) & 0xFF] << 8) | (uint32_t) T.sbox[d & 0xFF];
+        };
+        store_be32(out +  0, last(s0, s1, s2, s3) ^ k[0]);
+        store_be32(out +  4, last(s1, s2, s3, s0) ^ k[1]);
+        store_be32(out +  8, last(s2, s3, s0, s1) ^ k[2]);
+        store_be32(out + 12, last(s3, s0, s1, s2) ^ k[3]);
+    }
+
+    // generate n_blocks <= N_BATCH keystream blocks, starting with block number blk
+    void keystream(uint64_t blk, int n_blocks, uint8_t * out) const {
+        uint8_t ctr[N_BATCH*BLOCK_SIZE];
+        for (int i = 0; i < n_blocks; ++i) {
+            const uint64_t lo = iv_lo + blk + i;
+            const uint64_t hi = iv_hi + (lo < iv_lo ? 1 : 0);
+            store_be64(ctr + i*BLOCK_SIZE,     hi);
+            store_be64(ctr + i*BLOCK_SIZE + 8, lo);
+        }
+#if defined(__AES__)
+        __m128i k[N_ROUNDS + 1];
+        for (int r = 0; r <= N_ROUNDS; ++r) {
+            k[r] = _mm_loadu_si128((const __m128i *) (rk_bytes + r*BLOCK_SIZE));
+        }
+        __m128i b[N_BATCH];
+        for (int i = 0; i < n_blocks; ++i) {
+            b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (ctr + i*BLOCK_SIZE)), k[0]);
+        }
+        for (int r = 1; r < N_ROUNDS; ++r) {
+            for (int i = 0; i < n_blocks; ++i) {
+                b[i] = _mm_aesenc_si128(b[i], k[r]);
+            }
+        }
+        for (int i = 0; i < n_blocks; ++i) {
+            _mm_storeu_si128((__m128i *) (out + i*BLOCK_SIZE), _mm_aesenclast_si128(b[i], k[N_ROUNDS]));
+        }
+#else
+        for (int i = 0; i < n_blocks; ++i) {
+            encrypt_block(ctr + i*BLOCK_SIZE, out + i*BLOCK_SIZE);
+        }
+#endif
+    }
+
+    // xor buf with the keystream, buf holds the data read from the file at offset offs
+    void apply_chunk(size_t offs, uint8_t * buf, size_t n) const {
+        if (offs + n <= base) {
+            return;
+        }
+        if (offs < base) {
+            buf += base - offs;
+            n   -= base - offs;
+            offs = base;
+        }
+
+        uint64_t blk  = (offs - base) / BLOCK_SIZE;
+        size_t   skip = (offs - base) % BLOCK_SIZE;
+
+        uint8_t ks[N_BATCH*BLOCK_SIZE];
+        while (n > 0) {
+            const int    n_blocks = (int) std::min<size_t>(N_BATCH, (skip + n + BLOCK_SIZE - 1)/BLOCK_SIZE);
+            const size_t n_cur    = std::min(n, n_blocks*BLOCK_SIZE - skip);
+
+            keystream(blk, n_blocks, ks);
+            for (size_t i = 0; i < n_cur; ++i) {
+                buf[i] ^= ks[skip + i];
+            }
+
+            buf  += n_cur;
+            n    -= n_cur;
+            blk  += n_blocks;
+            skip  = 0;
+        }
+    }
+
+    void apply(size_t offs, void * data, size_t n) const {
+        uint8_t * buf = (uint8_t *) data;
+
+        // each thread takes a contiguous range, small reads are not worth the thread startup
+        const size_t min_chunk = 1024*1024;
+        const int n_chunks = (int) std::max<size_t>(1, std::min<size_t>(n_threads, n/min_chunk));
+        if (n_chunks == 1) {
+            apply_chunk(offs, buf, n);
+            return;
+        }
+
+        const size_t chunk = GGML_PAD(n/n_chunks, BLOCK_SIZE);
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_chunks - 1);
+        for (int i = 1; i < n_chunks; ++i) {
+            const size_t first = i*chunk;
+            const size_t last  = i == n_chunks - 1 ? n : std::min(n, first + chunk);
+            if (first >= last) {
+                break;
+            }
+            workers.emplace_back([=]() {
+                apply_chunk(offs + first, buf + first, last - first);
+            });
+        }
+        apply_chunk(offs, buf, std::min(n, chunk));
+
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+};
+
+static bool llama_hex_to_bytes(const std::string & hex, uint8_t * out, size_t n) {
+    if (hex.size() != 2*n) {
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t byte = 0;
+        for (int j = 0; j < 2; ++j) {
+            const char c = hex[2*i + j];
+            byte <<= 4;
+            if (c >= '0' && c <= '9') {
+                byte |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                byte |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                byte |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        out[i] = byte;
+    }
+    return true;
+}
+
+// key check value: the first 3 bytes of the zero block encrypted with the key, in hex
+static std::string llama_aes256_ctr_kcv(const llama_aes256_ctr & cipher) {
+    const uint8_t zero[llama_aes256_ctr::BLOCK_SIZE] = {0};
+    uint8_t out[llama_aes256_ctr::BLOCK_SIZE];
+    cipher.encrypt_block(zero, out);
+
+    char buf[7];
+    snprintf(buf, sizeof(buf), "%02x%02x%02x", out[0], out[1], out[2]);
+    return buf;
+}
+
+//
+// CRC-32C (Castagnoli), used for the checksums of the tensor data
+//
+
+#define LLAMA_CRC32C_POLY 0x82F63B78u // reflected
+
+struct llama_crc32c_table {
+    uint32_t t[8][256];
+
+    llama_crc32c_table() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? (c >> 1) ^ LLAMA_CRC32C_POLY : c >> 1;
+            }
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int j = 1; j < 8; ++j) {
+                t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+static uint32_t llama_crc32c_update(uint32_t crc, const void * data, size_t n) {
+    const uint8_t * p = (const uint8_t *) data;
+    crc = ~crc;
+#if defined(__SSE4_2__) && (defined(__x86_64__) || defined(_M_X64))
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t) _mm_crc32_u64(crc, v);
+    }
+    for (; n > 0; ++p, --n) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    for (; n > 0; ++p, --n) {
+        crc = __crc32cb(crc, *p);
+    }
+#else
+    // slicing-by-8
+    static const llama_crc32c_table T;
+    for (; n >= 8; p += 8, n -= 8) {
+        const uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        const uint32_t hi =        (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+        crc = T.t[7][lo & 0xFF] ^ T.t[6][(lo >> 8) & 0xFF] ^ T.t[5][(lo >> 16) & 0xFF] ^ T.t[4][lo >> 24] ^
+              T.t[3][hi & 0xFF] ^ T.t[2][(hi >> 8) & 0xFF] ^ T.t[1][(hi >> 16) & 0xFF] ^ T.t[0][hi >> 24];
+    }
+    for (; n > 0; ++p, --n) {
+        crc = (crc >> 8) ^ T.t[0][(crc ^ *p) & 0xFF];
+    }
+#endif
+    return ~crc;
+}
+
+static uint32_t llama_gf2_matrix_times(const uint32_t * mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void llama_gf2_matrix_square(uint32_t * square, const uint32_t * mat) {
+    for (int n = 0; n < 32; ++n) {
+        square[n] = llama_gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// the CRC of the concatenation of A and B, from the CRCs of A and B and the length of B
+// this lets several threads checksum consecutive parts of a tensor independently
+static uint32_t llama_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    if (len2 == 0) {
+        return crc1;
+    }
+
+    uint32_t even[32]; // operator for 2^n zero bits, n even
+    uint32_t odd[32];  // operator for 2^n zero bits, n odd
+
+    // the operator for one zero bit
+    odd[0] = LLAMA_CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    llama_gf2_matrix_square(even, odd); // two zero bits
+    llama_gf2_matrix_square(odd, even); // four zero bits
+
+    // apply len2 zero bytes to crc1, the first squaring gives the operator for one zero byte
+    do {
+        llama_gf2_matrix_square(even, odd);
+        if (len2 & 1) {
+            crc1 = llama_gf2_matrix_times(even, crc1);
+        }
+        len2 >>= 1;
+        if (len2 == 0) {
+            break;
+        }
+
+        llama_gf2_matrix_square(odd, even);
+        if (len2 & 1) {
+            crc1 = llama_gf2_matrix_times(odd, crc1);
+        }
+        len2 >>= 1;
+    } while (len2 != 0);
+
+    return crc1 ^ crc2;
+}
+
 template <typename T>
 struct no_init {
     T value;
@@ -1178,6 +1603,9 @@ struct llama_file {
     FILE * fp;
     size_t size;
 
+    // if set, the data returned by read_raw is decrypted on the fly
+    std::unique_ptr<llama_aes256_ctr> cipher;
+
     llama_file(const char * fname, const char * mode) {
         fp = ggml_fopen(fname, mode);
         if (fp == NULL) {
@@ -1211,6 +1639,7 @@ struct llama_file {
         if (len == 0) {
             return;
         }
+        const size_t offs = cipher ? tell() : 0;
         errno = 0;
         std::size_t ret = std::fread(ptr, len, 1, fp);
         if (ferror(fp)) {
@@ -1219,6 +1648,47 @@ struct llama_file {
         if (ret != 1) {
             throw std::runtime_error("unexpectedly reached end of file");
         }
+        if (cipher) {
+            cipher->apply(offs, ptr, len);
+        }
+    }
+
+    // positional read that does not use or move the file position, can be called from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offs) const {
+        uint8_t * dst = (uint8_t *) ptr;
+        size_t n_left = len;
+        size_t pos    = offs;
+        while (n_left > 0) {
+#ifdef _WIN32
+            HANDLE handle = (HANDLE) _get_osfhandle(_fileno(fp));
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) (pos & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) (pos >> 32);
+            DWORD n_read = 0;
+            if (!ReadFile(handle, dst, (DWORD) std::min<size_t>(n_left, 1u << 30), &n_read, &overlapped)) {
+                throw std::runtime_error(format("read error: %s", llama_format_win_err(GetLastError()).c_str()));
+            }
+            const size_t ret = n_read;
+#else
+            const ssize_t ret = pread(fileno(fp), dst, n_left, (off_t) pos);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+#endif
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            dst    += ret;
+            pos    += ret;
+            n_left -= ret;
+        }
+        if (cipher) {
+            // the callers already read from multiple threads
+            cipher->apply_chunk(offs, (uint8_t *) ptr, len);
+        }
     }
 
     uint32_t read_u32() const {
@@ -1242,6 +1712,62 @@ struct llama_file {
         write_raw(&val, sizeof(val));
     }
 
+    // write several buffers with as few system calls as possible, e.g. the rows of a tensor straight from its memory
+    void write_iov(const std::vector<std::pair<const void *, size_t>> & bufs) const {
+#ifdef _WIN32
+        for (const auto & buf : bufs) {
+            write_raw(buf.first, buf.second);
+        }
+#else
+        std::vector<struct iovec> iov;
+        iov.reserve(bufs.size());
+        for (const auto & buf : bufs) {
+            if (buf.second > 0) {
+                iov.push_back({ const_cast<void *>(buf.first), buf.second });
+            }
+        }
+        if (iov.empty()) {
+            return;
+        }
+
+        if (std::fflush(fp) != 0) {
+            throw std::runtime_error(format("write error: %s", strerror(errno)));
+        }
+        size_t offs = tell();
+
+#ifdef IOV_MAX
+        const size_t n_iov_max = IOV_MAX;
+#else
+        const size_t n_iov_max = 16;
+#endif
+        size_t i = 0;
+        while (i < iov.size()) {
+            const ssize_t ret = writev(fileno(fp), iov.data() + i, (int) std::min(iov.size() - i, n_iov_max));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("write error: %s", strerror(errno)));
+            }
+            offs += ret;
+
+            // skip the buffers that were written completely and advance into the next one
+            size_t n = ret;
+            while (i < iov.size() && n >= iov[i].iov_len) {
+                n -= iov[i].iov_len;
+                i++;
+            }
+            if (n > 0) {
+                iov[i].iov_base  = (uint8_t *) iov[i].iov_base + n;
+                iov[i].iov_len  -= n;
+            }
+        }
+
+        // the stream does not know about the writes to the file descriptor
+        seek(offs, SEEK_SET);
+#endif
+    }
+
     ~llama_file() {
         if (fp) {
             std::fclose(fp);
@@ -1361,6 +1887,18 @@ struct llama_mmap {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    // advise the kernel to read the range [first, last) ahead of its use
+    void prefetch_fragment(size_t first, size_t last) {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        first &= ~(page_size - 1);
+        if (last <= first) {
+            return;
+        }
+        if (posix_madvise((uint8_t *) addr + first, last - first, POSIX_MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", strerror(errno));
+        }
+    }
+
     ~llama_mmap() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -1424,6 +1962,12 @@ struct llama_mmap {
         GGML_UNUSED(last);
     }
 
+    void prefetch_fragment(size_t first, size_t last) {
+        // not supported
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
     ~llama_mmap() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -1447,6 +1991,13 @@ struct llama_mmap {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch_fragment(size_t first, size_t last) {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+
+        throw std::runtime_error("mmap not supported");
+    }
 #endif
 };
 using llama_mmaps = std::vector<std::unique_ptr<llama_mmap>>;
@@ -1915,6 +2466,9 @@ struct llama_cparams {
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
+    bool flash_attn;
+
+    uint32_t n_layer_exit; // evaluate only the first n_layer_exit layers (0 - all layers)
 
     enum llama_pooling_type pooling_type;
 
@@ -1998,6 +2552,7 @@ struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
     int32_t   src   = 0; // used by recurrent state models to copy states
+    uint32_t  gen   = 0; // when the K and V data were last written, see llama_kv_cache::gen
 
     std::set<llama_seq_id> seq_id;
 
@@ -2021,6 +2576,8 @@ struct llama_kv_cache {
     bool do_copy   = false;
     // with recurrent state models, a cell can hold the state for more than one past token
     bool recurrent = false;
+    // the value tensor is transposed (one row per embedding channel), flash attention needs one row per cell instead
+    bool v_trans   = true;
 
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_internal also uses it, so it
@@ -2037,6 +2594,17 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // the KQ mask is built from a per-sequence copy of the cell positions:
+    // seq_pos[s][i] is the position of cell i if it belongs to sequence s, and INT32_MAX otherwise
+    // the copies are kept up to date incrementally - every change to a cell is recorded in
+    // seq_pos_dirty and only those cells are refreshed before the next mask is built
+    std::map<llama_seq_id, std::vector<llama_pos>> seq_pos;
+    std::vector<uint32_t> seq_pos_dirty;
+
+    // incremented by each state checkpoint - cells written since have a gen >= the gen of the checkpoint,
+    // and only those are appended to the state file by the next incremental save
+    uint32_t gen = 0;
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -2051,6 +2619,30 @@ struct llama_kv_cache {
         return size;
     }
 
+    // the position or the sequences of cell i have changed
+    void cell_changed(uint32_t i) {
+        if (seq_pos.empty()) {
+            return;
+        }
+        if (seq_pos_dirty.size() >= size) {
+            // cheaper to rebuild the copies from scratch
+            cells_changed();
+            return;
+        }
+        seq_pos_dirty.push_back(i);
+    }
+
+    // any number of cells have changed
+    void cells_changed() {
+        seq_pos.clear();
+        seq_pos_dirty.clear();
+    }
+
+    // the K and V data of cell i have been written
+    void cell_written(uint32_t i) {
+        cells[i].gen = gen;
+    }
+
     ~llama_kv_cache() {
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
@@ -2086,6 +2678,29 @@ struct llama_control_vector {
     }
 };
 
+// the pieces of all tokens decoded to code points and arranged as a trie, so that llama_sample_grammar matches a
+// grammar stack once against the prefix that many tokens have in common
+struct llama_grammar_trie {
+    struct node {
+        uint32_t chr;         // last code point of the prefix of this node
+        uint32_t child_begin; // children are nodes[child_begin, child_end), sorted by chr
+        uint32_t child_end;
+        uint32_t token_begin; // tokens whose full code points are exactly this prefix, tokens[token_begin, token_end)
+        uint32_t token_end;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // incomplete UTF-8 sequence at the end of the piece
+    };
+
+    uint64_t                 id      = 0; // unique per built trie, identifies the vocab of cached token masks
+    int32_t                  n_vocab = 0;
+    std::vector<node>        nodes;  // nodes[0] is the root, the empty prefix
+    std::vector<token>       tokens; // tokens with an empty piece are never allowed and are not in the trie
+    std::vector<llama_token> eog;    // end-of-generation tokens, allowed iff a stack is empty
+};
+
 struct llama_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -2104,7 +2719,18 @@ struct llama_vocab {
 
     std::unordered_map<token, id> special_tokens_cache;
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // BPE merges in an open-addressed table keyed on the ids of the left and right parts. parts and results of merges
+    // that are not tokens are interned with ids from n_vocab on, so that merging never compares strings
+    struct bpe_merge {
+        id  left; // -1 for an empty slot
+        id  right;
+        id  result;
+        int rank;
+    };
+
+    std::vector<bpe_merge>        bpe_merges;
+    uint32_t                      n_bpe_merges = 0;
+    std::unordered_map<token, id> bpe_interned;
 
     // default LLaMA special tokens
     id special_bos_id  = 1;
@@ -2126,19 +2752,92 @@ struct llama_vocab {
 
     bool add_space_prefix = true;
 
-    int find_bpe_rank(const std::string & token_left, const std::string & token_right) const {
-        GGML_ASSERT(token_left.find(' ') == std::string::npos);
-        GGML_ASSERT(token_left.find('\n') == std::string::npos);
-        GGML_ASSERT(token_right.find(' ') == std::string::npos);
-        GGML_ASSERT(token_right.find('\n') == std::string::npos);
+    // id of a token or of an interned part of a merge, -1 if no merge involves the text
+    id find_bpe_piece(const std::string & text) const {
+        auto it = token_to_id.find(text);
+        if (it != token_to_id.end()) {
+            return it->second;
+        }
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
+        it = bpe_interned.find(text);
+        if (it == bpe_interned.end()) {
             return -1;
         }
 
         return it->second;
     }
+
+    const bpe_merge * find_bpe_merge(id left, id right) const {
+        if (bpe_merges.empty()) {
+            return nullptr;
+        }
+
+        const size_t mask = bpe_merges.size() - 1;
+        for (size_t i = bpe_merge_hash(left, right) & mask; ; i = (i + 1) & mask) {
+            const bpe_merge & merge = bpe_merges[i];
+            if (merge.left == left && merge.right == right) {
+                return &merge;
+            }
+            if (merge.left == -1) {
+                return nullptr;
+            }
+        }
+    }
+
+    // merges[i] has rank i, must be called after the tokens have been loaded
+    void init_bpe_merges(const std::vector<std::pair<std::string, std::string>> & merges) {
+        bpe_interned.clear();
+
+        auto intern = [&](const std::string & text) {
+            id piece = find_bpe_piece(text);
+            if (piece < 0) {
+                piece = id_to_token.size() + bpe_interned.size();
+                bpe_interned.emplace(text, piece);
+            }
+            return piece;
+        };
+
+        // at most half full
+        size_t size = 1;
+        while (size < 2*merges.size()) {
+            size *= 2;
+        }
+        bpe_merges.assign(size, { -1, -1, -1, -1 });
+        n_bpe_merges = 0;
+
+        const size_t mask = size - 1;
+        for (size_t rank = 0; rank < merges.size(); ++rank) {
+            const std::string & first  = merges[rank].first;
+            const std::string & second = merges[rank].second;
+            if (first.empty() || second.empty()) {
+                continue;
+            }
+
+            const id left  = intern(first);
+            const id right = intern(second);
+
+            // the first of duplicate merges has the lowest rank and wins
+            for (size_t i = bpe_merge_hash(left, right) & mask; ; i = (i + 1) & mask) {
+                bpe_merge & merge = bpe_merges[i];
+                if (merge.left == left && merge.right == right) {
+                    break;
+                }
+                if (merge.left == -1) {
+                    merge = { left, right, intern(first + second), (int) rank };
+                    n_bpe_merges++;
+                    break;
+                }
+            }
+        }
+    }
+
+    static size_t bpe_merge_hash(id left, id right) {
+        const uint64_t key = ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+        return (key * 0x9E3779B97F4A7C15ull) >> 32;
+    }
+
+    // built on first use by llama_sample_grammar
+    mutable llama_grammar_trie grammar_trie;
 };
 
 struct llama_model {
@@ -2219,15 +2918,84 @@ struct llama_model {
     }
 };
 
-struct llama_context {
-    llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
-    ~llama_context() {
-        ggml_backend_sched_free(sched);
+// buffers of llama_sample_token_fused, sized for the vocabulary on first use and reused by every call
+struct llama_sampling_arena {
+    std::vector<llama_token_data> cur;
+    std::vector<float>            probs;
+};
+
+// the compute graph of the last ubatch, reused by the next ubatch with the same shape
+// only the views that store the new K and V cells depend on kv_self.head, they are moved in place instead of rebuilt
+struct llama_graph_cache {
+    bool valid = false;
+
+    // shape of the cached graph
+    uint32_t n_tokens     = 0;
+    int32_t  n_outputs    = 0;
+    uint32_t n_kv         = 0;
+    bool     inp_embd     = false;
+    bool     causal_attn  = false;
+    bool     embeddings   = false;
+    uint32_t n_layer_exit = 0;
+
+    struct ggml_cgraph * gf   = nullptr;
+    struct ggml_tensor * res  = nullptr;
+    struct ggml_tensor * embd = nullptr;
+
+    // views of the K and V cache written by the graph (both the destination of each copy and its result)
+    struct kv_store {
+        struct ggml_tensor * t;
+        int32_t il;
+        bool    is_v;
+    };
+
+    std::vector<kv_store> kv_stores;
+};
+
+// the last record written to or read from a state file, incremental saves append a delta record to it
+struct llama_state_checkpoint {
+    uint64_t chain_id   = 0; // trailer of the last record, identifies the contents of the file
+    size_t   file_size  = 0;
+    size_t   base_size  = 0; // size of the full state at the start of the file
+    size_t   delta_size = 0; // size of the delta records after it
+    uint32_t gen        = 0; // see llama_kv_cache::gen
+
+    // sequence state files only: the sequence and its (pos, cell) pairs, sorted
+    llama_seq_id seq_id = -1;
+    std::vector<std::pair<llama_pos, uint32_t>> cells;
+};
+
+// tree of draft tokens evaluated by llama_decode_tree, until it is verified or accepted
+struct llama_draft_tree {
+    bool decoding = false; // the current ubatch is the tree, its KQ mask follows the parents
+
+    llama_seq_id seq_id = 0;
+    llama_pos    pos    = 0;
+
+    std::vector<llama_token> tokens;
+    std::vector<int32_t>     parents; // -1 for the root
+    std::vector<int32_t>     depth;
+    std::vector<uint32_t>    cells;   // KV cell of each token
+
+    void clear() {
+        tokens.clear();
+        parents.clear();
+        depth.clear();
+        cells.clear();
+    }
+};
+
+struct llama_context {
+    llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
+    ~llama_context() {
+        ggml_backend_sched_free(sched);
 
         for (ggml_backend_t backend : backends) {
             ggml_backend_free(backend);
         }
 
+        ggml_threadpool_free(threadpool);
+
         ggml_backend_buffer_free(buf_output);
     }
 
@@ -2239,6 +3007,10 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // persistent CPU compute threads, sized for max(n_threads, n_threads_batch)
+    ggml_threadpool_params threadpool_params;
+    ggml_threadpool *      threadpool = nullptr;
+
     const llama_model & model;
 
     // key + value cache for the self attention
@@ -2253,6 +3025,7 @@ struct llama_context {
     int64_t t_sample_us = 0;
     int64_t t_p_eval_us = 0;
     int64_t t_eval_us   = 0;
+    int64_t t_graph_us  = 0;
 
     int64_t t_compute_start_us = 0;
     int64_t n_queued_tokens = 0;
@@ -2261,6 +3034,9 @@ struct llama_context {
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
+    int32_t n_graph       = 0; // number of ubatches evaluated
+    int32_t n_graph_reuse = 0; // number of ubatches that reused the cached graph
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_t buf_output = nullptr;
 
@@ -2287,6 +3063,12 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_t sched = nullptr;
 
+    // graph of the last ubatch, lives in buf_compute_meta
+    struct llama_graph_cache graph_cache;
+
+    // tree of the last llama_decode_tree
+    struct llama_draft_tree draft_tree;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -2304,9 +3086,15 @@ struct llama_context {
     struct ggml_tensor * inp_s_mask;    // F32 [1, n_kv]
     struct ggml_tensor * inp_s_seq;     // I32 [n_kv, n_batch]
 
+    // candidates of llama_sample_token_fused
+    struct llama_sampling_arena sampling_arena;
+
     // control vectors
     struct llama_control_vector cvec;
 
+    // state files saved or loaded by this context, by path
+    std::map<std::string, llama_state_checkpoint> state_checkpoints;
+
 #ifdef GGML_USE_MPI
     ggml_mpi_context * ctx_mpi = NULL;
 #endif
@@ -2459,6 +3247,7 @@ static bool llama_kv_cache_find_slot(
                         cache.used += 1;
                     }
                     cache.cells[seq_id].pos = batch.pos[i];
+                    cache.cell_changed(seq_id);
                     // NOTE: seq_ids are not inserted here; they are handled when the input tensors are set
                 } else {
                     // too big seq_id
@@ -2518,6 +3307,9 @@ static bool llama_kv_cache_find_slot(
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
             cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
         }
+
+        cache.cell_changed(cache.head + i);
+        cache.cell_written(cache.head + i);
     }
 
     cache.used += n_tokens;
@@ -2545,6 +3337,7 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     }
     cache.head = 0;
     cache.used = 0;
+    cache.cells_changed();
 }
 
 static bool llama_kv_cache_seq_rm(
@@ -2585,6 +3378,7 @@ static bool llama_kv_cache_seq_rm(
             } else {
                 continue;
             }
+            cache.cell_changed(i);
             if (cache.cells[i].is_empty()) {
                 // keep count of the number of used cells
                 if (cache.cells[i].pos >= 0) cache.used--;
@@ -2628,6 +3422,7 @@ static void llama_kv_cache_seq_cp(
             cache.do_copy = true;
 
             cache.cells[seq_id_dst].pos = cache.cells[seq_id_src].pos;
+            cache.cell_changed(seq_id_dst);
         }
         return;
     }
@@ -2638,6 +3433,7 @@ static void llama_kv_cache_seq_cp(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.cells[i].seq_id.insert(seq_id_dst);
+            cache.cell_changed(i);
         }
     }
 }
@@ -2657,6 +3453,8 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
         }
     }
 
+    cache.cells_changed();
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 }
@@ -2678,6 +3476,7 @@ static void llama_kv_cache_seq_add(
             llama_kv_cell & cell = cache.cells[seq_id];
             if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
                 cell.pos += delta;
+                cache.cell_changed(seq_id);
             }
         }
         return;
@@ -2688,6 +3487,7 @@ static void llama_kv_cache_seq_add(
             cache.has_shift = true;
             cache.cells[i].pos   += delta;
             cache.cells[i].delta += delta;
+            cache.cell_changed(i);
 
             if (cache.cells[i].pos < 0) {
                 if (!cache.cells[i].is_empty()) {
@@ -2722,6 +3522,7 @@ static void llama_kv_cache_seq_div(
             llama_kv_cell & cell = cache.cells[seq_id];
             if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
                 cell.pos /= d;
+                cache.cell_changed(seq_id);
             }
         }
         return;
@@ -2736,6 +3537,8 @@ static void llama_kv_cache_seq_div(
                 cache.cells[i].pos   /= d;
                 cache.cells[i].delta += cache.cells[i].pos - p_old;
             }
+
+            cache.cell_changed(i);
         }
     }
 }
@@ -2967,7 +3770,8 @@ struct llama_model_loader {
     int64_t n_elements = 0;
     size_t  n_bytes    = 0;
 
-    bool use_mmap = false;
+    bool use_mmap  = false;
+    bool encrypted = false;
 
     llama_files files;
     llama_ftype ftype;
@@ -2982,9 +3786,16 @@ struct llama_model_loader {
 
         ggml_tensor * tensor;
 
-        llama_tensor_weight(uint16_t idx, const char * name, const struct gguf_context * gguf_ctx, ggml_tensor * tensor) : idx(idx), tensor(tensor) {
+        bool     has_crc = false;
+        uint32_t crc     = 0; // CRC-32C of the (decrypted) tensor data
+
+        llama_tensor_weight(uint16_t idx, const char * name, const struct gguf_context * gguf_ctx, ggml_tensor * tensor, const uint32_t * crcs) : idx(idx), tensor(tensor) {
             const int tensor_idx = gguf_find_tensor(gguf_ctx, name);
             offs = gguf_get_data_offset(gguf_ctx) + gguf_get_tensor_offset(gguf_ctx, tensor_idx);
+            if (crcs) {
+                has_crc = true;
+                crc     = crcs[tensor_idx];
+            }
         }
     };
     std::vector<llama_tensor_weight> weights;
@@ -2997,7 +3808,7 @@ struct llama_model_loader {
     std::string arch_name;
     LLM_KV      llm_kv    = LLM_KV(LLM_ARCH_UNKNOWN);
 
-    llama_model_loader(const std::string & fname, bool use_mmap, const struct llama_model_kv_override * param_overrides_p) {
+    llama_model_loader(const std::string & fname, bool use_mmap, const struct llama_model_kv_override * param_overrides_p, const char * encryption_key) {
         int trace = 0;
         if (getenv("LLAMA_TRACE")) {
             trace = atoi(getenv("LLAMA_TRACE"));
@@ -3026,10 +3837,12 @@ struct llama_model_loader {
         // Save tensors data offset of the main file.
         // For subsidiary files, `meta` tensor data offset must not be used,
         // so we build a unified tensors index for weights.
+        const uint32_t * crcs = get_checksums(meta);
         for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur; cur = ggml_get_next_tensor(ctx, cur)) {
-            weights.emplace_back(0, cur->name, meta, cur);
+            weights.emplace_back(0, cur->name, meta, cur, crcs);
         }
         files.emplace_back(new llama_file(fname.c_str(), "rb"));
+        init_cipher(files.back().get(), meta, encryption_key);
         contexts.emplace_back(ctx);
 
         uint16_t n_split = 0;
@@ -3066,10 +3879,12 @@ struct llama_model_loader {
                 }
 
                 // Save tensors data offset info of the shard.
+                const uint32_t * split_crcs = get_checksums(ctx_gguf);
                 for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur; cur = ggml_get_next_tensor(ctx, cur)) {
-                    weights.emplace_back(idx, cur->name, ctx_gguf, cur);
+                    weights.emplace_back(idx, cur->name, ctx_gguf, cur, split_crcs);
                 }
                 files.emplace_back(new llama_file(split_path, "rb"));
+                init_cipher(files.back().get(), ctx_gguf, encryption_key);
                 contexts.emplace_back(ctx);
 
                 gguf_free(ctx_gguf);
@@ -3200,9 +4015,74 @@ struct llama_model_loader {
             use_mmap = false;
         }
 
+        if (encrypted && use_mmap) {
+            // the decrypted data only exists in the tensor buffers, never in the page cache or on disk
+            LLAMA_LOG_INFO("%s: model is encrypted, mmap disabled\n", __func__);
+            use_mmap = false;
+        }
+
         this->use_mmap = use_mmap;
     }
 
+    // the CRC-32C of the tensors of a file in the order of its tensor infos, nullptr if the file has no checksums
+    const uint32_t * get_checksums(const struct gguf_context * ctx_gguf) const {
+        const std::string kv_crc = llm_kv(LLM_KV_GENERAL_TENSOR_CRC32C);
+        const int kid = gguf_find_key(ctx_gguf, kv_crc.c_str());
+        if (kid < 0) {
+            return nullptr;
+        }
+        if (gguf_get_kv_type(ctx_gguf, kid) != GGUF_TYPE_ARRAY || gguf_get_arr_type(ctx_gguf, kid) != GGUF_TYPE_UINT32 ||
+            gguf_get_arr_n(ctx_gguf, kid) != gguf_get_n_tensors(ctx_gguf)) {
+            throw std::runtime_error(format("invalid %s, expected one uint32 per tensor", kv_crc.c_str()));
+        }
+        return (const uint32_t *) gguf_get_arr_data(ctx_gguf, kid);
+    }
+
+    // set up on-the-fly decryption of the tensor data of an encrypted file
+    // only the tensor data is encrypted, the GGUF header and metadata are stored in plain text
+    void init_cipher(llama_file * file, const struct gguf_context * ctx_gguf, const char * encryption_key) {
+        const std::string kv_enc = llm_kv(LLM_KV_GENERAL_ENCRYPTION);
+        const int kid = gguf_find_key(ctx_gguf, kv_enc.c_str());
+        if (kid < 0) {
+            return;
+        }
+
+        const std::string cipher_name = gguf_get_val_str(ctx_gguf, kid);
+        if (cipher_name != "aes-256-ctr") {
+            throw std::runtime_error(format("unsupported model encryption: %s", cipher_name.c_str()));
+        }
+        if (encryption_key == nullptr || encryption_key[0] == '\0') {
+            throw std::runtime_error("model is encrypted, but no key was provided");
+        }
+
+        uint8_t key[32];
+        if (!llama_hex_to_bytes(encryption_key, key, sizeof(key))) {
+            throw std::runtime_error("invalid model key, expected 64 hex digits");
+        }
+
+        const std::string kv_iv = llm_kv(LLM_KV_GENERAL_ENCRYPTION_IV);
+        const int kid_iv = gguf_find_key(ctx_gguf, kv_iv.c_str());
+        uint8_t iv[llama_aes256_ctr::BLOCK_SIZE];
+        if (kid_iv < 0 || !llama_hex_to_bytes(gguf_get_val_str(ctx_gguf, kid_iv), iv, sizeof(iv))) {
+            throw std::runtime_error(format("missing or invalid %s", kv_iv.c_str()));
+        }
+
+        file->cipher.reset(new llama_aes256_ctr(key, iv));
+        file->cipher->base      = gguf_get_data_offset(ctx_gguf);
+        file->cipher->n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        // the key check value catches a wrong key before garbage is loaded into the tensors
+        const std::string kv_kcv = llm_kv(LLM_KV_GENERAL_ENCRYPTION_KCV);
+        const int kid_kcv = gguf_find_key(ctx_gguf, kv_kcv.c_str());
+        if (kid_kcv >= 0) {
+            if (llama_aes256_ctr_kcv(*file->cipher) != gguf_get_val_str(ctx_gguf, kid_kcv)) {
+                throw std::runtime_error("wrong model key");
+            }
+        }
+
+        encrypted = true;
+    }
+
     ~llama_model_loader() {
         if (meta) {
             gguf_free(meta);
@@ -3461,32 +4341,353 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
-    // Returns false if cancelled by progress_callback
-    bool load_all_data(
+    // without mmap, the tensor data is read with positional reads from several threads
+    int     n_threads_read = std::max(1, std::min(8, (int) std::thread::hardware_concurrency()));
+    size_t  size_read      = 0;
+    int64_t t_read_us      = 0;
+
+    // a part of the data of a tensor that is read or checksummed as a unit
+    struct read_chunk {
+        ggml_tensor               * tensor;
+        const llama_tensor_weight * weight;
+        const llama_file          * file;
+        size_t                      file_offs;
+        size_t                      offs; // offset in the tensor
+        size_t                      size;
+        bool                        host;
+        uint32_t                    crc;  // CRC-32C of the chunk, set if the tensor has a checksum
+    };
+
+    // combines the checksums of the chunks of each tensor and compares them with the ones stored in the file
+    // the chunks of a tensor must be consecutive and in order, returns the names of the tensors that do not match
+    std::vector<std::string> check_checksums(const std::vector<read_chunk> & chunks) const {
+        std::vector<std::string> failed;
+        for (size_t i = 0; i < chunks.size(); ) {
+            const llama_tensor_weight * weight = chunks[i].weight;
+
+            uint32_t crc = 0;
+            size_t j = i;
+            for (; j < chunks.size() && chunks[j].weight == weight; ++j) {
+                crc = llama_crc32c_combine(crc, chunks[j].crc, chunks[j].size);
+            }
+            if (weight->has_crc && crc != weight->crc) {
+                LLAMA_LOG_ERROR("%s: tensor '%s' is corrupted: CRC-32C %08x, expected %08x\n", __func__,
+                        ggml_get_name(weight->tensor), crc, weight->crc);
+                failed.push_back(ggml_get_name(weight->tensor));
+            }
+            i = j;
+        }
+        return failed;
+    }
+
+    void verify_checksums(const std::vector<read_chunk> & chunks) const {
+        const std::vector<std::string> failed = check_checksums(chunks);
+        if (!failed.empty()) {
+            throw std::runtime_error(format("%zu tensor(s) failed the checksum verification, the first is '%s'", failed.size(), failed[0].c_str()));
+        }
+    }
+
+    // checksums the mapped tensor data of ctx with n_threads_read threads, which also faults in the pages in parallel
+    void verify_mapped_data(struct ggml_context * ctx) {
+        const size_t max_chunk_size = 4*1024*1024;
+
+        std::vector<read_chunk> chunks;
+        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            if (weight == nullptr || !weight->has_crc) {
+                continue;
+            }
+            const size_t n_size = ggml_nbytes(cur);
+            for (size_t offs = 0; offs < n_size; offs += max_chunk_size) {
+                chunks.push_back({ cur, weight, files.at(weight->idx).get(), weight->offs + offs, offs, std::min(max_chunk_size, n_size - offs), true, 0 });
+            }
+        }
+        if (chunks.empty()) {
+            return;
+        }
+
+        std::atomic<size_t> next_chunk(0);
+        auto worker = [&]() {
+            while (true) {
+                const size_t i = next_chunk++;
+                if (i >= chunks.size()) {
+                    break;
+                }
+                auto & chunk = chunks[i];
+                const uint8_t * data = (const uint8_t *) mappings.at(chunk.weight->idx)->addr + chunk.file_offs;
+                chunk.crc = llama_crc32c_update(0, data, chunk.size);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < std::min<int>(n_threads_read, chunks.size()); ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        verify_checksums(chunks);
+    }
+
+    // reads the data of all the tensors that have a checksum and checks it, without loading the model
+    // returns the names of the corrupted tensors
+    std::vector<std::string> verify_all_data() {
+        const size_t max_chunk_size = 4*1024*1024;
+
+        std::vector<read_chunk> chunks;
+        for (const auto & w : weights) {
+            if (!w.has_crc) {
+                continue;
+            }
+            const size_t n_size = ggml_nbytes(w.tensor);
+            for (size_t offs = 0; offs < n_size; offs += max_chunk_size) {
+                chunks.push_back({ w.tensor, &w, files.at(w.idx).get(), w.offs + offs, offs, std::min(max_chunk_size, n_size - offs), true, 0 });
+            }
+        }
+        if (chunks.empty()) {
+            return {};
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        std::atomic<size_t> next_chunk(0);
+        std::exception_ptr  error;
+        std::mutex          mutex;
+
+        auto worker = [&]() {
+            std::vector<no_init<uint8_t>> buf(max_chunk_size);
+            try {
+                while (true) {
+                    const size_t i = next_chunk++;
+                    if (i >= chunks.size()) {
+                        break;
+                    }
+                    auto & chunk = chunks[i];
+                    chunk.file->read_raw_at(buf.data(), chunk.size, chunk.file_offs);
+                    chunk.crc = llama_crc32c_update(0, buf.data(), chunk.size);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = std::current_exception();
+                next_chunk = chunks.size();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < std::min<int>(n_threads_read, chunks.size()); ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto & w : workers) {
+            w.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        for (const auto & chunk : chunks) {
+            size_read += chunk.size;
+        }
+        t_read_us += ggml_time_us() - t_start_us;
+
+        return check_checksums(chunks);
+    }
+
+    // reads all tensors of ctx from the files, returns false if cancelled by progress_callback
+    // the tensors are split into chunks that are read by n_threads_read threads; chunks of host tensors are read in place,
+    // the others go through a bounded set of staging buffers (two per thread) and are uploaded by the calling thread,
+    // so that the upload of a chunk overlaps with the reads (and the decryption) of the next ones
+    bool load_all_data_read(
             struct ggml_context * ctx,
-            llama_buf_map & bufs_mmap,
-            llama_mlocks * lmlocks,
             llama_progress_callback progress_callback,
             void * progress_callback_user_data) {
-        GGML_ASSERT(size_data != 0 && "call init_mappings() first");
+        const size_t max_chunk_size = 4*1024*1024;
 
-        std::vector<no_init<uint8_t>> read_buf;
+        std::vector<read_chunk> chunks;
+        size_t staging_size = 0;
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
                 // this can happen with split experts models
                 continue;
             }
+            GGML_ASSERT(weight->idx < files.size());
+            GGML_ASSERT(cur->data != nullptr);
+
+            const bool   host   = ggml_backend_buffer_is_host(cur->buffer);
+            const size_t n_size = ggml_nbytes(cur);
+            for (size_t offs = 0; offs < n_size; offs += max_chunk_size) {
+                const size_t size = std::min(max_chunk_size, n_size - offs);
+                chunks.push_back({ cur, weight, files.at(weight->idx).get(), weight->offs + offs, offs, size, host, 0 });
+                if (!host) {
+                    staging_size = std::max(staging_size, size);
+                }
+            }
+        }
+
+        if (chunks.empty()) {
+            return true;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        const int n_threads = (int) std::min<size_t>(n_threads_read, chunks.size());
+        const int n_staging = staging_size > 0 ? 2*n_threads : 0;
+
+        std::vector<no_init<uint8_t>> staging(n_staging*staging_size);
+
+        std::mutex mutex;
+        std::condition_variable cv_done;
+        std::condition_variable cv_free;
+
+        std::vector<int> staging_free;
+        for (int i = 0; i < n_staging; ++i) {
+            staging_free.push_back(i);
+        }
+        std::queue<std::pair<size_t, int>> done; // chunk index, staging buffer or -1 if read in place
+        std::string error;
+
+        std::atomic<size_t> next_chunk(0);
+        std::atomic<bool>   stop(false);
+
+        auto worker = [&]() {
+            while (!stop) {
+                const size_t i = next_chunk++;
+                if (i >= chunks.size()) {
+                    break;
+                }
+                auto & chunk = chunks[i];
+
+                int ibuf = -1;
+                uint8_t * dst = (uint8_t *) chunk.tensor->data + chunk.offs;
+                if (!chunk.host) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv_free.wait(lock, [&] { return stop || !staging_free.empty(); });
+                    if (stop) {
+                        break;
+                    }
+                    ibuf = staging_free.back();
+                    staging_free.pop_back();
+                    dst = &staging[ibuf*staging_size].value;
+                }
+
+                try {
+                    chunk.file->read_raw_at(dst, chunk.size, chunk.file_offs);
+                    if (chunk.weight->has_crc) {
+                        chunk.crc = llama_crc32c_update(0, dst, chunk.size);
+                    }
+                } catch (const std::exception & err) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = err.what();
+                    stop  = true;
+                    cv_done.notify_all();
+                    cv_free.notify_all();
+                    break;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done.emplace(i, ibuf);
+                }
+                cv_done.notify_one();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads);
+        for (int i = 0; i < n_threads; ++i) {
+            workers.emplace_back(worker);
+        }
+
+        bool cancelled = false;
+        for (size_t n_done = 0; n_done < chunks.size(); ++n_done) {
+            std::pair<size_t, int> item;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_done.wait(lock, [&] { return stop || !done.empty(); });
+                if (stop) {
+                    break;
+                }
+                item = done.front();
+                done.pop();
+            }
+
+            const auto & chunk = chunks[item.first];
+            if (item.second >= 0) {
+                ggml_backend_tensor_set(chunk.tensor, &staging[item.second*staging_size].value, chunk.offs, chunk.size);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    staging_free.push_back(item.second);
+                }
+                cv_free.notify_one();
+            }
+
+            size_done += chunk.size;
+            size_read += chunk.size;
 
             if (progress_callback) {
                 if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
-                    return false;
+                    cancelled = true;
+                    break;
                 }
             }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_free.notify_all();
+        for (auto & w : workers) {
+            w.join();
+        }
 
-            size_t n_size = ggml_nbytes(cur);
+        t_read_us += ggml_time_us() - t_start_us;
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+
+        if (!cancelled) {
+            verify_checksums(chunks);
+        }
+
+        return !cancelled;
+    }
+
+    // Returns false if cancelled by progress_callback
+    bool load_all_data(
+            struct ggml_context * ctx,
+            llama_buf_map & bufs_mmap,
+            llama_mlocks * lmlocks,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data) {
+        GGML_ASSERT(size_data != 0 && "call init_mappings() first");
+
+        if (!use_mmap) {
+            if (!load_all_data_read(ctx, progress_callback, progress_callback_user_data)) {
+                return false;
+            }
+        } else {
+            verify_mapped_data(ctx);
+
+            for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+                const auto * weight = get_weight(ggml_get_name(cur));
+                if (weight == nullptr) {
+                    // this can happen with split experts models
+                    continue;
+                }
+
+                if (progress_callback) {
+                    if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+                        return false;
+                    }
+                }
+
+                size_t n_size = ggml_nbytes(cur);
 
-            if (use_mmap) {
                 const auto & mapping = mappings.at(weight->idx);
                 ggml_backend_buffer_t buf_mmap = nullptr;
                 if (bufs_mmap.count(weight->idx)) {
@@ -3506,25 +4707,18 @@ struct llama_model_loader {
                 } else {
                     ggml_backend_tensor_set(cur, (uint8_t *) mapping->addr + weight->offs, 0, n_size);
                 }
-            } else {
-                GGML_ASSERT(weight->idx < files.size());
-                const auto & file = files.at(weight->idx);
-                if (ggml_backend_buffer_is_host(cur->buffer)) {
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(cur->data, ggml_nbytes(cur));
-                } else {
-                    read_buf.resize(ggml_nbytes(cur));
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), ggml_nbytes(cur));
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                }
-            }
 
-            size_done += n_size;
+                size_done += n_size;
+            }
         }
 
         // check if this is the last call and do final cleanup
         if (size_done >= size_data) {
+            if (size_read > 0 && t_read_us > 0) {
+                LLAMA_LOG_INFO("%s: read %.2f MiB with %d threads in %.2f ms (%.2f GB/s)\n", __func__,
+                        size_read/1024.0/1024.0, n_threads_read, t_read_us/1000.0, (double) size_read/t_read_us/1e3);
+            }
+
             // unmap offloaded tensors and metadata
             if (use_mmap) {
                 for (uint32_t idx = 0; idx < mappings.size(); idx++) {
@@ -4127,6 +5321,9 @@ static void llm_load_vocab(
 
     const auto kv = LLM_KV(model.arch);
 
+    // read before the tokens, the merges refer to them by id
+    std::vector<std::pair<std::string, std::string>> bpe_merges;
+
     // determine vocab type
     {
         std::string tokenizer_name;
@@ -4195,7 +5392,7 @@ static void llm_load_vocab(
         } else if (tokenizer_name == "gpt2") {
             vocab.type = LLAMA_VOCAB_TYPE_BPE;
 
-            // read bpe merges and populate bpe ranks
+            // read bpe merges, they are added to the vocab once the tokens are known
             const int merges_keyidx = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str());
             if (merges_keyidx == -1) {
                 throw std::runtime_error("cannot find tokenizer merges in model file\n");
@@ -4203,6 +5400,8 @@ static void llm_load_vocab(
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
 
+            bpe_merges.resize(n_merges);
+
             for (int i = 0; i < n_merges; i++) {
                 const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
                 GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
@@ -4217,7 +5416,7 @@ static void llm_load_vocab(
                     second = word.substr(pos + 1);
                 }
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                bpe_merges[i] = std::make_pair(std::move(first), std::move(second));
             }
 
             // default special tokens
@@ -4282,6 +5481,10 @@ static void llm_load_vocab(
     }
     GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
 
+    if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        vocab.init_bpe_merges(bpe_merges);
+    }
+
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         try {
@@ -4471,7 +5674,7 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch             = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch));
     LLAMA_LOG_INFO("%s: vocab type       = %s\n",     __func__, llama_model_vocab_type_name(vocab.type));
     LLAMA_LOG_INFO("%s: n_vocab          = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, vocab.n_bpe_merges);
     LLAMA_LOG_INFO("%s: n_ctx_train      = %u\n",     __func__, hparams.n_ctx_train);
     LLAMA_LOG_INFO("%s: n_embd           = %u\n",     __func__, hparams.n_embd);
     LLAMA_LOG_INFO("%s: n_head           = %u\n",     __func__, hparams.n_head);
@@ -5899,6 +7102,16 @@ static bool llm_load_tensors(
         }
     }
 
+    // with --numa distribute, move the rows of the CPU weights to the nodes whose threads process them in mul_mat
+    if (ggml_is_numa()) {
+        for (auto & it : model.tensors_by_name) {
+            ggml_tensor * t = it.second;
+            if (t->buffer && ggml_backend_buffer_is_host(t->buffer) && ggml_n_dims(t) >= 2) {
+                ggml_numa_place_tensor(t);
+            }
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             model.mappings.emplace_back(std::move(mapping));
@@ -5914,7 +7127,7 @@ static bool llm_load_tensors(
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
 static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
     try {
-        llama_model_loader ml(fname, params.use_mmap, params.kv_overrides);
+        llama_model_loader ml(fname, params.use_mmap, params.kv_overrides, params.encryption_key);
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -6040,6 +7253,18 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
+// offset of the cell kv_head in the K and V cache of layer il, where llm_build_kv_store writes the new cells
+static size_t llama_kv_cache_k_offset(const llama_kv_cache & kv, const llama_hparams & hparams, int64_t il, int32_t kv_head) {
+    return ggml_row_size(kv.k_l[il]->type, hparams.n_embd_k_gqa())*kv_head;
+}
+
+static size_t llama_kv_cache_v_offset(const llama_kv_cache & kv, const llama_hparams & hparams, int64_t il, int32_t kv_head) {
+    if (kv.v_trans) {
+        return ggml_element_size(kv.v_l[il])*kv_head;
+    }
+    return ggml_row_size(kv.v_l[il]->type, hparams.n_embd_v_gqa())*kv_head;
+}
+
 static void llm_build_kv_store(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
@@ -6057,23 +7282,33 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
-    // compute the transposed [n_tokens, n_embd] V matrix
-    assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
-    struct ggml_tensor * v_cur_t = ggml_transpose(ctx, v_cur);
-    cb(v_cur_t, "v_cur_t", il);
-
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
-            (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
+            llama_kv_cache_k_offset(kv, hparams, il, kv_head));
     cb(k_cache_view, "k_cache_view", il);
 
-    struct ggml_tensor * v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-            (  n_ctx)*ggml_element_size(kv.v_l[il]),
-            (kv_head)*ggml_element_size(kv.v_l[il]));
+    // important: storing RoPE-ed version of K in the KV cache!
+    ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur, k_cache_view));
+
+    assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+
+    struct ggml_tensor * v_cache_view = nullptr;
+
+    if (kv.v_trans) {
+        // compute the transposed [n_tokens, n_embd] V matrix
+        v_cur = ggml_transpose(ctx, v_cur);
+        cb(v_cur, "v_cur_t", il);
+
+        v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
+                (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                llama_kv_cache_v_offset(kv, hparams, il, kv_head));
+    } else {
+        // the V rows are stored like the K rows - one row of n_embd_v_gqa per cell
+        v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa,
+                llama_kv_cache_v_offset(kv, hparams, il, kv_head));
+    }
     cb(v_cache_view, "v_cache_view", il);
 
-    // important: storing RoPE-ed version of K in the KV cache!
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur,   k_cache_view));
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur_t, v_cache_view));
+    ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
 }
 
 static struct ggml_tensor * llm_build_norm(
@@ -6297,6 +7532,7 @@ static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
           const llama_model & model,
         const llama_hparams & hparams,
+        const llama_cparams & cparams,
        const llama_kv_cache & kv,
          struct ggml_cgraph * graph,
          struct ggml_tensor * wo,
@@ -6315,6 +7551,7 @@ static struct ggml_tensor * llm_build_kqv(
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
     const int64_t n_embd_k_gqa  = hparams.n_embd_k_gqa();
     const int64_t n_embd_head_v = hparams.n_embd_head_v;
+    const int64_t n_embd_v_gqa  = hparams.n_embd_v_gqa();
 
     struct ggml_tensor * q = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
     cb(q, "q", il);
@@ -6327,71 +7564,93 @@ static struct ggml_tensor * llm_build_kqv(
                 0);
     cb(k, "k", il);
 
-    struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
-    cb(kq, "kq", il);
+    struct ggml_tensor * cur;
 
-    if (model.arch == LLM_ARCH_PHI2) {
-        // for this arch, we need to perform the KQ multiplication with F32 precision, otherwise we get NaNs
-        // ref: https://github.com/ggerganov/llama.cpp/pull/4490#issuecomment-1859055847
-        ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
-    }
+    if (cparams.flash_attn) {
+        GGML_ASSERT(!kv.v_trans);
 
-    if (model.arch == LLM_ARCH_GROK) {
-        // need to do the following:
-        // multiply by attn_output_multiplyer of 0.08838834764831845
-        // and then :
-        // kq = 30 * tanh(kq / 30)
-        // before the softmax below
+        // split cached v into n_head heads (not transposed)
+        struct ggml_tensor * v =
+            ggml_view_3d(ctx, kv.v_l[il],
+                    n_embd_head_v, n_kv, n_head_kv,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
+                    0);
+        cb(v, "v", il);
 
-        //try from phi2
-        //ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
+        // fused KQ, soft_max_ext and KQV - the result is already [n_embd_head_v, n_head, n_tokens]
+        cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, kq_pos, kq_scale, hparams.f_max_alibi_bias);
+        cb(cur, "kqv_fa", il);
 
-        kq = ggml_tanh(ctx, ggml_scale(ctx, kq, 0.08838834764831845f/30.0f));
-        kq = ggml_scale(ctx, kq, 30);
-    }
+        cur = ggml_reshape_2d(ctx, cur, n_embd_head_v*n_head, n_tokens);
+        cb(cur, "kqv_merged_cont", il);
+    } else {
+        struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
+        cb(kq, "kq", il);
+
+        if (model.arch == LLM_ARCH_PHI2) {
+            // for this arch, we need to perform the KQ multiplication with F32 precision, otherwise we get NaNs
+            // ref: https://github.com/ggerganov/llama.cpp/pull/4490#issuecomment-1859055847
+            ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
+        }
+
+        if (model.arch == LLM_ARCH_GROK) {
+            // need to do the following:
+            // multiply by attn_output_multiplyer of 0.08838834764831845
+            // and then :
+            // kq = 30 * tanh(kq / 30)
+            // before the softmax below
+
+            //try from phi2
+            //ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
+
+            kq = ggml_tanh(ctx, ggml_scale(ctx, kq, 0.08838834764831845f/30.0f));
+            kq = ggml_scale(ctx, kq, 30);
+        }
 
 #if defined(GGML_USE_KOMPUTE)
 #pragma message("TODO: ALiBi support in ggml_soft_max_ext is not implemented for Kompute")
 #pragma message("      Falling back to ggml_alibi(). Will become an error in Mar 2024")
 #pragma message("ref:  https://github.com/ggerganov/llama.cpp/pull/5488")
-    if (hparams.f_max_alibi_bias > 0.0f) {
-        kq = ggml_scale(ctx, kq, kq_scale);
-        cb(kq, "kq_scaled", il);
+        if (hparams.f_max_alibi_bias > 0.0f) {
+            kq = ggml_scale(ctx, kq, kq_scale);
+            cb(kq, "kq_scaled", il);
 
-        kq = ggml_alibi(ctx, kq, /*n_past*/ 0, n_head, hparams.f_max_alibi_bias);
-        cb(kq, "kq_scaled_alibi", il);
+            kq = ggml_alibi(ctx, kq, /*n_past*/ 0, n_head, hparams.f_max_alibi_bias);
+            cb(kq, "kq_scaled_alibi", il);
 
-        kq = ggml_add(ctx, kq, kq_mask);
-        cb(kq, "kq_masked", il);
+            kq = ggml_add(ctx, kq, kq_mask);
+            cb(kq, "kq_masked", il);
 
-        kq = ggml_soft_max(ctx, kq);
-        cb(kq, "kq_soft_max", il);
-    } else
+            kq = ggml_soft_max(ctx, kq);
+            cb(kq, "kq_soft_max", il);
+        } else
 #endif
-    {
-        kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_pos, kq_scale, hparams.f_max_alibi_bias);
-        cb(kq, "kq_soft_max_ext", il);
-    }
+        {
+            kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_pos, kq_scale, hparams.f_max_alibi_bias);
+            cb(kq, "kq_soft_max_ext", il);
+        }
 
-    GGML_ASSERT(kv.size == n_ctx);
+        GGML_ASSERT(kv.size == n_ctx);
 
-    // split cached v into n_head heads
-    struct ggml_tensor * v =
-        ggml_view_3d(ctx, kv.v_l[il],
-                n_kv, n_embd_head_v, n_head_kv,
-                ggml_element_size(kv.v_l[il])*n_ctx,
-                ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
-                0);
-    cb(v, "v", il);
+        // split cached v into n_head heads
+        struct ggml_tensor * v =
+            ggml_view_3d(ctx, kv.v_l[il],
+                    n_kv, n_embd_head_v, n_head_kv,
+                    ggml_element_size(kv.v_l[il])*n_ctx,
+                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                    0);
+        cb(v, "v", il);
 
-    struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
-    cb(kqv, "kqv", il);
+        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+        cb(kqv, "kqv", il);
 
-    struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
-    cb(kqv_merged, "kqv_merged", il);
+        struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
+        cb(kqv_merged, "kqv_merged", il);
 
-    struct ggml_tensor * cur = ggml_cont_2d(ctx, kqv_merged, n_embd_head_k*n_head, n_tokens);
-    cb(cur, "kqv_merged_cont", il);
+        cur = ggml_cont_2d(ctx, kqv_merged, n_embd_head_k*n_head, n_tokens);
+        cb(cur, "kqv_merged_cont", il);
+    }
 
     ggml_build_forward_expand(graph, cur);
 
@@ -6411,6 +7670,7 @@ static struct ggml_tensor * llm_build_kv(
         struct ggml_context * ctx,
           const llama_model & model,
         const llama_hparams & hparams,
+        const llama_cparams & cparams,
        const llama_kv_cache & kv,
          struct ggml_cgraph * graph,
          struct ggml_tensor * wo,
@@ -6438,7 +7698,7 @@ static struct ggml_tensor * llm_build_kv(
 
     struct ggml_tensor * cur;
 
-    cur  = llm_build_kqv(ctx, model, hparams, kv, graph, wo, wo_b,
+    cur  = llm_build_kqv(ctx, model, hparams, cparams, kv, graph, wo, wo_b,
             q_cur, kq_mask, kq_pos, n_ctx, n_tokens, n_kv, kq_scale, cb, il);
     cb(cur, "kqv_out", il);
 
@@ -6454,7 +7714,7 @@ struct llm_build_context {
     const llama_kv_cache & kv_self;
 
     const int64_t n_embd;
-    const int64_t n_layer;
+    const int64_t n_layer;     // number of layers to evaluate (less than hparams.n_layer when exiting early)
     const int64_t n_rot;
     const int64_t n_ctx;       // user-specified context size (can be different from n_ctx_train)
     const int64_t n_head;
@@ -6503,7 +7763,7 @@ struct llm_build_context {
         batch            (batch),
         kv_self          (lctx.kv_self),
         n_embd           (hparams.n_embd),
-        n_layer          (hparams.n_layer),
+        n_layer          (cparams.n_layer_exit > 0 ? std::min(cparams.n_layer_exit, hparams.n_layer) : hparams.n_layer),
         n_rot            (hparams.n_rot),
         n_ctx            (cparams.n_ctx),
         n_head           (hparams.n_head),
@@ -6573,17 +7833,30 @@ struct llm_build_context {
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
-        for (int il = 0; il < n_layer; ++il) {
-            struct ggml_tensor * tmp =
+        for (int il = 0; il < (int) hparams.n_layer; ++il) {
+            struct ggml_tensor * k =
+                ggml_view_3d(ctx0, kv_self.k_l[il],
+                    n_embd_head_k, n_head_kv, n_ctx,
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                    0);
+
+            struct ggml_tensor * tmp;
+            if (ggml_is_quantized(k->type)) {
+                // dequantize to f32 -> RoPE -> quantize back
+                tmp = ggml_cast(ctx0, k, GGML_TYPE_F32);
+                cb(tmp, "K_f32", il);
+                tmp = ggml_rope_custom_inplace(ctx0, tmp,
+                        lctx.inp_K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+                cb(tmp, "K_shifted_f32", il);
+                tmp = ggml_cpy(ctx0, tmp, k);
+            } else {
                 // we rotate only the first n_rot dimensions
-                ggml_rope_custom_inplace(ctx0,
-                        ggml_view_3d(ctx0, kv_self.k_l[il],
-                            n_embd_head_k, n_head_kv, n_ctx,
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                            0),
+                tmp = ggml_rope_custom_inplace(ctx0, k,
                         lctx.inp_K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
+            }
             cb(tmp, "K_shifted", il);
             ggml_build_forward_expand(gf, tmp);
         }
@@ -6598,7 +7871,7 @@ struct llm_build_context {
 
         struct ggml_tensor * state_copy = build_inp_s_copy();
 
-        for (int il = 0; il < n_layer; ++il) {
+        for (int il = 0; il < (int) hparams.n_layer; ++il) {
             struct ggml_tensor * conv_states = ggml_reshape_2d(ctx0, kv_self.k_l[il], hparams.n_embd_k_s(), kv_self.size);
             struct ggml_tensor * ssm_states  = ggml_reshape_2d(ctx0, kv_self.v_l[il], hparams.n_embd_v_s(), kv_self.size);
 
@@ -6630,7 +7903,7 @@ struct llm_build_context {
                 nm++;
             }
 
-            for (int il = 0; il < n_layer; ++il) {
+            for (int il = 0; il < (int) hparams.n_layer; ++il) {
                 ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
                         n_embd_k_gqa, nm,
                         ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
@@ -6641,15 +7914,30 @@ struct llm_build_context {
                         ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
                         ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
 
-                ggml_tensor * view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                        nm, n_embd_v_gqa,
-                        ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                        ggml_row_size(kv_self.v_l[il]->type, i));
+                ggml_tensor * view_v_src;
+                ggml_tensor * view_v_dst;
+
+                if (kv_self.v_trans) {
+                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                            nm, n_embd_v_gqa,
+                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
+                            ggml_row_size(kv_self.v_l[il]->type, i));
 
-                ggml_tensor * view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                        nm, n_embd_v_gqa,
-                        ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                        ggml_row_size(kv_self.v_l[il]->type, id));
+                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                            nm, n_embd_v_gqa,
+                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
+                            ggml_row_size(kv_self.v_l[il]->type, id));
+                } else {
+                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                            n_embd_v_gqa, nm,
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+
+                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                            n_embd_v_gqa, nm,
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
+                }
 
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
@@ -6798,7 +8086,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -6938,7 +8226,7 @@ struct llm_build_context {
                 cb(Qcur, "Qcur", il);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7045,7 +8333,7 @@ struct llm_build_context {
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7165,7 +8453,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7290,7 +8578,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -7442,7 +8730,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                                    model.layers[il].wo, NULL,
                                    Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7554,7 +8842,7 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7758,7 +9046,7 @@ struct llm_build_context {
                         );
                 cb(Vcur, "Vcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Q, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7854,7 +9142,7 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 cb(Qcur, "Qcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8147,7 +9435,7 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8278,12 +9566,12 @@ struct llm_build_context {
                     Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                     Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
-                    cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                    cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
                 } else {
                     Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
-                    cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                    cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                             model.layers[il].wo, model.layers[il].bo,
                             Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
                 }
@@ -8427,7 +9715,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8545,7 +9833,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8658,7 +9946,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8772,7 +10060,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8927,7 +10215,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -9029,7 +10317,7 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9132,7 +10420,7 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9239,7 +10527,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9355,7 +10643,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9472,7 +10760,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9602,7 +10890,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9615,7 +10903,7 @@ struct llm_build_context {
             }
 
             // scale_res - scale the hidden states for residual connection
-            const float scale_res = scale_depth/sqrtf(float(n_layer));
+            const float scale_res = scale_depth/sqrtf(float(hparams.n_layer));
             cur = ggml_scale(ctx0, cur, scale_res);
             cb(cur, "hidden_scaled", -1);
 
@@ -9723,7 +11011,7 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -9842,7 +11130,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -10132,7 +11420,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -10263,7 +11551,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, nullptr,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_ctx, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -10563,10 +11851,126 @@ static void llama_set_s_copy(llama_context & lctx) {
     }
 }
 
-static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
-    //
-    // set input data
-    //
+// build the causal KQ mask [n_kv, n_tokens] of a batch
+// For causal attention, use only the previous KV cells
+// of the correct sequence for each token of the batch.
+// It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+static void llama_kv_cache_build_kq_mask(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch,
+                         int32_t   n_kv,
+                           float * data) {
+    // refresh the cells that changed since the last mask in the per-sequence positions
+    for (auto & it : cache.seq_pos) {
+        for (uint32_t i : cache.seq_pos_dirty) {
+            const llama_kv_cell & cell = cache.cells[i];
+            it.second[i] = cell.has_seq_id(it.first) ? cell.pos : std::numeric_limits<llama_pos>::max();
+        }
+    }
+    cache.seq_pos_dirty.clear();
+
+    for (int j = 0; j < batch.n_tokens; ++j) {
+        const llama_seq_id seq_id = batch.seq_id[j][0];
+
+        auto it = cache.seq_pos.find(seq_id);
+        if (it == cache.seq_pos.end()) {
+            // first time this sequence is seen since the cells were last reset
+            it = cache.seq_pos.emplace(seq_id, std::vector<llama_pos>(cache.size)).first;
+            for (uint32_t i = 0; i < cache.size; ++i) {
+                const llama_kv_cell & cell = cache.cells[i];
+                it->second[i] = cell.has_seq_id(seq_id) ? cell.pos : std::numeric_limits<llama_pos>::max();
+            }
+        }
+
+        const llama_pos * seq_pos = it->second.data();
+        const llama_pos   p       = batch.pos[j];
+
+        float * row = data + (int64_t) j*n_kv;
+        for (int i = 0; i < n_kv; ++i) {
+            row[i] = seq_pos[i] <= p ? 0.0f : -INFINITY;
+        }
+    }
+}
+
+// restrict the KQ mask of a tree of draft tokens, which occupies the cells head ... head + n_tokens - 1:
+// each token only attends to its ancestors among them
+static void llama_draft_tree_build_kq_mask(
+        struct llama_draft_tree & tree,
+                       uint32_t   head,
+                        int32_t   n_kv,
+                          float * data) {
+    const int32_t n_tokens = tree.tokens.size();
+
+    GGML_ASSERT((int64_t) head + n_tokens <= n_kv);
+
+    tree.cells.resize(n_tokens);
+    for (int32_t k = 0; k < n_tokens; ++k) {
+        tree.cells[k] = head + k;
+    }
+
+    for (int32_t j = 0; j < n_tokens; ++j) {
+        float * row = data + (int64_t) j*n_kv + head;
+        for (int32_t k = 0; k < n_tokens; ++k) {
+            row[k] = -INFINITY;
+        }
+        for (int32_t k = j; k >= 0; k = tree.parents[k]) {
+            row[k] = 0.0f;
+        }
+    }
+}
+
+// remove the cells of the tokens of a tree that are not on path from the KV cache, and forget the tree
+static bool llama_draft_tree_prune(
+         struct llama_kv_cache & cache,
+       struct llama_draft_tree & tree,
+                 const int32_t * path,
+                         int32_t   n_path) {
+    const int32_t n_tokens = tree.cells.size();
+    if (n_tokens == 0) {
+        return true;
+    }
+
+    std::vector<bool> keep(n_tokens, false);
+    for (int32_t i = 0; i < n_path; ++i) {
+        if (path[i] < 0 || path[i] >= n_tokens || tree.parents[path[i]] != (i == 0 ? -1 : path[i - 1])) {
+            LLAMA_LOG_ERROR("%s: token %d of the path is not a child of the previous one\n", __func__, path[i]);
+            return false;
+        }
+        keep[path[i]] = true;
+    }
+
+    uint32_t new_head = cache.size;
+
+    for (int32_t k = 0; k < n_tokens; ++k) {
+        const uint32_t i = tree.cells[k];
+        llama_kv_cell & cell = cache.cells[i];
+
+        // skip the cells that were changed since the tree was decoded
+        if (keep[k] || cell.pos != tree.pos + tree.depth[k] || !cell.has_seq_id(tree.seq_id)) {
+            continue;
+        }
+
+        cell.seq_id.erase(tree.seq_id);
+        cache.cell_changed(i);
+        if (cell.is_empty()) {
+            cache.used--;
+            cell.pos = -1;
+            if (new_head == cache.size) new_head = i;
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    tree.clear();
+
+    return true;
+}
+
+static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
+    //
+    // set input data
+    //
 
     const auto & hparams = lctx.model.hparams;
     const auto & cparams = lctx.cparams;
@@ -10629,31 +12033,16 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     if (lctx.inp_KQ_mask) {
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn) {
-            const int64_t n_kv     = kv_self.n;
-            const int64_t n_tokens = batch.n_tokens;
+            const int64_t n_kv = kv_self.n;
 
             GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask->buffer));
 
             float * data = (float *) lctx.inp_KQ_mask->data;
 
-            // For causal attention, use only the previous KV cells
-            // of the correct sequence for each token of the batch.
-            // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const llama_pos    pos    = batch.pos[j];
-                    const llama_seq_id seq_id = batch.seq_id[j][0];
+            llama_kv_cache_build_kq_mask(lctx.kv_self, batch, n_kv, data);
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                            f = -INFINITY;
-                        } else {
-                            f = 0.0f;
-                        }
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
-                    }
-                }
+            if (lctx.draft_tree.decoding) {
+                llama_draft_tree_build_kq_mask(lctx.draft_tree, kv_self.head, n_kv, data);
             }
         } else {
             // when using kv cache, the mask needs to match the kv cache size
@@ -10772,6 +12161,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
                 // ensure current sequences will be kept
                 if (!has_self_seq && kv_cell.pos >= 0) {
                     kv_cell.seq_id.insert(seq_id);
+                    lctx.kv_self.cell_changed(seq_id);
                 }
             }
         }
@@ -10899,6 +12289,111 @@ static void llama_graph_compute(
 #endif
 }
 
+static bool llama_graph_cache_match(const llama_context & lctx, const llama_batch & batch) {
+    const auto & gc = lctx.graph_cache;
+
+    return gc.valid &&
+        gc.n_tokens     == (uint32_t) batch.n_tokens &&
+        gc.n_outputs    == lctx.n_outputs &&
+        gc.n_kv         == lctx.kv_self.n &&
+        gc.inp_embd     == (batch.token == nullptr) &&
+        gc.causal_attn  == lctx.cparams.causal_attn &&
+        gc.embeddings   == lctx.cparams.embeddings &&
+        gc.n_layer_exit == lctx.cparams.n_layer_exit;
+}
+
+// the cached graph moves its KV store views by rewriting their data pointer, which is only valid when the
+// backend of the KV buffers does not keep per-view state (e.g. the device offset in tensor->extra)
+static bool llama_kv_cache_views_movable(const llama_kv_cache & kv_self) {
+    for (ggml_backend_buffer_t buf : kv_self.bufs) {
+        if (ggml_backend_buffer_is_host(buf)) {
+            continue;
+        }
+        bool movable = false;
+#if defined(GGML_USE_CUDA)
+        // CUDA views do not have an extra
+        for (int device = 0; device < ggml_backend_cuda_get_device_count(); ++device) {
+            if (ggml_backend_buffer_get_type(buf) == ggml_backend_cuda_buffer_type(device)) {
+                movable = true;
+                break;
+            }
+        }
+#endif
+        if (!movable) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// remember the graph of this ubatch after it has been allocated
+static void llama_graph_cache_set(llama_context & lctx, const llama_batch & batch, ggml_cgraph * gf, ggml_tensor * res, ggml_tensor * embd) {
+    auto & gc = lctx.graph_cache;
+    const auto & kv_self = lctx.kv_self;
+
+    gc.valid = false;
+    gc.kv_stores.clear();
+
+#ifdef GGML_USE_MPI
+    // the graph is modified for each node in ggml_mpi_graph_compute_pre
+    return;
+#endif
+
+    // the recurrent state views are not plain stores at kv_head, and with pipeline parallelism
+    // the scheduler cycles through several copies of the inputs
+    if (kv_self.recurrent || ggml_backend_sched_get_n_copies(lctx.sched) > 1) {
+        return;
+    }
+
+    if (!llama_kv_cache_views_movable(kv_self)) {
+        return;
+    }
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        ggml_tensor * node = gf->nodes[i];
+        if (node->op != GGML_OP_CPY || node->view_src == nullptr) {
+            continue;
+        }
+        for (int32_t il = 0; il < (int32_t) kv_self.k_l.size(); ++il) {
+            if (node->view_src == kv_self.k_l[il] || node->view_src == kv_self.v_l[il]) {
+                const bool is_v = node->view_src == kv_self.v_l[il];
+                gc.kv_stores.push_back({ node,         il, is_v });
+                gc.kv_stores.push_back({ node->src[1], il, is_v });
+                break;
+            }
+        }
+    }
+
+    gc.n_tokens     = batch.n_tokens;
+    gc.n_outputs    = lctx.n_outputs;
+    gc.n_kv         = kv_self.n;
+    gc.inp_embd     = batch.token == nullptr;
+    gc.causal_attn  = lctx.cparams.causal_attn;
+    gc.embeddings   = lctx.cparams.embeddings;
+    gc.n_layer_exit = lctx.cparams.n_layer_exit;
+
+    gc.gf   = gf;
+    gc.res  = res;
+    gc.embd = embd;
+
+    gc.valid = true;
+}
+
+// move the K and V stores of the cached graph to the current kv_self.head
+static void llama_graph_cache_set_kv_head(llama_context & lctx) {
+    const auto & kv_self = lctx.kv_self;
+    const auto & hparams = lctx.model.hparams;
+
+    for (const auto & store : lctx.graph_cache.kv_stores) {
+        const size_t offs = store.is_v ?
+            llama_kv_cache_v_offset(kv_self, hparams, store.il, kv_self.head) :
+            llama_kv_cache_k_offset(kv_self, hparams, store.il, kv_self.head);
+
+        store.t->view_offs = offs;
+        store.t->data      = (char *) store.t->view_src->data + offs;
+    }
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -11077,48 +12572,72 @@ static int llama_decode_internal(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
+        const int64_t t_graph_start_us = ggml_time_us();
+
         ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+        ggml_cgraph * gf;
+        struct ggml_tensor * res;
+        struct ggml_tensor * embd;
 
-        // the output is always the last tensor in the graph
-        struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
-        struct ggml_tensor * embd = gf->nodes[gf->n_nodes - 2];
+        if (llama_graph_cache_match(lctx, u_batch)) {
+            // same shape as the previous ubatch - the graph is still allocated, only the KV stores move
+            gf   = lctx.graph_cache.gf;
+            res  = lctx.graph_cache.res;
+            embd = lctx.graph_cache.embd;
 
-        if (lctx.n_outputs == 0) {
-            // no output
-            res  = nullptr;
-            embd = nullptr;
-        } else if (!hparams.causal_attn) {
-            res = nullptr; // do not extract logits for embedding models such as BERT
+            llama_graph_cache_set_kv_head(lctx);
 
-            // token or sequence embeddings
-            embd = gf->nodes[gf->n_nodes - 1];
+            lctx.n_graph_reuse++;
+        } else {
+            ggml_backend_sched_reset(lctx.sched);
 
-            GGML_ASSERT(strcmp(embd->name, "result_embd") == 0 || strcmp(embd->name, "result_embd_pooled") == 0);
-        } else if (cparams.embeddings) {
-            // the embeddings could be in the second to last tensor, or any of the previous tensors
-            int i_embd = gf->n_nodes - 2;
-            for (int i = 3; strcmp(embd->name, "result_norm") != 0; ++i) {
-                i_embd = gf->n_nodes - i;
-                if (i_embd < 0) { break; }
-                embd = gf->nodes[i_embd];
+            gf = llama_build_graph(lctx, u_batch, false);
+
+            // the output is always the last tensor in the graph
+            res  = gf->nodes[gf->n_nodes - 1];
+            embd = gf->nodes[gf->n_nodes - 2];
+
+            if (lctx.n_outputs == 0) {
+                // no output
+                res  = nullptr;
+                embd = nullptr;
+            } else if (!hparams.causal_attn) {
+                res = nullptr; // do not extract logits for embedding models such as BERT
+
+                // token or sequence embeddings
+                embd = gf->nodes[gf->n_nodes - 1];
+
+                GGML_ASSERT(strcmp(embd->name, "result_embd") == 0 || strcmp(embd->name, "result_embd_pooled") == 0);
+            } else if (cparams.embeddings) {
+                // the embeddings could be in the second to last tensor, or any of the previous tensors
+                int i_embd = gf->n_nodes - 2;
+                for (int i = 3; strcmp(embd->name, "result_norm") != 0; ++i) {
+                    i_embd = gf->n_nodes - i;
+                    if (i_embd < 0) { break; }
+                    embd = gf->nodes[i_embd];
+                }
+                GGML_ASSERT(i_embd >= 0 && "missing result_norm tensor");
+
+                // TODO: use a per-batch flag to know when to skip logits while keeping embeddings
+                if (!cparams.causal_attn) {
+                    res = nullptr; // do not extract logits when not needed
+                    // skip computing logits
+                    // TODO: is this safe?
+                    gf->n_nodes = i_embd + 1;
+                }
+            } else {
+                embd = nullptr; // do not extract embeddings when not needed
+                GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
             }
-            GGML_ASSERT(i_embd >= 0 && "missing result_norm tensor");
 
-            // TODO: use a per-batch flag to know when to skip logits while keeping embeddings
-            if (!cparams.causal_attn) {
-                res = nullptr; // do not extract logits when not needed
-                // skip computing logits
-                // TODO: is this safe?
-                gf->n_nodes = i_embd + 1;
-            }
-        } else {
-            embd = nullptr; // do not extract embeddings when not needed
-            GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+
+            llama_graph_cache_set(lctx, u_batch, gf, res, embd);
         }
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+        lctx.t_graph_us += ggml_time_us() - t_graph_start_us;
+        lctx.n_graph++;
 
         // for big prompts, if BLAS is enabled, it is better to use only one thread
         // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
@@ -11131,8 +12650,6 @@ static int llama_decode_internal(
             n_threads = std::min(4, n_threads);
         }
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
-
         llama_set_inputs(lctx, u_batch);
 
         llama_graph_compute(lctx, gf, n_threads);
@@ -11342,6 +12859,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
             // move the cell meta data
             kv_self.cells[i0 + nf] = cell1;
+            kv_self.cell_written(i0 + nf);
 
             // clear the old cell and move the head there
             cell1 = llama_kv_cell();
@@ -11372,6 +12890,8 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         return;
     }
 
+    kv_self.cells_changed();
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -11486,6 +13006,10 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
             kv_self.has_shift = false;
 
             for (uint32_t i = 0; i < kv_self.size; ++i) {
+                if (kv_self.cells[i].delta != 0) {
+                    // the keys have been rotated
+                    kv_self.cell_written(i);
+                }
                 kv_self.cells[i].delta = 0;
             }
         }
@@ -11528,6 +13052,9 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
 
     // reserve a worst case graph again
     if (need_reserve) {
+        // the graphs above were built in the same buffer as the cached one and the scheduler was reset
+        lctx.graph_cache.valid = false;
+
         // TODO: extract to a function
         // build worst-case graph
         int n_tokens = (int)std::min(lctx.cparams.n_ctx, lctx.cparams.n_ubatch);
@@ -11660,6 +13187,9 @@ struct llm_tokenizer_spm {
     llm_tokenizer_spm(const llama_vocab & vocab) : vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+        symbols.clear();
+        rev_merge.clear();
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
@@ -11796,26 +13326,27 @@ struct llm_bigram_bpe {
     };
 
     using queue_storage = std::vector<llm_bigram_bpe>;
-    using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id left_id;
+    llama_vocab::id right_id;
+    llama_vocab::id result;
     int rank;
-    size_t size;
 };
 
 struct llm_tokenizer_bpe {
     llm_tokenizer_bpe(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-        auto word_collection = bpe_gpt2_preprocess(text);
+        const llama_vocab::id n_vocab = vocab.id_to_token.size();
 
-        symbols_final.clear();
+        auto word_collection = bpe_gpt2_preprocess(text);
 
         for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
+            // the buffers keep their capacity across words
+            work_queue.clear();
             symbols.clear();
+            symbol_ids.clear();
 
             int index = 0;
             size_t offset = 0;
@@ -11830,6 +13361,7 @@ struct llm_tokenizer_bpe {
                 sym.next = offset == word.size() ? -1 : index + 1;
                 index++;
                 symbols.emplace_back(sym);
+                symbol_ids.push_back(vocab.find_bpe_piece(std::string(sym.text, sym.n)));
             }
             for (size_t i = 1; i < symbols.size(); ++i) {
                 add_new_bigram(i - 1, i);
@@ -11837,8 +13369,9 @@ struct llm_tokenizer_bpe {
 
             // build token(s)
             while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+                std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+                const llm_bigram_bpe bigram = work_queue.back();
+                work_queue.pop_back();
 
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
@@ -11846,15 +13379,14 @@ struct llm_tokenizer_bpe {
                 if (left_symbol.n == 0 || right_symbol.n == 0) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
+                if (symbol_ids[bigram.left] != bigram.left_id || symbol_ids[bigram.right] != bigram.right_id) {
                     continue;  // Skip this bigram if it's outdated
                 }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
                 right_symbol.n = 0;
+                symbol_ids[bigram.left] = bigram.result;
 
                 // remove the right sym from the chain
                 left_symbol.next = right_symbol.next;
@@ -11866,35 +13398,18 @@ struct llm_tokenizer_bpe {
                 add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
-        }
-
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
+            // output the finished tokens of the word, or their bytes for the pieces that are not tokens
+            for (int i = symbols.empty() ? -1 : 0; i != -1; i = symbols[i].next) {
+                const auto & symbol = symbols[i];
                 if (symbol.n == 0) {
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+                const llama_vocab::id id = symbol_ids[i];
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
+                if (id < 0 || id >= n_vocab) {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        std::string byte_str(1, symbol.text[j]);
                         auto token_multibyte = vocab.token_to_id.find(byte_str);
                         if (token_multibyte == vocab.token_to_id.end()) {
                             throw std::runtime_error("ERROR: byte not found in vocab");
@@ -11902,7 +13417,7 @@ struct llm_tokenizer_bpe {
                         output.push_back((*token_multibyte).second);
                     }
                 } else {
-                    output.push_back((*token).second);
+                    output.push_back(id);
                 }
             }
         }
@@ -11914,26 +13429,30 @@ private:
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        const llama_vocab::id left_id  = symbol_ids[left];
+        const llama_vocab::id right_id = symbol_ids[right];
 
-        int rank_found = -1;
+        if (left_id < 0 || right_id < 0) {
+            return;
+        }
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        const llama_vocab::bpe_merge * merge = vocab.find_bpe_merge(left_id, right_id);
 
-        if (rank_found < 0) {
+        if (merge == nullptr) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = left_id;
+        bigram.right_id = right_id;
+        bigram.result   = merge->result;
+        bigram.rank     = merge->rank;
 
-        work_queue.push(bigram);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
     }
 
     std::vector<std::string> bpe_gpt2_preprocess(const std::string & text) {
@@ -12077,10 +13596,10 @@ private:
 
     const llama_vocab & vocab;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llm_symbol>      symbols;
+    std::vector<llama_vocab::id> symbol_ids; // token or interned id of each symbol, -1 if it takes part in no merge
 
-    llm_bigram_bpe::queue work_queue;
+    llm_bigram_bpe::queue_storage work_queue; // a heap ordered by llm_bigram_bpe::comparator
 };
 
 struct llm_tokenizer_wpm {
@@ -12339,8 +13858,19 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
     }
 }
 
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special) {
-    std::vector<llama_vocab::id> output;
+// the tokenizers of a thread, reused with their buffers for all the texts it tokenizes
+struct llama_tokenize_scratch {
+    llama_tokenize_scratch(const llama_vocab & vocab) : spm(vocab), bpe(vocab), wpm(vocab) {}
+
+    llm_tokenizer_spm spm;
+    llm_tokenizer_bpe bpe;
+    llm_tokenizer_wpm wpm;
+};
+
+// appends the tokens of raw_text to output
+static void llama_tokenize_impl(
+        const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special,
+        llama_tokenize_scratch & scratch, std::vector<llama_vocab::id> & output) {
     std::forward_list<fragment_buffer_variant> fragment_buffer;
 
     if (!raw_text.empty()) {
@@ -12379,9 +13909,8 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_spm tokenizer(vocab);
                         llama_escape_whitespace(raw_text);
-                        tokenizer.tokenize(raw_text, output);
+                        scratch.spm.tokenize(raw_text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
                     }
@@ -12406,8 +13935,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_bpe tokenizer(vocab);
-                        tokenizer.tokenize(raw_text, output);
+                        scratch.bpe.tokenize(raw_text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
                     }
@@ -12429,8 +13957,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_wpm tokenizer(vocab);
-                        tokenizer.tokenize(raw_text, output);
+                        scratch.wpm.tokenize(raw_text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
                     }
@@ -12444,6 +13971,13 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
         case LLAMA_VOCAB_TYPE_NONE:
             GGML_ASSERT(false);
     }
+}
+
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special) {
+    llama_tokenize_scratch scratch(vocab);
+
+    std::vector<llama_vocab::id> output;
+    llama_tokenize_impl(vocab, std::move(raw_text), add_special, parse_special, scratch, output);
 
     return output;
 }
@@ -12767,6 +14301,228 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
     return rejects;
 }
 
+static void llama_grammar_trie_build(
+        llama_grammar_trie             & trie,
+        const std::vector<std::string> & pieces,
+        const std::vector<llama_token> & eog) {
+    static std::atomic<uint64_t> next_id(1);
+
+    trie.id      = next_id++;
+    trie.n_vocab = pieces.size();
+    trie.nodes.clear();
+    trie.tokens.clear();
+    trie.eog = eog;
+
+    std::vector<bool> is_eog(pieces.size(), false);
+    for (const llama_token id : eog) {
+        is_eog[id] = true;
+    }
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded(pieces.size());
+    std::vector<llama_token> order;
+    order.reserve(pieces.size());
+
+    for (size_t id = 0; id < pieces.size(); ++id) {
+        if (is_eog[id] || pieces[id].empty() || pieces[id][0] == 0) {
+            continue;
+        }
+        decoded[id] = decode_utf8(pieces[id], {});
+        decoded[id].first.pop_back(); // terminating 0
+        order.push_back(id);
+    }
+
+    // tokens sharing a prefix are contiguous, and the ones ending at a prefix come before the longer ones
+    std::sort(order.begin(), order.end(), [&](llama_token a, llama_token b) {
+        return decoded[a].first < decoded[b].first;
+    });
+
+    // breadth first, so that the children of a node are contiguous
+    struct range {
+        uint32_t node;
+        uint32_t begin;
+        uint32_t end;
+        uint32_t depth;
+    };
+
+    std::vector<range> queue;
+    queue.push_back({ 0, 0, (uint32_t) order.size(), 0 });
+    trie.nodes.push_back({ 0, 0, 0, 0, 0 });
+
+    for (size_t q = 0; q < queue.size(); ++q) {
+        const range r = queue[q];
+
+        uint32_t i = r.begin;
+
+        trie.nodes[r.node].token_begin = trie.tokens.size();
+        for (; i < r.end && decoded[order[i]].first.size() == r.depth; ++i) {
+            trie.tokens.push_back({ order[i], decoded[order[i]].second });
+        }
+        trie.nodes[r.node].token_end = trie.tokens.size();
+
+        trie.nodes[r.node].child_begin = trie.nodes.size();
+        while (i < r.end) {
+            const uint32_t chr = decoded[order[i]].first[r.depth];
+
+            uint32_t j = i + 1;
+            while (j < r.end && decoded[order[j]].first[r.depth] == chr) {
+                ++j;
+            }
+
+            queue.push_back({ (uint32_t) trie.nodes.size(), i, j, r.depth + 1 });
+            trie.nodes.push_back({ chr, 0, 0, 0, 0 });
+
+            i = j;
+        }
+        trie.nodes[r.node].child_end = trie.nodes.size();
+    }
+}
+
+static void llama_grammar_mask_set(std::vector<uint32_t> & mask, llama_token id) {
+    mask[id >> 5] |= 1u << (id & 31);
+}
+
+// same as llama_grammar_reject_candidates_for_stack, with the candidates that share a prefix matched once as a
+// node of the trie, and the allowed tokens set in mask instead of returning the rejected ones
+static void llama_grammar_trie_match(
+        const llama_grammar_trie                              & trie,
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const std::vector<const llama_grammar_element *>      & stack,
+        const std::vector<uint32_t>                           & nodes,
+        std::vector<uint32_t>                                 & mask) {
+
+    if (stack.empty()) {
+        for (const uint32_t n : nodes) {
+            for (uint32_t t = trie.nodes[n].token_begin; t < trie.nodes[n].token_end; ++t) {
+                if (trie.tokens[t].partial_utf8.n_remain == 0) {
+                    llama_grammar_mask_set(mask, trie.tokens[t].id);
+                }
+            }
+        }
+        return;
+    }
+
+    const llama_grammar_element * stack_pos = stack.back();
+
+    // a single char, e.g. "a", can be looked up among the sorted children
+    const bool is_single_char =
+        stack_pos->type == LLAMA_GRETYPE_CHAR &&
+        stack_pos[1].type != LLAMA_GRETYPE_CHAR_RNG_UPPER &&
+        stack_pos[1].type != LLAMA_GRETYPE_CHAR_ALT;
+
+    std::vector<uint32_t> next_nodes;
+
+    for (const uint32_t n : nodes) {
+        const llama_grammar_trie::node & node = trie.nodes[n];
+
+        for (uint32_t t = node.token_begin; t < node.token_end; ++t) {
+            const llama_grammar_trie::token & tok = trie.tokens[t];
+            if (tok.partial_utf8.n_remain == 0 || llama_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                llama_grammar_mask_set(mask, tok.id);
+            }
+        }
+
+        if (is_single_char) {
+            const auto * begin = trie.nodes.data() + node.child_begin;
+            const auto * end   = trie.nodes.data() + node.child_end;
+            const auto * it    = std::lower_bound(begin, end, stack_pos->value,
+                    [](const llama_grammar_trie::node & a, uint32_t chr) { return a.chr < chr; });
+            if (it != end && it->chr == stack_pos->value) {
+                next_nodes.push_back(it - trie.nodes.data());
+            }
+        } else {
+            for (uint32_t c = node.child_begin; c < node.child_end; ++c) {
+                if (llama_grammar_match_char(stack_pos, trie.nodes[c].chr).first) {
+                    next_nodes.push_back(c);
+                }
+            }
+        }
+    }
+
+    if (next_nodes.empty()) {
+        return;
+    }
+
+    const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    std::vector<const llama_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    std::vector<std::vector<const llama_grammar_element *>> next_stacks;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    for (const auto & next_stack : next_stacks) {
+        llama_grammar_trie_match(trie, rules, next_stack, next_nodes, mask);
+    }
+}
+
+// bitmask of the tokens of the trie that the grammar allows next, assuming no partial UTF-8 sequence is pending
+static void llama_grammar_token_mask(
+        const llama_grammar_trie & trie,
+        const llama_grammar      * grammar,
+        std::vector<uint32_t>    & mask) {
+    GGML_ASSERT(grammar->partial_utf8.n_remain == 0);
+
+    mask.assign((trie.n_vocab + 31)/32, 0);
+
+    const std::vector<uint32_t> root = { 0 };
+
+    bool allow_eog = false;
+    for (const auto & stack : grammar->stacks) {
+        allow_eog = allow_eog || stack.empty();
+        llama_grammar_trie_match(trie, grammar->rules, stack, root, mask);
+    }
+
+    if (allow_eog) {
+        for (const llama_token id : trie.eog) {
+            llama_grammar_mask_set(mask, id);
+        }
+    }
+}
+
+// a grammar that keeps returning to the same states, e.g. the characters of a JSON string, computes their masks once
+#define LLAMA_GRAMMAR_MAX_TOKEN_MASKS 256
+
+// the cached masks are only valid for the vocab they were computed with, a grammar used with another model drops them
+static bool llama_grammar_has_token_mask(const llama_grammar_trie & trie, const llama_grammar * grammar) {
+    return grammar->token_masks_trie_id == trie.id && grammar->token_masks.count(grammar->stacks) > 0;
+}
+
+static const std::vector<uint32_t> & llama_grammar_cached_token_mask(
+        const llama_grammar_trie & trie,
+        const llama_grammar      * grammar) {
+    auto & masks = grammar->token_masks;
+
+    if (grammar->token_masks_trie_id != trie.id) {
+        masks.clear();
+        grammar->token_masks_trie_id = trie.id;
+    }
+
+    auto it = masks.find(grammar->stacks);
+    if (it != masks.end()) {
+        return it->second;
+    }
+
+    if (masks.size() >= LLAMA_GRAMMAR_MAX_TOKEN_MASKS) {
+        masks.clear();
+    }
+
+    auto & mask = masks[grammar->stacks];
+    llama_grammar_token_mask(trie, grammar, mask);
+
+    return mask;
+}
+
+static void llama_grammar_apply_token_mask(const std::vector<uint32_t> & mask, llama_token_data_array * candidates) {
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const llama_token id = candidates->data[i].id;
+        if (!((mask[id >> 5] >> (id & 31)) & 1)) {
+            candidates->data[i].logit = -INFINITY;
+        }
+    }
+}
+
 //
 // grammar - external
 //
@@ -12808,7 +14564,7 @@ struct llama_grammar * llama_grammar_init(
         }
     } while (true);
 
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {}, {}, 0 };
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -12816,7 +14572,8 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
+    // the cached masks refer to the elements of the original rules and are not copied
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8, {}, 0 };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -12845,20 +14602,270 @@ void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed) {
     ctx->rng.seed(seed);
 }
 
-void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
-    GGML_ASSERT(candidates->size > 0);
+// loops over the logits of the whole vocabulary, written with independent lanes so that the compiler vectorizes them
 
-    const int64_t t_start_sample_us = ggml_time_us();
+static constexpr int LLAMA_SAMPLE_VEC_LANES = 16;
 
-    // Sort the logits in descending order
-    if (!candidates->sorted) {
-        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        });
-        candidates->sorted = true;
+static float llama_sample_vec_max(const float * x, size_t n) {
+    float acc[LLAMA_SAMPLE_VEC_LANES];
+    for (int j = 0; j < LLAMA_SAMPLE_VEC_LANES; ++j) {
+        acc[j] = -INFINITY;
     }
 
-    float max_l = candidates->data[0].logit;
+    size_t i = 0;
+    for (; i + LLAMA_SAMPLE_VEC_LANES <= n; i += LLAMA_SAMPLE_VEC_LANES) {
+        for (int j = 0; j < LLAMA_SAMPLE_VEC_LANES; ++j) {
+            acc[j] = x[i + j] > acc[j] ? x[i + j] : acc[j];
+        }
+    }
+
+    float max = -INFINITY;
+    for (int j = 0; j < LLAMA_SAMPLE_VEC_LANES; ++j) {
+        max = std::max(max, acc[j]);
+    }
+    for (; i < n; ++i) {
+        max = std::max(max, x[i]);
+    }
+
+    return max;
+}
+
+// true if any of LLAMA_SAMPLE_VEC_BLOCK values is greater than t
+// (counted rather than or-ed, the compiler does not vectorize the latter once this is inlined)
+static constexpr int LLAMA_SAMPLE_VEC_BLOCK = 64;
+
+static inline bool llama_sample_vec_any_greater(const float * x, float t) {
+    int count = 0;
+    for (int j = 0; j < LLAMA_SAMPLE_VEC_BLOCK; ++j) {
+        count += x[j] > t;
+    }
+    return count != 0;
+}
+
+// expf without a library call (Cephes polynomial, within 2 ulp), exp(-inf) and anything below the smallest normal is 0
+static inline float llama_sample_expf(float x) {
+    const float xc = std::min(std::max(x, -87.33654f), 88.0f);
+
+    // x = n*ln(2) + r, |r| <= ln(2)/2
+    const float n = (xc*1.44269504f + 12582912.0f) - 12582912.0f;
+    const float r = xc - n*0.693359375f + n*2.12194440e-4f;
+
+    float y = 1.9875691500e-4f;
+    y = y*r + 1.3981999507e-3f;
+    y = y*r + 8.3334519073e-3f;
+    y = y*r + 4.1665795894e-2f;
+    y = y*r + 1.6666665459e-1f;
+    y = y*r + 5.0000001201e-1f;
+    y = y*r*r + r + 1.0f;
+
+    // 2^n
+    const int32_t bits = ((int32_t) n + 127) << 23;
+    float pow2n;
+    memcpy(&pow2n, &bits, sizeof(pow2n));
+
+    return x < -87.33654f ? 0.0f : y*pow2n;
+}
+
+// y[i] = exp((x[i] - max)*scale), returns the sum of y - x and y can be the same
+static float llama_sample_vec_exp(const float * x, float * y, size_t n, float max, float scale) {
+    float acc[LLAMA_SAMPLE_VEC_LANES] = {};
+
+    size_t i = 0;
+    for (; i + LLAMA_SAMPLE_VEC_LANES <= n; i += LLAMA_SAMPLE_VEC_LANES) {
+        for (int j = 0; j < LLAMA_SAMPLE_VEC_LANES; ++j) {
+            const float e = llama_sample_expf((x[i + j] - max)*scale);
+            y[i + j] = e;
+            acc[j] += e;
+        }
+    }
+
+    float sum = 0.0f;
+    for (int j = 0; j < LLAMA_SAMPLE_VEC_LANES; ++j) {
+        sum += acc[j];
+    }
+    for (; i < n; ++i) {
+        y[i] = llama_sample_expf((x[i] - max)*scale);
+        sum += y[i];
+    }
+
+    return sum;
+}
+
+static bool llama_sample_logit_greater(const llama_token_data & a, const llama_token_data & b) {
+    return a.logit > b.logit;
+}
+
+// histogram of the logits in buckets below max, like the bucket sort of llama_sample_top_k but relative to the max logit
+struct llama_sample_buckets {
+    static constexpr int   n     = 128;
+    static constexpr float range = 32.0f; // everything further below the max falls into the lowest bucket
+    static constexpr float scale = n/range;
+
+    float low;
+
+    int   count[n] = {};
+    float mass [n] = {}; // sum of exp(logit - max), only filled by llama_sample_select_top_p
+
+    explicit llama_sample_buckets(float max) : low(max - range) {}
+
+    int operator()(float x) const {
+        const float f = (x - low)*scale;
+        return !(f > 0.0f) ? 0 : std::min((int) f, n - 1);
+    }
+};
+
+// copy the candidates from bucket ib up to out and sort them
+static size_t llama_sample_gather_sorted(const float * logits, size_t n, const llama_sample_buckets & buckets, int ib, std::vector<llama_token_data> & out) {
+    if (out.size() < n) {
+        out.resize(n);
+    }
+
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (buckets(logits[i]) >= ib) {
+            out[m++] = llama_token_data{ (llama_token) i, logits[i], 0.0f };
+        }
+    }
+    std::sort(out.begin(), out.begin() + m, llama_sample_logit_greater);
+
+    return m;
+}
+
+// the k highest logits in descending order in out, by partial selection without sorting the vocabulary
+static size_t llama_sample_select_top(const float * logits, size_t n, size_t k, float max, std::vector<llama_token_data> & out) {
+    k = std::min(k, n);
+
+    if (out.size() < n) {
+        out.resize(n);
+    }
+
+    if (k <= 128) {
+        // keep the k highest seen so far in a min-heap, most blocks of logits are below all of them and skipped at once
+        for (size_t i = 0; i < k; ++i) {
+            out[i] = llama_token_data{ (llama_token) i, logits[i], 0.0f };
+        }
+        std::make_heap(out.begin(), out.begin() + k, llama_sample_logit_greater);
+
+        float lowest = out[0].logit;
+
+        // replace the lowest of the heap and sift it down
+        auto push = [&](size_t i) {
+            if (logits[i] <= lowest) {
+                return;
+            }
+            size_t pos = 0;
+            for (size_t c = 1; c < k; c = 2*pos + 1) {
+                if (c + 1 < k && out[c + 1].logit < out[c].logit) {
+                    c++;
+                }
+                if (out[c].logit >= logits[i]) {
+                    break;
+                }
+                out[pos] = out[c];
+                pos = c;
+            }
+            out[pos] = llama_token_data{ (llama_token) i, logits[i], 0.0f };
+            lowest = out[0].logit;
+        };
+
+        size_t i0 = k;
+        for (; i0 + LLAMA_SAMPLE_VEC_BLOCK <= n; i0 += LLAMA_SAMPLE_VEC_BLOCK) {
+            if (llama_sample_vec_any_greater(logits + i0, lowest)) {
+                for (int j = 0; j < LLAMA_SAMPLE_VEC_BLOCK; ++j) {
+                    push(i0 + j);
+                }
+            }
+        }
+        for (; i0 < n; ++i0) {
+            push(i0);
+        }
+
+        std::sort_heap(out.begin(), out.begin() + k, llama_sample_logit_greater);
+
+        return k;
+    }
+
+    // only the candidates from the bucket that contains the k-th highest logit up are sorted
+    llama_sample_buckets buckets(max);
+    for (size_t i = 0; i < n; ++i) {
+        ++buckets.count[buckets(logits[i])];
+    }
+
+    size_t nhave = 0;
+    int ib = llama_sample_buckets::n - 1;
+    for (; ib > 0; --ib) {
+        nhave += buckets.count[ib];
+        if (nhave >= k) {
+            break;
+        }
+    }
+
+    llama_sample_gather_sorted(logits, n, buckets, ib, out);
+
+    return k;
+}
+
+// the smallest number of highest logits whose probabilities add up to p in descending order in out, like
+// llama_sample_top_p on the whole vocabulary: the probability mass of each bucket gives the bucket of the cutoff
+static size_t llama_sample_select_top_p(
+        const float * logits, size_t n, float p, size_t min_keep, float max,
+        std::vector<llama_token_data> & out, std::vector<float> & tmp) {
+    if (tmp.size() < n) {
+        tmp.resize(n);
+    }
+
+    const float sum = llama_sample_vec_exp(logits, tmp.data(), n, max, 1.0f);
+
+    llama_sample_buckets buckets(max);
+    for (size_t i = 0; i < n; ++i) {
+        const int ib = buckets(logits[i]);
+        buckets.count[ib] += 1;
+        buckets.mass [ib] += tmp[i];
+    }
+
+    size_t nhave = 0;
+    float  cum   = 0.0f;
+    int ib = llama_sample_buckets::n - 1;
+    for (; ib > 0; --ib) {
+        nhave += buckets.count[ib];
+        cum   += buckets.mass [ib];
+        if (cum >= p*sum && nhave >= min_keep) {
+            break;
+        }
+    }
+
+    // rounding can leave the cumulative probability of the candidates just short of p, then include the next bucket
+    for (;; --ib) {
+        const size_t m = llama_sample_gather_sorted(logits, n, buckets, ib, out);
+
+        float cum_sum = 0.0f;
+        for (size_t i = 0; i < m; ++i) {
+            cum_sum += llama_sample_expf(out[i].logit - max)/sum;
+            if (cum_sum >= p && i + 1 >= min_keep) {
+                return i + 1;
+            }
+        }
+
+        if (ib == 0) {
+            return m;
+        }
+    }
+}
+
+void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
+    GGML_ASSERT(candidates->size > 0);
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    // Sort the logits in descending order
+    if (!candidates->sorted) {
+        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        candidates->sorted = true;
+    }
+
+    float max_l = candidates->data[0].logit;
     float cum_sum = 0.0f;
     for (size_t i = 0; i < candidates->size; ++i) {
         float p = expf(candidates->data[i].logit - max_l);
@@ -12960,15 +14967,43 @@ void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * can
         return;
     }
 
-    llama_sample_softmax(ctx, candidates);
+    if (candidates->sorted) {
+        llama_sample_softmax(ctx, candidates);
+    }
 
     const int64_t t_start_sample_us = ggml_time_us();
 
+    // only the candidates up to the cutoff have to be sorted - the probabilities are computed in any order,
+    // then the highest candidates are sorted in growing chunks as the cumulative probability needs them
+    size_t n_sorted = candidates->size;
+
+    if (!candidates->sorted) {
+        float max_l = -INFINITY;
+        for (size_t i = 0; i < candidates->size; ++i) {
+            max_l = std::max(max_l, candidates->data[i].logit);
+        }
+        // summed in double, the order of the candidates must not matter for the cutoff
+        double sum = 0.0;
+        for (size_t i = 0; i < candidates->size; ++i) {
+            candidates->data[i].p = expf(candidates->data[i].logit - max_l);
+            sum += candidates->data[i].p;
+        }
+        for (size_t i = 0; i < candidates->size; ++i) {
+            candidates->data[i].p /= (float) sum;
+        }
+        n_sorted = 0;
+    }
+
     // Compute the cumulative probabilities
     float cum_sum = 0.0f;
     size_t last_idx = candidates->size;
 
     for (size_t i = 0; i < candidates->size; ++i) {
+        if (i == n_sorted) {
+            n_sorted = std::min(std::max((size_t) 64, 4*n_sorted), candidates->size);
+            std::partial_sort(candidates->data + i, candidates->data + n_sorted, candidates->data + candidates->size, llama_sample_logit_greater);
+        }
+
         cum_sum += candidates->data[i].p;
 
         // Check if the running sum is at least p or if we have kept at least min_keep tokens
@@ -12981,6 +15016,7 @@ void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * can
 
     // Resize the output vector to keep only the top-p tokens
     candidates->size = last_idx;
+    candidates->sorted = true;
 
     if (ctx) {
         ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -13297,10 +15333,47 @@ void llama_sample_repetition_penalties(
     }
 }
 
+static const llama_grammar_trie & llama_get_grammar_trie(const struct llama_context * ctx) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    llama_grammar_trie & trie = ctx->model.vocab.grammar_trie;
+    if (trie.n_vocab == 0) {
+        const int32_t n_vocab = llama_n_vocab(&ctx->model);
+
+        std::vector<std::string> pieces(n_vocab);
+        std::vector<llama_token> eog;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            pieces[id] = llama_token_to_piece(ctx, id, false);
+            if (llama_token_is_eog(&ctx->model, id)) {
+                eog.push_back(id);
+            }
+        }
+
+        llama_grammar_trie_build(trie, pieces, eog);
+    }
+
+    return trie;
+}
+
 void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * candidates, const struct llama_grammar * grammar) {
     GGML_ASSERT(ctx);
     const int64_t t_start_sample_us = ggml_time_us();
 
+    // unless the previous token ended in the middle of a UTF-8 sequence, the allowed tokens depend on the stacks
+    // only: test the candidates against the mask of the whole vocabulary for these stacks, computed once per state.
+    // a few candidates without a cached mask are cheaper to match one by one
+    if (grammar->partial_utf8.n_remain == 0) {
+        const llama_grammar_trie & trie = llama_get_grammar_trie(ctx);
+
+        if (candidates->size >= (size_t) trie.n_vocab/16 || llama_grammar_has_token_mask(trie, grammar)) {
+            llama_grammar_apply_token_mask(llama_grammar_cached_token_mask(trie, grammar), candidates);
+
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+            return;
+        }
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
@@ -13505,6 +15578,138 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
     return result;
 }
 
+// the candidates left by top-k, top-p and min-p in arena.cur, their weights after temperature in arena.probs
+static size_t llama_sample_fused_candidates(
+        llama_sampling_arena & arena,
+                 const float * logits,
+                      int32_t   n_vocab,
+                      int32_t   top_k,
+                        float   top_p,
+                        float   min_p,
+                        float   temp,
+                       size_t   min_keep) {
+    auto & cur = arena.cur;
+
+    const size_t n   = n_vocab;
+    const float  max = llama_sample_vec_max(logits, n);
+
+    min_keep = std::min(std::max(min_keep, (size_t) 1), n);
+
+    // number of candidates in cur, none until one of the samplers narrows down the vocabulary
+    size_t n_cur = 0;
+    bool   all   = true;
+
+    if (top_k > 0 && (size_t) top_k < n) {
+        n_cur = llama_sample_select_top(logits, n, std::max((size_t) top_k, min_keep), max, cur);
+        all   = false;
+    }
+
+    if (top_p < 1.0f) {
+        if (all) {
+            n_cur = llama_sample_select_top_p(logits, n, top_p, min_keep, max, cur, arena.probs);
+            all   = false;
+        } else {
+            float sum = 0.0f;
+            for (size_t i = 0; i < n_cur; ++i) {
+                cur[i].p = llama_sample_expf(cur[i].logit - max);
+                sum += cur[i].p;
+            }
+
+            float cum_sum = 0.0f;
+            for (size_t i = 0; i < n_cur; ++i) {
+                cum_sum += cur[i].p/sum;
+                if (cum_sum >= top_p && i + 1 >= min_keep) {
+                    n_cur = i + 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (min_p > 0.0f) {
+        const float min_logit = max + logf(min_p);
+
+        if (all) {
+            if (cur.size() < n) {
+                cur.resize(n);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (logits[i] >= min_logit) {
+                    cur[n_cur++] = llama_token_data{ (llama_token) i, logits[i], 0.0f };
+                }
+            }
+            if (n_cur < min_keep) {
+                n_cur = llama_sample_select_top(logits, n, min_keep, max, cur);
+            }
+            all = false;
+        } else {
+            // cur is sorted, the first candidate always stays
+            size_t i = 1;
+            for (; i < n_cur; ++i) {
+                if (cur[i].logit < min_logit && i >= min_keep) {
+                    break;
+                }
+            }
+            n_cur = i;
+        }
+    }
+
+    if (all) {
+        if (cur.size() < n) {
+            cur.resize(n);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            cur[i] = llama_token_data{ (llama_token) i, logits[i], 0.0f };
+        }
+        n_cur = n;
+    }
+
+    // the highest logit is always among the candidates
+    if (arena.probs.size() < n_cur) {
+        arena.probs.resize(n);
+    }
+    for (size_t i = 0; i < n_cur; ++i) {
+        arena.probs[i] = cur[i].logit;
+    }
+    llama_sample_vec_exp(arena.probs.data(), arena.probs.data(), n_cur, max, 1.0f/temp);
+
+    return n_cur;
+}
+
+llama_token llama_sample_token_fused(
+        struct llama_context * ctx,
+                 const float * logits,
+                     int32_t   top_k,
+                       float   top_p,
+                       float   min_p,
+                       float   temp,
+                      size_t   min_keep) {
+    GGML_ASSERT(ctx);
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const int32_t n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    llama_token result;
+
+    if (temp <= 0.0f) {
+        // the first token with the highest logit, like llama_sample_token_greedy
+        const float max = llama_sample_vec_max(logits, n_vocab);
+        result = std::find(logits, logits + n_vocab, max) - logits;
+    } else {
+        auto & arena = ctx->sampling_arena;
+
+        const size_t n_cur = llama_sample_fused_candidates(arena, logits, n_vocab, top_k, top_p, min_p, temp, min_keep);
+
+        std::discrete_distribution<> dist(arena.probs.begin(), arena.probs.begin() + n_cur);
+        result = arena.cur[dist(ctx->rng)].id;
+    }
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    ctx->n_sample++;
+    return result;
+}
+
 void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar * grammar, llama_token token) {
     const int64_t t_start_sample_us = ggml_time_us();
 
@@ -13818,65 +16023,133 @@ struct quantize_state_internal {
         {}
 };
 
-static void llama_tensor_dequantize_internal(
-    struct ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
-    const size_t nelements, const int nthread
-) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
+// a fixed set of threads that run the chunks of parallel loops, so that quantizing a model does not start new threads for every tensor
+// the chunks are handed out with an atomic counter, the thread that starts a loop works on it too
+struct llama_quantize_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    const std::function<void(int64_t)> * fn = nullptr;
+
+    int64_t              n_chunks = 0;
+    std::atomic<int64_t> next_chunk;
+    uint64_t             n_loops  = 0; // number of loops started, the threads wait for it to change
+    int                  n_busy   = 0;
+    bool                 stop     = false;
+
+    explicit llama_quantize_pool(int n_threads) : next_chunk(0) {
+        for (int i = 1; i < n_threads; ++i) {
+            threads.emplace_back([this] { worker(); });
+        }
+    }
+
+    ~llama_quantize_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_start.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    void run_chunks(const std::function<void(int64_t)> & f) {
+        while (true) {
+            const int64_t i = next_chunk.fetch_add(1, std::memory_order_relaxed);
+            if (i >= n_chunks) {
+                break;
+            }
+            f(i);
+        }
+    }
+
+    void worker() {
+        uint64_t n_seen = 0;
+        while (true) {
+            const std::function<void(int64_t)> * f;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_start.wait(lock, [&] { return stop || n_loops != n_seen; });
+                if (stop) {
+                    return;
+                }
+                n_seen = n_loops;
+                f      = fn;
+                ++n_busy;
+            }
+            run_chunks(*f);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--n_busy == 0) {
+                    cv_done.notify_all();
+                }
+            }
+        }
+    }
+
+    // calls f(i) for i in [0, n) from all the threads of the pool, returns when all the calls are done
+    void parallel_for(int64_t n, const std::function<void(int64_t)> & f) {
+        if (threads.empty() || n < 2) {
+            for (int64_t i = 0; i < n; ++i) {
+                f(i);
+            }
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // a thread that woke up after the previous loop was done may still be looking at its counter
+            cv_done.wait(lock, [&] { return n_busy == 0; });
+            fn         = &f;
+            n_chunks   = n;
+            next_chunk = 0;
+            ++n_loops;
+        }
+        cv_start.notify_all();
+        run_chunks(f);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_busy == 0; });
     }
-    float * f32_output = (float *) output.data();
+};
 
-    ggml_type_traits_t qtype;
+static void llama_tensor_dequantize_check(const struct ggml_tensor * tensor) {
     if (ggml_is_quantized(tensor->type)) {
-        qtype = ggml_internal_get_type_traits(tensor->type);
-        if (qtype.to_float == NULL) {
+        if (ggml_internal_get_type_traits(tensor->type).to_float == NULL) {
             throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
         }
     } else if (tensor->type != GGML_TYPE_F16) {
         throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
     }
+}
 
-    if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype.to_float(tensor->data, f32_output, nelements);
-        } else {
-            GGML_ASSERT(false); // unreachable
-        }
-        return;
-    }
+static void llama_tensor_dequantize_internal(const struct ggml_tensor * tensor, float * f32_output, llama_quantize_pool & pool) {
+    llama_tensor_dequantize_check(tensor);
+
+    const ggml_type_traits_t qtype = ggml_internal_get_type_traits(tensor->type);
 
-    size_t block_size = tensor->type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor->type);
-    size_t block_size_bytes = ggml_type_size(tensor->type);
+    const int64_t nelements  = ggml_nelements(tensor);
+    const int64_t block_size = tensor->type == GGML_TYPE_F16 ? 1 : ggml_blck_size(tensor->type);
+    const size_t  type_size  = ggml_type_size(tensor->type);
 
     GGML_ASSERT(nelements % block_size == 0);
-    size_t nblocks = nelements / block_size;
-    size_t blocks_per_thread = nblocks / nthread;
-    size_t spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
 
-    size_t in_buff_offs = 0;
-    size_t out_buff_offs = 0;
+    const int64_t chunk_size = std::max<int64_t>(1, 64*1024/block_size)*block_size;
+    const int64_t nchunk     = (nelements + chunk_size - 1)/chunk_size;
 
-    for (int tnum = 0; tnum < nthread; tnum++) {
-        size_t thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
-        size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
+    pool.parallel_for(nchunk, [&](int64_t ic) {
+        const int64_t   first = ic*chunk_size;
+        const int64_t   n     = std::min(chunk_size, nelements - first);
+        const uint8_t * src   = (const uint8_t *) tensor->data + first/block_size*type_size;
 
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype.to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
+        if (tensor->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, f32_output + first, n);
+        } else {
+            qtype.to_float(src, f32_output + first, n);
+        }
+    });
 }
 
 static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type new_type, const ggml_tensor * tensor, llama_ftype ftype) {
@@ -14162,43 +16435,52 @@ static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type n
     return new_type;
 }
 
-static size_t llama_tensor_quantize_internal(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
-    std::mutex mutex;
-    int64_t counter = 0;
-    size_t new_size = 0;
-    if (nthread < 2) {
-        // single-thread
-        return ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
-    }
-    auto compute = [&mutex, &counter, &new_size, new_type, f32_data, new_data, chunk_size,
-            nrows, n_per_row, imatrix]() {
-        const int64_t nrows_per_chunk = chunk_size / n_per_row;
-        size_t local_size = 0;
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int64_t first_row = counter; counter += nrows_per_chunk;
-            if (first_row >= nrows) {
-                if (local_size > 0) {
-                    new_size += local_size;
-                }
-                break;
-            }
-            lock.unlock();
-            const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
-            local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first_row * n_per_row, this_nrow, n_per_row, imatrix);
-        }
-    };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
-    }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
+static size_t llama_tensor_quantize_internal(enum ggml_type new_type, const float * f32_data, void * new_data, const float * imatrix, const struct ggml_tensor * tensor, llama_quantize_pool & pool) {
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t nrows     = tensor->ne[1];
+    const int64_t n_mat     = tensor->ne[2];
+
+    static const int64_t min_chunk_size = 32 * 512;
+    const int64_t nrows_per_chunk = n_per_row >= min_chunk_size ? 1 : (min_chunk_size + n_per_row - 1)/n_per_row;
+    const int64_t nchunk_per_mat  = (nrows + nrows_per_chunk - 1)/nrows_per_chunk;
+
+    std::atomic<size_t> new_size(0);
+
+    // the experts are quantized separately since they have different importance matrices
+    pool.parallel_for(n_mat*nchunk_per_mat, [&](int64_t ic) {
+        const int64_t i03       = ic / nchunk_per_mat;
+        const int64_t first_row = (ic % nchunk_per_mat)*nrows_per_chunk;
+        const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
+
+        const float * f32_data_03 = f32_data + i03 * n_per_row * nrows;
+        void        * new_data_03 = (char *) new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
+        const float * imatrix_03  = imatrix ? imatrix + i03 * n_per_row : nullptr;
+
+        new_size += ggml_quantize_chunk(new_type, f32_data_03, new_data_03, first_row * n_per_row, this_nrow, n_per_row, imatrix_03);
+    });
+
     return new_size;
 }
 
-static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
-    ggml_type default_type;
+// a tensor of the model being quantized
+// the types and sizes of all the tensors are decided before any data is read, so that the meta data can be written first;
+// then the tensors go through three stages that run concurrently on consecutive tensors: reading (or prefetching) the data,
+// converting it with the thread pool and writing the result
+struct llama_quantize_job {
+    struct ggml_tensor * tensor;
+    enum ggml_type       new_type;
+    bool                 quantize;
+    const float        * imatrix;
+    size_t               new_size;
+    size_t               mem_size; // memory used by the tensor while it is in flight
+
+    std::vector<no_init<uint8_t>> read_data;
+    std::vector<no_init<float>>   f32_data;
+    std::vector<no_init<uint8_t>> new_data;
+};
+
+static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
+    ggml_type default_type;
     llama_ftype ftype = params->ftype;
 
     switch (params->ftype) {
@@ -14256,7 +16538,7 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         auto v = (std::vector<llama_model_kv_override>*)params->kv_overrides;
         kv_overrides = v->data();
     }
-    llama_model_loader ml(fname_inp, use_mmap, kv_overrides);
+    llama_model_loader ml(fname_inp, use_mmap, kv_overrides, /*encryption_key*/ nullptr);
     ml.init_mappings(false); // no prefetching
 
     llama_model model;
@@ -14288,6 +16570,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_SPLIT_NO).c_str());
     gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str());
     gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str());
+    // the checksums of the input do not match the converted data
+    gguf_remove_key(ctx_out, ml.llm_kv(LLM_KV_GENERAL_TENSOR_CRC32C).c_str());
 
     if (params->kv_overrides) {
         const std::vector<llama_model_kv_override> & overrides = *(const std::vector<llama_model_kv_override> *)params->kv_overrides;
@@ -14331,52 +16615,22 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
-    int idx = 0;
-
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
-
     // populate the original tensors so we get an initial meta data
     for (int i = 0; i < ml.n_tensors; ++i) {
         const struct ggml_tensor * meta = ml.get_tensor_meta(i);
         gguf_add_tensor(ctx_out, meta);
     }
 
-    std::ofstream fout(fname_out, std::ios::binary);
-    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-
-    const size_t meta_size = gguf_get_meta_size(ctx_out);
-
-    LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, meta_size);
-
-    // placeholder for the meta data
-    ::zeros(fout, meta_size);
-
     const auto tn = LLM_TN(model.arch);
 
+    std::vector<llama_quantize_job> jobs(ml.n_tensors);
+
+    // decide the type of each tensor
     for (int i = 0; i < ml.n_tensors; ++i) {
         struct ggml_tensor * tensor = ml.get_tensor_meta(i);
 
         const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
-
         // This used to be a regex, but <regex> has an extreme cost to compile times.
         bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
 
@@ -14404,8 +16658,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         quantize &= name.find("ssm_dt.weight")     == std::string::npos;
 
         enum ggml_type new_type;
-        void * new_data;
         size_t new_size;
+        const float * imatrix = nullptr;
 
         if (quantize) {
             new_type = default_type;
@@ -14428,13 +16682,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
 
         if (!quantize) {
             new_type = tensor->type;
-            new_data = tensor->data;
             new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
-            const int64_t nelements = ggml_nelements(tensor);
-
-            const float * imatrix = nullptr;
             if (imatrix_data) {
                 auto it = imatrix_data->find(tensor->name);
                 if (it == imatrix_data->end()) {
@@ -14470,60 +16719,202 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
                 throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
             }
 
-            float * f32_data;
+            if (tensor->type != GGML_TYPE_F32) {
+                if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+                    throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+                }
+                llama_tensor_dequantize_check(tensor);
+            }
+
+            new_size = ggml_row_size(new_type, tensor->ne[0]) * tensor->ne[1] * tensor->ne[2];
+        }
+        total_size_org += ggml_nbytes(tensor);
+        total_size_new += new_size;
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
+        auto & job = jobs[i];
+        job.tensor   = tensor;
+        job.new_type = new_type;
+        job.quantize = quantize;
+        job.imatrix  = imatrix;
+        job.new_size = new_size;
+        job.mem_size = ggml_nbytes(tensor);
+        if (quantize) {
+            job.mem_size += new_size;
+            if (tensor->type != GGML_TYPE_F32) {
+                job.mem_size += ggml_nelements(tensor)*sizeof(float);
             }
+        }
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
+        gguf_set_tensor_data(ctx_out, name.c_str(), nullptr, new_size);
+    }
+
+    // the checksums are computed while writing, the meta data is rewritten with them at the end
+    const std::string kv_crc = ml.llm_kv(LLM_KV_GENERAL_TENSOR_CRC32C);
+    std::vector<uint32_t> crcs(ml.n_tensors, 0);
+    if (params->checksums) {
+        gguf_set_arr_data(ctx_out, kv_crc.c_str(), GGUF_TYPE_UINT32, crcs.data(), crcs.size());
+    }
+
+    std::ofstream fout(fname_out, std::ios::binary);
+    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+
+    // the offsets of all the tensors are known, so the meta data can be written right away
+    {
+        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+        gguf_get_meta_data(ctx_out, data.data());
+        fout.write((const char *) data.data(), data.size());
+
+        LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, data.size());
+    }
+
+    llama_quantize_pool pool(nthread);
+
+    const size_t window_size = params->window_size;
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    size_t n_read      = 0; // number of jobs done by each stage
+    size_t n_converted = 0;
+    size_t mem_used    = 0; // memory used by the jobs in flight
+
+    std::exception_ptr error;
+    bool stop = false;
+
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+            error = std::current_exception();
+        }
+        stop = true;
+        cv.notify_all();
+    };
+
+    // waits until job i is done by the previous stage, returns false if the quantization was stopped
+    auto wait_for = [&](const size_t & n_done, size_t i) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return stop || n_done > i; });
+        return !stop;
+    };
+
+    std::thread converter([&]() {
+        try {
+            std::vector<no_init<float>> f32_conv_buf;
+            for (size_t i = 0; i < jobs.size() && wait_for(n_read, i); ++i) {
+                auto & job = jobs[i];
+                if (job.quantize) {
+                    const float * f32_data = (const float *) job.tensor->data;
+                    if (job.tensor->type != GGML_TYPE_F32) {
+                        job.f32_data.resize(ggml_nelements(job.tensor));
+                        llama_tensor_dequantize_internal(job.tensor, (float *) job.f32_data.data(), pool);
+                        f32_data = (const float *) job.f32_data.data();
+                    }
+                    job.new_data.resize(job.new_size);
+                    const size_t new_size = llama_tensor_quantize_internal(job.new_type, f32_data, job.new_data.data(), job.imatrix, job.tensor, pool);
+                    GGML_ASSERT(new_size == job.new_size);
+
+                    job.f32_data = std::vector<no_init<float>>();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    n_converted = i + 1;
+                }
+                cv.notify_all();
             }
-            new_data = work.data();
+        } catch (...) {
+            fail();
+        }
+    });
 
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
+    std::thread writer([&]() {
+        try {
+            for (size_t i = 0; i < jobs.size() && wait_for(n_converted, i); ++i) {
+                auto & job = jobs[i];
+                const struct ggml_tensor * tensor = job.tensor;
+
+                const void * new_data = job.quantize ? (const void *) job.new_data.data() : tensor->data;
 
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row);
+                // write tensor data + padding
+                fout.write((const char *) new_data, job.new_size);
+                zeros(fout, GGML_PAD(job.new_size, align) - job.new_size);
+
+                if (params->checksums) {
+                    crcs[i] = llama_crc32c_update(0, new_data, job.new_size);
+                }
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+                if (!job.quantize) {
+                    LLAMA_LOG_INFO("[%4zu/%4d] %36s - [%s], type = %6s, size = %8.3f MB\n",
+                            i + 1, ml.n_tensors, ggml_get_name(tensor), llama_format_tensor_shape(tensor).c_str(),
+                            ggml_type_name(tensor->type), ggml_nbytes(tensor)/1024.0/1024.0);
+                } else {
+                    LLAMA_LOG_INFO("[%4zu/%4d] %36s - [%s], type = %6s, converting to %s .. size = %8.2f MiB -> %8.2f MiB\n",
+                            i + 1, ml.n_tensors, ggml_get_name(tensor), llama_format_tensor_shape(tensor).c_str(),
+                            ggml_type_name(tensor->type), ggml_type_name(job.new_type), ggml_nbytes(tensor)/1024.0/1024.0, job.new_size/1024.0/1024.0);
+                }
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+                job.read_data = std::vector<no_init<uint8_t>>();
+                job.new_data  = std::vector<no_init<uint8_t>>();
+                if (ml.use_mmap) {
+                    // the pages of the input are not needed anymore
+                    const auto & w = ml.require_weight(ggml_get_name(tensor));
+                    ml.mappings.at(w.idx)->unmap_fragment(w.offs, w.offs + ggml_nbytes(tensor));
+                }
 
-                new_size += llama_tensor_quantize_internal(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    mem_used -= job.mem_size;
+                }
+                cv.notify_all();
             }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+        } catch (...) {
+            fail();
         }
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
+    });
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
+    // read the tensors, as far ahead of the other stages as the window allows
+    try {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            auto & job = jobs[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || mem_used == 0 || mem_used + job.mem_size <= window_size; });
+                if (stop) {
+                    break;
+                }
+                mem_used += job.mem_size;
+            }
+
+            if (ml.use_mmap) {
+                const auto & w = ml.require_weight(ggml_get_name(job.tensor));
+                ml.mappings.at(w.idx)->prefetch_fragment(w.offs, w.offs + ggml_nbytes(job.tensor));
+            } else {
+                job.read_data.resize(ggml_nbytes(job.tensor));
+                job.tensor->data = job.read_data.data();
+            }
+            ml.load_data_for(job.tensor);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                n_read = i + 1;
+            }
+            cv.notify_all();
+        }
+    } catch (...) {
+        fail();
+    }
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+    converter.join();
+    writer.join();
+
+    if (error) {
+        gguf_free(ctx_out);
+        std::rethrow_exception(error);
     }
 
-    // go back to beginning of file and write the updated meta data
-    {
+    if (params->checksums) {
+        gguf_set_arr_data(ctx_out, kv_crc.c_str(), GGUF_TYPE_UINT32, crcs.data(), crcs.size());
+
         fout.seekp(0);
         std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
         gguf_get_meta_data(ctx_out, data.data());
@@ -14577,7 +16968,7 @@ static int llama_apply_lora_from_file_internal(
     std::unique_ptr<llama_model_loader> ml;
     if (path_base_model) {
         LLAMA_LOG_INFO("%s: loading base model from '%s'\n", __func__, path_base_model);
-        ml.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true, /*kv_overrides*/ nullptr));
+        ml.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true, /*kv_overrides*/ nullptr, /*encryption_key*/ nullptr));
         ml->init_mappings(/*prefetch*/ false); // no prefetching
     }
 
@@ -14833,6 +17224,7 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.encryption_key              =*/ nullptr,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
@@ -14855,6 +17247,7 @@ struct llama_context_params llama_context_default_params() {
         /*.n_seq_max                   =*/ 1,
         /*.n_threads                   =*/ GGML_DEFAULT_N_THREADS, // TODO: better default
         /*.n_threads_batch             =*/ GGML_DEFAULT_N_THREADS,
+        /*.poll                        =*/ 50,
         /*.rope_scaling_type           =*/ LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED,
         /*.pooling_type                =*/ LLAMA_POOLING_TYPE_UNSPECIFIED,
         /*.rope_freq_base              =*/ 0.0f,
@@ -14869,9 +17262,12 @@ struct llama_context_params llama_context_default_params() {
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.cpumask                     =*/ nullptr,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
+        /*.cpu_strict                  =*/ false,
+        /*.flash_attn                  =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -14891,6 +17287,8 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
         /*.pure                        =*/ false,
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.window_size                 =*/ 1024ull*1024*1024,
+        /*.checksums                   =*/ false,
     };
 
     return result;
@@ -15037,8 +17435,36 @@ struct llama_context * llama_new_context_with_model(
     cparams.defrag_thold     = params.defrag_thold;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
+    cparams.flash_attn       = params.flash_attn;
     cparams.pooling_type     = params.pooling_type;
 
+    if (cparams.flash_attn && model->arch == LLM_ARCH_GROK) {
+        LLAMA_LOG_WARN("%s: flash_attn is not compatible with Grok - forcing off\n", __func__);
+        cparams.flash_attn = false;
+    }
+
+    if (cparams.flash_attn && llama_supports_gpu_offload() && model->n_gpu_layers > 0 && cparams.offload_kqv) {
+        LLAMA_LOG_WARN("%s: flash_attn is only implemented on the CPU backend - forcing off\n", __func__);
+        cparams.flash_attn = false;
+    }
+
+    // a transposed V cache is written one element per row, which block-quantized types cannot do
+    if (ggml_is_quantized(params.type_v) && !cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
+    if (cparams.flash_attn) {
+        for (ggml_type type : { params.type_k, params.type_v }) {
+            if (type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0 && type != GGML_TYPE_Q4_0) {
+                LLAMA_LOG_ERROR("%s: flash_attn supports only f16, q8_0 and q4_0 KV cache types, got %s\n", __func__, ggml_type_name(type));
+                llama_free(ctx);
+                return nullptr;
+            }
+        }
+    }
+
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
     cparams.rope_freq_scale  = params.rope_freq_scale == 0.0f ? hparams.rope_freq_scale_train : params.rope_freq_scale;
@@ -15072,6 +17498,7 @@ struct llama_context * llama_new_context_with_model(
     }
 
     cparams.causal_attn = hparams.causal_attn;
+    cparams.n_layer_exit = 0;
 
     if (cparams.pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED) {
         if (hparams.pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED) {
@@ -15088,6 +17515,7 @@ struct llama_context * llama_new_context_with_model(
     LLAMA_LOG_INFO("%s: n_ctx      = %u\n",     __func__, cparams.n_ctx);
     LLAMA_LOG_INFO("%s: n_batch    = %u\n",     __func__, cparams.n_batch);
     LLAMA_LOG_INFO("%s: n_ubatch   = %u\n",     __func__, cparams.n_ubatch);
+    LLAMA_LOG_INFO("%s: flash_attn = %d\n",     __func__, cparams.flash_attn);
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
 
@@ -15216,12 +17644,24 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
+        ctx->threadpool_params = ggml_threadpool_params_default(std::max(cparams.n_threads, cparams.n_threads_batch));
+        ctx->threadpool_params.poll       = std::min(params.poll, 100u);
+        ctx->threadpool_params.strict_cpu = params.cpu_strict;
+        if (params.cpumask) {
+            memcpy(ctx->threadpool_params.cpumask, params.cpumask, sizeof(ctx->threadpool_params.cpumask));
+        }
+        ctx->threadpool = ggml_threadpool_new(&ctx->threadpool_params);
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+
         if (!llama_kv_cache_init(ctx->kv_self, ctx->model, type_k, type_v, kv_size, cparams.offload_kqv)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        // with flash attention the V cache is stored with one row per cell, like the K cache
+        ctx->kv_self.v_trans = !cparams.flash_attn;
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
@@ -15582,6 +18022,9 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    // the layers that add the control vector are part of the graph
+    lctx->graph_cache.valid = false;
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
@@ -15810,6 +18253,7 @@ size_t llama_state_get_size(const struct llama_context * ctx) {
     const size_t s_kv_head         = sizeof(uint32_t);
     const size_t s_kv_size         = sizeof(uint32_t);
     const size_t s_kv_used         = sizeof(uint32_t);
+    const size_t s_kv_v_trans      = sizeof(uint32_t);
     const size_t s_kv              = ctx->kv_self.total_size();
     const size_t s_kv_cell         = sizeof(llama_pos) + sizeof(size_t) + cparams.n_seq_max*sizeof(llama_seq_id);
     const size_t s_kv_cells        = ctx->kv_self.size * s_kv_cell;
@@ -15827,6 +18271,7 @@ size_t llama_state_get_size(const struct llama_context * ctx) {
         + s_kv_head
         + s_kv_size
         + s_kv_used
+        + s_kv_v_trans
         + s_kv
         + s_kv_cells
     );
@@ -15835,9 +18280,15 @@ size_t llama_state_get_size(const struct llama_context * ctx) {
 }
 
 // llama_context_data
+// in state files, the KV data of each layer starts at a multiple of this offset, so that it can be copied
+// straight from a mapping of the file into the KV cache
+#define LLAMA_STATE_ALIGNMENT 4096
+
 struct llama_data_context {
     virtual void write(const void * src, size_t size) = 0;
     virtual size_t get_size_written() = 0;
+    // pad to the next multiple of LLAMA_STATE_ALIGNMENT in files, buffers are not padded
+    virtual void align() {}
     virtual ~llama_data_context() = default;
 };
 
@@ -15872,22 +18323,24 @@ struct llama_data_file_context : llama_data_context {
     size_t get_size_written() override {
         return size_written;
     }
+
+    void align() override {
+        static const uint8_t zeros[LLAMA_STATE_ALIGNMENT] = {};
+
+        const size_t offs = file->tell();
+        write(zeros, GGML_PAD(offs, LLAMA_STATE_ALIGNMENT) - offs);
+    }
 };
 
-/** copy state data into either a buffer or file depending on the passed in context
- *
- * file context:
- * llama_file file("/path", "wb");
- * llama_data_file_context data_ctx(&file);
- * llama_state_get_data(ctx, &data_ctx);
- *
- * buffer context:
- * std::vector<uint8_t> buf(max_size, 0);
- * llama_data_buffer_context data_ctx(&buf.data());
- * llama_state_get_data(ctx, &data_ctx);
- *
-*/
-static void llama_state_get_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
+// throws if [inp, inp + size) is not inside the data that ends at end, end is nullptr if its size is unknown
+static void llama_state_check_read(const uint8_t * inp, size_t size, const uint8_t * end) {
+    if (end != nullptr && (inp > end || size > (size_t) (end - inp))) {
+        throw std::runtime_error("unexpectedly reached the end of the state data");
+    }
+}
+
+// copy the rng, the output ids, the logits and the embeddings
+static void llama_state_write_outputs(struct llama_context * ctx, llama_data_context * data_ctx) {
     // copy rng
     {
         std::ostringstream rng_ss;
@@ -15959,6 +18412,40 @@ static void llama_state_get_data_internal(struct llama_context * ctx, llama_data
             }
         }
     }
+}
+
+// copy the positions and sequences of the cells [0, kv_head)
+static void llama_state_write_cells(const llama_kv_cache & kv_self, uint32_t kv_head, llama_data_context * data_ctx) {
+    for (uint32_t i = 0; i < kv_head; ++i) {
+        const auto & cell = kv_self.cells[i];
+
+        const llama_pos pos         = cell.pos;
+        const size_t    seq_id_size = cell.seq_id.size();
+
+        data_ctx->write(&pos,         sizeof(pos));
+        data_ctx->write(&seq_id_size, sizeof(seq_id_size));
+
+        for (auto seq_id : cell.seq_id) {
+            data_ctx->write(&seq_id, sizeof(seq_id));
+        }
+    }
+}
+
+/** copy state data into either a buffer or file depending on the passed in context
+ *
+ * file context:
+ * llama_file file("/path", "wb");
+ * llama_data_file_context data_ctx(&file);
+ * llama_state_get_data(ctx, &data_ctx);
+ *
+ * buffer context:
+ * std::vector<uint8_t> buf(max_size, 0);
+ * llama_data_buffer_context data_ctx(&buf.data());
+ * llama_state_get_data(ctx, &data_ctx);
+ *
+*/
+static void llama_state_get_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
+    llama_state_write_outputs(ctx, data_ctx);
 
     // copy kv cache
     {
@@ -15974,14 +18461,16 @@ static void llama_state_get_data_internal(struct llama_context * ctx, llama_data
         const uint32_t kv_size     = kv_self.size;
         const size_t   kv_buf_size = kv_self.total_size() / (kv_size ? kv_size : 1) * kv_head;
         const uint32_t kv_used     = kv_self.used;
+        const uint32_t v_trans     = kv_self.v_trans ? 1 : 0;
 
         data_ctx->write(&kv_buf_size, sizeof(kv_buf_size));
         data_ctx->write(&kv_head,     sizeof(kv_head));
         data_ctx->write(&kv_size,     sizeof(kv_size));
         data_ctx->write(&kv_used,     sizeof(kv_used));
+        data_ctx->write(&v_trans,     sizeof(v_trans));
 
         if (kv_buf_size) {
-            const size_t pre_kv_buf_size = data_ctx->get_size_written();
+            size_t kv_buf_written = 0;
 
             std::vector<uint8_t> tmp_buf;
             for (int il = 0; il < (int) n_layer; ++il) {
@@ -15989,45 +18478,39 @@ static void llama_state_get_data_internal(struct llama_context * ctx, llama_data
 
                 tmp_buf.resize(k_size);
                 ggml_backend_tensor_get(kv_self.k_l[il], tmp_buf.data(), 0, tmp_buf.size());
+                data_ctx->align();
                 data_ctx->write(tmp_buf.data(), tmp_buf.size());
+                kv_buf_written += tmp_buf.size();
 
-                if (kv_self.recurrent) {
-                    // v is contiguous for recurrent models
+                if (kv_self.recurrent || !kv_self.v_trans) {
+                    // v is contiguous for recurrent models and when it is not transposed (flash attention)
                     // TODO: use other tensors for state models than k and v
                     const size_t v_size = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*kv_head);
 
                     tmp_buf.resize(v_size);
                     ggml_backend_tensor_get(kv_self.v_l[il], tmp_buf.data(), 0, tmp_buf.size());
+                    data_ctx->align();
                     data_ctx->write(tmp_buf.data(), tmp_buf.size());
+                    kv_buf_written += tmp_buf.size();
                     continue;
                 }
 
-                // v is not contiguous, copy row by row
+                // v is not contiguous, gather the rows and write them at once
                 const size_t v_row_size   = ggml_row_size(kv_self.v_l[il]->type, kv_head);
                 const size_t v_row_stride = ggml_row_size(kv_self.v_l[il]->type, kv_size);
 
-                tmp_buf.resize(v_row_size);
+                tmp_buf.resize(v_row_size*n_embd_v_gqa);
                 for (int ir = 0; ir < (int) n_embd_v_gqa; ++ir) {
-                    ggml_backend_tensor_get(kv_self.v_l[il], tmp_buf.data(), ir*v_row_stride, tmp_buf.size());
-                    data_ctx->write(tmp_buf.data(), tmp_buf.size());
+                    ggml_backend_tensor_get(kv_self.v_l[il], tmp_buf.data() + ir*v_row_size, ir*v_row_stride, v_row_size);
                 }
+                data_ctx->align();
+                data_ctx->write(tmp_buf.data(), tmp_buf.size());
+                kv_buf_written += tmp_buf.size();
             }
-            GGML_ASSERT(kv_buf_size == data_ctx->get_size_written() - pre_kv_buf_size);
+            GGML_ASSERT(kv_buf_size == kv_buf_written);
         }
 
-        for (uint32_t i = 0; i < kv_head; ++i) {
-            const auto & cell = kv_self.cells[i];
-
-            const llama_pos pos         = cell.pos;
-            const size_t    seq_id_size = cell.seq_id.size();
-
-            data_ctx->write(&pos,         sizeof(pos));
-            data_ctx->write(&seq_id_size, sizeof(seq_id_size));
-
-            for (auto seq_id : cell.seq_id) {
-                data_ctx->write(&seq_id, sizeof(seq_id));
-            }
-        }
+        llama_state_write_cells(kv_self, kv_head, data_ctx);
     }
 }
 
@@ -16038,17 +18521,17 @@ size_t llama_state_get_data(struct llama_context * ctx, uint8_t * dst) {
     return data_ctx.get_size_written();
 }
 
-// Sets the state reading from the specified source address
-size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
-    const uint8_t * inp = src;
-
+// set the rng, the output ids, the logits and the embeddings, returns the end of the data read
+static const uint8_t * llama_state_read_outputs(struct llama_context * ctx, const uint8_t * inp, const uint8_t * end) {
     // set rng
     {
         size_t rng_size;
+        llama_state_check_read(inp, sizeof(rng_size), end);
         memcpy(&rng_size, inp, sizeof(rng_size)); inp += sizeof(rng_size);
 
         GGML_ASSERT(rng_size <= LLAMA_MAX_RNG_STATE);
 
+        llama_state_check_read(inp, rng_size, end);
         std::string rng_str((const char *)inp, rng_size); inp += rng_size;
 
         std::istringstream rng_ss(rng_str);
@@ -16062,12 +18545,14 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
         size_t n_outputs;
         std::vector<int32_t> output_pos;
 
+        llama_state_check_read(inp, sizeof(n_outputs), end);
         memcpy(&n_outputs, inp, sizeof(n_outputs)); inp += sizeof(n_outputs);
 
         GGML_ASSERT(n_outputs <= llama_output_reserve(*ctx, n_outputs));
 
         if (n_outputs) {
             output_pos.resize(n_outputs);
+            llama_state_check_read(inp, n_outputs * sizeof(int32_t), end);
             memcpy(output_pos.data(), inp, n_outputs * sizeof(int32_t));
             inp += n_outputs * sizeof(int32_t);
 
@@ -16085,11 +18570,13 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
     {
         size_t logits_size;
 
+        llama_state_check_read(inp, sizeof(logits_size), end);
         memcpy(&logits_size, inp, sizeof(logits_size)); inp += sizeof(logits_size);
 
         GGML_ASSERT(ctx->logits_size >= logits_size);
 
         if (logits_size) {
+            llama_state_check_read(inp, logits_size * sizeof(float), end);
             memcpy(ctx->logits, inp, logits_size * sizeof(float));
             inp += logits_size * sizeof(float);
         }
@@ -16099,16 +18586,64 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
     {
         size_t embeddings_size;
 
+        llama_state_check_read(inp, sizeof(embeddings_size), end);
         memcpy(&embeddings_size, inp, sizeof(embeddings_size)); inp += sizeof(embeddings_size);
 
         GGML_ASSERT(ctx->embd_size >= embeddings_size);
 
         if (embeddings_size) {
+            llama_state_check_read(inp, embeddings_size * sizeof(float), end);
             memcpy(ctx->embd, inp, embeddings_size * sizeof(float));
             inp += embeddings_size * sizeof(float);
         }
     }
 
+    return inp;
+}
+
+// set the positions and sequences of the cells [0, kv_head) and clear the others, returns the end of the data read
+static const uint8_t * llama_state_read_cells(llama_kv_cache & kv_self, uint32_t kv_head, uint32_t kv_used, const uint8_t * inp, const uint8_t * end) {
+    llama_kv_cache_clear(kv_self);
+
+    kv_self.head = kv_head;
+    kv_self.used = kv_used;
+
+    for (uint32_t i = 0; i < kv_head; ++i) {
+        llama_pos pos;
+        size_t    seq_id_size;
+
+        llama_state_check_read(inp, sizeof(pos) + sizeof(seq_id_size), end);
+        memcpy(&pos,         inp, sizeof(pos));         inp += sizeof(pos);
+        memcpy(&seq_id_size, inp, sizeof(seq_id_size)); inp += sizeof(seq_id_size);
+
+        kv_self.cells[i].pos = pos;
+
+        llama_seq_id seq_id;
+
+        llama_state_check_read(inp, seq_id_size*sizeof(seq_id), end);
+        for (size_t j = 0; j < seq_id_size; ++j) {
+            memcpy(&seq_id, inp, sizeof(seq_id)); inp += sizeof(seq_id);
+            kv_self.cells[i].seq_id.insert(seq_id);
+        }
+    }
+
+    kv_self.cells_changed();
+
+    return inp;
+}
+
+// set the state from [src, end), end is nullptr if the size of the data is unknown
+// in state files, the KV data of the layers is aligned to LLAMA_STATE_ALIGNMENT relative to the start of the file at base
+static size_t llama_state_set_data_internal(struct llama_context * ctx, const uint8_t * src, const uint8_t * end, const uint8_t * base, size_t alignment) {
+    const uint8_t * inp = src;
+
+    // skip the padding before the data of a layer
+    auto align = [&]() {
+        inp = base + GGML_PAD(inp - base, alignment);
+    };
+
+    inp = llama_state_read_outputs(ctx, inp, end);
+
     // set kv cache
     {
         const auto & kv_self = ctx->kv_self;
@@ -16122,11 +18657,20 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
         uint32_t kv_head;
         uint32_t kv_size;
         uint32_t kv_used;
+        uint32_t v_trans;
 
+        llama_state_check_read(inp, sizeof(kv_buf_size) + 4*sizeof(uint32_t), end);
         memcpy(&kv_buf_size, inp, sizeof(kv_buf_size)); inp += sizeof(kv_buf_size);
         memcpy(&kv_head,     inp, sizeof(kv_head));     inp += sizeof(kv_head);
         memcpy(&kv_size,     inp, sizeof(kv_size));     inp += sizeof(kv_size);
         memcpy(&kv_used,     inp, sizeof(kv_used));     inp += sizeof(kv_used);
+        memcpy(&v_trans,     inp, sizeof(v_trans));     inp += sizeof(v_trans);
+
+        // the V layout depends on whether flash attention is enabled
+        if (kv_self.v_trans != (bool) v_trans) {
+            LLAMA_LOG_ERROR("%s: mismatched value layout (v_trans %d != %d), flash attention setting differs\n", __func__, kv_self.v_trans, v_trans);
+            return 0;
+        }
 
         if (kv_self.size != kv_size) {
             // the KV cache needs to be big enough to load all the KV cells from the saved state
@@ -16137,23 +18681,29 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
         }
 
         if (kv_buf_size) {
-            const size_t pre_kv_buf_size = inp - src;
+            size_t kv_buf_read = 0;
 
             GGML_ASSERT(kv_self.total_size() >= kv_buf_size);
 
             for (int il = 0; il < (int) n_layer; ++il) {
                 const size_t k_size = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*kv_head);
 
+                align();
+                llama_state_check_read(inp, k_size, end);
                 ggml_backend_tensor_set(kv_self.k_l[il], inp, 0, k_size);
                 inp += k_size;
+                kv_buf_read += k_size;
 
-                if (kv_self.recurrent) {
-                    // v is contiguous for recurrent models
+                if (kv_self.recurrent || !kv_self.v_trans) {
+                    // v is contiguous for recurrent models and when it is not transposed (flash attention)
                     // TODO: use other tensors for state models than k and v
                     const size_t v_size = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*kv_head);
 
+                    align();
+                    llama_state_check_read(inp, v_size, end);
                     ggml_backend_tensor_set(kv_self.v_l[il], inp, 0, v_size);
                     inp += v_size;
+                    kv_buf_read += v_size;
                     continue;
                 }
 
@@ -16161,102 +18711,492 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
                 const size_t v_row_size   = ggml_row_size(kv_self.v_l[il]->type, kv_head);
                 const size_t v_row_stride = ggml_row_size(kv_self.v_l[il]->type, kv_self.size);
 
+                align();
+                llama_state_check_read(inp, v_row_size*n_embd_v_gqa, end);
                 for (int ir = 0; ir < (int) n_embd_v_gqa; ++ir) {
                     ggml_backend_tensor_set(kv_self.v_l[il], inp, ir*v_row_stride, v_row_size);
                     inp += v_row_size;
                 }
+                kv_buf_read += v_row_size*n_embd_v_gqa;
             }
-            GGML_ASSERT(kv_buf_size == inp - src - pre_kv_buf_size);
+            GGML_ASSERT(kv_buf_size == kv_buf_read);
         }
 
-        llama_kv_cache_clear(ctx);
-
-        ctx->kv_self.head = kv_head;
-        ctx->kv_self.used = kv_used;
+        inp = llama_state_read_cells(ctx->kv_self, kv_head, kv_used, inp, end);
 
         for (uint32_t i = 0; i < kv_head; ++i) {
-            llama_pos pos;
-            size_t    seq_id_size;
-
-            memcpy(&pos,         inp, sizeof(pos));         inp += sizeof(pos);
-            memcpy(&seq_id_size, inp, sizeof(seq_id_size)); inp += sizeof(seq_id_size);
-
-            ctx->kv_self.cells[i].pos = pos;
-
-            llama_seq_id seq_id;
-
-            for (size_t j = 0; j < seq_id_size; ++j) {
-                memcpy(&seq_id, inp, sizeof(seq_id)); inp += sizeof(seq_id);
-                ctx->kv_self.cells[i].seq_id.insert(seq_id);
-            }
+            ctx->kv_self.cell_written(i);
         }
     }
 
     const size_t nread    = inp - src;
-    const size_t max_size = llama_state_get_size(ctx);
+    const size_t max_size = llama_state_get_size(ctx) + (alignment - 1)*2*ctx->model.hparams.n_layer;
 
     GGML_ASSERT(nread <= max_size);
 
     return nread;
 }
 
-static bool llama_state_load_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
-    llama_file file(path_session, "rb");
+// Sets the state reading from the specified source address
+size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
+    return llama_state_set_data_internal(ctx, src, nullptr, src, 1);
+}
 
-    // sanity checks
-    {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+// incremental state files
+//
+// a state file is a full state followed by any number of delta records, each of them with the cells that have been
+// written since the previous record - the last record of a file saved or loaded by a context is remembered in
+// llama_context::state_checkpoints, and the next save to the same path appends a record to it
+//
+// the full state and every record end with a random chain id, an append only happens if the file still ends with
+// the chain id of the checkpoint, so files that were changed by anybody else are rewritten instead
+//
+// a delta record is:
+//   uint32_t magic
+//   uint64_t n_bytes   - size of the payload
+//   payload            - see llama_state_write_delta and llama_state_seq_write_delta
+//   uint64_t chain_id
+
+static uint64_t llama_state_new_chain_id() {
+    std::random_device rd;
+    return ((uint64_t) rd() << 32) | (uint64_t) rd();
+}
 
-        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
-            LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
-            return false;
-        }
+// the size of the data written by llama_state_write_cells_data for n_cells cells
+static size_t llama_state_cells_data_size(const struct llama_context * ctx, size_t n_cells) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
 
-        llama_hparams session_hparams;
-        file.read_raw(&session_hparams, sizeof(llama_hparams));
+    const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa() + hparams.n_embd_k_s();
+    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
 
-        if (session_hparams != ctx->model.hparams) {
-            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
-            return false;
+    size_t size = 0;
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        size += n_cells*ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
+        size += n_cells*ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
+    }
+    return size;
+}
+
+// split a list of cells into runs of consecutive cells (first, count)
+static std::vector<std::pair<uint32_t, uint32_t>> llama_state_cell_runs(const std::vector<uint32_t> & cells) {
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    for (uint32_t i : cells) {
+        if (!runs.empty() && runs.back().first + runs.back().second == i) {
+            runs.back().second++;
+        } else {
+            runs.push_back({ i, 1 });
         }
     }
+    return runs;
+}
 
-    // load the prompt
-    {
-        const uint32_t n_token_count = file.read_u32();
+// write the K and V data of a list of cells in the order of the list, layer by layer: the keys of all cells, then
+// the values - or, when V is transposed, the values of all cells channel by channel
+// each layer is written with a single vectored write, rows in host memory are not copied
+static void llama_state_write_cells_data(llama_file & file, const struct llama_context * ctx, const std::vector<uint32_t> & cells) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
 
-        if (n_token_count > n_token_capacity) {
-            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
-            return false;
-        }
+    const uint32_t n_layer      = hparams.n_layer;
+    const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa() + hparams.n_embd_k_s();
+    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
+    const size_t   n_cells      = cells.size();
 
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
-        *n_token_count_out = n_token_count;
-    }
+    const auto runs = llama_state_cell_runs(cells);
 
-    // restore the context state
-    {
-        const size_t n_state_size_cur = file.size - file.tell();
-        const size_t n_state_size_max = llama_state_get_size(ctx);
+    std::vector<uint8_t> tmp_buf;
+    std::vector<std::pair<const void *, size_t>> bufs;
 
-        if (n_state_size_cur > n_state_size_max) {
-            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
-            return false;
-        }
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        const ggml_tensor * k = kv_self.k_l[il];
+        const ggml_tensor * v = kv_self.v_l[il];
 
-        std::vector<uint8_t> state_data(n_state_size_max);
-        file.read_raw(state_data.data(), n_state_size_cur);
+        const size_t k_size_row = ggml_row_size(k->type, n_embd_k_gqa);
+        const size_t v_size_row = ggml_row_size(v->type, n_embd_v_gqa);
+        const size_t v_size_el  = ggml_type_size(v->type);
 
-        llama_state_set_data(ctx, state_data.data());
-    }
+        const bool k_host = ggml_backend_buffer_is_host(k->buffer);
+        const bool v_host = ggml_backend_buffer_is_host(v->buffer) && !kv_self.v_trans;
 
-    return true;
-}
+        // everything that cannot be written from the tensors directly is gathered in tmp_buf first
+        tmp_buf.resize((k_host ? 0 : n_cells*k_size_row) + (v_host ? 0 : n_cells*v_size_row));
+        uint8_t * tmp = tmp_buf.data();
 
-bool llama_state_load_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
-    try {
-        return llama_state_load_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
+        bufs.clear();
+
+        for (const auto & run : runs) {
+            const size_t offs = run.first*k_size_row;
+            const size_t size = run.second*k_size_row;
+            if (k_host) {
+                bufs.push_back({ (const uint8_t *) k->data + offs, size });
+            } else {
+                ggml_backend_tensor_get(k, tmp, offs, size);
+                bufs.push_back({ tmp, size });
+                tmp += size;
+            }
+        }
+
+        if (!kv_self.v_trans) {
+            for (const auto & run : runs) {
+                const size_t offs = run.first*v_size_row;
+                const size_t size = run.second*v_size_row;
+                if (v_host) {
+                    bufs.push_back({ (const uint8_t *) v->data + offs, size });
+                } else {
+                    ggml_backend_tensor_get(v, tmp, offs, size);
+                    bufs.push_back({ tmp, size });
+                    tmp += size;
+                }
+            }
+        } else {
+            bufs.push_back({ tmp, n_cells*v_size_row });
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & run : runs) {
+                    ggml_backend_tensor_get(v, tmp, (run.first + j*kv_self.size)*v_size_el, run.second*v_size_el);
+                    tmp += run.second*v_size_el;
+                }
+            }
+        }
+
+        file.write_iov(bufs);
+    }
+}
+
+// set the K and V data of a list of cells from the data of llama_state_write_cells_data, returns the end of the data read
+static const uint8_t * llama_state_read_cells_data(struct llama_context * ctx, const std::vector<uint32_t> & cells, const uint8_t * inp) {
+    auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    const uint32_t n_layer      = hparams.n_layer;
+    const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa() + hparams.n_embd_k_s();
+    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
+
+    const auto runs = llama_state_cell_runs(cells);
+
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        ggml_tensor * k = kv_self.k_l[il];
+        ggml_tensor * v = kv_self.v_l[il];
+
+        const size_t k_size_row = ggml_row_size(k->type, n_embd_k_gqa);
+        const size_t v_size_row = ggml_row_size(v->type, n_embd_v_gqa);
+        const size_t v_size_el  = ggml_type_size(v->type);
+
+        for (const auto & run : runs) {
+            ggml_backend_tensor_set(k, inp, run.first*k_size_row, run.second*k_size_row);
+            inp += run.second*k_size_row;
+        }
+
+        if (!kv_self.v_trans) {
+            for (const auto & run : runs) {
+                ggml_backend_tensor_set(v, inp, run.first*v_size_row, run.second*v_size_row);
+                inp += run.second*v_size_row;
+            }
+        } else {
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & run : runs) {
+                    ggml_backend_tensor_set(v, inp, (run.first + j*kv_self.size)*v_size_el, run.second*v_size_el);
+                    inp += run.second*v_size_el;
+                }
+            }
+        }
+    }
+
+    for (uint32_t i : cells) {
+        kv_self.cell_written(i);
+    }
+
+    return inp;
+}
+
+// open the file of a checkpoint for appending, if it has not changed since the checkpoint
+static std::unique_ptr<llama_file> llama_state_open_checkpoint(const llama_state_checkpoint & ckpt, const char * path) {
+    std::unique_ptr<llama_file> file;
+    try {
+        file.reset(new llama_file(path, "r+b"));
+    } catch (const std::exception &) {
+        return nullptr;
+    }
+
+    if (file->size != ckpt.file_size || file->size < sizeof(uint64_t)) {
+        return nullptr;
+    }
+
+    uint64_t chain_id;
+    file->seek(file->size - sizeof(chain_id), SEEK_SET);
+    file->read_raw(&chain_id, sizeof(chain_id));
+    if (chain_id != ckpt.chain_id) {
+        return nullptr;
+    }
+
+    file->seek(0, SEEK_END);
+
+    return file;
+}
+
+// start a delta record, its size is filled in by llama_state_end_record
+static size_t llama_state_begin_record(llama_file & file, uint32_t magic) {
+    const size_t   offs    = file.tell();
+    const uint64_t n_bytes = 0;
+
+    file.write_u32(magic);
+    file.write_raw(&n_bytes, sizeof(n_bytes));
+
+    return offs;
+}
+
+// finish a delta record, returns its size including the header and the chain id
+static size_t llama_state_end_record(llama_file & file, size_t offs, uint64_t chain_id) {
+    const size_t   end     = file.tell();
+    const uint64_t n_bytes = end - offs - sizeof(uint32_t) - sizeof(uint64_t);
+
+    file.seek(offs + sizeof(uint32_t), SEEK_SET);
+    file.write_raw(&n_bytes, sizeof(n_bytes));
+    file.seek(end, SEEK_SET);
+    file.write_raw(&chain_id, sizeof(chain_id));
+
+    return file.tell() - offs;
+}
+
+// the payload of the delta record at inp, false if the record is invalid or truncated
+static bool llama_state_read_record(const uint8_t * inp, const uint8_t * end, uint32_t magic, const uint8_t *& payload, const uint8_t *& payload_end) {
+    const size_t n_header = sizeof(uint32_t) + sizeof(uint64_t);
+    if ((size_t) (end - inp) < n_header) {
+        return false;
+    }
+
+    uint32_t magic_ref;
+    uint64_t n_bytes;
+    memcpy(&magic_ref, inp, sizeof(magic_ref));
+    memcpy(&n_bytes,   inp + sizeof(magic_ref), sizeof(n_bytes));
+
+    if (magic_ref != magic || n_bytes + sizeof(uint64_t) > (size_t) (end - inp) - n_header) {
+        return false;
+    }
+
+    payload     = inp + n_header;
+    payload_end = payload + n_bytes;
+
+    return true;
+}
+
+// read the tokens at the start of a delta record
+static bool llama_state_read_tokens(const uint8_t *& inp, const uint8_t * end, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    uint32_t n_token_count;
+    llama_state_check_read(inp, sizeof(n_token_count), end);
+    memcpy(&n_token_count, inp, sizeof(n_token_count)); inp += sizeof(n_token_count);
+
+    if (n_token_count > n_token_capacity) {
+        LLAMA_LOG_ERROR("%s: token count in state file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+        return false;
+    }
+    if (n_token_count*sizeof(llama_token) > (size_t) (end - inp)) {
+        LLAMA_LOG_ERROR("%s: truncated delta record\n", __func__);
+        return false;
+    }
+
+    memcpy(tokens_out, inp, n_token_count*sizeof(llama_token));
+    inp += n_token_count*sizeof(llama_token);
+
+    *n_token_count_out = n_token_count;
+
+    return true;
+}
+
+// a delta record of a session file:
+//   uint32_t    n_token_count, tokens
+//   the rng, outputs, logits and embeddings as in llama_state_get_data
+//   uint32_t    kv_head, kv_used
+//   the positions and sequences of the cells [0, kv_head) as in llama_state_get_data
+//   uint32_t    n_cells, the cells written since the checkpoint
+//   the K and V data of these cells, see llama_state_write_cells_data
+static size_t llama_state_write_delta(struct llama_context * ctx, llama_file & file, const llama_state_checkpoint & ckpt, const llama_token * tokens, size_t n_token_count, uint64_t chain_id) {
+    const auto & kv_self = ctx->kv_self;
+
+    const size_t offs = llama_state_begin_record(file, LLAMA_SESSION_DELTA_MAGIC);
+
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+
+    llama_data_file_context data_ctx(&file);
+    llama_state_write_outputs(ctx, &data_ctx);
+
+    const uint32_t kv_head = llama_kv_cache_cell_max(kv_self);
+
+    file.write_u32(kv_head);
+    file.write_u32(kv_self.used);
+    llama_state_write_cells(kv_self, kv_head, &data_ctx);
+
+    std::vector<uint32_t> cells;
+    for (uint32_t i = 0; i < kv_head; ++i) {
+        const auto & cell = kv_self.cells[i];
+        if (!cell.is_empty() && cell.gen >= ckpt.gen) {
+            cells.push_back(i);
+        }
+    }
+
+    file.write_u32((uint32_t) cells.size());
+    file.write_raw(cells.data(), cells.size()*sizeof(uint32_t));
+    llama_state_write_cells_data(file, ctx, cells);
+
+    return llama_state_end_record(file, offs, chain_id);
+}
+
+static bool llama_state_read_delta(struct llama_context * ctx, const uint8_t * inp, const uint8_t * end, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    auto & kv_self = ctx->kv_self;
+
+    if (!llama_state_read_tokens(inp, end, tokens_out, n_token_capacity, n_token_count_out)) {
+        return false;
+    }
+
+    inp = llama_state_read_outputs(ctx, inp, end);
+
+    uint32_t kv_head;
+    uint32_t kv_used;
+    llama_state_check_read(inp, sizeof(kv_head) + sizeof(kv_used), end);
+    memcpy(&kv_head, inp, sizeof(kv_head)); inp += sizeof(kv_head);
+    memcpy(&kv_used, inp, sizeof(kv_used)); inp += sizeof(kv_used);
+
+    if (kv_head > kv_self.size) {
+        LLAMA_LOG_ERROR("%s: delta record contains %u KV cells, but the KV cache has only %u\n", __func__, kv_head, kv_self.size);
+        return false;
+    }
+
+    inp = llama_state_read_cells(kv_self, kv_head, kv_used, inp, end);
+
+    uint32_t n_cells;
+    llama_state_check_read(inp, sizeof(n_cells), end);
+    memcpy(&n_cells, inp, sizeof(n_cells)); inp += sizeof(n_cells);
+
+    if (n_cells > kv_head) {
+        LLAMA_LOG_ERROR("%s: invalid delta record\n", __func__);
+        return false;
+    }
+
+    std::vector<uint32_t> cells(n_cells);
+    llama_state_check_read(inp, n_cells*sizeof(uint32_t), end);
+    memcpy(cells.data(), inp, n_cells*sizeof(uint32_t)); inp += n_cells*sizeof(uint32_t);
+
+    for (uint32_t i : cells) {
+        if (i >= kv_head) {
+            LLAMA_LOG_ERROR("%s: invalid cell %u in delta record\n", __func__, i);
+            return false;
+        }
+    }
+
+    if ((size_t) (end - inp) != llama_state_cells_data_size(ctx, n_cells)) {
+        LLAMA_LOG_ERROR("%s: mismatched size of the KV data in delta record\n", __func__);
+        return false;
+    }
+
+    llama_state_read_cells_data(ctx, cells, inp);
+
+    return true;
+}
+
+static bool llama_state_load_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_file file(path_session, "rb");
+
+    // sanity checks
+    {
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+
+        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
+            LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+            return false;
+        }
+
+        llama_hparams session_hparams;
+        file.read_raw(&session_hparams, sizeof(llama_hparams));
+
+        if (session_hparams != ctx->model.hparams) {
+            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
+            return false;
+        }
+    }
+
+    // load the prompt
+    {
+        const uint32_t n_token_count = file.read_u32();
+
+        if (n_token_count > n_token_capacity) {
+            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+            return false;
+        }
+
+        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+        *n_token_count_out = n_token_count;
+    }
+
+    // restore the context state, then replay the delta records appended to it
+    // the file is mapped and the KV data is copied from the mapping into the cache, layer by layer
+    {
+        const size_t n_header = file.tell();
+
+        std::unique_ptr<llama_mmap> mapping;
+        std::vector<uint8_t> file_data;
+        const uint8_t * data;
+
+        if (llama_mmap::SUPPORTED) {
+            mapping.reset(new llama_mmap(&file));
+            data = (const uint8_t *) mapping->addr;
+        } else {
+            file_data.resize(file.size);
+            file.seek(0, SEEK_SET);
+            file.read_raw(file_data.data(), file.size);
+            data = file_data.data();
+        }
+
+        const uint8_t * inp = data + n_header;
+        const uint8_t * end = data + file.size;
+
+        const size_t nread = llama_state_set_data_internal(ctx, inp, end, data, LLAMA_STATE_ALIGNMENT);
+        if (!nread) {
+            LLAMA_LOG_ERROR("%s : failed to restore the context state\n", __func__);
+            return false;
+        }
+        inp += nread;
+
+        uint64_t chain_id;
+        if ((size_t) (end - inp) < sizeof(chain_id)) {
+            LLAMA_LOG_ERROR("%s : the session file is truncated\n", __func__);
+            return false;
+        }
+        memcpy(&chain_id, inp, sizeof(chain_id)); inp += sizeof(chain_id);
+
+        llama_state_checkpoint ckpt;
+        ckpt.base_size = inp - data;
+
+        while (inp < end) {
+            const uint8_t * payload;
+            const uint8_t * payload_end;
+            if (!llama_state_read_record(inp, end, LLAMA_SESSION_DELTA_MAGIC, payload, payload_end)) {
+                LLAMA_LOG_ERROR("%s : invalid delta record at offset %zu\n", __func__, (size_t) (inp - data));
+                return false;
+            }
+            if (!llama_state_read_delta(ctx, payload, payload_end, tokens_out, n_token_capacity, n_token_count_out)) {
+                return false;
+            }
+            inp = payload_end;
+            memcpy(&chain_id, inp, sizeof(chain_id)); inp += sizeof(chain_id);
+        }
+
+        // the next save to this file only appends the changes since now
+        ckpt.chain_id   = chain_id;
+        ckpt.file_size  = file.size;
+        ckpt.delta_size = file.size - ckpt.base_size;
+        ckpt.gen        = ++ctx->kv_self.gen;
+
+        ctx->state_checkpoints[path_session] = ckpt;
+    }
+
+    return true;
+}
+
+bool llama_state_load_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        return llama_state_load_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
         return false;
@@ -16264,6 +19204,33 @@ bool llama_state_load_file(struct llama_context * ctx, const char * path_session
 }
 
 static bool llama_state_save_file_internal(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    auto & kv_self = ctx->kv_self;
+
+    // append the changes since the last save or load of this file, unless they have grown larger than the full state
+    auto it = ctx->state_checkpoints.find(path_session);
+    if (it != ctx->state_checkpoints.end()) {
+        llama_state_checkpoint ckpt = it->second;
+
+        // forget the checkpoint until the record is complete
+        ctx->state_checkpoints.erase(it);
+
+        std::unique_ptr<llama_file> file;
+        if (!kv_self.recurrent && ckpt.seq_id == -1 && ckpt.delta_size <= ckpt.base_size) {
+            file = llama_state_open_checkpoint(ckpt, path_session);
+        }
+
+        if (file) {
+            ckpt.chain_id    = llama_state_new_chain_id();
+            ckpt.delta_size += llama_state_write_delta(ctx, *file, ckpt, tokens, n_token_count, ckpt.chain_id);
+            ckpt.file_size   = file->tell();
+            ckpt.gen         = ++kv_self.gen;
+
+            ctx->state_checkpoints[path_session] = ckpt;
+
+            return true;
+        }
+    }
+
     llama_file file(path_session, "wb");
 
     file.write_u32(LLAMA_SESSION_MAGIC);
@@ -16279,6 +19246,16 @@ static bool llama_state_save_file_internal(struct llama_context * ctx, const cha
     llama_data_file_context data_ctx(&file);
     llama_state_get_data_internal(ctx, &data_ctx);
 
+    llama_state_checkpoint ckpt;
+    ckpt.chain_id = llama_state_new_chain_id();
+    file.write_raw(&ckpt.chain_id, sizeof(ckpt.chain_id));
+
+    ckpt.file_size = file.tell();
+    ckpt.base_size = ckpt.file_size;
+    ckpt.gen       = ++kv_self.gen;
+
+    ctx->state_checkpoints[path_session] = ckpt;
+
     return true;
 }
 
@@ -16299,6 +19276,7 @@ size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id)
     const size_t s_cell_count_size = sizeof(uint32_t);
     const size_t s_layer_count_size = sizeof(uint32_t);
     const size_t n_embd_v_gqa_size = sizeof(uint32_t);
+    const size_t v_trans_size = sizeof(uint32_t);
 
     size_t s_cell_count = 0;
     size_t s_cell_data_size = 0;
@@ -16327,9 +19305,9 @@ size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id)
         const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
         s_cell_data_size += k_size_row * s_cell_count;
 
-        // values (transposed)
-        const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
-        s_cell_data_size += v_size_el * s_cell_count * n_embd_v_gqa;
+        // values (transposed, or one row per cell with flash attention)
+        const size_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
+        s_cell_data_size += v_size_row * s_cell_count;
     }
 
     const size_t s_total = (
@@ -16337,6 +19315,7 @@ size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id)
         s_cell_count_size +
         s_layer_count_size +
         n_embd_v_gqa_size +
+        v_trans_size +
         s_cell_data_size
         );
 
@@ -16399,6 +19378,10 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
     // Write n_embd_v_gqa
     data_ctx.write(&n_embd_v_gqa, sizeof(n_embd_v_gqa));
 
+    // Write the layout of the values
+    const uint32_t v_trans = kv_self.v_trans ? 1 : 0;
+    data_ctx.write(&v_trans, sizeof(v_trans));
+
     // Iterate the ranges and write all the pos (this is the token position in the prompt)
     for (const auto & range : cell_ranges) {
         for (uint32_t i = range.first; i < range.second; ++i) {
@@ -16419,6 +19402,8 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
         const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
         data_ctx.write(&k_size_row, sizeof(k_size_row));
 
+        data_ctx.align();
+
         // Read each range of cells of k_size length each into tmp_buf and write out
         for (const auto & range : cell_ranges) {
             const size_t range_size = range.second - range.first;
@@ -16428,6 +19413,30 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
         }
     }
 
+    // Without transposition (flash attention), the values are stored like the keys, each row is a cell
+    if (!kv_self.v_trans) {
+        for (int il = 0; il < (int)n_layer; ++il) {
+            // Write value type
+            const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
+            data_ctx.write(&v_type_i, sizeof(v_type_i));
+
+            // Write row size of value
+            const size_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
+            data_ctx.write(&v_size_row, sizeof(v_size_row));
+
+            data_ctx.align();
+
+            for (const auto & range : cell_ranges) {
+                const size_t range_size = range.second - range.first;
+                tmp_buf.resize(range_size * v_size_row);
+                ggml_backend_tensor_get(kv_self.v_l[il], tmp_buf.data(), range.first * v_size_row, range_size * v_size_row);
+                data_ctx.write(tmp_buf.data(), tmp_buf.size());
+            }
+        }
+
+        return data_ctx.get_size_written();
+    }
+
     // For the values, they are transposed, so we also need the element size and get the element ranges from each row
     const uint32_t kv_size = kv_self.size;
     for (int il = 0; il < (int)n_layer; ++il) {
@@ -16439,6 +19448,8 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
         const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
         data_ctx.write(&v_size_el, sizeof(v_size_el));
 
+        data_ctx.align();
+
         // For each row, we get the element values of each cell
         for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
             // Read each range of cells of v_size_el length each into tmp_buf and write out
@@ -16460,7 +19471,9 @@ size_t llama_state_seq_get_data(struct llama_context* ctx, uint8_t* dst, llama_s
     return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
 }
 
-size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+// set the state of a sequence from [src, end), end is nullptr if the size of the data is unknown
+// in sequence state files, the KV data of the layers is aligned to LLAMA_STATE_ALIGNMENT relative to the start of the file at base
+static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, const uint8_t * src, const uint8_t * end, const uint8_t * base, size_t alignment, llama_seq_id dest_seq_id) {
     auto & kv_self = ctx->kv_self;
     GGML_ASSERT(!kv_self.recurrent); // not implemented
 
@@ -16469,8 +19482,14 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
     const uint8_t * inp = src;
 
+    // skip the padding before the data of a layer
+    auto align = [&]() {
+        inp = base + GGML_PAD(inp - base, alignment);
+    };
+
     // Read size of size_t
     uint32_t size_t_size;
+    llama_state_check_read(inp, sizeof(size_t_size), end);
     memcpy(&size_t_size, inp, sizeof(size_t_size));
     inp += sizeof(size_t_size);
     if (size_t_size != sizeof(size_t)) {
@@ -16480,19 +19499,28 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
     // Read the cell count
     uint32_t cell_count;
+    llama_state_check_read(inp, sizeof(cell_count), end);
     memcpy(&cell_count, inp, sizeof(cell_count));
     inp += sizeof(cell_count);
 
     // Read the layer count
     uint32_t n_layer_ref;
+    llama_state_check_read(inp, sizeof(n_layer_ref), end);
     memcpy(&n_layer_ref, inp, sizeof(n_layer_ref));
     inp += sizeof(n_layer_ref);
 
     // Read n_embd_v_gqa
     uint32_t n_embd_v_gqa_ref;
+    llama_state_check_read(inp, sizeof(n_embd_v_gqa_ref), end);
     memcpy(&n_embd_v_gqa_ref, inp, sizeof(n_embd_v_gqa_ref));
     inp += sizeof(n_embd_v_gqa_ref);
 
+    // Read the layout of the values
+    uint32_t v_trans_ref;
+    llama_state_check_read(inp, sizeof(v_trans_ref), end);
+    memcpy(&v_trans_ref, inp, sizeof(v_trans_ref));
+    inp += sizeof(v_trans_ref);
+
     // Sanity check model compatibility
     const auto & hparams = ctx->model.hparams;
     const uint32_t n_layer = hparams.n_layer;
@@ -16506,9 +19534,14 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
         LLAMA_LOG_ERROR("%s: mismatched n_embd_v_gqa (%d != %d)\n", __func__, n_embd_v_gqa, n_embd_v_gqa_ref);
         return 0;
     }
+    if (kv_self.v_trans != (bool) v_trans_ref) {
+        LLAMA_LOG_ERROR("%s: mismatched value layout (v_trans %d != %d), flash attention setting differs\n", __func__, kv_self.v_trans, v_trans_ref);
+        return 0;
+    }
 
     // Allocate the new cells for the slot
     if (cell_count) {
+        llama_state_check_read(inp, cell_count * sizeof(llama_pos), end);
         llama_batch batch = llama_batch_init(cell_count, 0, 1);
         batch.n_tokens = cell_count;
         for (uint32_t i = 0; i < cell_count; ++i) {
@@ -16545,6 +19578,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     for (int il = 0; il < (int)n_layer; ++il) {
         // Read type of key
         int32_t k_type_i_ref;
+        llama_state_check_read(inp, sizeof(k_type_i_ref), end);
         memcpy(&k_type_i_ref, inp, sizeof(k_type_i_ref));
         inp += sizeof(k_type_i_ref);
         const int32_t k_type_i = (int32_t)kv_self.k_l[il]->type;
@@ -16556,6 +19590,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
         // Read row size of key
         size_t k_size_row_ref;
+        llama_state_check_read(inp, sizeof(k_size_row_ref), end);
         memcpy(&k_size_row_ref, inp, sizeof(k_size_row_ref));
         inp += sizeof(k_size_row_ref);
         const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
@@ -16565,17 +19600,60 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             return 0;
         }
 
+        align();
         if (cell_count) {
             // Read and set the keys for the whole cell range
+            llama_state_check_read(inp, cell_count * k_size_row, end);
             ggml_backend_tensor_set(kv_self.k_l[il], inp, kv_head * k_size_row, cell_count * k_size_row);
             inp += cell_count * k_size_row;
         }
     }
 
+    // Without transposition (flash attention), read the values like the keys, one row is one cell
+    if (!kv_self.v_trans) {
+        for (int il = 0; il < (int)n_layer; ++il) {
+            // Read type of value
+            int32_t v_type_i_ref;
+            llama_state_check_read(inp, sizeof(v_type_i_ref), end);
+            memcpy(&v_type_i_ref, inp, sizeof(v_type_i_ref));
+            inp += sizeof(v_type_i_ref);
+            const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
+            if (v_type_i != v_type_i_ref) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
+                return 0;
+            }
+
+            // Read row size of value
+            size_t v_size_row_ref;
+            llama_state_check_read(inp, sizeof(v_size_row_ref), end);
+            memcpy(&v_size_row_ref, inp, sizeof(v_size_row_ref));
+            inp += sizeof(v_size_row_ref);
+            const size_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
+            if (v_size_row != v_size_row_ref) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: mismatched value row size (%zu != %zu, layer %d)\n", __func__, v_size_row, v_size_row_ref, il);
+                return 0;
+            }
+
+            align();
+            if (cell_count) {
+                // Read and set the values for the whole cell range
+                llama_state_check_read(inp, cell_count * v_size_row, end);
+                ggml_backend_tensor_set(kv_self.v_l[il], inp, kv_head * v_size_row, cell_count * v_size_row);
+                inp += cell_count * v_size_row;
+            }
+        }
+
+        const size_t nread = inp - src;
+        return nread;
+    }
+
     // For each layer, read the values for each cell (transposed)
     for (int il = 0; il < (int)n_layer; ++il) {
         // Read type of value
         int32_t v_type_i_ref;
+        llama_state_check_read(inp, sizeof(v_type_i_ref), end);
         memcpy(&v_type_i_ref, inp, sizeof(v_type_i_ref));
         inp += sizeof(v_type_i_ref);
         const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
@@ -16587,6 +19665,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
         // Read element size of value
         size_t v_size_el_ref;
+        llama_state_check_read(inp, sizeof(v_size_el_ref), end);
         memcpy(&v_size_el_ref, inp, sizeof(v_size_el_ref));
         inp += sizeof(v_size_el_ref);
         const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
@@ -16596,8 +19675,10 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             return 0;
         }
 
+        align();
         if (cell_count) {
             // For each row in the transposed matrix, read the values for the whole cell range
+            llama_state_check_read(inp, n_embd_v_gqa * cell_count * v_size_el, end);
             for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
                 const size_t dst_offset = (kv_head + j * kv_size) * v_size_el;
                 ggml_backend_tensor_set(kv_self.v_l[il], inp, dst_offset, cell_count * v_size_el);
@@ -16610,7 +19691,228 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     return nread;
 }
 
+size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+    return llama_state_seq_set_data_internal(ctx, src, nullptr, src, 1, dest_seq_id);
+}
+
+// the (pos, cell) pairs of a sequence sorted by position, false if a position is in more than one cell
+static bool llama_state_seq_cells(const llama_kv_cache & kv_self, llama_seq_id seq_id, std::vector<std::pair<llama_pos, uint32_t>> & cells) {
+    cells.clear();
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        if (kv_self.cells[i].has_seq_id(seq_id)) {
+            cells.push_back({ kv_self.cells[i].pos, i });
+        }
+    }
+
+    std::sort(cells.begin(), cells.end());
+
+    for (size_t k = 1; k < cells.size(); ++k) {
+        if (cells[k].first == cells[k - 1].first) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// a delta record of a sequence state file, the cells are identified by their positions:
+//   uint32_t    n_token_count, tokens
+//   uint32_t    cell_count, the positions of all cells of the sequence, sorted
+//   uint32_t    n_cells, the indices into the positions of the cells written since the checkpoint
+//   the K and V data of these cells, see llama_state_write_cells_data
+// a cell has to be written again if its data has changed or if its position has moved to another cell
+static size_t llama_state_seq_write_delta(
+        struct llama_context * ctx,
+                 llama_file & file,
+ const llama_state_checkpoint & ckpt,
+ const std::vector<std::pair<llama_pos, uint32_t>> & seq_cells,
+         const llama_token * tokens,
+                      size_t   n_token_count,
+                    uint64_t   chain_id) {
+    const auto & kv_self = ctx->kv_self;
+
+    const size_t offs = llama_state_begin_record(file, LLAMA_STATE_SEQ_DELTA_MAGIC);
+
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+
+    std::vector<llama_pos> pos;
+    std::vector<uint32_t>  idxs;
+    std::vector<uint32_t>  cells;
+
+    for (size_t k = 0; k < seq_cells.size(); ++k) {
+        pos.push_back(seq_cells[k].first);
+
+        const uint32_t i = seq_cells[k].second;
+        if (kv_self.cells[i].gen >= ckpt.gen || !std::binary_search(ckpt.cells.begin(), ckpt.cells.end(), seq_cells[k])) {
+            idxs.push_back((uint32_t) k);
+            cells.push_back(i);
+        }
+    }
+
+    file.write_u32((uint32_t) pos.size());
+    file.write_raw(pos.data(), pos.size()*sizeof(llama_pos));
+    file.write_u32((uint32_t) idxs.size());
+    file.write_raw(idxs.data(), idxs.size()*sizeof(uint32_t));
+    llama_state_write_cells_data(file, ctx, cells);
+
+    return llama_state_end_record(file, offs, chain_id);
+}
+
+static bool llama_state_seq_read_delta(struct llama_context * ctx, const uint8_t * inp, const uint8_t * end, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    auto & kv_self = ctx->kv_self;
+
+    if (!llama_state_read_tokens(inp, end, tokens_out, n_token_capacity, n_token_count_out)) {
+        return false;
+    }
+
+    uint32_t cell_count;
+    llama_state_check_read(inp, sizeof(cell_count), end);
+    memcpy(&cell_count, inp, sizeof(cell_count)); inp += sizeof(cell_count);
+
+    if (cell_count > kv_self.size) {
+        LLAMA_LOG_ERROR("%s: delta record contains %u KV cells, but the KV cache has only %u\n", __func__, cell_count, kv_self.size);
+        return false;
+    }
+
+    std::vector<llama_pos> pos(cell_count);
+    llama_state_check_read(inp, cell_count*sizeof(llama_pos), end);
+    memcpy(pos.data(), inp, cell_count*sizeof(llama_pos)); inp += cell_count*sizeof(llama_pos);
+
+    uint32_t n_cells;
+    llama_state_check_read(inp, sizeof(n_cells), end);
+    memcpy(&n_cells, inp, sizeof(n_cells)); inp += sizeof(n_cells);
+
+    if (n_cells > cell_count) {
+        LLAMA_LOG_ERROR("%s: invalid delta record\n", __func__);
+        return false;
+    }
+
+    std::vector<uint32_t> idxs(n_cells);
+    llama_state_check_read(inp, n_cells*sizeof(uint32_t), end);
+    memcpy(idxs.data(), inp, n_cells*sizeof(uint32_t)); inp += n_cells*sizeof(uint32_t);
+
+    std::vector<bool> written(cell_count, false);
+    for (uint32_t j = 0; j < n_cells; ++j) {
+        const uint32_t k = idxs[j];
+        if (k >= cell_count || (j > 0 && k <= idxs[j - 1])) {
+            LLAMA_LOG_ERROR("%s: invalid cell %u in delta record\n", __func__, k);
+            return false;
+        }
+        written[k] = true;
+    }
+
+    if ((size_t) (end - inp) != llama_state_cells_data_size(ctx, n_cells)) {
+        LLAMA_LOG_ERROR("%s: mismatched size of the KV data in delta record\n", __func__);
+        return false;
+    }
+
+    std::vector<std::pair<llama_pos, uint32_t>> seq_cells;
+    llama_state_seq_cells(kv_self, dest_seq_id, seq_cells);
+
+    // drop the positions that are gone, and the written ones in cells that are shared with other sequences
+    for (const auto & sc : seq_cells) {
+        const auto it = std::lower_bound(pos.begin(), pos.end(), sc.first);
+
+        bool keep = it != pos.end() && *it == sc.first;
+        if (keep && written[it - pos.begin()] && kv_self.cells[sc.second].seq_id.size() > 1) {
+            keep = false;
+        }
+
+        if (!keep) {
+            llama_kv_cache_seq_rm(kv_self, dest_seq_id, sc.first, sc.first + 1);
+        }
+    }
+
+    llama_state_seq_cells(kv_self, dest_seq_id, seq_cells);
+
+    // the cells of the written positions, the ones that are not in the cache yet are allocated together
+    std::vector<uint32_t> cells(n_cells);
+    std::vector<uint32_t> missing;
+
+    for (uint32_t k = 0; k < cell_count; ++k) {
+        const auto it = std::lower_bound(seq_cells.begin(), seq_cells.end(), std::make_pair(pos[k], (uint32_t) 0));
+        const bool found = it != seq_cells.end() && it->first == pos[k];
+
+        if (!written[k]) {
+            if (!found) {
+                LLAMA_LOG_ERROR("%s: delta record does not match the sequence, position %d is missing\n", __func__, pos[k]);
+                return false;
+            }
+            continue;
+        }
+
+        const uint32_t j = std::lower_bound(idxs.begin(), idxs.end(), k) - idxs.begin();
+        if (found) {
+            cells[j] = it->second;
+        } else {
+            missing.push_back(j);
+        }
+    }
+
+    if (!missing.empty()) {
+        llama_batch batch = llama_batch_init(missing.size(), 0, 1);
+        batch.n_tokens = missing.size();
+        for (size_t m = 0; m < missing.size(); ++m) {
+            batch.pos[m]       = pos[idxs[missing[m]]];
+            batch.n_seq_id[m]  = 1;
+            batch.seq_id[m][0] = dest_seq_id;
+        }
+
+        const bool ok = llama_kv_cache_find_slot(kv_self, batch);
+
+        llama_batch_free(batch);
+
+        if (!ok) {
+            LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
+            return false;
+        }
+
+        for (size_t m = 0; m < missing.size(); ++m) {
+            cells[missing[m]] = kv_self.head + m;
+        }
+    }
+
+    llama_state_read_cells_data(ctx, cells, inp);
+
+    return true;
+}
+
 static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    auto & kv_self = ctx->kv_self;
+
+    std::vector<std::pair<llama_pos, uint32_t>> seq_cells;
+    const bool unique_pos = llama_state_seq_cells(kv_self, seq_id, seq_cells);
+
+    // append the changes since the last save or load of this file, unless they have grown larger than the full state
+    auto it = ctx->state_checkpoints.find(filepath);
+    if (it != ctx->state_checkpoints.end()) {
+        llama_state_checkpoint ckpt = it->second;
+
+        // forget the checkpoint until the record is complete
+        ctx->state_checkpoints.erase(it);
+
+        std::unique_ptr<llama_file> file;
+        if (unique_pos && ckpt.seq_id == seq_id && ckpt.delta_size <= ckpt.base_size) {
+            file = llama_state_open_checkpoint(ckpt, filepath);
+        }
+
+        if (file) {
+            ckpt.chain_id = llama_state_new_chain_id();
+
+            const size_t res = llama_state_seq_write_delta(ctx, *file, ckpt, seq_cells, tokens, n_token_count, ckpt.chain_id);
+
+            ckpt.delta_size += res;
+            ckpt.file_size   = file->tell();
+            ckpt.gen         = ++kv_self.gen;
+            ckpt.cells       = std::move(seq_cells);
+
+            ctx->state_checkpoints[filepath] = ckpt;
+
+            return res;
+        }
+    }
+
     llama_file file(filepath, "wb");
 
     file.write_u32(LLAMA_STATE_SEQ_MAGIC);
@@ -16624,8 +19926,23 @@ static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, con
     llama_data_file_context data_ctx(&file);
     llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
 
+    llama_state_checkpoint ckpt;
+    ckpt.chain_id = llama_state_new_chain_id();
+    file.write_raw(&ckpt.chain_id, sizeof(ckpt.chain_id));
+
     const size_t res = file.tell();
-    GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + data_ctx.get_size_written());
+    GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + data_ctx.get_size_written() + sizeof(ckpt.chain_id));
+
+    if (unique_pos) {
+        ckpt.file_size = res;
+        ckpt.base_size = res;
+        ckpt.gen       = ++kv_self.gen;
+        ckpt.seq_id    = seq_id;
+        ckpt.cells     = std::move(seq_cells);
+
+        ctx->state_checkpoints[filepath] = ckpt;
+    }
+
     return res;
 }
 
@@ -16656,21 +19973,72 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
         *n_token_count_out = n_token_count;
     }
 
-    // restore the context state
+    // restore the context state, then replay the delta records appended to it
+    // the file is mapped and the KV data is copied from the mapping into the cache, layer by layer
     {
-        const size_t state_size = file.size - file.tell();
-        std::vector<uint8_t> state_data(state_size);
-        file.read_raw(state_data.data(), state_size);
-        const size_t nread = llama_state_seq_set_data(ctx, state_data.data(), dest_seq_id);
+        const size_t n_header = file.tell();
+
+        std::unique_ptr<llama_mmap> mapping;
+        std::vector<uint8_t> file_data;
+        const uint8_t * data;
+
+        if (llama_mmap::SUPPORTED) {
+            mapping.reset(new llama_mmap(&file));
+            data = (const uint8_t *) mapping->addr;
+        } else {
+            file_data.resize(file.size);
+            file.seek(0, SEEK_SET);
+            file.read_raw(file_data.data(), file.size);
+            data = file_data.data();
+        }
+
+        const uint8_t * inp = data + n_header;
+        const uint8_t * end = data + file.size;
+
+        const size_t nread = llama_state_seq_set_data_internal(ctx, inp, end, data, LLAMA_STATE_ALIGNMENT, dest_seq_id);
         if (!nread) {
             LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
             return 0;
         }
-        GGML_ASSERT(nread <= state_size);
-        GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
+        inp += nread;
+
+        uint64_t chain_id;
+        if ((size_t) (end - inp) < sizeof(chain_id)) {
+            llama_kv_cache_seq_rm(ctx->kv_self, dest_seq_id, -1, -1);
+            LLAMA_LOG_ERROR("%s: the sequence state file is truncated\n", __func__);
+            return 0;
+        }
+        memcpy(&chain_id, inp, sizeof(chain_id)); inp += sizeof(chain_id);
+
+        llama_state_checkpoint ckpt;
+        ckpt.base_size = inp - data;
+
+        while (inp < end) {
+            const uint8_t * payload;
+            const uint8_t * payload_end;
+            if (!llama_state_read_record(inp, end, LLAMA_STATE_SEQ_DELTA_MAGIC, payload, payload_end) ||
+                !llama_state_seq_read_delta(ctx, payload, payload_end, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out)) {
+                llama_kv_cache_seq_rm(ctx->kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: failed to replay the delta record at offset %zu\n", __func__, (size_t) (inp - data));
+                return 0;
+            }
+            inp = payload_end;
+            memcpy(&chain_id, inp, sizeof(chain_id)); inp += sizeof(chain_id);
+        }
+
+        // the next save of this sequence to this file only appends the changes since now
+        if (llama_state_seq_cells(ctx->kv_self, dest_seq_id, ckpt.cells)) {
+            ckpt.chain_id   = chain_id;
+            ckpt.file_size  = file.size;
+            ckpt.delta_size = file.size - ckpt.base_size;
+            ckpt.gen        = ++ctx->kv_self.gen;
+            ckpt.seq_id     = dest_seq_id;
+
+            ctx->state_checkpoints[filepath] = ckpt;
+        }
     }
 
-    return file.tell();
+    return file.size;
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
@@ -16686,6 +20054,8 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
     try {
         return llama_state_seq_load_file_internal(ctx, filepath, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out);
     } catch (const std::exception & err) {
+        // the cells of the sequence may have been partially restored
+        llama_kv_cache_seq_rm(ctx->kv_self, dest_seq_id, -1, -1);
         LLAMA_LOG_ERROR("error loading sequence state file: %s\n", err.what());
         return 0;
     }
@@ -16694,6 +20064,16 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
+
+    // grow the threadpool if needed - a smaller thread count just leaves some of the workers idle
+    const int n_threads_max = (int) std::max(n_threads, n_threads_batch);
+    if (ctx->threadpool != nullptr && n_threads_max > ggml_threadpool_get_n_threads(ctx->threadpool)) {
+        ggml_threadpool_free(ctx->threadpool);
+
+        ctx->threadpool_params.n_threads = n_threads_max;
+        ctx->threadpool = ggml_threadpool_new(&ctx->threadpool_params);
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+    }
 }
 
 void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
@@ -16705,6 +20085,15 @@ void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
 }
 
+void llama_set_n_layer_exit(struct llama_context * ctx, int32_t n_layer) {
+    if (n_layer > 0 && ctx->kv_self.recurrent) {
+        // the recurrent states of the skipped layers would not be updated
+        LLAMA_LOG_WARN("%s: early exit is not supported for recurrent models\n", __func__);
+        return;
+    }
+    ctx->cparams.n_layer_exit = std::max(0, n_layer);
+}
+
 struct llama_batch llama_batch_get_one(
              llama_token * tokens,
                  int32_t   n_tokens,
@@ -16771,6 +20160,110 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_tree(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+               const int32_t * parents,
+                     int32_t   n_tokens,
+                   llama_pos   pos,
+                llama_seq_id   seq_id) {
+    llama_draft_tree & tree = ctx->draft_tree;
+    tree.clear();
+
+    if (ctx->kv_self.recurrent || !ctx->cparams.causal_attn) {
+        LLAMA_LOG_ERROR("%s: tree decoding needs a KV cache with causal attention\n", __func__);
+        return -1;
+    }
+    if (n_tokens <= 0 || (uint32_t) n_tokens > ctx->cparams.n_ubatch) {
+        LLAMA_LOG_ERROR("%s: the tree must have between 1 and n_ubatch = %u tokens, got %d\n", __func__, ctx->cparams.n_ubatch, n_tokens);
+        return -1;
+    }
+
+    tree.seq_id = seq_id;
+    tree.pos    = pos;
+    tree.tokens.assign(tokens, tokens + n_tokens);
+    tree.parents.resize(n_tokens);
+    tree.depth.resize(n_tokens);
+
+    tree.parents[0] = -1;
+    tree.depth[0]   = 0;
+    for (int32_t i = 1; i < n_tokens; ++i) {
+        if (parents[i] < 0 || parents[i] >= i) {
+            LLAMA_LOG_ERROR("%s: invalid parent %d of token %d\n", __func__, parents[i], i);
+            tree.clear();
+            return -1;
+        }
+        tree.parents[i] = parents[i];
+        tree.depth[i]   = tree.depth[parents[i]] + 1;
+    }
+
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        batch.token   [i]    = tokens[i];
+        batch.pos     [i]    = pos + tree.depth[i];
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = seq_id;
+        batch.logits  [i]    = true;
+    }
+    batch.n_tokens = n_tokens;
+
+    tree.decoding = true;
+    const int ret = llama_decode_internal(*ctx, batch);
+    tree.decoding = false;
+
+    llama_batch_free(batch);
+
+    if (ret != 0) {
+        if (ret < 0) {
+            LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+        }
+        tree.clear();
+    }
+
+    return ret;
+}
+
+void llama_tree_accept(struct llama_context * ctx, const int32_t * path, int32_t n_path) {
+    llama_draft_tree_prune(ctx->kv_self, ctx->draft_tree, path, n_path);
+}
+
+int32_t llama_tree_verify(
+        struct llama_context * ctx,
+    llama_tree_pick_callback   pick,
+                        void * user_data,
+                     int32_t * path,
+                 llama_token * ids) {
+    const llama_draft_tree & tree = ctx->draft_tree;
+
+    const int32_t n_tokens = tree.cells.size();
+    if (n_tokens == 0) {
+        return 0;
+    }
+
+    int32_t n_path = 0;
+    for (int32_t cur = 0; cur >= 0; ) {
+        const llama_token id = pick(ctx, cur, user_data);
+
+        path[n_path] = cur;
+        ids [n_path] = id;
+        n_path++;
+
+        // the children come after their parent
+        int32_t next = -1;
+        for (int32_t k = cur + 1; k < n_tokens; ++k) {
+            if (tree.parents[k] == cur && tree.tokens[k] == id) {
+                next = k;
+                break;
+            }
+        }
+        cur = next;
+    }
+
+    llama_tree_accept(ctx, path, n_path);
+
+    return n_path;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched);
 
@@ -16985,6 +20478,90 @@ int32_t llama_tokenize(
     return res.size();
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_model * model,
+          const char * const * texts,
+               const int32_t * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * offsets,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    n_threads = std::max(1, std::min(n_threads, n_texts));
+
+    // the threads take the texts one by one and append their tokens to a buffer of their own
+    struct span {
+        int32_t ith;
+        size_t  begin;
+        size_t  n;
+    };
+
+    std::vector<span>                      spans(n_texts);
+    std::vector<std::vector<llama_token>>  buffers(n_threads);
+    std::vector<std::exception_ptr>        errors(n_threads);
+    std::atomic<int32_t>                   next(0);
+
+    auto worker = [&](int32_t ith) {
+        try {
+            llama_tokenize_scratch scratch(model->vocab);
+
+            auto & buffer = buffers[ith];
+            while (true) {
+                const int32_t i = next.fetch_add(1, std::memory_order_relaxed);
+                if (i >= n_texts) {
+                    break;
+                }
+
+                const size_t begin = buffer.size();
+                llama_tokenize_impl(model->vocab, std::string(texts[i], text_lens[i]), add_special, parse_special, scratch, buffer);
+                spans[i] = { ith, begin, buffer.size() - begin };
+            }
+        } catch (...) {
+            errors[ith] = std::current_exception();
+            // let the other threads finish early
+            next = n_texts;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int32_t ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(worker, ith);
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    for (const auto & error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    int64_t n_tokens = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        offsets[i] = n_tokens;
+        n_tokens += spans[i].n;
+        GGML_ASSERT(n_tokens <= INT32_MAX);
+    }
+    offsets[n_texts] = n_tokens;
+
+    if (n_tokens_max < n_tokens) {
+        return -((int32_t) n_tokens);
+    }
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        if (spans[i].n > 0) {
+            memcpy(tokens + offsets[i], buffers[spans[i].ith].data() + spans[i].begin, spans[i].n*sizeof(llama_token));
+        }
+    }
+
+    return n_tokens;
+}
+
 static std::string llama_decode_text(const std::string & text) {
     std::string decoded_text;
     auto unicode_sequences = unicode_cpts_from_utf8(text);
@@ -17334,6 +20911,37 @@ int llama_split_prefix(char * dest, size_t maxlen, const char * split_path, int
     return 0;
 }
 
+void llama_aes256_ctr_apply(const uint8_t * key, const uint8_t * iv, size_t offs, void * buf, size_t n, int32_t n_threads) {
+    llama_aes256_ctr cipher(key, iv);
+    cipher.n_threads = std::max(1, n_threads);
+    cipher.apply(offs, buf, n);
+}
+
+uint32_t llama_crc32c(uint32_t crc, const void * data, size_t n) {
+    return llama_crc32c_update(crc, data, n);
+}
+
+int32_t llama_model_verify(const char * path_model, struct llama_model_params params) {
+    try {
+        llama_model_loader ml(path_model, /*use_mmap*/ false, params.kv_overrides, params.encryption_key);
+
+        if (std::none_of(ml.weights.begin(), ml.weights.end(), [](const llama_model_loader::llama_tensor_weight & w) { return w.has_crc; })) {
+            LLAMA_LOG_ERROR("%s: %s has no tensor checksums\n", __func__, path_model);
+            return -1;
+        }
+
+        const std::vector<std::string> failed = ml.verify_all_data();
+
+        LLAMA_LOG_INFO("%s: verified %.2f MiB in %.2f ms (%.2f GB/s), %zu corrupted tensor(s)\n", __func__,
+                ml.size_read/1024.0/1024.0, ml.t_read_us/1000.0, (double) ml.size_read/std::max<int64_t>(ml.t_read_us, 1)/1e3, failed.size());
+
+        return (int32_t) failed.size();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to verify %s: %s\n", __func__, path_model, err.what());
+        return -1;
+    }
+}
+
 struct llama_timings llama_get_timings(struct llama_context * ctx) {
     struct llama_timings result = {
         /*.t_start_ms  =*/ 1e-3 * ctx->t_start_us,
@@ -17342,10 +20950,13 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_sample_ms =*/ 1e-3 * ctx->t_sample_us,
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
+        /*.t_graph_ms  =*/ 1e-3 * ctx->t_graph_us,
 
-        /*.n_sample =*/ std::max(1, ctx->n_sample),
-        /*.n_p_eval =*/ std::max(1, ctx->n_p_eval),
-        /*.n_eval   =*/ std::max(1, ctx->n_eval),
+        /*.n_sample      =*/ std::max(1, ctx->n_sample),
+        /*.n_p_eval      =*/ std::max(1, ctx->n_p_eval),
+        /*.n_eval        =*/ std::max(1, ctx->n_eval),
+        /*.n_graph       =*/ std::max(1, ctx->n_graph),
+        /*.n_graph_reuse =*/ ctx->n_graph_reuse,
     };
 
     return result;
@@ -17362,6 +20973,8 @@ void llama_print_timings(struct llama_context * ctx) {
             __func__, timings.t_p_eval_ms, timings.n_p_eval, timings.t_p_eval_ms / timings.n_p_eval, 1e3 / timings.t_p_eval_ms * timings.n_p_eval);
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
+    LLAMA_LOG_INFO("%s:       graph time = %10.2f ms / %5d graphs (%8.2f ms per graph, %5d reused)\n",
+            __func__, timings.t_graph_ms, timings.n_graph, timings.t_graph_ms / timings.n_graph, timings.n_graph_reuse);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (timings.t_end_ms - timings.t_start_ms), (timings.n_p_eval + timings.n_eval));
 }
 
@@ -17370,6 +20983,8 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->t_graph_us  = ctx->n_graph  = 0;
+    ctx->n_graph_reuse = 0;
 }
 
 const char * llama_print_system_info(void) {
@@ -17413,7 +21028,10 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
     fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample);
+    fprintf(stream, "n_graph: %d  # number of compute graphs evaluated\n", ctx->n_graph);
+    fprintf(stream, "n_graph_reuse: %d  # number of compute graphs reused from the previous ubatch\n", ctx->n_graph_reuse);
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
+    fprintf(stream, "t_graph_us: %" PRId64 "  # total microseconds spent building and allocating compute graphs\n", ctx->t_graph_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
     fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us);
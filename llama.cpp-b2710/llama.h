@@ -43,12 +43,16 @@ extern "C" {
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
+#define LLAMA_FILE_MAGIC_GGSD 0x67677364u // 'ggsd'
+#define LLAMA_FILE_MAGIC_GGQD 0x67677164u // 'ggqd'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 5
+#define LLAMA_SESSION_VERSION 8
+#define LLAMA_SESSION_DELTA_MAGIC LLAMA_FILE_MAGIC_GGSD
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 1
+#define LLAMA_STATE_SEQ_VERSION 4
+#define LLAMA_STATE_SEQ_DELTA_MAGIC LLAMA_FILE_MAGIC_GGQD
 
     //
     // C interface
@@ -232,6 +236,10 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // AES-256 key of encrypted models as 64 hex digits, NULL for unencrypted models
+        // the tensor data is decrypted while it is read and mmap is not used
+        const char * encryption_key;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
@@ -246,6 +254,7 @@ extern "C" {
         uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
         uint32_t n_threads;         // number of threads to use for generation
         uint32_t n_threads_batch;   // number of threads to use for batch processing
+        uint32_t poll;              // polling level of the compute threadpool (0 - 100), how long idle threads spin before sleeping
 
         enum llama_rope_scaling_type rope_scaling_type; // RoPE scaling type, from `enum llama_rope_scaling_type`
         enum llama_pooling_type      pooling_type;      // whether to pool (sum) embedding results by sequence id
@@ -265,12 +274,16 @@ extern "C" {
         void * cb_eval_user_data;
 
         enum ggml_type type_k; // data type for K cache
-        enum ggml_type type_v; // data type for V cache
+        enum ggml_type type_v; // data type for V cache (quantized types require flash_attn)
+
+        const bool * cpumask; // CPUs the compute threads may run on, GGML_MAX_N_CPUS entries (NULL = no affinity)
 
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
+        bool cpu_strict;  // pin each compute thread to a single CPU from cpumask
+        bool flash_attn;  // whether to use the fused flash attention kernel (the V cache is then not transposed)
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -291,6 +304,8 @@ extern "C" {
         bool pure;                           // quantize all tensors to the default type
         void * imatrix;                      // pointer to importance matrix data
         void * kv_overrides;                 // pointer to vector containing overrides
+        size_t window_size;                  // max. bytes of tensor data being read, converted or written at the same time, 0 = one tensor at a time
+        bool checksums;                      // store the CRC-32C of each tensor in the meta data, they are verified when the model is loaded
     } llama_model_quantize_params;
 
     // grammar types
@@ -335,10 +350,13 @@ extern "C" {
         double t_sample_ms;
         double t_p_eval_ms;
         double t_eval_ms;
+        double t_graph_ms; // building and allocating compute graphs, part of the eval times
 
         int32_t n_sample;
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_graph;       // number of ubatches evaluated
+        int32_t n_graph_reuse; // number of them that reused the graph of the previous ubatch
     };
 
     // used in chat template
@@ -616,7 +634,7 @@ extern "C" {
         "use llama_state_get_data instead");
 
     // Set the state reading from the specified address
-    // Returns the number of bytes read
+    // Returns the number of bytes read, or 0 if the state does not match the context
     LLAMA_API size_t llama_state_set_data(
             struct llama_context * ctx,
                    const uint8_t * src);
@@ -626,6 +644,9 @@ extern "C" {
         "use llama_state_set_data instead");
 
     // Save/load session file
+    // Saving again to a file that was saved or loaded by the same context appends a delta record with only the
+    // KV cells that have changed since, instead of rewriting the whole state. Loading replays the records in order.
+    // The file is rewritten in full when the records grow larger than the full state.
     LLAMA_API bool llama_state_load_file(
             struct llama_context * ctx,
                       const char * path_session,
@@ -672,6 +693,9 @@ extern "C" {
                    const uint8_t * src,
                     llama_seq_id   dest_seq_id);
 
+    // Save/load the state of a single sequence, incrementally like llama_state_save_file
+    // The file is appended to when it was last saved from or loaded into the same sequence by the same context
+    // Returns the number of bytes written or read, zero on failure
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -724,6 +748,43 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Tree-based speculative decoding
+    // Evaluate a tree of draft tokens in a single batch. tokens[0] is the root, usually the last sampled token,
+    // and parents[i] (0 <= parents[i] < i) is the index of the parent of tokens[i], parents[0] is ignored.
+    // Each token is at position pos + its depth in the tree, and attends to the cells of seq_id before pos and to its
+    // ancestors in the tree only, so the branches do not need sequences of their own.
+    // The logits of all tokens are output, llama_get_logits_ith(ctx, i) returns those of tokens[i].
+    // n_tokens must not exceed n_ubatch. Not supported for recurrent models and non-causal attention
+    // Returns 0 on success, like llama_decode
+    LLAMA_API int32_t llama_decode_tree(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                   const int32_t * parents,
+                         int32_t   n_tokens,
+                       llama_pos   pos,
+                    llama_seq_id   seq_id);
+
+    // Keep the KV cells of the tokens on path of the last tree and remove those of all other tokens of the tree
+    // path[0] must be the root and path[i] a child of path[i - 1]: the kept tokens are at the positions pos ... pos + n_path - 1
+    // and the sequence continues at pos + n_path. n_path = 0 removes the whole tree. Call it before the next llama_decode
+    LLAMA_API void llama_tree_accept(struct llama_context * ctx, const int32_t * path, int32_t n_path);
+
+    // The token that the target model picks after tokens[i] of the last tree, e.g. sampled from llama_get_logits_ith(ctx, i)
+    typedef llama_token (*llama_tree_pick_callback)(struct llama_context * ctx, int32_t i, void * user_data);
+
+    // Verify the last tree: starting from the root, pick the token after the current token and continue with the child
+    // that was drafted with it, until there is none. pick is called in the order of the path, so it can sample with state
+    // (grammar, penalties) and accept each token. If siblings have the same token the first one is followed
+    // Writes the accepted path to path and the picked tokens to ids, both need room for the n_tokens of the tree,
+    // and returns the length n of the path. ids[n - 1] follows the accepted tokens and is not in the KV cache yet
+    // The rejected branches are then removed with llama_tree_accept
+    LLAMA_API int32_t llama_tree_verify(
+            struct llama_context * ctx,
+        llama_tree_pick_callback   pick,
+                            void * user_data,
+                         int32_t * path,
+                     llama_token * ids);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -733,6 +794,11 @@ extern "C" {
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
 
+    // Evaluate only the first n_layer layers of the model in the following llama_decode calls, followed by the output norm and head
+    // The KV cache of the skipped layers is not written. Used to draft tokens with the model itself in self-speculative decoding
+    // n_layer <= 0 evaluates all layers again. Not supported for recurrent models
+    LLAMA_API void llama_set_n_layer_exit(struct llama_context * ctx, int32_t n_layer);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -825,6 +891,24 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Convert many texts into tokens at once, in parallel on n_threads threads.
+    /// @param texts, text_lens The n_texts texts and their lengths in bytes.
+    /// @param tokens The tokens of all texts, those of text i are tokens[offsets[i]] to tokens[offsets[i + 1] - 1].
+    /// @param offsets Must hold n_texts + 1 values, and is filled even if tokens is too small.
+    /// @return Returns the total number of tokens on success, no more than n_tokens_max
+    /// @return Returns a negative number on failure - the total number of tokens that would have been returned
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_model * model,
+              const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -993,6 +1077,24 @@ extern "C" {
             struct llama_context * ctx,
           llama_token_data_array * candidates);
 
+    /// @details Samples a token directly from the logits of one output with top-k, top-p, min-p and temperature applied in this order.
+    ///          Draws from the same distribution as llama_sample_top_k, llama_sample_top_p, llama_sample_min_p, llama_sample_temp and
+    ///          llama_sample_token on the candidates of the whole vocabulary, without building and sorting them: the candidates are
+    ///          narrowed down with a partial selection into a buffer of the context that is reused by the next call.
+    /// @param logits The logits of one output, e.g. from llama_get_logits_ith()
+    /// @param top_k <= 0 to keep the whole vocabulary
+    /// @param top_p 1.0 to disable
+    /// @param min_p 0.0 to disable
+    /// @param temp <= 0.0 to select the token with the highest logit
+    LLAMA_API llama_token llama_sample_token_fused(
+            struct llama_context * ctx,
+                     const float * logits,
+                         int32_t   top_k,
+                           float   top_p,
+                           float   min_p,
+                           float   temp,
+                          size_t   min_keep);
+
     /// @details Accepts the sampled token into the grammar
     LLAMA_API void llama_grammar_accept_token(
             struct llama_context * ctx,
@@ -1053,6 +1155,21 @@ extern "C" {
     //  Returns the split_prefix length.
     LLAMA_API int llama_split_prefix(char * split_prefix, size_t maxlen, const char * split_path, int split_no, int split_count);
 
+    /// @details Encrypt or decrypt (same operation) n bytes in place with AES-256 in counter mode, as used for encrypted models.
+    /// @param key 32 bytes key
+    /// @param iv 16 bytes initial counter block
+    /// @param offs Offset of buf in the encrypted stream, the counter block of byte i is iv + i/16 (128-bit big-endian)
+    LLAMA_API void llama_aes256_ctr_apply(const uint8_t * key, const uint8_t * iv, size_t offs, void * buf, size_t n, int32_t n_threads);
+
+    /// @details CRC-32C (Castagnoli) of n bytes, continuing the checksum crc of the preceding data (0 to start a new one).
+    ///          The checksums of the tensor data stored in "general.tensor_crc32c" use this function.
+    LLAMA_API uint32_t llama_crc32c(uint32_t crc, const void * data, size_t n);
+
+    /// @details Read the data of all the tensors of a model (and its splits) that have a checksum and verify it, without loading the model.
+    ///          Only kv_overrides and encryption_key of params are used. The names of the corrupted tensors are logged.
+    ///          Returns the number of corrupted tensors, or -1 if the model has no checksums or cannot be read.
+    LLAMA_API int32_t llama_model_verify(const char * path_model, struct llama_model_params params);
+
     // Performance information
     LLAMA_API struct llama_timings llama_get_timings(struct llama_context * ctx);
 
@@ -1075,6 +1192,7 @@ extern "C" {
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
 #ifdef LLAMA_API_INTERNAL
 
+#include <map>
 #include <vector>
 #include <string>
 
@@ -1091,6 +1209,12 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8                                      partial_utf8;
+
+    // bitmasks of the tokens allowed from the stacks seen so far, see llama_sample_grammar
+    mutable std::map<std::vector<std::vector<const llama_grammar_element *>>, std::vector<uint32_t>> token_masks;
+
+    // id of the vocab trie that the masks were computed for, 0 if none
+    mutable uint64_t token_masks_trie_id;
 };
 
 struct llama_grammar_candidate {
@@ -929,6 +929,291 @@ class tinyBLAS_Q0_AVX2 {
 };
 #endif // __AVX2__
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// K-QUANT MATRIX MULTIPLICATION
+
+#if QK_K == 256 && (defined(__AVX2__) || defined(__AVX512F__) || defined(__ARM_FEATURE_DOTPROD))
+
+/**
+ * K-quant super-block unpacked into a form that all the formats share.
+ *
+ * The 256 weights are stored as unsigned integers `u` in sixteen groups
+ * of sixteen, where weight `x = d * s[g] * u - dmin * m[g]`. Formats that
+ * have no mins (Q3_K, Q6_K) fold their constant offset into `m`, so that
+ * the dot product with a Q8_K block only needs the `bsums` of the latter
+ * to correct for it. Each scale is repeated eight times, which lines up
+ * with the pairwise sums of a 16-bit multiply over 32 quants.
+ */
+struct block_kx {
+    float d;
+    float dmin;
+    int16_t m[QK_K / 16];
+    int16_t s[QK_K / 32][16];
+    uint8_t u[QK_K];
+};
+
+inline void set_scale(block_kx *y, int g, int s, int m) {
+    for (int l = 0; l < 8; ++l)
+        y->s[g / 2][g % 2 * 8 + l] = s;
+    y->m[g] = m;
+}
+
+inline void get_scale_min_k4(int j, const uint8_t *q, int *s, int *m) {
+    if (j < 4) {
+        *s = q[j] & 63;
+        *m = q[j + 4] & 63;
+    } else {
+        *s = (q[j + 4] & 15) | ((q[j - 4] >> 6) << 4);
+        *m = (q[j + 4] >> 4) | ((q[j - 0] >> 6) << 4);
+    }
+}
+
+inline void unpack(const block_q2_K *x, block_kx *y) {
+    y->d = unhalf(x->d);
+    y->dmin = unhalf(x->dmin);
+    for (int g = 0; g < QK_K / 16; ++g)
+        set_scale(y, g, x->scales[g] & 15, x->scales[g] >> 4);
+    for (int n = 0; n < 2; ++n)
+        for (int j = 0; j < 4; ++j)
+            for (int l = 0; l < 32; ++l)
+                y->u[128 * n + 32 * j + l] = (x->qs[32 * n + l] >> (2 * j)) & 3;
+}
+
+inline void unpack(const block_q3_K *x, block_kx *y) {
+    uint32_t aux[4];
+    memcpy(aux, x->scales, 12);
+    uint32_t tmp = aux[2];
+    aux[2] = ((aux[0] >> 4) & 0x0f0f0f0f) | (((tmp >> 4) & 0x03030303) << 4);
+    aux[3] = ((aux[1] >> 4) & 0x0f0f0f0f) | (((tmp >> 6) & 0x03030303) << 4);
+    aux[0] = (aux[0] & 0x0f0f0f0f) | (((tmp >> 0) & 0x03030303) << 4);
+    aux[1] = (aux[1] & 0x0f0f0f0f) | (((tmp >> 2) & 0x03030303) << 4);
+    const int8_t *scales = (const int8_t *)aux;
+    y->d = unhalf(x->d);
+    y->dmin = y->d;
+    for (int g = 0; g < QK_K / 16; ++g)
+        set_scale(y, g, scales[g] - 32, 4 * (scales[g] - 32));
+    for (int n = 0; n < 2; ++n)
+        for (int j = 0; j < 4; ++j)
+            for (int l = 0; l < 32; ++l)
+                y->u[128 * n + 32 * j + l] = ((x->qs[32 * n + l] >> (2 * j)) & 3) |
+                                             ((x->hmask[l] >> (4 * n + j)) & 1) << 2;
+}
+
+inline void unpack(const block_q4_K *x, block_kx *y) {
+    y->d = unhalf(x->d);
+    y->dmin = unhalf(x->dmin);
+    for (int j = 0; j < QK_K / 32; ++j) {
+        int s, m;
+        get_scale_min_k4(j, x->scales, &s, &m);
+        set_scale(y, 2 * j + 0, s, m);
+        set_scale(y, 2 * j + 1, s, m);
+    }
+    for (int j = 0; j < 4; ++j)
+        for (int l = 0; l < 32; ++l) {
+            y->u[64 * j + l] = x->qs[32 * j + l] & 15;
+            y->u[64 * j + 32 + l] = x->qs[32 * j + l] >> 4;
+        }
+}
+
+inline void unpack(const block_q5_K *x, block_kx *y) {
+    y->d = unhalf(x->d);
+    y->dmin = unhalf(x->dmin);
+    for (int j = 0; j < QK_K / 32; ++j) {
+        int s, m;
+        get_scale_min_k4(j, x->scales, &s, &m);
+        set_scale(y, 2 * j + 0, s, m);
+        set_scale(y, 2 * j + 1, s, m);
+    }
+    for (int j = 0; j < 4; ++j)
+        for (int l = 0; l < 32; ++l) {
+            y->u[64 * j + l] = (x->qs[32 * j + l] & 15) | ((x->qh[l] >> (2 * j + 0)) & 1) << 4;
+            y->u[64 * j + 32 + l] = (x->qs[32 * j + l] >> 4) | ((x->qh[l] >> (2 * j + 1)) & 1) << 4;
+        }
+}
+
+inline void unpack(const block_q6_K *x, block_kx *y) {
+    y->d = unhalf(x->d);
+    y->dmin = y->d;
+    for (int g = 0; g < QK_K / 16; ++g)
+        set_scale(y, g, x->scales[g], 32 * x->scales[g]);
+    for (int n = 0; n < 2; ++n)
+        for (int l = 0; l < 32; ++l) {
+            const uint8_t *ql = x->ql + 64 * n;
+            const uint8_t qh = x->qh[32 * n + l];
+            y->u[128 * n + l] = (ql[l] & 15) | ((qh >> 0) & 3) << 4;
+            y->u[128 * n + 32 + l] = (ql[l + 32] & 15) | ((qh >> 2) & 3) << 4;
+            y->u[128 * n + 64 + l] = (ql[l] >> 4) | ((qh >> 4) & 3) << 4;
+            y->u[128 * n + 96 + l] = (ql[l + 32] >> 4) | ((qh >> 6) & 3) << 4;
+        }
+}
+
+/**
+ * Multiplies K-quant weights with Q8_K activations.
+ *
+ * Unlike the quant zero kernels, the super-block formats are too costly
+ * to unpack in the inner loop, so a panel of rows from `A` is unpacked
+ * once into a small buffer on the stack, and then swept across all the
+ * columns of `B` in tiles. The panel covers only a slice of `k` at once
+ * so the buffer stays within the L1 cache.
+ */
+template <typename TA>
+class tinyBLAS_K {
+  public:
+    tinyBLAS_K(int k,
+               const TA *A, int lda,
+               const block_q8_K *B, int ldb,
+               float *C, int ldc,
+               int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int m, int n, int task) {
+        if (task == GGML_TASK_TYPE_COMPUTE)
+            mnpack(m, n);
+    }
+
+  private:
+    static constexpr int RM = 4;
+    static constexpr int RN = 3;
+    static constexpr int KC = 4;
+
+    NOINLINE void mnpack(int m, int n) {
+        block_kx a[RM * KC];
+        int panels = (m + RM - 1) / RM;
+        int duty = (panels + nth - 1) / nth;
+        int start = duty * ith;
+        int end = start + duty;
+        if (end > panels)
+            end = panels;
+        for (int p = start; p < end; ++p) {
+            int i = p * RM;
+            int mc = m - i < RM ? m - i : RM;
+            for (int l = 0; l < k; l += KC) {
+                int kc = k - l < KC ? k - l : KC;
+                for (int ii = 0; ii < mc; ++ii)
+                    for (int ll = 0; ll < kc; ++ll)
+                        unpack(A + lda * (i + ii) + l + ll, a + KC * ii + ll);
+                int j = 0;
+                if (mc == RM)
+                    for (; j + RN <= n; j += RN)
+                        gemm<RM, RN>(a, i, j, l, kc);
+                for (; j < n; ++j)
+                    for (int ii = 0; ii < mc; ++ii)
+                        gemm<1, 1>(a + KC * ii, i + ii, j, l, kc);
+            }
+        }
+    }
+
+    template <int BM, int BN>
+    inline void gemm(const block_kx *a, int i, int j, int l, int kc) {
+#if defined(__AVX2__) || defined(__AVX512F__)
+        __m256 c[BN][BM] = {};
+        for (int ll = 0; ll < kc; ++ll) {
+            __m256i sum[BN][BM] = {};
+            for (int r = 0; r < QK_K / 32; ++r) {
+                __m256i u[BM];
+                __m256i s[BM];
+                for (int ii = 0; ii < BM; ++ii) {
+                    u[ii] = _mm256_loadu_si256((const __m256i *)(a[KC * ii + ll].u + 32 * r));
+                    s[ii] = _mm256_loadu_si256((const __m256i *)a[KC * ii + ll].s[r]);
+                }
+                for (int jj = 0; jj < BN; ++jj) {
+                    __m256i q = _mm256_loadu_si256((const __m256i *)(B[ldb * (j + jj) + l + ll].qs + 32 * r));
+                    for (int ii = 0; ii < BM; ++ii)
+                        sum[jj][ii] = _mm256_add_epi32(
+                            sum[jj][ii], _mm256_madd_epi16(_mm256_maddubs_epi16(u[ii], q), s[ii]));
+                }
+            }
+            for (int jj = 0; jj < BN; ++jj) {
+                const block_q8_K *b = B + ldb * (j + jj) + l + ll;
+                __m256i bsums = _mm256_loadu_si256((const __m256i *)b->bsums);
+                for (int ii = 0; ii < BM; ++ii) {
+                    const block_kx *x = a + KC * ii + ll;
+                    __m256i mins = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)x->m), bsums);
+                    c[jj][ii] = madd(_mm256_set1_ps(x->d * b->d), _mm256_cvtepi32_ps(sum[jj][ii]), c[jj][ii]);
+                    c[jj][ii] = madd(_mm256_set1_ps(-x->dmin * b->d), _mm256_cvtepi32_ps(mins), c[jj][ii]);
+                }
+            }
+        }
+#else
+        float32x4_t c[BN][BM];
+        for (int jj = 0; jj < BN; ++jj)
+            for (int ii = 0; ii < BM; ++ii)
+                c[jj][ii] = vdupq_n_f32(0.f);
+        for (int ll = 0; ll < kc; ++ll) {
+            for (int jj = 0; jj < BN; ++jj) {
+                const block_q8_K *b = B + ldb * (j + jj) + l + ll;
+                for (int ii = 0; ii < BM; ++ii) {
+                    const block_kx *x = a + KC * ii + ll;
+                    int32x4_t sum = vdupq_n_s32(0);
+                    for (int g = 0; g < QK_K / 16; ++g)
+                        sum = vmlaq_n_s32(sum,
+                                          vdotq_s32(vdupq_n_s32(0),
+                                                    vreinterpretq_s8_u8(vld1q_u8(x->u + 16 * g)),
+                                                    vld1q_s8(b->qs + 16 * g)),
+                                          x->s[g / 2][g % 2 * 8]);
+                    int32x4_t mins = vmull_s16(vld1_s16(x->m), vld1_s16(b->bsums));
+                    for (int g = 4; g < QK_K / 16; g += 4)
+                        mins = vmlal_s16(mins, vld1_s16(x->m + g), vld1_s16(b->bsums + g));
+                    c[jj][ii] = vmlaq_n_f32(c[jj][ii], vcvtq_f32_s32(sum), x->d * b->d);
+                    c[jj][ii] = vmlaq_n_f32(c[jj][ii], vcvtq_f32_s32(mins), -x->dmin * b->d);
+                }
+            }
+        }
+#endif
+        for (int jj = 0; jj < BN; ++jj)
+            for (int ii = 0; ii < BM; ++ii) {
+                float *p = C + ldc * (j + jj) + i + ii;
+                *p = l ? *p + hsum(c[jj][ii]) : hsum(c[jj][ii]);
+            }
+    }
+
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int k;
+    const int lda;
+    const int ldb;
+    const int ldc;
+    const int ith;
+    const int nth;
+};
+#endif // QK_K
+
+template <typename TA>
+bool llamafile_sgemm_k(int m, int n, int k, const void *A, int lda, const void *B, int ldb, void *C,
+                       int ldc, int ith, int nth, int task, int Btype) {
+    if (Btype != GGML_TYPE_Q8_K)
+        return false;
+#if QK_K == 256 && (defined(__AVX2__) || defined(__AVX512F__) || defined(__ARM_FEATURE_DOTPROD))
+    // unpacking a panel only pays for itself when it's reused across a
+    // few columns, so token generation keeps using ggml's vec_dot
+    if (n < 16)
+        return false;
+    tinyBLAS_K<TA> tb{
+        k, (const TA *)A, lda,
+        (const block_q8_K *)B, ldb,
+        (float *)C, ldc,
+        ith, nth};
+    tb.matmul(m, n, task);
+    return true;
+#else
+    (void)m;
+    (void)n;
+    (void)k;
+    (void)A;
+    (void)lda;
+    (void)B;
+    (void)ldb;
+    (void)C;
+    (void)ldc;
+    (void)ith;
+    (void)nth;
+    (void)task;
+    return false;
+#endif
+}
+
 } // namespace
 
 /**
@@ -1126,6 +1411,17 @@ bool llamafile_sgemm(int m, int n, int k, const void *A, int lda, const void *B,
 #endif
     }
 
+    case GGML_TYPE_Q2_K:
+        return llamafile_sgemm_k<block_q2_K>(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Btype);
+    case GGML_TYPE_Q3_K:
+        return llamafile_sgemm_k<block_q3_K>(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Btype);
+    case GGML_TYPE_Q4_K:
+        return llamafile_sgemm_k<block_q4_K>(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Btype);
+    case GGML_TYPE_Q5_K:
+        return llamafile_sgemm_k<block_q5_K>(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Btype);
+    case GGML_TYPE_Q6_K:
+        return llamafile_sgemm_k<block_q6_K>(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Btype);
+
     default:
         return false;
     }
@@ -0,0 +1,83 @@
+// tests the AES-256-CTR implementation used to load encrypted models
+
+#include "llama.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static std::vector<uint8_t> from_hex(const std::string & hex) {
+    std::vector<uint8_t> out(hex.size()/2);
+    for (size_t i = 0; i < out.size(); ++i) {
+        out[i] = (uint8_t) std::stoul(hex.substr(2*i, 2), nullptr, 16);
+    }
+    return out;
+}
+
+static bool check(const char * name, const std::vector<uint8_t> & result, const std::vector<uint8_t> & expected) {
+    if (result != expected) {
+        fprintf(stderr, "%s: FAILED\n", name);
+        return false;
+    }
+    fprintf(stderr, "%s: OK\n", name);
+    return true;
+}
+
+int main(void) {
+    bool ok = true;
+
+    const std::vector<uint8_t> key = from_hex("603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4");
+
+    // NIST SP 800-38A, F.5.5 CTR-AES256.Encrypt
+    {
+        const std::vector<uint8_t> iv = from_hex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+        const std::vector<uint8_t> plain = from_hex(
+            "6bc1bee22e409f96e93d7e117393172a" "ae2d8a571e03ac9c9eb76fac45af8e51"
+            "30c81c46a35ce411e5fbc1191a0a52ef" "f69f2445df4f9b17ad2b417be66c3710");
+        const std::vector<uint8_t> cipher = from_hex(
+            "601ec313775789a5b7a7f504bbf3d228" "f443e3ca4d62b59aca84e990cacaf5c5"
+            "2b0930daa23de94ce87017ba2d84988d" "dfc9c58db67aada613c2dd08457941a6");
+
+        std::vector<uint8_t> buf = plain;
+        llama_aes256_ctr_apply(key.data(), iv.data(), 0, buf.data(), buf.size(), 1);
+        ok &= check("sp800-38a encrypt", buf, cipher);
+
+        llama_aes256_ctr_apply(key.data(), iv.data(), 0, buf.data(), buf.size(), 1);
+        ok &= check("sp800-38a decrypt", buf, plain);
+
+        // a read starting in the middle of a block, e.g. at a tensor offset
+        std::vector<uint8_t> part(cipher.begin() + 21, cipher.begin() + 50);
+        llama_aes256_ctr_apply(key.data(), iv.data(), 21, part.data(), part.size(), 1);
+        ok &= check("sp800-38a unaligned", part, std::vector<uint8_t>(plain.begin() + 21, plain.begin() + 50));
+    }
+
+    // the counter is a 128-bit integer, the carry must propagate into the upper 64 bits
+    {
+        const std::vector<uint8_t> iv = from_hex("0000000000000000fffffffffffffffe");
+        const std::vector<uint8_t> keystream = from_hex(
+            "917a0ec37162f7d8d7ad20aee7b1dd04" "289e23e13ec8c34291f27c4ccf3eaa29" "579be1a0d892238805feb810a4a10aaa");
+
+        std::vector<uint8_t> buf(keystream.size(), 0);
+        llama_aes256_ctr_apply(key.data(), iv.data(), 0, buf.data(), buf.size(), 1);
+        ok &= check("counter carry", buf, keystream);
+    }
+
+    // splitting a large buffer across threads must not change the result
+    {
+        const std::vector<uint8_t> iv = from_hex("000102030405060708090a0b0c0d0e0f");
+
+        std::vector<uint8_t> ref(8*1024*1024 + 13);
+        for (size_t i = 0; i < ref.size(); ++i) {
+            ref[i] = (uint8_t) (i*31 + 7);
+        }
+        std::vector<uint8_t> buf = ref;
+
+        llama_aes256_ctr_apply(key.data(), iv.data(), 5, ref.data(), ref.size(), 1);
+        llama_aes256_ctr_apply(key.data(), iv.data(), 5, buf.data(), buf.size(), 4);
+        ok &= check("multi-threaded", buf, ref);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -1475,6 +1475,71 @@ struct test_leaky_relu : public test_case {
     }
 };
 
+// GGML_OP_FLASH_ATTN_EXT
+struct test_flash_attn_ext : public test_case {
+    const int64_t hs; // head size
+    const int64_t nh; // num heads
+    const int64_t nr; // repeat factor of q heads over kv heads (GQA)
+    const int64_t kv; // kv size
+    const int64_t nb; // batch size
+    const bool mask;
+    const float max_bias;
+    const ggml_type type_KV;
+
+    std::string vars() override {
+        return VARS_TO_STR8(hs, nh, nr, kv, nb, mask, max_bias, type_KV);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    test_flash_attn_ext(int64_t hs = 128, int64_t nh = 32, int64_t nr = 1, int64_t kv = 96, int64_t nb = 8,
+            bool mask = true, float max_bias = 0.0f, ggml_type type_KV = GGML_TYPE_F16)
+        : hs(hs), nh(nh), nr(nr), kv(kv), nb(nb), mask(mask), max_bias(max_bias), type_KV(type_KV) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hs, nb, nh*nr, 1);
+        ggml_tensor * k = ggml_new_tensor_4d(ctx, type_KV, hs, kv, nh, 1);
+        ggml_tensor * v = ggml_new_tensor_4d(ctx, type_KV, hs, kv, nh, 1);
+        ggml_tensor * m = nullptr;
+        if (mask) {
+            m = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, kv, nb);
+            ggml_set_name(m, "mask");
+        }
+        ggml_tensor * pos = nullptr;
+        if (max_bias > 0.0f) {
+            pos = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, kv);
+        }
+        ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, pos, 1.0f/sqrtf(hs), max_bias);
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+            if (strcmp(t->name, "mask") == 0) {
+                init_causal_mask(t);
+            } else {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+
+    // the last nb cells of the cache hold the batch, every query sees at least one cell
+    static void init_causal_mask(ggml_tensor * t) {
+        const int64_t n_kv = t->ne[0];
+        const int64_t n_q  = t->ne[1];
+
+        std::vector<float> data(n_kv*n_q);
+        for (int64_t j = 0; j < n_q; j++) {
+            for (int64_t i = 0; i < n_kv; i++) {
+                data[j*n_kv + i] = i <= n_kv - n_q + j ? 0.0f : -INFINITY;
+            }
+        }
+        ggml_backend_tensor_set(t, data.data(), 0, data.size()*sizeof(float));
+    }
+};
+
 enum llm_norm_type {
     LLM_NORM,
     LLM_NORM_RMS,
@@ -1956,6 +2021,10 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
            test_cases.emplace_back(new test_cpy(type_src, type_dst, {256, 4, 4, 4}));
         }
     }
+    // dequantization of the KV cache types, e.g. for the K-shift of a quantized cache
+    for (ggml_type type_src : {GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+        test_cases.emplace_back(new test_cpy(type_src, GGML_TYPE_F32, {256, 4, 4, 4}));
+    }
 
     test_cases.emplace_back(new test_cont());
 
@@ -2139,6 +2208,26 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     test_cases.emplace_back(new test_timestep_embedding());
     test_cases.emplace_back(new test_leaky_relu());
 
+    for (int hs : { 64, 80, 128, }) {
+        for (bool mask : { true, false }) {
+            for (float max_bias : { 0.0f, 8.0f }) {
+                for (int nh : { 32, }) {
+                    for (int kv : { 512, 1024, }) {
+                        for (int nb : { 1, 8, 512, }) {
+                            test_cases.emplace_back(new test_flash_attn_ext(hs, nh, 1, kv, nb, mask, max_bias));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    test_cases.emplace_back(new test_flash_attn_ext(128, 8, 4, 256, 8, true, 0.0f)); // GQA
+    for (ggml_type type_KV : { GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        for (int nb : { 1, 8, 512, }) {
+            test_cases.emplace_back(new test_flash_attn_ext(128, 32, 1, 512, nb, true, 0.0f, type_KV));
+        }
+    }
+
     // these tests are disabled to save execution time, but they can be handy for debugging
 #if 0
     test_cases.emplace_back(new test_llama(1));
@@ -2175,6 +2264,123 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     return false;
 }
 
+// checks the fused GGML_OP_FLASH_ATTN_EXT against the unfused KQ -> soft_max_ext -> KQV path used by llm_build_kqv on the CPU backend
+static bool test_flash_attn_ext_vs_unfused(const char * op_name) {
+    if (op_name != nullptr && strcmp(op_name, "FLASH_ATTN_EXT") != 0) {
+        return true;
+    }
+
+    struct fa_case {
+        int64_t hs, nh, nr, kv, nb;
+        bool mask;
+        float max_bias;
+        ggml_type type_KV;
+    };
+
+    const fa_case cases[] = {
+        {  64, 32, 1, 256,   1, true,  0.0f, GGML_TYPE_F16  },
+        {  64, 32, 1, 256,  16, true,  0.0f, GGML_TYPE_F16  },
+        { 128, 32, 1, 512,   1, true,  0.0f, GGML_TYPE_F16  },
+        { 128, 32, 1, 512,  32, true,  0.0f, GGML_TYPE_F16  },
+        { 128,  8, 4, 512,  32, true,  0.0f, GGML_TYPE_F16  }, // GQA
+        {  80, 32, 1, 256,   7, true,  8.0f, GGML_TYPE_F16  }, // ALiBi
+        { 128, 16, 2, 256,   5, false, 8.0f, GGML_TYPE_F16  },
+        {  64, 32, 1, 256, 256, false, 0.0f, GGML_TYPE_F16  },
+        { 128, 32, 1, 512,   1, true,  0.0f, GGML_TYPE_Q8_0 }, // quantized KV cache
+        { 128,  8, 4, 512,  32, true,  0.0f, GGML_TYPE_Q8_0 },
+        { 128, 32, 1, 512,   1, true,  0.0f, GGML_TYPE_Q4_0 },
+        {  64, 32, 1, 256,  16, true,  8.0f, GGML_TYPE_Q4_0 },
+    };
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+
+    size_t n_ok = 0;
+
+    for (const fa_case & c : cases) {
+        printf("  FLASH_ATTN_EXT vs unfused(hs=%d,nh=%d,nr=%d,kv=%d,nb=%d,mask=%d,max_bias=%f,type_KV=%s): ",
+            (int) c.hs, (int) c.nh, (int) c.nr, (int) c.kv, (int) c.nb, c.mask, c.max_bias, ggml_type_name(c.type_KV));
+        fflush(stdout);
+
+        ggml_init_params params = {
+            /* .mem_size = */ ggml_tensor_overhead()*32 + ggml_graph_overhead(),
+            /* .mem_base = */ NULL,
+            /* .no_alloc = */ true,
+        };
+        ggml_context * ctx = ggml_init(params);
+
+        ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, c.hs, c.nb, c.nh*c.nr, 1);
+        ggml_tensor * k = ggml_new_tensor_4d(ctx, c.type_KV, c.hs, c.kv, c.nh, 1);
+        ggml_tensor * v = ggml_new_tensor_4d(ctx, c.type_KV, c.hs, c.kv, c.nh, 1);
+        ggml_tensor * m = c.mask ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, c.kv, c.nb) : nullptr;
+        ggml_tensor * pos = c.max_bias > 0.0f ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, c.kv) : nullptr;
+
+        const float scale = 1.0f/sqrtf(c.hs);
+
+        // fused: [hs, n_head, nb]
+        ggml_tensor * out_fa = ggml_flash_attn_ext(ctx, q, k, v, m, pos, scale, c.max_bias);
+
+        // unfused, as in llm_build_kqv with a transposed V (a quantized V is dequantized first)
+        ggml_tensor * kq  = ggml_mul_mat(ctx, k, q);
+        kq = ggml_soft_max_ext(ctx, kq, m, pos, scale, c.max_bias);
+        ggml_tensor * vt  = ggml_cont(ctx, ggml_transpose(ctx, ggml_is_quantized(c.type_KV) ? ggml_cast(ctx, v, GGML_TYPE_F32) : v));
+        ggml_tensor * kqv = ggml_mul_mat(ctx, vt, kq);
+        ggml_tensor * out_ref = ggml_cont(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3));
+
+        ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, out_fa);
+        ggml_build_forward_expand(gf, out_ref);
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+        init_tensor_uniform(q);
+        init_tensor_uniform(k);
+        init_tensor_uniform(v);
+        if (m) {
+            test_flash_attn_ext::init_causal_mask(m);
+        }
+        if (pos) {
+            std::vector<float> pos_data(c.kv);
+            for (int64_t i = 0; i < c.kv; i++) {
+                pos_data[i] = (float) i;
+            }
+            ggml_backend_tensor_set(pos, pos_data.data(), 0, pos_data.size()*sizeof(float));
+        }
+
+        ggml_backend_graph_compute(backend, gf);
+
+        std::vector<float> f_fa  = tensor_to_float(out_fa);
+        std::vector<float> f_ref = tensor_to_float(out_ref);
+
+        const double max_err = 5e-4;
+        const double err = nmse(f_fa.data(), f_ref.data(), f_fa.size());
+
+        bool ok = f_fa.size() == f_ref.size() && err <= max_err;
+        for (size_t i = 0; ok && i < f_fa.size(); i++) {
+            if (std::isnan(f_fa[i]) || std::isinf(f_fa[i])) {
+                printf("non-finite value at index %zu ", i);
+                ok = false;
+            }
+        }
+
+        if (ok) {
+            printf("\033[1;32mOK\033[0m\n");
+            n_ok++;
+        } else {
+            printf("NMSE = %.9f > %.9f \033[1;31mFAIL\033[0m\n", err, max_err);
+        }
+
+        ggml_backend_buffer_free(buf);
+        ggml_free(ctx);
+    }
+
+    ggml_backend_free(backend);
+
+    const size_t n_cases = sizeof(cases)/sizeof(cases[0]);
+    printf("  %zu/%zu tests passed\n", n_ok, n_cases);
+
+    return n_ok == n_cases;
+}
+
 static void usage(char ** argv) {
     printf("Usage: %s [mode] [-o op] [-b backend]\n", argv[0]);
     printf("  valid modes are: test (compare with CPU backend for correctness) or perf (performance evaluation)\n");
@@ -2259,6 +2465,15 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // the CPU backend is the reference for the other backends, check its fused attention against the unfused ops instead
+    if (mode == MODE_TEST && (backend_filter == NULL || strcmp(backend_filter, "CPU") == 0)) {
+        printf("\nCPU fused attention\n");
+        if (!test_flash_attn_ext_vs_unfused(op_name_filter)) {
+            printf("\033[1;31mFAIL\033[0m\n");
+            return 1;
+        }
+    }
+
     ggml_quantize_free();
 
     printf("\033[1;32mOK\033[0m\n");
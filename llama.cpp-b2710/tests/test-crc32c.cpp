@@ -0,0 +1,73 @@
+// tests the CRC-32C used for the checksums of the tensor data, and the combination of the checksums of consecutive parts
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.cpp" // TODO: not great
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static bool check(const char * name, uint32_t result, uint32_t expected) {
+    if (result != expected) {
+        fprintf(stderr, "%s: FAILED (%08x, expected %08x)\n", name, result, expected);
+        return false;
+    }
+    fprintf(stderr, "%s: OK\n", name);
+    return true;
+}
+
+int main(void) {
+    bool ok = true;
+
+    // RFC 3720, B.4 CRC Examples
+    {
+        const std::string digits = "123456789";
+        ok &= check("check value", llama_crc32c(0, digits.data(), digits.size()), 0xE3069283);
+
+        const std::vector<uint8_t> zeros(32, 0x00);
+        ok &= check("32 bytes of zeros", llama_crc32c(0, zeros.data(), zeros.size()), 0x8A9136AA);
+
+        const std::vector<uint8_t> ones(32, 0xFF);
+        ok &= check("32 bytes of ones", llama_crc32c(0, ones.data(), ones.size()), 0x62A8AB43);
+
+        std::vector<uint8_t> incr(32);
+        for (size_t i = 0; i < incr.size(); ++i) {
+            incr[i] = (uint8_t) i;
+        }
+        ok &= check("32 incrementing bytes", llama_crc32c(0, incr.data(), incr.size()), 0x46DD794E);
+    }
+
+    std::vector<uint8_t> data(3*1024*1024 + 77);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i*131 + (i >> 9));
+    }
+    const uint32_t ref = llama_crc32c(0, data.data(), data.size());
+
+    // continuing a checksum, with splits that are not multiples of 8 bytes
+    {
+        uint32_t crc = 0;
+        for (size_t offs = 0; offs < data.size(); offs += 65533) {
+            crc = llama_crc32c(crc, data.data() + offs, std::min<size_t>(65533, data.size() - offs));
+        }
+        ok &= check("incremental", crc, ref);
+    }
+
+    // the loader checksums the chunks of a tensor on different threads and combines the results
+    {
+        for (size_t chunk : { (size_t) 1, (size_t) 1000, (size_t) 4*1024*1024 }) {
+            uint32_t crc = 0;
+            const size_t n = chunk == 1 ? 4096 : data.size();
+            for (size_t offs = 0; offs < n; offs += chunk) {
+                const size_t size = std::min(chunk, n - offs);
+                crc = llama_crc32c_combine(crc, llama_crc32c(0, data.data() + offs, size), size);
+            }
+            ok &= check(("combine, chunks of " + std::to_string(chunk)).c_str(), crc, llama_crc32c(0, data.data(), n));
+        }
+        ok &= check("combine, empty", llama_crc32c_combine(ref, 0, 0), ref);
+    }
+
+    return ok ? 0 : 1;
+}
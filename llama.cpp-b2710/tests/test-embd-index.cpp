@@ -0,0 +1,259 @@
+// checks the search of the embedding store against a brute-force scan, with and without an IVF index and after saving and loading,
+// and compares the query latency and the recall of the store types and numbers of probed lists with the brute-force scan
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "embd-index.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// normalized embeddings that are scattered around a number of centers, like the chunks of documents on a few topics
+static std::vector<float> random_embeddings(std::mt19937 & rng, const std::vector<float> & centers, int n, int n_embd) {
+    const int n_centers = centers.size()/n_embd;
+
+    std::normal_distribution<float> noise(0.0f, 1.0f/std::sqrt((float) n_embd));
+
+    std::vector<float> embd(n*n_embd);
+    for (int i = 0; i < n; ++i) {
+        const float * c = centers.data() + (rng() % n_centers)*n_embd;
+        float * x = embd.data() + i*n_embd;
+        for (int j = 0; j < n_embd; ++j) {
+            x[j] = c[j] + noise(rng);
+        }
+        llama_embd_normalize(x, x, n_embd);
+    }
+    return embd;
+}
+
+// the top k by sorting the cosine similarities with all rows
+static std::vector<llama_embd_match> brute_force(const std::vector<float> & embd, const float * query, int n_embd, int k) {
+    const int n = embd.size()/n_embd;
+
+    std::vector<llama_embd_match> all(n);
+    for (int i = 0; i < n; ++i) {
+        all[i] = { i, llama_embd_similarity_cos(embd.data() + i*n_embd, query, n_embd) };
+    }
+    std::sort(all.begin(), all.end(), [](const llama_embd_match & a, const llama_embd_match & b) {
+        return a.score > b.score;
+    });
+    all.resize(std::min(k, n));
+    return all;
+}
+
+static float recall(const std::vector<llama_embd_match> & result, const std::vector<llama_embd_match> & exact) {
+    int n_found = 0;
+    for (const llama_embd_match & m : exact) {
+        for (const llama_embd_match & r : result) {
+            n_found += r.id == m.id;
+        }
+    }
+    return (float) n_found/exact.size();
+}
+
+static bool same(const std::vector<llama_embd_match> & a, const std::vector<llama_embd_match> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].id != b[i].id || a[i].score != b[i].score) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void) {
+    llama_backend_init();
+
+    const int n_embd    = 256;
+    const int n_rows    = 32768;
+    const int n_queries = 32;
+    const int k         = 10;
+    const int n_list    = 128;
+
+    std::mt19937 rng(42);
+
+    std::normal_distribution<float> normal;
+    std::vector<float> centers(64*n_embd);
+    for (float & x : centers) {
+        x = normal(rng);
+    }
+    for (size_t i = 0; i < centers.size(); i += n_embd) {
+        llama_embd_normalize(centers.data() + i, centers.data() + i, n_embd);
+    }
+
+    const std::vector<float> embd    = random_embeddings(rng, centers, n_rows,    n_embd);
+    const std::vector<float> queries = random_embeddings(rng, centers, n_queries, n_embd);
+
+    std::vector<std::vector<llama_embd_match>> exact;
+    int64_t t_exact = ggml_time_us();
+    for (int q = 0; q < n_queries; ++q) {
+        exact.push_back(brute_force(embd, queries.data() + q*n_embd, n_embd, k));
+    }
+    t_exact = ggml_time_us() - t_exact;
+
+    bool ok = true;
+
+    const std::string fname         = "test-embd-index.bin";
+    const std::string fname_corrupt = "test-embd-index-corrupt.bin";
+
+    printf("\nlatency per query (ms) and recall@%d of %d rows of %d dimensions\n", k, n_rows, n_embd);
+    printf("%6s %8s %8s %12s %8s\n", "type", "n_list", "n_probe", "latency", "recall");
+    printf("%6s %8s %8s %12.3f %8.3f\n", "sort", "-", "-", t_exact/1e3/n_queries, 1.0f);
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        llama_embd_store store;
+        GGML_ASSERT(llama_embd_store_init(store, n_embd, type));
+        llama_embd_store_add(store, embd.data(), n_rows/2);
+        llama_embd_store_add(store, embd.data() + (n_rows/2)*n_embd, n_rows - n_rows/2);
+
+        const char * name = ggml_type_name(type);
+
+        // the scores of the flat scan only differ from the exact ones by the rounding of the row type
+        const float eps = type == GGML_TYPE_F32 ? 1e-5f : type == GGML_TYPE_F16 ? 1e-3f : 2e-2f;
+
+        std::vector<std::vector<llama_embd_match>> flat;
+        bool ok_flat    = true;
+        bool ok_threads = true;
+        float sum_recall = 0.0f;
+        int64_t t_flat = ggml_time_us();
+        for (int q = 0; q < n_queries; ++q) {
+            flat.push_back(llama_embd_store_search(store, queries.data() + q*n_embd, k));
+        }
+        t_flat = ggml_time_us() - t_flat;
+        for (int q = 0; q < n_queries; ++q) {
+            ok_flat &= flat[q].size() == exact[q].size();
+            for (size_t i = 0; i < exact[q].size() && ok_flat; ++i) {
+                ok_flat &= std::fabs(flat[q][i].score - exact[q][i].score) < eps;
+            }
+            ok_threads &= same(llama_embd_store_search(store, queries.data() + q*n_embd, k, 0, 4), flat[q]);
+            sum_recall += recall(flat[q], exact[q]);
+        }
+        printf("%6s %8s %8s %12.3f %8.3f\n", name, "-", "-", t_flat/1e3/n_queries, sum_recall/n_queries);
+
+        if (!ok_flat || !ok_threads) {
+            fprintf(stderr, "%s: flat scan: %s, threads: %s\n", name, ok_flat ? "OK" : "FAILED", ok_threads ? "OK" : "FAILED");
+        }
+        ok &= ok_flat && ok_threads;
+
+        // the mapped store gives the same results and is copied out of the mapping when rows are added
+        {
+            store.tag = 1234;
+            llama_embd_store_save(store, fname);
+            llama_embd_store loaded = llama_embd_store_load(fname);
+
+            bool ok_load = loaded.rows_mapped != nullptr && loaded.tag == store.tag;
+            for (int q = 0; q < n_queries; ++q) {
+                ok_load &= same(llama_embd_store_search(loaded, queries.data() + q*n_embd, k), flat[q]);
+            }
+
+            llama_embd_store_add(loaded, queries.data(), 1);
+            const std::vector<llama_embd_match> top = llama_embd_store_search(loaded, queries.data(), 1);
+            ok_load &= loaded.rows_mapped == nullptr && loaded.n_rows == n_rows + 1 && top.size() == 1 && top[0].id == n_rows;
+
+            if (!ok_load) {
+                fprintf(stderr, "%s: save and load: FAILED\n", name);
+            }
+            ok &= ok_load;
+        }
+
+        llama_embd_store_build_ivf(store, n_list, 10, 4);
+
+        // probing all lists scans the same rows as the flat scan, in a different order
+        bool ok_ivf = store.n_list == n_list && store.offsets()[n_list] == n_rows;
+        for (int q = 0; q < n_queries; ++q) {
+            ok_ivf &= same(llama_embd_store_search(store, queries.data() + q*n_embd, k, n_list), flat[q]);
+        }
+
+        llama_embd_store_save(store, fname);
+        const llama_embd_store loaded = llama_embd_store_load(fname);
+
+        for (int n_probe : { 1, 4, 16 }) {
+            std::vector<std::vector<llama_embd_match>> result;
+            int64_t t_ivf = ggml_time_us();
+            for (int q = 0; q < n_queries; ++q) {
+                result.push_back(llama_embd_store_search(store, queries.data() + q*n_embd, k, n_probe));
+            }
+            t_ivf = ggml_time_us() - t_ivf;
+
+            float sum_recall_ivf = 0.0f;
+            for (int q = 0; q < n_queries; ++q) {
+                sum_recall_ivf += recall(result[q], exact[q]);
+                ok_ivf &= same(llama_embd_store_search(loaded, queries.data() + q*n_embd, k, n_probe), result[q]);
+            }
+            printf("%6s %8d %8d %12.3f %8.3f\n", name, n_list, n_probe, t_ivf/1e3/n_queries, sum_recall_ivf/n_queries);
+
+            // the queries are close to the rows of one center, the lists of that center hold most of their neighbors
+            if (n_probe == 16) {
+                ok_ivf &= sum_recall_ivf/n_queries > 0.8f;
+            }
+        }
+
+        if (!ok_ivf) {
+            fprintf(stderr, "%s: ivf: FAILED\n", name);
+        }
+        ok &= ok_ivf;
+
+        // corrupt files are rejected with an exception instead of being read out of bounds
+        {
+            const auto load_fails = [&](const std::vector<char> & data) {
+                FILE * f = fopen(fname_corrupt.c_str(), "wb");
+                fwrite(data.data(), 1, data.size(), f);
+                fclose(f);
+                try {
+                    llama_embd_store_load(fname_corrupt);
+                } catch (const std::ifstream::failure &) {
+                    return true;
+                }
+                return false;
+            };
+
+            const char * addr = (const char *) loaded.mapping->addr;
+            const std::vector<char> data(addr, addr + loaded.mapping->size);
+            const size_t offs_offsets = (const char *) loaded.offsets_mapped - addr;
+            const size_t offs_ids     = (const char *) loaded.ids_mapped     - addr;
+
+            // a list that ends before it starts, a list past the last row and a row id out of range
+            const int64_t offset_neg = -1;
+            std::vector<char> data_order = data;
+            memcpy(data_order.data() + offs_offsets + sizeof(int64_t), &offset_neg, sizeof(offset_neg));
+
+            const int64_t offset_past = n_rows + 1;
+            std::vector<char> data_past = data;
+            memcpy(data_past.data() + offs_offsets + sizeof(int64_t), &offset_past, sizeof(offset_past));
+
+            const int32_t id_bad = n_rows;
+            std::vector<char> data_id = data;
+            memcpy(data_id.data() + offs_ids, &id_bad, sizeof(id_bad));
+
+            bool ok_corrupt = true;
+            ok_corrupt &= load_fails(std::vector<char>(data.begin(), data.end() - 1));
+            ok_corrupt &= load_fails(data_order);
+            ok_corrupt &= load_fails(data_past);
+            ok_corrupt &= load_fails(data_id);
+            if (!ok_corrupt) {
+                fprintf(stderr, "%s: corrupt files: FAILED\n", name);
+            }
+            ok &= ok_corrupt;
+        }
+    }
+
+    std::remove(fname.c_str());
+    std::remove(fname_corrupt.c_str());
+
+    llama_backend_free();
+
+    fprintf(stderr, "%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
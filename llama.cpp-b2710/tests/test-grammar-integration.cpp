@@ -2,13 +2,11 @@
 #undef NDEBUG
 #endif
 
-#define LLAMA_API_INTERNAL
-
-#include "ggml.h"
-#include "llama.h"
+#include "llama.cpp" // TODO: not great
 #include "grammar-parser.h"
 #include "unicode.h"
 #include <cassert>
+#include <random>
 #include <string>
 
 static void test_simple_grammar() {
@@ -234,10 +232,174 @@ number ::= [0-9]+)""";
     fprintf(stderr, "End of expected error. Test successful.\n");
 }
 
+// a synthetic vocabulary: all single bytes, random words with and without a leading space, and a few multi-byte and
+// split UTF-8 sequences. token 2 is the end-of-generation token, with an empty piece like </s>
+static std::vector<std::string> make_vocab(int n_vocab) {
+    std::vector<std::string> pieces;
+    for (int c = 0; c < 256; ++c) {
+        pieces.push_back(std::string(1, (char) c));
+    }
+    pieces[2] = "";
+
+    const std::vector<std::string> extra = {
+        "\u00e9", "caf\u00e9", " caf\u00e9", "\u65e5\u672c", "\u65e5", "\u672c\u8a9e", "\xe6\x97", "\xa5", "\x97\xa5", "a\xc3", "\xa9\"",
+        "\": \"", "\", \"", "\": ", "\":", "{\"", "\"}", "[1", ", -", ".5", "},", "true", " true", "null",
+    };
+    pieces.insert(pieces.end(), extra.begin(), extra.end());
+
+    const std::string chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.,:;\"'{}[]() \n";
+
+    std::mt19937 rng(42);
+    while ((int) pieces.size() < n_vocab) {
+        std::string piece = rng() % 2 ? " " : "";
+        const int n = 1 + rng() % 8;
+        for (int i = 0; i < n; ++i) {
+            // mostly letters
+            piece += chars[rng() % 3 ? rng() % 26 : rng() % chars.size()];
+        }
+        pieces.push_back(piece);
+    }
+
+    return pieces;
+}
+
+// the tokens allowed next, as llama_sample_grammar used to find them: one candidate per token, all matched against
+// the grammar from scratch
+static std::vector<bool> reference_allowed(
+        const llama_grammar            * grammar,
+        const std::vector<std::string> & pieces,
+        const std::vector<llama_token> & eog) {
+    bool allow_eog = false;
+    for (const auto & stack : grammar->stacks) {
+        allow_eog = allow_eog || stack.empty();
+    }
+
+    std::vector<bool> allowed(pieces.size(), false);
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded;
+    decoded.reserve(pieces.size());
+    std::vector<llama_grammar_candidate> candidates;
+
+    for (size_t id = 0; id < pieces.size(); ++id) {
+        if (std::find(eog.begin(), eog.end(), (llama_token) id) != eog.end()) {
+            allowed[id] = allow_eog;
+        } else if (!pieces[id].empty() && pieces[id][0] != 0) {
+            allowed[id] = true;
+            decoded.push_back(decode_utf8(pieces[id], grammar->partial_utf8));
+            candidates.push_back({ id, decoded.back().first.data(), decoded.back().second });
+        }
+    }
+
+    for (const auto & reject : llama_grammar_reject_candidates(grammar->rules, grammar->stacks, candidates)) {
+        allowed[reject.index] = false;
+    }
+
+    return allowed;
+}
+
+// checks the allowed-token masks against the reference in every state along an input that the grammar accepts,
+// and compares the time to find the allowed tokens from scratch, with the trie and from the cache
+static void test_token_mask(const std::string & name, const std::string & grammar_str, const std::string & input) {
+    const std::vector<std::string> pieces = make_vocab(32000);
+    const std::vector<llama_token> eog    = { 2 };
+
+    llama_grammar_trie trie;
+    llama_grammar_trie_build(trie, pieces, eog);
+
+    grammar_parser::parse_state parsed_grammar = grammar_parser::parse(grammar_str.c_str());
+    assert(!parsed_grammar.rules.empty());
+
+    std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+    llama_grammar * grammar = llama_grammar_init(
+        grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+
+    std::vector<llama_token_data> data(pieces.size());
+
+    int64_t t_ref   = 0;
+    int64_t t_trie  = 0;
+    int64_t t_cache = 0;
+    int     n_allowed = 0;
+
+    const auto code_points = decode_utf8(input, {}).first;
+
+    for (size_t i = 0; i < code_points.size(); ++i) {
+        const int64_t t0 = ggml_time_us();
+        const std::vector<bool> allowed = reference_allowed(grammar, pieces, eog);
+        const int64_t t1 = ggml_time_us();
+        std::vector<uint32_t> mask;
+        llama_grammar_token_mask(trie, grammar, mask);
+        const int64_t t2 = ggml_time_us();
+
+        // the first lookup of a state fills the cache
+        llama_grammar_cached_token_mask(trie, grammar);
+        for (size_t id = 0; id < data.size(); ++id) {
+            data[id] = { (llama_token) id, 0.0f, 0.0f };
+        }
+        llama_token_data_array candidates = { data.data(), data.size(), false };
+
+        const int64_t t3 = ggml_time_us();
+        llama_grammar_apply_token_mask(llama_grammar_cached_token_mask(trie, grammar), &candidates);
+        const int64_t t4 = ggml_time_us();
+
+        t_ref   += t1 - t0;
+        t_trie  += t2 - t1;
+        t_cache += t4 - t3;
+
+        for (size_t id = 0; id < pieces.size(); ++id) {
+            const bool in_mask = (mask[id >> 5] >> (id & 31)) & 1;
+            if (in_mask != allowed[id] || (data[id].logit == 0.0f) != allowed[id]) {
+                fprintf(stderr, "%s: token %zu ('%s') allowed: %d, mask: %d, after %zu code points of '%s'\n",
+                        name.c_str(), id, pieces[id].c_str(), (int) allowed[id], (int) in_mask, i, input.c_str());
+            }
+            assert(in_mask == allowed[id]);
+            assert((data[id].logit == 0.0f) == allowed[id]);
+            n_allowed += allowed[id];
+        }
+
+        if (code_points[i] == 0) {
+            break;
+        }
+
+        auto prev_stacks = grammar->stacks;
+        llama_grammar_accept(grammar->rules, prev_stacks, code_points[i], grammar->stacks);
+        assert(!grammar->stacks.empty());
+    }
+
+    const int n_states = code_points.size();
+
+    fprintf(stderr, "%-12s %6d %10.1f %12.3f %12.3f %12.4f %8.0fx\n", name.c_str(), n_states, (double) n_allowed/n_states,
+            t_ref/1e3/n_states, t_trie/1e3/n_states, t_cache/1e3/n_states, (double) t_ref/std::max<int64_t>(t_cache, 1));
+
+    llama_grammar_free(grammar);
+}
+
+static void test_token_masks() {
+    fprintf(stderr, "\nallowed tokens of a %d token vocabulary per grammar state (ms)\n", 32000);
+    fprintf(stderr, "%-12s %6s %10s %12s %12s %12s %9s\n", "grammar", "states", "allowed", "reference", "trie", "cached", "speedup");
+
+    test_token_mask("arithmetic", R"""(root ::= expr
+expr ::= term ws (("+"|"-") ws term)*
+term ::= factor ws (("*"|"/") ws factor)*
+factor ::= number | variable | "(" expression ")"
+expression ::= expr
+number ::= [0-9]+
+variable ::= [a-zA-Z_][a-zA-Z0-9_]*
+ws ::= [ \t\n]?)""", "(a + b1) * 42 - c_d / (7 + x)");
+
+    test_token_mask("json", R"""(root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+string ::= "\"" ( [^"\\] | "\\" (["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F]) )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]*)) ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws
+ws     ::= ([ \t\n] ws)?)""", "{\"name\": \"caf\u00e9 \u65e5\u672c\", \"values\": [1, 2.5, -3, true], \"nested\": {\"a\": null, \"b\": \"x y z\"}}");
+}
+
 int main() {
     test_simple_grammar();
     test_complex_grammar();
     test_failure_missing_root();
     test_failure_missing_reference();
+    test_token_masks();
     return 0;
 }
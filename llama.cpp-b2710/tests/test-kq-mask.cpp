@@ -0,0 +1,291 @@
+// checks the incrementally maintained KQ mask against a mask built from scratch and the mask of a tree of draft tokens,
+// and compares the time it takes to build both for different context sizes and numbers of sequences
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.cpp" // TODO: not great
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <random>
+
+// the mask as llama_set_inputs used to build it, from the cells alone
+static void build_kq_mask_ref(const llama_kv_cache & cache, const llama_batch & batch, int32_t n_kv, float * data) {
+    for (int j = 0; j < batch.n_tokens; ++j) {
+        const llama_pos    pos    = batch.pos[j];
+        const llama_seq_id seq_id = batch.seq_id[j][0];
+
+        for (int i = 0; i < n_kv; ++i) {
+            float f;
+            if (!cache.cells[i].has_seq_id(seq_id) || cache.cells[i].pos > pos) {
+                f = -INFINITY;
+            } else {
+                f = 0.0f;
+            }
+            data[j*n_kv + i] = f;
+        }
+    }
+}
+
+static void cache_init(llama_kv_cache & cache, uint32_t size) {
+    cache.size = size;
+    cache.cells.clear();
+    cache.cells.resize(size);
+    llama_kv_cache_clear(cache);
+}
+
+static void batch_add(llama_batch & batch, llama_pos pos, llama_seq_id seq_id) {
+    const int j = batch.n_tokens++;
+    batch.token[j]     = 0;
+    batch.pos[j]       = pos;
+    batch.n_seq_id[j]  = 1;
+    batch.seq_id[j][0] = seq_id;
+    batch.logits[j]    = false;
+}
+
+static bool test_random_ops(int seed) {
+    std::mt19937 rng(seed);
+
+    const uint32_t n_ctx   = 256;
+    const int      n_seq   = 4;
+    const int      n_batch = 8;
+
+    llama_kv_cache cache;
+    cache_init(cache, n_ctx);
+
+    llama_batch batch = llama_batch_init(n_batch*n_seq, 0, 2);
+
+    std::vector<llama_pos> n_past(n_seq, 0);
+    std::vector<float> mask(n_ctx*n_batch*n_seq);
+    std::vector<float> mask_ref(n_ctx*n_batch*n_seq);
+
+    bool ok = true;
+
+    for (int step = 0; step < 2000 && ok; ++step) {
+        const int op = rng() % 10;
+        const llama_seq_id s0 = rng() % n_seq;
+        const llama_seq_id s1 = rng() % n_seq;
+        const llama_pos    p0 = n_past[s0] > 0 ? rng() % n_past[s0] : 0;
+
+        switch (op) {
+            case 0: llama_kv_cache_seq_rm  (cache, s0, p0, -1); n_past[s0] = p0; break;
+            case 1: llama_kv_cache_seq_cp  (cache, s0, s1, 0, p0); break;
+            case 2: llama_kv_cache_seq_add (cache, s0, p0, -1, -(llama_pos)(rng() % 4)); break;
+            case 3: llama_kv_cache_seq_div (cache, s0, p0, -1, 2); break;
+            case 4: if (rng() % 20 == 0) { llama_kv_cache_seq_keep(cache, s0); } break;
+            default: break;
+        }
+
+        // decode either one token for each sequence or a few tokens of one of them
+        batch.n_tokens = 0;
+        if (rng() % 2) {
+            for (llama_seq_id s = 0; s < n_seq; ++s) {
+                batch_add(batch, n_past[s], s);
+            }
+        } else {
+            const int n_tokens = 1 + rng() % n_batch;
+            for (int j = 0; j < n_tokens; ++j) {
+                batch_add(batch, n_past[s0] + j, s0);
+                if (s1 != s0) {
+                    // the tokens also belong to another sequence
+                    batch.seq_id[j][batch.n_seq_id[j]++] = s1;
+                }
+            }
+        }
+
+        if (!llama_kv_cache_find_slot(cache, batch)) {
+            // full, start over
+            llama_kv_cache_clear(cache);
+            std::fill(n_past.begin(), n_past.end(), 0);
+            continue;
+        }
+        for (int j = 0; j < batch.n_tokens; ++j) {
+            n_past[batch.seq_id[j][0]] = std::max(n_past[batch.seq_id[j][0]], batch.pos[j] + 1);
+        }
+
+        const int32_t n_kv = std::max(1u, GGML_PAD(llama_kv_cache_cell_max(cache), 32));
+
+        llama_kv_cache_build_kq_mask(cache, batch, n_kv, mask.data());
+        build_kq_mask_ref(cache, batch, n_kv, mask_ref.data());
+
+        if (memcmp(mask.data(), mask_ref.data(), n_kv*batch.n_tokens*sizeof(float)) != 0) {
+            fprintf(stderr, "%s: seed %d: mismatch at step %d (op %d)\n", __func__, seed, step, op);
+            ok = false;
+        }
+    }
+
+    llama_batch_free(batch);
+
+    return ok;
+}
+
+// a tree of draft tokens after a prompt: each token only sees the prompt and its ancestors,
+// and pruning the tree to a path leaves the cells of the prompt and of the path
+static bool test_draft_tree() {
+    const uint32_t n_ctx    = 64;
+    const int      n_prompt = 10;
+
+    llama_kv_cache cache;
+    cache_init(cache, n_ctx);
+
+    llama_batch batch = llama_batch_init(16, 0, 1);
+
+    batch.n_tokens = 0;
+    for (int p = 0; p < n_prompt; ++p) {
+        batch_add(batch, p, 0);
+    }
+    GGML_ASSERT(llama_kv_cache_find_slot(cache, batch));
+    cache.head += batch.n_tokens;
+
+    // children: 0 -> 1, 2; 1 -> 3, 4; 2 -> 5; 3 -> 6
+    llama_draft_tree tree;
+    tree.seq_id  = 0;
+    tree.pos     = n_prompt;
+    tree.parents = { -1, 0, 0, 1, 1, 2, 3 };
+    tree.tokens.assign(tree.parents.size(), 0);
+
+    const int n_tree = tree.parents.size();
+
+    batch.n_tokens = 0;
+    for (int k = 0; k < n_tree; ++k) {
+        tree.depth.push_back(k == 0 ? 0 : tree.depth[tree.parents[k]] + 1);
+        batch_add(batch, tree.pos + tree.depth[k], tree.seq_id);
+    }
+    GGML_ASSERT(llama_kv_cache_find_slot(cache, batch));
+
+    const uint32_t head = cache.head;
+    const int32_t  n_kv = GGML_PAD(llama_kv_cache_cell_max(cache), 32);
+
+    std::vector<float> mask(n_kv*n_tree);
+    llama_kv_cache_build_kq_mask(cache, batch, n_kv, mask.data());
+    llama_draft_tree_build_kq_mask(tree, head, n_kv, mask.data());
+
+    bool ok = true;
+
+    for (int j = 0; j < n_tree; ++j) {
+        std::vector<bool> visible(n_kv, false);
+        for (int i = 0; i < n_prompt; ++i) {
+            visible[i] = true;
+        }
+        for (int k = j; k >= 0; k = tree.parents[k]) {
+            visible[head + k] = true;
+        }
+        for (int i = 0; i < n_kv; ++i) {
+            ok &= (mask[j*n_kv + i] == 0.0f) == visible[i];
+        }
+    }
+    cache.head += n_tree;
+
+    // keep 0 -> 1 -> 3
+    const std::vector<int32_t> path = { 0, 1, 3 };
+    ok &= llama_draft_tree_prune(cache, tree, path.data(), path.size());
+    ok &= tree.cells.empty();
+    ok &= cache.used == (uint32_t) (n_prompt + path.size());
+    for (int k = 0; k < n_tree; ++k) {
+        const bool on_path = std::find(path.begin(), path.end(), k) != path.end();
+        ok &= cache.cells[head + k].is_empty() != on_path;
+    }
+
+    // the next token sees the prompt and the path
+    batch.n_tokens = 0;
+    batch_add(batch, n_prompt + path.size(), 0);
+    GGML_ASSERT(llama_kv_cache_find_slot(cache, batch));
+
+    llama_kv_cache_build_kq_mask(cache, batch, n_kv, mask.data());
+    for (int i = 0; i < n_kv; ++i) {
+        const bool on_path = i >= (int) head && std::find(path.begin(), path.end(), i - (int) head) != path.end();
+        const bool visible = i < n_prompt || on_path || i == (int) cache.head;
+        ok &= (mask[i] == 0.0f) == visible;
+    }
+
+    llama_batch_free(batch);
+
+    fprintf(stderr, "%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+static void bench(uint32_t n_ctx, int n_seq) {
+    const int n_steps = 16;
+
+    llama_kv_cache cache;
+    cache_init(cache, n_ctx);
+
+    llama_batch batch = llama_batch_init(std::max(n_seq, 512), 0, 1);
+
+    // fill most of the cache with the prompts of all sequences
+    std::vector<llama_pos> n_past(n_seq, 0);
+    for (int s = 0; s < n_seq; ++s) {
+        const int n_prompt = (n_ctx - n_seq*n_steps)/n_seq;
+        for (int p = 0; p < n_prompt; p += 512) {
+            batch.n_tokens = 0;
+            for (int j = 0; j < std::min(512, n_prompt - p); ++j) {
+                batch_add(batch, n_past[s] + j, s);
+            }
+            GGML_ASSERT(llama_kv_cache_find_slot(cache, batch));
+            n_past[s] += batch.n_tokens;
+        }
+    }
+
+    std::vector<float> mask(n_ctx*n_seq);
+
+    int64_t t_ref = 0;
+    int64_t t_inc = 0;
+
+    // then generate one token for each of them per step
+    for (int step = 0; step < n_steps; ++step) {
+        batch.n_tokens = 0;
+        for (int s = 0; s < n_seq; ++s) {
+            batch_add(batch, n_past[s], s);
+        }
+        GGML_ASSERT(llama_kv_cache_find_slot(cache, batch));
+        for (int s = 0; s < n_seq; ++s) {
+            n_past[s]++;
+        }
+
+        const int32_t n_kv = GGML_PAD(llama_kv_cache_cell_max(cache), 32);
+
+        int64_t t0 = ggml_time_us();
+        build_kq_mask_ref(cache, batch, n_kv, mask.data());
+        int64_t t1 = ggml_time_us();
+        llama_kv_cache_build_kq_mask(cache, batch, n_kv, mask.data());
+        int64_t t2 = ggml_time_us();
+
+        // the first build of the incremental mask creates the copies of all sequences
+        if (step > 0) {
+            t_ref += t1 - t0;
+            t_inc += t2 - t1;
+        }
+    }
+
+    printf("%8u %8d %16.3f %16.3f %8.1fx\n", n_ctx, n_seq,
+            t_ref/1e3/(n_steps - 1), t_inc/1e3/(n_steps - 1), (double) t_ref/std::max<int64_t>(t_inc, 1));
+
+    llama_batch_free(batch);
+}
+
+int main(void) {
+    ggml_time_init();
+
+    bool ok = true;
+
+    for (int seed = 0; seed < 8; ++seed) {
+        ok &= test_random_ops(seed);
+    }
+    fprintf(stderr, "%s: random cache operations: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    ok &= test_draft_tree();
+
+    printf("\nmask build time per decode step of one token for each sequence (ms)\n");
+    printf("%8s %8s %16s %16s %9s\n", "n_ctx", "n_seq", "from cells", "incremental", "speedup");
+    for (uint32_t n_ctx : { 4096u, 16384u, 65536u }) {
+        for (int n_seq : { 1, 8, 32 }) {
+            bench(n_ctx, n_seq);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+// checks that the n-gram tables hold the same counts as the ngram caches after updates, merges, saving and loading,
+// and that the drafts from a loaded table are the same as from the table it was saved from
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "ngram-cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+// the contents of a table in the form of an ngram cache
+static llama_ngram_cache table_to_cache(const llama_ngram_table & ngram_table) {
+    llama_ngram_cache ngram_cache;
+    for (const llama_ngram_table_shard & shard : ngram_table.shards) {
+        const llama_ngram_table_entry * entries = shard.entries();
+        const llama_ngram_table_chunk * chunks  = shard.chunks();
+
+        for (uint32_t i = 0; i < shard.capacity; ++i) {
+            const llama_ngram_table_entry & entry = entries[i];
+            if (entry.ngram.tokens[0] == -1) {
+                continue;
+            }
+            llama_ngram_cache_part & part = ngram_cache[entry.ngram];
+            for (int j = 0; j < std::min(entry.n_cont, LLAMA_NGRAM_TABLE_INLINE); ++j) {
+                part[entry.tokens[j]] += entry.counts[j];
+            }
+            for (int32_t i_chunk = entry.i_chunk; i_chunk != -1; i_chunk = chunks[i_chunk].i_next) {
+                for (int j = 0; j < chunks[i_chunk].n; ++j) {
+                    part[chunks[i_chunk].tokens[j]] += chunks[i_chunk].counts[j];
+                }
+            }
+            if ((int32_t) part.size() != entry.n_cont) {
+                fprintf(stderr, "%s: wrong number of continuations\n", __func__);
+                ngram_cache.clear();
+                return ngram_cache;
+            }
+        }
+    }
+    return ngram_cache;
+}
+
+static bool check(const char * name, const llama_ngram_table & ngram_table, const llama_ngram_cache & ngram_cache) {
+    const bool ok = ngram_table.size() == ngram_cache.size() && table_to_cache(ngram_table) == ngram_cache;
+    fprintf(stderr, "%s: %s\n", name, ok ? "OK" : "FAILED");
+    return ok;
+}
+
+// a mix of repeated phrases and random tokens, with a few frequent n-grams that need overflow chunks
+static std::vector<llama_token> random_tokens(std::mt19937 & rng, int n_tokens, int n_vocab) {
+    std::vector<llama_token> tokens;
+    while ((int) tokens.size() < n_tokens) {
+        if (rng() % 4 == 0 && tokens.size() > 16) {
+            const int n = 2 + rng() % 8;
+            const int i = rng() % (tokens.size() - n);
+            tokens.insert(tokens.end(), tokens.begin() + i, tokens.begin() + i + n);
+        } else if (rng() % 8 == 0) {
+            tokens.push_back(0);
+            tokens.push_back(1 + rng() % 64);
+        } else {
+            tokens.push_back(rng() % n_vocab);
+        }
+    }
+    tokens.resize(n_tokens);
+    return tokens;
+}
+
+int main(void) {
+    bool ok = true;
+
+    std::mt19937 rng(42);
+
+    std::vector<llama_token> inp_a = random_tokens(rng, 20000, 500);
+    std::vector<llama_token> inp_b = random_tokens(rng, 20000, 500);
+
+    llama_ngram_cache cache_a;
+    llama_ngram_table table_a;
+    llama_ngram_cache_update(cache_a, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_a, inp_a.size(), false);
+    llama_ngram_cache_update(table_a, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_a, inp_a.size(), false);
+    ok &= check("update", table_a, cache_a);
+
+    // incremental updates as done while generating
+    {
+        llama_ngram_cache cache;
+        llama_ngram_table table;
+        std::vector<llama_token> inp;
+        for (const llama_token token : inp_b) {
+            inp.push_back(token);
+            llama_ngram_cache_update(cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, 1, false);
+            llama_ngram_cache_update(table, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, 1, false);
+        }
+        ok &= check("incremental update", table, cache);
+    }
+
+    llama_ngram_cache cache_b;
+    llama_ngram_table table_b;
+    llama_ngram_cache_update(cache_b, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_b, inp_b.size(), false);
+    llama_ngram_cache_update(table_b, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_b, inp_b.size(), false);
+
+    llama_ngram_cache cache_ab = cache_a;
+    llama_ngram_cache_merge(cache_ab, cache_b);
+    for (int n_threads : { 1, 3, 8 }) {
+        llama_ngram_table table_ab = table_a;
+        llama_ngram_cache_merge(table_ab, table_b, n_threads);
+        ok &= check(("merge, " + std::to_string(n_threads) + " threads").c_str(), table_ab, cache_ab);
+    }
+    ok &= check("conversion", llama_ngram_table_from_cache(cache_ab), cache_ab);
+
+    const std::string fname_table = "test-ngram-cache-table.bin";
+    const std::string fname_cache = "test-ngram-cache-cache.bin";
+
+    // saved tables are mapped, caches saved with llama_ngram_cache_save are converted
+    {
+        llama_ngram_table_save(table_a, fname_table);
+        llama_ngram_table table = llama_ngram_table_load(fname_table);
+        ok &= check("save and load", table, cache_a);
+
+        std::string fname = fname_cache;
+        llama_ngram_cache_save(cache_b, fname);
+        ok &= check("load cache file", llama_ngram_table_load(fname_cache), cache_b);
+
+        // the drafts only depend on the layout of the table, which the file keeps
+        bool ok_draft = true;
+        for (int i = 100; i < (int) inp_b.size(); i += 97) {
+            std::vector<llama_token> inp(inp_b.begin(), inp_b.begin() + i);
+            std::vector<llama_token> draft_saved  = { inp.back() };
+            std::vector<llama_token> draft_loaded = { inp.back() };
+            llama_ngram_cache_draft(inp, draft_saved,  8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, table_b, table_b, table_a);
+            llama_ngram_cache_draft(inp, draft_loaded, 8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, table_b, table_b, table);
+            ok_draft &= draft_saved == draft_loaded;
+        }
+        fprintf(stderr, "draft from loaded table: %s\n", ok_draft ? "OK" : "FAILED");
+        ok &= ok_draft;
+
+        // modifying a loaded table copies it out of the mapping, the file can then be overwritten
+        llama_ngram_table table_copy = table;
+        llama_ngram_cache_merge(table, table_b, 4);
+        ok &= check("merge into loaded table", table, cache_ab);
+        ok &= check("copy of loaded table", table_copy, cache_a);
+        table_copy.clear();
+
+        llama_ngram_table_save(table, fname_table);
+        ok &= check("save over loaded file", llama_ngram_table_load(fname_table), cache_ab);
+    }
+
+    // corrupt files are rejected with an exception instead of being read out of bounds
+    {
+        const auto load_fails = [&](const std::vector<char> & data) {
+            FILE * f = fopen(fname_table.c_str(), "wb");
+            fwrite(data.data(), 1, data.size(), f);
+            fclose(f);
+            try {
+                llama_ngram_table_load(fname_table);
+            } catch (const std::ifstream::failure &) {
+                return true;
+            }
+            return false;
+        };
+
+        llama_ngram_table_save(table_a, fname_table);
+        std::vector<char> data;
+        {
+            std::ifstream f(fname_table, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        }
+
+        // the chunks of a shard are at its end, followed by the entries and chunks of the next shards
+        size_t offs_chunk = data.size();
+        int i_shard = LLAMA_NGRAM_TABLE_SHARDS - 1;
+        for (; i_shard >= 0 && table_a.shards[i_shard].n_chunks == 0; --i_shard) {
+            offs_chunk -= table_a.shards[i_shard].capacity*sizeof(llama_ngram_table_entry);
+        }
+        assert(i_shard >= 0);
+        offs_chunk -= table_a.shards[i_shard].n_chunks*sizeof(llama_ngram_table_chunk);
+        std::vector<char> data_cycle = data;
+        const int32_t i_next = 0; // the first chunk of the shard links to itself
+        memcpy(data_cycle.data() + offs_chunk + offsetof(llama_ngram_table_chunk, i_next), &i_next, sizeof(i_next));
+
+        bool ok_corrupt = true;
+        ok_corrupt &= load_fails(std::vector<char>(data.begin(), data.end() - 1));
+        ok_corrupt &= load_fails(data_cycle);
+        fprintf(stderr, "corrupt files: %s\n", ok_corrupt ? "OK" : "FAILED");
+        ok &= ok_corrupt;
+    }
+
+    std::remove(fname_table.c_str());
+    std::remove(fname_cache.c_str());
+
+    return ok ? 0 : 1;
+}
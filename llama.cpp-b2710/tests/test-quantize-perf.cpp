@@ -1,6 +1,9 @@
 // Benchmark quantization specific functions on synthetic data
 
 #include "ggml.h"
+#ifdef GGML_USE_LLAMAFILE
+#include "sgemm.h"
+#endif
 
 #undef NDEBUG
 #include <algorithm>
@@ -28,6 +31,10 @@
 #define L3_SIZE    32*20480
 #define MEM_SIZE 32*2048000
 
+// rows and columns of the matrices multiplied by gemm_q, i.e. a short prompt
+#define GEMM_M 64
+#define GEMM_N 64
+
 struct quantize_perf_params {
     std::vector<std::string> include_types;
     std::vector<size_t> test_sizes;
@@ -37,6 +44,7 @@ struct quantize_perf_params {
     bool op_dequantize_row_q = false;
     bool op_quantize_row_q_dot = false;
     bool op_vec_dot_q = false;
+    bool op_gemm_q = false;
     int64_t iterations = ITERATIONS;
 };
 
@@ -118,7 +126,7 @@ static void usage(char * argv[]) {
     printf("  -3                    use size as L1, L2, L3 sizes (L1:%d L2:%d L3:%d)\n", L1_SIZE, L2_SIZE, L3_SIZE);
     printf("  -4                    use size as L1, L2, L3, MEM sizes (L1:%d L2:%d L3:%d MEM:%d)\n", L1_SIZE, L2_SIZE, L3_SIZE, MEM_SIZE);
     printf("  --op OP               set test operation as quantize_row_q_reference, quantize_row_q, dequantize_row_q,\n");
-    printf("                        quantize_row_q_dot, vec_dot_q (all)\n");
+    printf("                        quantize_row_q_dot, vec_dot_q, gemm_q (all)\n");
     printf("  --type TYPE           set test type as");
     for (int i = 0; i < GGML_TYPE_COUNT; i++) {
         ggml_type type = (ggml_type) i;
@@ -185,6 +193,8 @@ int main(int argc, char * argv[]) {
                 params.op_quantize_row_q_dot = true;
             } else if (op == "vec_dot_q") {
                 params.op_vec_dot_q = true;
+            } else if (op == "gemm_q") {
+                params.op_gemm_q = true;
             } else {
                 invalid_param = true;
                 break;
@@ -235,8 +245,8 @@ int main(int argc, char * argv[]) {
     if (params.test_sizes.empty()) {
         params.test_sizes.push_back(L1_SIZE);
     }
-    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q)) {
-        params.op_quantize_row_q_reference = params.op_quantize_row_q = params.op_dequantize_row_q = params.op_quantize_row_q_dot = params.op_vec_dot_q = true;
+    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q || params.op_gemm_q)) {
+        params.op_quantize_row_q_reference = params.op_quantize_row_q = params.op_dequantize_row_q = params.op_quantize_row_q_dot = params.op_vec_dot_q = params.op_gemm_q = true;
     }
 
     std::sort(params.test_sizes.begin(), params.test_sizes.end());
@@ -354,6 +364,65 @@ int main(int argc, char * argv[]) {
                 }
                 printf("\n");
             }
+
+            if (params.op_gemm_q) {
+                // prompt processing: a GEMM_M x size matrix times a size x GEMM_N matrix,
+                // once as GEMM_M*GEMM_N calls to vec_dot and once through llamafile_sgemm
+                printf("  gemm_q (%d x %d)\n", GEMM_M, GEMM_N);
+                for (size_t size : params.test_sizes) {
+                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
+                    const size_t row_size_a = ggml_row_size(type, size);
+                    const size_t row_size_b = ggml_row_size(qfns.vec_dot_type, size);
+                    auto vdot = ggml_internal_get_type_traits(qfns.vec_dot_type);
+
+                    std::vector<float> data(size);
+                    std::vector<uint8_t> a(GEMM_M*row_size_a);
+                    std::vector<uint8_t> b(GEMM_N*row_size_b);
+                    for (int i = 0; i < GEMM_M; i++) {
+                        generate_data(i, size, data.data());
+                        qfns.from_float(data.data(), a.data() + i*row_size_a, size);
+                    }
+                    for (int j = 0; j < GEMM_N; j++) {
+                        generate_data(0.5f + j, size, data.data());
+                        vdot.from_float(data.data(), b.data() + j*row_size_b, size);
+                    }
+                    std::vector<float> c_ref(GEMM_M*GEMM_N);
+                    std::vector<float> c(GEMM_M*GEMM_N);
+
+                    auto vec_dot_fn = [&](void) -> float {
+                        for (int j = 0; j < GEMM_N; j++) {
+                            for (int i = 0; i < GEMM_M; i++) {
+                                qfns.vec_dot(size, &c_ref[j*GEMM_M + i], 0, a.data() + i*row_size_a, 0, b.data() + j*row_size_b, 0, 1);
+                            }
+                        }
+                        return c_ref[0];
+                    };
+                    printf("      vec_dot\n");
+                    benchmark_function(size*GEMM_M*GEMM_N, row_size_a*GEMM_M, iterations, vec_dot_fn);
+
+#ifdef GGML_USE_LLAMAFILE
+                    auto sgemm_fn = [&](void) -> float {
+                        return llamafile_sgemm(GEMM_M, GEMM_N, size/ggml_blck_size(type),
+                                               a.data(), row_size_a/ggml_type_size(type),
+                                               b.data(), row_size_b/ggml_type_size(qfns.vec_dot_type),
+                                               c.data(), GEMM_M, 0, 1, GGML_TASK_TYPE_COMPUTE,
+                                               type, qfns.vec_dot_type, GGML_TYPE_F32) ? c[0] : NAN;
+                    };
+                    if (std::isnan(sgemm_fn())) {
+                        printf("      llamafile_sgemm: not supported\n");
+                    } else {
+                        float max_err = 0.0f;
+                        for (size_t i = 0; i < c.size(); i++) {
+                            max_err = std::max(max_err, fabsf(c[i] - c_ref[i]) / std::max(1.0f, fabsf(c_ref[i])));
+                        }
+                        printf("      llamafile_sgemm (max relative error vs vec_dot: %g)\n", max_err);
+                        assert(max_err < 1e-3f);
+                        benchmark_function(size*GEMM_M*GEMM_N, row_size_a*GEMM_M, iterations, sgemm_fn);
+                    }
+#endif
+                }
+                printf("\n");
+            }
         }
     }
 
@@ -1,5 +1,5 @@
 #include "ggml.h"
-#include "llama.h"
+#include "llama.cpp" // TODO: not great - for the internals of llama_sample_token_fused
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -230,6 +231,160 @@ static void test_sampler_queue(
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static std::vector<float> random_logits(std::mt19937 & rng, size_t n_vocab) {
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) {
+        l = dist(rng);
+    }
+    return logits;
+}
+
+// the separate samplers on the candidates of the whole vocabulary, as in common/sampling.cpp
+static size_t sample_chain(std::vector<llama_token_data> & candidates, const std::vector<float> & logits,
+        int top_k, float top_p, float min_p, float temp, size_t min_keep) {
+    candidates.clear();
+    for (llama_token token_id = 0; token_id < (llama_token) logits.size(); token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    llama_sample_top_k  (nullptr, &candidates_p, top_k, min_keep);
+    llama_sample_top_p  (nullptr, &candidates_p, top_p, min_keep);
+    llama_sample_min_p  (nullptr, &candidates_p, min_p, min_keep);
+    llama_sample_temp   (nullptr, &candidates_p, temp);
+    llama_sample_softmax(nullptr, &candidates_p);
+
+    return candidates_p.size;
+}
+
+static void test_expf() {
+    float max_err = 0.0f;
+    for (float x = -90.0f; x <= 10.0f; x += 1e-3f) {
+        const float ref = expf(x);
+        const float err = fabsf(llama_sample_expf(x) - ref);
+        if (ref > FLT_MIN) {
+            max_err = std::max(max_err, err/ref);
+        } else {
+            GGML_ASSERT(err <= FLT_MIN);
+        }
+    }
+    GGML_ASSERT(max_err < 1e-6f);
+    GGML_ASSERT(llama_sample_expf(-INFINITY) == 0.0f);
+
+    printf("expf max relative error %g OK\n", max_err);
+}
+
+static void test_fused(size_t n_vocab, int top_k, float top_p, float min_p, float temp, size_t min_keep) {
+    std::mt19937 rng(42);
+
+    llama_sampling_arena arena;
+    std::vector<llama_token_data> candidates;
+
+    for (int iter = 0; iter < 8; ++iter) {
+        const std::vector<float> logits = random_logits(rng, n_vocab);
+
+        const size_t n_ref = sample_chain(candidates, logits, top_k, top_p, min_p, temp, min_keep);
+        const size_t n_cur = llama_sample_fused_candidates(arena, logits.data(), n_vocab, top_k, top_p, min_p, temp, min_keep);
+
+        float sum = 0.0f;
+        for (size_t i = 0; i < n_cur; ++i) {
+            sum += arena.probs[i];
+        }
+
+        std::vector<float> p_ref(n_vocab, 0.0f);
+        std::vector<float> p_cur(n_vocab, 0.0f);
+        for (size_t i = 0; i < n_ref; ++i) {
+            p_ref[candidates[i].id] = candidates[i].p;
+        }
+        for (size_t i = 0; i < n_cur; ++i) {
+            p_cur[arena.cur[i].id] = arena.probs[i]/sum;
+        }
+
+        // rounding in the cumulative probability can move the top-p cutoff by a few candidates of tiny probability,
+        // which changes the normalization of the others by the probability of those candidates
+        float p_diff = 0.0f;
+        for (size_t i = 0; i < n_vocab; ++i) {
+            if ((p_ref[i] == 0.0f) != (p_cur[i] == 0.0f)) {
+                p_diff += p_ref[i] + p_cur[i];
+            }
+        }
+        GGML_ASSERT(n_cur + n_ref/100 >= n_ref && n_ref + n_ref/100 >= n_cur);
+
+        for (size_t i = 0; i < n_vocab; ++i) {
+            if ((p_ref[i] == 0.0f) == (p_cur[i] == 0.0f)) {
+                GGML_ASSERT(fabsf(p_cur[i] - p_ref[i]) <= (p_diff + 1e-4f)*p_ref[i]);
+            }
+        }
+        GGML_ASSERT(top_p < 1.0f || n_cur == n_ref);
+    }
+
+    printf("Fused sampler OK with n_vocab=%06zu top_k=%05d top_p=%f min_p=%f temp=%f min_keep=%zu\n",
+           n_vocab, top_k, top_p, min_p, temp, min_keep);
+}
+
+static void bench_fused(size_t n_vocab, int top_k, float top_p, float min_p, float temp) {
+    const int n_iter = 32;
+
+    std::mt19937 rng(42);
+    std::mt19937 rng_sample(1234);
+
+    std::vector<std::vector<float>> logits;
+    for (int i = 0; i < n_iter; ++i) {
+        logits.push_back(random_logits(rng, n_vocab));
+    }
+
+    llama_sampling_arena arena;
+    std::vector<llama_token_data> candidates;
+
+    int64_t t_ref = 0;
+    int64_t t_fused = 0;
+
+    for (int i = 0; i < n_iter; ++i) {
+        int64_t t0 = ggml_time_us();
+        {
+            llama_token id;
+            if (temp <= 0.0f) {
+                candidates.clear();
+                for (llama_token token_id = 0; token_id < (llama_token) n_vocab; token_id++) {
+                    candidates.emplace_back(llama_token_data{token_id, logits[i][token_id], 0.0f});
+                }
+                llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+                id = llama_sample_token_greedy(nullptr, &candidates_p);
+            } else {
+                const size_t n_cur = sample_chain(candidates, logits[i], top_k, top_p, min_p, temp, 1);
+                std::vector<float> probs(n_cur);
+                for (size_t j = 0; j < n_cur; ++j) {
+                    probs[j] = candidates[j].p;
+                }
+                std::discrete_distribution<> dist(probs.begin(), probs.end());
+                id = candidates[dist(rng_sample)].id;
+            }
+            GGML_ASSERT(id >= 0 && id < (llama_token) n_vocab);
+        }
+        int64_t t1 = ggml_time_us();
+        {
+            llama_token id;
+            if (temp <= 0.0f) {
+                const float max = llama_sample_vec_max(logits[i].data(), n_vocab);
+                id = std::find(logits[i].begin(), logits[i].end(), max) - logits[i].begin();
+            } else {
+                const size_t n_cur = llama_sample_fused_candidates(arena, logits[i].data(), n_vocab, top_k, top_p, min_p, temp, 1);
+                std::discrete_distribution<> dist(arena.probs.begin(), arena.probs.begin() + n_cur);
+                id = arena.cur[dist(rng_sample)].id;
+            }
+            GGML_ASSERT(id >= 0 && id < (llama_token) n_vocab);
+        }
+        int64_t t2 = ggml_time_us();
+
+        t_ref   += t1 - t0;
+        t_fused += t2 - t1;
+    }
+
+    printf("%8zu %6d %6.2f %6.2f %5.2f %12.1f %12.1f %8.1fx\n", n_vocab, top_k, top_p, min_p, temp,
+            (double) t_ref/n_iter, (double) t_fused/n_iter, (double) t_ref/std::max<int64_t>(t_fused, 1));
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -295,6 +450,30 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_expf();
+
+    for (size_t n_vocab : { 100, 32000 }) {
+        test_fused(n_vocab,  40, 1.00f, 0.00f, 1.0f, 1);
+        test_fused(n_vocab,  40, 0.95f, 0.05f, 0.8f, 1);
+        test_fused(n_vocab,   0, 0.95f, 0.00f, 0.8f, 1);
+        test_fused(n_vocab,   0, 0.99f, 0.00f, 1.5f, 5);
+        test_fused(n_vocab,   0, 1.00f, 0.05f, 0.8f, 1);
+        test_fused(n_vocab,   0, 1.00f, 0.99f, 0.8f, 3);
+        test_fused(n_vocab,   0, 0.90f, 0.05f, 0.8f, 1);
+        test_fused(n_vocab,   0, 1.00f, 0.00f, 0.8f, 1);
+        test_fused(n_vocab, 100, 0.90f, 0.00f, 0.8f, 200);
+    }
+
+    printf("\nsampling latency per token (us)\n");
+    printf("%8s %6s %6s %6s %5s %12s %12s %9s\n", "n_vocab", "top_k", "top_p", "min_p", "temp", "separate", "fused", "speedup");
+    for (size_t n_vocab : { 32000, 128256 }) {
+        bench_fused(n_vocab,  0, 1.00f, 0.00f, 0.0f);
+        bench_fused(n_vocab, 40, 0.95f, 0.05f, 0.8f);
+        bench_fused(n_vocab,  0, 0.95f, 0.00f, 0.8f);
+        bench_fused(n_vocab,  0, 1.00f, 0.05f, 0.8f);
+        bench_fused(n_vocab,  0, 1.00f, 0.00f, 0.8f);
+    }
+
     printf("OK\n");
 
     return 0;
@@ -8,10 +8,48 @@
 #include <cstdio>
 #include <cstring>
 #include <locale>
+#include <random>
 #include <string>
 #include <thread>
 #include <vector>
 
+// checks that llama_tokenize_batch gives the same tokens as llama_tokenize one text at a time, on lines of random
+// words of the vocabulary - the throughput of both is measured by examples/benchmark/benchmark-tokenize
+static void check_tokenize_batch(llama_context * ctx) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<std::string> texts(1);
+    std::mt19937 rng(1);
+    while (texts.size() < 256) {
+        const std::string word = llama_detokenize_bpe(ctx, std::vector<int>(1, rng() % n_vocab));
+        try {
+            unicode_cpts_from_utf8(word);
+        } catch (const std::invalid_argument &) {
+            // a byte of a longer UTF-8 sequence
+            continue;
+        }
+        texts.back() += word;
+        if (rng() % 8 == 0) {
+            texts.back() += ".\n";
+            texts.emplace_back();
+        } else {
+            texts.back() += " ";
+        }
+    }
+
+    std::vector<std::vector<llama_token>> ref;
+    for (const auto & text : texts) {
+        ref.push_back(llama_tokenize(ctx, text, true));
+    }
+
+    for (int n_threads : { 1, 3, 8 }) {
+        if (llama_tokenize_batch(ctx, texts, true, false, n_threads) != ref) {
+            fprintf(stderr, "%s : error: llama_tokenize_batch on %d threads differs from llama_tokenize\n", __func__, n_threads);
+            std::exit(4);
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
@@ -114,6 +152,8 @@ int main(int argc, char **argv) {
         }
     }
 
+    check_tokenize_batch(ctx);
+
     llama_free_model(model);
     llama_free(ctx);
 